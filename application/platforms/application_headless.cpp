@@ -569,6 +569,8 @@ int application_main_headless(Application *(*create_application)(int, char **),
 	}
 #endif
 
+	// Startup time includes application and device creation as well as pipeline warm-up.
+	auto startup_time = get_current_time_nsecs();
 	auto app = unique_ptr<Application>(
 			create_application(int(filtered_argv.size() - 1), filtered_argv.data()));
 
@@ -611,17 +613,31 @@ int application_main_headless(Application *(*create_application)(int, char **),
 		p->wait_threads();
 		app->get_wsi().get_device().wait_idle();
 
+		double first_frame_ms = 1e-6 * double(get_current_time_nsecs() - startup_time);
+		bool warm_pipeline_cache = app->get_wsi().get_device().has_warm_pipeline_cache();
+		LOGI("Time to first frame: %.3f ms (%s pipeline cache)\n", first_frame_ms, warm_pipeline_cache ? "warm" : "cold");
+
 		hw_counter start_counter, end_counter;
 		bool has_start_counters = p->get_counters(start_counter);
 
 		auto start_time = get_current_time_nsecs();
 		unsigned rendered_frames = 0;
+		unsigned shader_hitch_frames = 0;
+		unsigned shader_sync_compiles = 0;
 		while (app->poll())
 		{
 			p->begin_frame();
 			app->run_frame();
 			p->end_frame();
 			rendered_frames++;
+
+			// Any variant compiled synchronously after the warm-up frame is a hitch.
+			auto variant_stats = app->get_wsi().get_device().get_shader_manager().get_variant_statistics();
+			if (variant_stats.sync_compiles)
+			{
+				shader_hitch_frames++;
+				shader_sync_compiles += variant_stats.sync_compiles;
+			}
 #ifdef HAVE_GRANITE_AUDIO
 			if (audio_dumper)
 				audio_dumper->frame();
@@ -643,6 +659,8 @@ int application_main_headless(Application *(*create_application)(int, char **),
 		{
 			double usec = 1e-3 * double(end_time - start_time) / rendered_frames;
 			LOGI("Average frame time: %.3f usec\n", usec);
+			if (shader_hitch_frames)
+				LOGI("Shader variant hitches: %u frames, %u variants.\n", shader_hitch_frames, shader_sync_compiles);
 
 			if (!args.stat.empty())
 			{
@@ -651,6 +669,10 @@ int application_main_headless(Application *(*create_application)(int, char **),
 				auto &allocator = doc.GetAllocator();
 
 				doc.AddMember("averageFrameTimeUs", usec, allocator);
+				doc.AddMember("timeToFirstFrameMs", first_frame_ms, allocator);
+				doc.AddMember("warmPipelineCache", warm_pipeline_cache, allocator);
+				doc.AddMember("shaderHitchFrames", shader_hitch_frames, allocator);
+				doc.AddMember("shaderSyncCompiles", shader_sync_compiles, allocator);
 				doc.AddMember("gpu", StringRef(app->get_wsi().get_context().get_gpu_props().deviceName), allocator);
 				doc.AddMember("driverVersion", app->get_wsi().get_context().get_gpu_props().driverVersion, allocator);
 
@@ -31,6 +31,7 @@
 //#include "ocean.hpp"
 #include <float.h>
 #include <stdexcept>
+#include <thread>
 
 using namespace std;
 using namespace Vulkan;
@@ -185,6 +186,12 @@ void SceneViewerApplication::read_config(const std::string &path)
 		config.max_point_lights = doc["maxPointLights"].GetUint();
 	if (doc.HasMember("volumetricFog"))
 		config.volumetric_fog = doc["volumetricFog"].GetBool();
+	if (doc.HasMember("textureStreamingBudgetMiB"))
+		config.texture_streaming_budget_mib = doc["textureStreamingBudgetMiB"].GetUint();
+	if (doc.HasMember("asyncLoad"))
+		config.async_load = doc["asyncLoad"].GetBool();
+	if (doc.HasMember("asyncLoadBudgetMs"))
+		config.async_load_budget_ms = doc["asyncLoadBudgetMs"].GetFloat();
 }
 
 SceneViewerApplication::SceneViewerApplication(const std::string &path, const std::string &config_path,
@@ -198,7 +205,23 @@ SceneViewerApplication::SceneViewerApplication(const std::string &path, const st
 	if (!quirks_path.empty())
 		read_quirks(quirks_path);
 
-	scene_loader.load_scene(path);
+	if (config.async_load)
+	{
+		// Cameras, lights, animations and the environment come with the hierarchy, so wait for that before setting up.
+		// Meshes and textures are streamed in by update_scene().
+		auto load = scene_loader.load_scene_async(path);
+		while (load->get_progress().stage == SceneLoader::AsyncLoadStage::Parsing)
+		{
+			scene_loader.update_async_loads(vec3(0.0f), 0.0);
+			if (load->get_progress().stage == SceneLoader::AsyncLoadStage::Parsing)
+				this_thread::yield();
+		}
+
+		if (load->get_progress().stage == SceneLoader::AsyncLoadStage::Failed)
+			throw runtime_error("Failed to load scene.");
+	}
+	else
+		scene_loader.load_scene(path);
 
 	// Why not. :D
 	//Ocean::add_to_scene(scene_loader.get_scene());
@@ -344,7 +367,8 @@ SceneViewerApplication::SceneViewerApplication(const std::string &path, const st
 
 	graph.enable_timestamps(config.timestamps);
 
-	if (config.rescale_scene)
+	// The scene bounds are not known until every mesh has been created.
+	if (config.rescale_scene && !scene_loader.has_pending_async_loads())
 		rescale_scene(10.0f);
 
 	EVENT_MANAGER_REGISTER_LATCH(SceneViewerApplication, on_swapchain_changed, on_swapchain_destroyed,
@@ -398,6 +422,9 @@ void SceneViewerApplication::rescale_scene(float radius)
 
 void SceneViewerApplication::on_device_created(const DeviceCreatedEvent &device)
 {
+	device.get_device().get_texture_manager().set_streaming_budget(
+			VkDeviceSize(config.texture_streaming_budget_mib) * 1024 * 1024);
+
 	if (!skydome_reflection.empty())
 		reflection = device.get_device().get_texture_manager().request_texture(skydome_reflection);
 	if (!skydome_irradiance.empty())
@@ -1097,6 +1124,15 @@ void SceneViewerApplication::update_scene(double frame_time, double elapsed_time
 	last_frame_times[last_frame_index++ & FrameWindowSizeMask] = float(frame_time);
 	auto &scene = scene_loader.get_scene();
 
+	if (scene_loader.has_pending_async_loads())
+	{
+		scene_loader.update_async_loads(selected_camera->get_position(), config.async_load_budget_ms * 1e-3);
+		// New shadow casters show up every frame until the load completes.
+		need_shadow_map_update = true;
+		if (!scene_loader.has_pending_async_loads() && config.rescale_scene)
+			rescale_scene(10.0f);
+	}
+
 	animation_system->animate(frame_time, elapsed_time);
 	scene.update_cached_transforms();
 
@@ -1183,6 +1219,9 @@ void SceneViewerApplication::render_scene()
 	scene.bind_render_graph_resources(graph);
 	graph.enqueue_render_passes(device);
 
+	// Texture feedback was gathered while rendering this frame.
+	device.get_texture_manager().update_streaming();
+
 	need_shadow_map_update = false;
 }
 
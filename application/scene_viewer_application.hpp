@@ -151,6 +151,10 @@ private:
 		bool volumetric_fog = false;
 		bool ssao = true;
 		PostAAType postaa_type = PostAAType::None;
+		unsigned texture_streaming_budget_mib = 0;
+		// Build the node hierarchy up front and stream meshes and textures in over the first frames.
+		bool async_load = false;
+		float async_load_budget_ms = 2.0f;
 	};
 	Config config;
 
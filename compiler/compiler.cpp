@@ -26,6 +26,7 @@
 #include "logging.hpp"
 #include "filesystem.hpp"
 #include "string_helpers.hpp"
+#include "hash.hpp"
 
 #include "spirv-tools/libspirv.hpp"
 
@@ -165,6 +166,48 @@ bool GLSLCompiler::preprocess()
 	return parse_variants(source, source_path);
 }
 
+uint64_t GLSLCompiler::get_compilation_hash(const vector<pair<string, int>> *defines) const
+{
+	// Bump when the way we invoke the compiler changes in a way which affects the output.
+	static const uint32_t compiler_options_version = 1;
+
+	Util::Hasher h;
+	h.u32(compiler_options_version);
+
+	// The SPIR-V version alone does not change when glslang or the optimizer is updated,
+	// so key on the compiler build instead.
+#ifdef GRANITE_SHADER_COMPILER_VERSION
+	h.string(GRANITE_SHADER_COMPILER_VERSION);
+#endif
+	h.string(spvSoftwareVersionDetailsString());
+
+	h.u32(uint32_t(stage));
+	h.u32(uint32_t(target));
+	h.u32(uint32_t(optimization));
+#if GRANITE_COMPILER_OPTIMIZE
+	h.u32(1);
+#else
+	h.u32(0);
+#endif
+	h.u32(strip ? 1 : 0);
+	h.string(source_path);
+	h.string(preprocessed_source);
+
+	if (defines)
+	{
+		h.u32(uint32_t(defines->size()));
+		for (auto &define : *defines)
+		{
+			h.string(define.first);
+			h.s32(define.second);
+		}
+	}
+	else
+		h.u32(0);
+
+	return h.get();
+}
+
 vector<uint32_t> GLSLCompiler::compile(const vector<pair<string, int>> *defines)
 {
 	shaderc::Compiler compiler;
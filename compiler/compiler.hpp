@@ -73,6 +73,10 @@ public:
 
 	std::vector<uint32_t> compile(const std::vector<std::pair<std::string, int>> *defines = nullptr);
 
+	// Identifies the SPIR-V which compile() would produce for the current preprocessed source,
+	// defines, options and compiler version. Suitable as a key for caching compiled SPIR-V.
+	uint64_t get_compilation_hash(const std::vector<std::pair<std::string, int>> *defines = nullptr) const;
+
 	const std::unordered_set<std::string> &get_dependencies() const
 	{
 		return dependencies;
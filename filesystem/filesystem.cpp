@@ -23,15 +23,43 @@
 #include "filesystem.hpp"
 #include "os_filesystem.hpp"
 #include "fs-netfs.hpp"
+#include "pack_filesystem.hpp"
 #include "path.hpp"
 #include "logging.hpp"
+#include "thread_group.hpp"
 #include <stdlib.h>
 #include <algorithm>
+#include <string.h>
 
 using namespace std;
 
 namespace Granite
 {
+void *File::map_range(size_t offset, size_t size)
+{
+	size_t file_size = get_size();
+	if (offset > file_size || size > file_size - offset)
+		return nullptr;
+
+	auto *mapped = static_cast<uint8_t *>(map());
+	return mapped ? mapped + offset : nullptr;
+}
+
+size_t File::read(size_t offset, void *dst, size_t size)
+{
+	size_t file_size = get_size();
+	if (offset >= file_size)
+		return 0;
+
+	size = std::min(size, file_size - offset);
+	auto *mapped = static_cast<const uint8_t *>(map_range(offset, size));
+	if (!mapped)
+		return 0;
+
+	memcpy(dst, mapped, size);
+	return size;
+}
+
 bool StdioFile::init(const std::string &path, FileMode mode_)
 {
 	mode = mode_;
@@ -140,6 +168,67 @@ vector<ListEntry> FilesystemBackend::walk(const std::string &path)
 	return final_entries;
 }
 
+vector<WalkEntry> FilesystemBackend::walk_stat(const std::string &path)
+{
+	auto entries = walk(path);
+	vector<WalkEntry> final_entries;
+	final_entries.reserve(entries.size());
+	for (auto &e : entries)
+	{
+		FileStat s;
+		if (stat(e.path, s))
+			final_entries.push_back({ move(e.path), s });
+	}
+	return final_entries;
+}
+
+bool FilesystemBackend::remove(const std::string &)
+{
+	return false;
+}
+
+bool FilesystemBackend::move_replace(const std::string &, const std::string &)
+{
+	return false;
+}
+
+bool FilesystemBackend::read_async(const std::string &path, uint64_t offset, size_t size, void *dst,
+                                   AsyncReadCallback callback)
+{
+	auto work = [this, path, offset, size, dst, callback]() {
+		int64_t result = -1;
+		auto file = open(path, FileMode::ReadOnly);
+		if (file)
+		{
+			size_t file_size = file->get_size();
+			if (offset >= file_size)
+				result = 0;
+			else
+			{
+				auto *mapped = static_cast<const uint8_t *>(file->map());
+				if (mapped)
+				{
+					size_t to_read = std::min<uint64_t>(size, file_size - offset);
+					memcpy(dst, mapped + offset, to_read);
+					result = int64_t(to_read);
+				}
+			}
+		}
+		callback(result);
+	};
+
+	auto *workers = Global::thread_group();
+	if (workers)
+	{
+		auto task = workers->create_task(move(work));
+		task->flush();
+	}
+	else
+		work();
+
+	return true;
+}
+
 Filesystem::Filesystem()
 {
 	register_protocol("file", unique_ptr<FilesystemBackend>(new OSFilesystem(".")));
@@ -183,6 +272,19 @@ Filesystem::Filesystem()
 			register_protocol("cache", unique_ptr<FilesystemBackend>(new OSFilesystem(cache_dir)));
 	}
 #endif
+
+	// Archive built with the pack-archive tool. It is registered as pack:// unless
+	// GRANITE_PACK_PROTOCOL names another protocol, e.g. to serve assets:// from it.
+	const char *pack_archive = getenv("GRANITE_PACK_ARCHIVE");
+	if (pack_archive)
+	{
+		const char *pack_protocol = getenv("GRANITE_PACK_PROTOCOL");
+		auto pack = PackFilesystem::create(get_backend("file")->open(pack_archive));
+		if (pack)
+			register_protocol(pack_protocol ? pack_protocol : "pack", move(pack));
+		else
+			LOGE("Failed to open pack archive %s.\n", pack_archive);
+	}
 }
 
 void Filesystem::register_protocol(const std::string &proto, std::unique_ptr<FilesystemBackend> fs)
@@ -216,6 +318,16 @@ std::vector<ListEntry> Filesystem::walk(const std::string &path)
 	return backend->walk(paths.second);
 }
 
+std::vector<WalkEntry> Filesystem::walk_stat(const std::string &path)
+{
+	auto paths = Path::protocol_split(path);
+	auto *backend = get_backend(paths.first);
+	if (!backend)
+		return {};
+
+	return backend->walk_stat(paths.second);
+}
+
 std::vector<ListEntry> Filesystem::list(const std::string &path)
 {
 	auto paths = Path::protocol_split(path);
@@ -276,6 +388,17 @@ std::unique_ptr<File> Filesystem::open(const std::string &path, FileMode mode)
 	return file;
 }
 
+bool Filesystem::read_async(const std::string &path, uint64_t offset, size_t size, void *dst,
+                            AsyncReadCallback callback)
+{
+	auto paths = Path::protocol_split(path);
+	auto *backend = get_backend(paths.first);
+	if (!backend)
+		return false;
+
+	return backend->read_async(paths.second, offset, size, dst, move(callback));
+}
+
 std::string Filesystem::get_filesystem_path(const std::string &path)
 {
 	auto paths = Path::protocol_split(path);
@@ -296,6 +419,30 @@ bool Filesystem::stat(const std::string &path, FileStat &stat)
 	return backend->stat(paths.second, stat);
 }
 
+bool Filesystem::remove(const std::string &path)
+{
+	auto paths = Path::protocol_split(path);
+	auto *backend = get_backend(paths.first);
+	if (!backend)
+		return false;
+
+	return backend->remove(paths.second);
+}
+
+bool Filesystem::move_replace(const std::string &dst, const std::string &src)
+{
+	auto dst_paths = Path::protocol_split(dst);
+	auto src_paths = Path::protocol_split(src);
+	if (dst_paths.first != src_paths.first)
+		return false;
+
+	auto *backend = get_backend(dst_paths.first);
+	if (!backend)
+		return false;
+
+	return backend->move_replace(dst_paths.second, src_paths.second);
+}
+
 void Filesystem::poll_notifications()
 {
 	for (auto &proto : protocols)
@@ -45,6 +45,15 @@ public:
 	virtual size_t get_size() = 0;
 
 	virtual bool reopen() = 0;
+
+	// Maps only [offset, offset + size), so loading part of a large file does not touch the rest of it.
+	// Returns nullptr if the range is out of bounds. Ranges stay valid until unmap().
+	// The default implementation maps the whole file.
+	virtual void *map_range(size_t offset, size_t size);
+
+	// Copies up to size bytes at offset into dst without keeping a mapping around.
+	// Returns the number of bytes copied, which is only short at end of file.
+	virtual size_t read(size_t offset, void *dst, size_t size);
 };
 
 enum class PathType
@@ -67,6 +76,12 @@ struct FileStat
 	uint64_t last_modified;
 };
 
+struct WalkEntry
+{
+	std::string path;
+	FileStat stat;
+};
+
 using FileNotifyHandle = int;
 
 enum class FileNotifyType
@@ -90,6 +105,9 @@ enum class FileMode
 	ReadWrite
 };
 
+// Result of an asynchronous read: the number of bytes read, which is only short at end of file, or negative on failure.
+using AsyncReadCallback = std::function<void (int64_t result)>;
+
 class StdioFile : public File
 {
 public:
@@ -121,7 +139,12 @@ class FilesystemBackend
 public:
 	virtual ~FilesystemBackend() = default;
 
-	std::vector<ListEntry> walk(const std::string &path);
+	// Recursively lists files and directories below path, every directory comes before its contents.
+	virtual std::vector<ListEntry> walk(const std::string &path);
+
+	// Same as walk(), along with stat information for every entry.
+	// The default implementation stats one entry at a time, backends which can do better in bulk override it.
+	virtual std::vector<WalkEntry> walk_stat(const std::string &path);
 
 	virtual std::vector<ListEntry> list(const std::string &path) = 0;
 
@@ -129,6 +152,12 @@ public:
 
 	virtual bool stat(const std::string &path, FileStat &stat) = 0;
 
+	// Deletes a file. Read-only backends return false.
+	virtual bool remove(const std::string &path);
+
+	// Renames src to dst, atomically replacing dst if it exists. Read-only backends return false.
+	virtual bool move_replace(const std::string &dst, const std::string &src);
+
 	virtual FileNotifyHandle
 	install_notification(const std::string &path, std::function<void(const FileNotifyInfo &)> func) = 0;
 
@@ -138,6 +167,11 @@ public:
 
 	virtual int get_notification_fd() const = 0;
 
+	// Reads up to size bytes at offset into dst, which must stay valid until callback has run.
+	// Unless false is returned, callback runs exactly once, on an arbitrary thread.
+	// The default implementation maps the file with open() on the global thread group, so callers never block on page faults.
+	virtual bool read_async(const std::string &path, uint64_t offset, size_t size, void *dst, AsyncReadCallback callback);
+
 	inline virtual std::string get_filesystem_path(const std::string &)
 	{
 		return "";
@@ -187,10 +221,12 @@ public:
 	FilesystemBackend *get_backend(const std::string &proto);
 
 	std::vector<ListEntry> walk(const std::string &path);
+	std::vector<WalkEntry> walk_stat(const std::string &path);
 
 	std::vector<ListEntry> list(const std::string &path);
 
 	std::unique_ptr<File> open(const std::string &path, FileMode mode = FileMode::ReadOnly);
+	bool read_async(const std::string &path, uint64_t offset, size_t size, void *dst, AsyncReadCallback callback);
 
 	std::string get_filesystem_path(const std::string &path);
 
@@ -199,6 +235,9 @@ public:
 	bool write_buffer_to_file(const std::string &path, const void *data, size_t size);
 
 	bool stat(const std::string &path, FileStat &stat);
+	bool remove(const std::string &path);
+	// Both paths must live in the same protocol.
+	bool move_replace(const std::string &dst, const std::string &src);
 
 	void poll_notifications();
 
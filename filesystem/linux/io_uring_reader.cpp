@@ -0,0 +1,343 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "io_uring_reader.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define GRANITE_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef GRANITE_HAVE_IO_URING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Granite
+{
+#ifdef GRANITE_HAVE_IO_URING
+// Reads larger than this are split, since a single read returns at most about 2 GiB anyway.
+static const size_t MaxReadSize = size_t(1) << 30;
+
+struct IOUringReader::Request
+{
+	int fd;
+	uint8_t *dst;
+	uint64_t offset;
+	size_t size;
+	size_t done;
+	AsyncReadCallback callback;
+	iovec iov;
+};
+
+static int io_uring_setup(unsigned entries, io_uring_params *params)
+{
+	return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+unique_ptr<IOUringReader> IOUringReader::create(unsigned queue_depth)
+{
+	unique_ptr<IOUringReader> reader(new IOUringReader);
+	if (!reader->init(queue_depth))
+		return {};
+	return reader;
+}
+
+bool IOUringReader::init(unsigned queue_depth)
+{
+	io_uring_params params = {};
+	ring_fd = io_uring_setup(queue_depth, &params);
+	if (ring_fd < 0)
+		return false;
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+	{
+		sq_ring = nullptr;
+		return false;
+	}
+
+	if (single_mmap)
+		cq_ring = sq_ring;
+	else
+	{
+		cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+		{
+			cq_ring = nullptr;
+			return false;
+		}
+	}
+
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		sqes = nullptr;
+		return false;
+	}
+
+	auto *sq = static_cast<uint8_t *>(sq_ring);
+	sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	sq_mask = *reinterpret_cast<const unsigned *>(sq + params.sq_off.ring_mask);
+
+	auto *cq = static_cast<uint8_t *>(cq_ring);
+	cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cqes = cq + params.cq_off.cqes;
+	cq_mask = *reinterpret_cast<const unsigned *>(cq + params.cq_off.ring_mask);
+
+	// Bounding requests in flight by the CQ size means completions can never overflow.
+	max_inflight = params.cq_entries;
+	thread = std::thread(&IOUringReader::completion_loop, this);
+	return true;
+}
+
+IOUringReader::~IOUringReader()
+{
+	if (thread.joinable())
+	{
+		{
+			unique_lock<mutex> holder{lock};
+			cond.wait(holder, [this]() { return inflight == 0; });
+			// A NOP with no request attached tells the completion thread to exit.
+			submit(nullptr, IORING_OP_NOP);
+		}
+		thread.join();
+	}
+
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (cq_ring && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring)
+		munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+}
+
+bool IOUringReader::submit(Request *req, uint8_t opcode)
+{
+	// Every SQE is submitted right away, so the kernel has always consumed the SQ ring by the time we get here.
+	unsigned tail = *sq_tail;
+	unsigned index = tail & sq_mask;
+	auto *sqe = static_cast<io_uring_sqe *>(sqes) + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+
+	if (req)
+	{
+		req->iov.iov_base = req->dst + req->done;
+		req->iov.iov_len = min(req->size - req->done, MaxReadSize);
+		sqe->fd = req->fd;
+		sqe->addr = reinterpret_cast<uintptr_t>(&req->iov);
+		sqe->len = 1;
+		sqe->off = req->offset + req->done;
+		sqe->user_data = reinterpret_cast<uintptr_t>(req);
+	}
+
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	for (;;)
+	{
+		int ret = io_uring_enter(ring_fd, 1, 0, 0);
+		if (ret == 1)
+			return true;
+
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+			continue;
+
+		// The kernel did not consume the entry, so take it back.
+		LOGE("Failed to submit to io_uring: %s\n", ret < 0 ? strerror(errno) : "no entries consumed");
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+		return false;
+	}
+}
+
+bool IOUringReader::read(const string &path, uint64_t offset, size_t size, void *dst, AsyncReadCallback callback)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		callback(-errno);
+		return true;
+	}
+
+	if (size == 0)
+	{
+		close(fd);
+		callback(0);
+		return true;
+	}
+
+	auto *req = new Request;
+	req->fd = fd;
+	req->dst = static_cast<uint8_t *>(dst);
+	req->offset = offset;
+	req->size = size;
+	req->done = 0;
+	req->callback = move(callback);
+
+	unique_lock<mutex> holder{lock};
+
+	// Callbacks chaining reads run on the completion thread, which is the only one able to free a slot.
+	if (this_thread::get_id() == thread.get_id() && inflight >= max_inflight)
+	{
+		holder.unlock();
+		close(fd);
+		delete req;
+		return false;
+	}
+
+	cond.wait(holder, [this]() { return inflight < max_inflight; });
+	if (!submit(req, IORING_OP_READV))
+	{
+		holder.unlock();
+		close(fd);
+		delete req;
+		return false;
+	}
+
+	inflight++;
+	return true;
+}
+
+void IOUringReader::completion_loop()
+{
+	for (;;)
+	{
+		if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+		{
+			LOGE("Failed to wait for io_uring completions: %s\n", strerror(errno));
+			return;
+		}
+
+		bool shutdown = false;
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail)
+		{
+			auto &cqe = static_cast<const io_uring_cqe *>(cqes)[head & cq_mask];
+			auto *req = reinterpret_cast<Request *>(uintptr_t(cqe.user_data));
+			int res = cqe.res;
+
+			// Hand the slot back before resubmitting, which could complete into it.
+			__atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+			if (!req)
+			{
+				shutdown = true;
+				continue;
+			}
+
+			int64_t result;
+			bool finished;
+			if (res == -EINTR || res == -EAGAIN)
+			{
+				result = 0;
+				finished = false;
+			}
+			else if (res < 0)
+			{
+				result = res;
+				finished = true;
+			}
+			else
+			{
+				req->done += size_t(res);
+				result = int64_t(req->done);
+				finished = res == 0 || req->done == req->size;
+			}
+
+			// Short reads are continued where they left off.
+			if (!finished)
+			{
+				lock_guard<mutex> holder{lock};
+				if (!submit(req, IORING_OP_READV))
+				{
+					result = -EIO;
+					finished = true;
+				}
+			}
+
+			// Free the slot before the callback, so it can chain another read.
+			if (finished)
+			{
+				close(req->fd);
+				{
+					lock_guard<mutex> holder{lock};
+					inflight--;
+					cond.notify_all();
+				}
+				req->callback(result);
+				delete req;
+			}
+		}
+
+		if (shutdown)
+			return;
+	}
+}
+#else
+unique_ptr<IOUringReader> IOUringReader::create(unsigned)
+{
+	return {};
+}
+
+IOUringReader::~IOUringReader()
+{
+}
+
+bool IOUringReader::read(const string &, uint64_t, size_t, void *, AsyncReadCallback)
+{
+	return false;
+}
+#endif
+}
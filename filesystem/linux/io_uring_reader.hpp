@@ -0,0 +1,77 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "../filesystem.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace Granite
+{
+// Reads files through a Linux io_uring. Completions are reaped on a dedicated thread, which also runs the callbacks,
+// so callbacks should hand off heavy work rather than do it inline.
+class IOUringReader
+{
+public:
+	// Returns nullptr if io_uring is unsupported by the kernel, or blocked by a sandbox.
+	static std::unique_ptr<IOUringReader> create(unsigned queue_depth);
+	~IOUringReader();
+
+	// Returns false if the read could not be submitted, e.g. when a callback chains a read while the queue is full.
+	// The callback is not run in that case, so callers can fall back to another path.
+	bool read(const std::string &path, uint64_t offset, size_t size, void *dst, AsyncReadCallback callback);
+
+private:
+	IOUringReader() = default;
+	struct Request;
+
+	bool init(unsigned queue_depth);
+	bool submit(Request *req, uint8_t opcode);
+	void completion_loop();
+
+	int ring_fd = -1;
+
+	void *sq_ring = nullptr;
+	size_t sq_ring_size = 0;
+	void *cq_ring = nullptr;
+	size_t cq_ring_size = 0;
+	void *sqes = nullptr;
+	size_t sqes_size = 0;
+
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned *sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	void *cqes = nullptr;
+	unsigned cq_mask = 0;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned inflight = 0;
+	unsigned max_inflight = 0;
+	std::thread thread;
+};
+}
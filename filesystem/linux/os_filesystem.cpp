@@ -21,10 +21,16 @@
  */
 
 #include "os_filesystem.hpp"
+#include "io_uring_reader.hpp"
 #include "path.hpp"
 #include "logging.hpp"
+#include "global_managers.hpp"
+#include "thread_group.hpp"
 #include <stdexcept>
+#include <stdlib.h>
+#include <stdio.h>
 #include <algorithm>
+#include <memory>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,6 +41,7 @@
 #include <sys/mman.h>
 #ifdef __linux__
 #include <sys/inotify.h>
+#include <sys/syscall.h>
 #endif
 
 using namespace std;
@@ -146,6 +153,54 @@ void *MMapFile::map()
 	return mapped;
 }
 
+void *MMapFile::map_range(size_t offset, size_t range_size)
+{
+	if (offset > size || range_size > size - offset)
+		return nullptr;
+
+	if (mapped)
+		return static_cast<uint8_t *>(mapped) + offset;
+
+	if (range_size == 0)
+		return nullptr;
+
+	// mmap offsets must be page aligned, so map a slightly larger window.
+	static const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+	size_t aligned_offset = offset & ~(page_size - 1);
+	size_t window_size = range_size + (offset - aligned_offset);
+
+	void *window = mmap(nullptr, window_size, PROT_READ, MAP_PRIVATE, fd, off_t(aligned_offset));
+	if (window == MAP_FAILED)
+		return nullptr;
+
+	// Unlike a whole file mapping, the caller asked for exactly this range, so start reading it in right away.
+	madvise(window, window_size, MADV_WILLNEED);
+	ranges.push_back({ window, window_size });
+	return static_cast<uint8_t *>(window) + (offset - aligned_offset);
+}
+
+size_t MMapFile::read(size_t offset, void *dst, size_t read_size)
+{
+	if (offset >= size)
+		return 0;
+
+	read_size = std::min(read_size, size - offset);
+	auto *ptr = static_cast<uint8_t *>(dst);
+	size_t done = 0;
+
+	while (done < read_size)
+	{
+		ssize_t ret = pread(fd, ptr + done, read_size - done, off_t(offset + done));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret <= 0)
+			break;
+		done += size_t(ret);
+	}
+
+	return done;
+}
+
 size_t MMapFile::get_size()
 {
 	return size;
@@ -171,6 +226,10 @@ void MMapFile::unmap()
 		munmap(mapped, size);
 		mapped = nullptr;
 	}
+
+	for (auto &range : ranges)
+		munmap(range.ptr, range.size);
+	ranges.clear();
 }
 
 MMapFile::~MMapFile()
@@ -209,6 +268,21 @@ unique_ptr<File> OSFilesystem::open(const std::string &path, FileMode mode)
 	return unique_ptr<MMapFile>(MMapFile::open(Path::join(base, path), mode));
 }
 
+bool OSFilesystem::read_async(const string &path, uint64_t offset, size_t size, void *dst, AsyncReadCallback callback)
+{
+	call_once(io_uring_once, [this]() {
+		const char *env = getenv("GRANITE_IO_URING");
+		if (!env || strtoul(env, nullptr, 0) != 0)
+			io_uring = IOUringReader::create(256);
+	});
+
+	// The callback is only consumed if the read was submitted.
+	if (io_uring && io_uring->read(Path::join(base, path), offset, size, dst, callback))
+		return true;
+	else
+		return FilesystemBackend::read_async(path, offset, size, dst, move(callback));
+}
+
 string OSFilesystem::get_filesystem_path(const string &path)
 {
 	return Path::join(base, path);
@@ -411,13 +485,8 @@ vector<ListEntry> OSFilesystem::list(const string &path)
 	return entries;
 }
 
-bool OSFilesystem::stat(const std::string &path, FileStat &stat)
+static void fill_stat(const struct stat &buf, FileStat &stat)
 {
-	auto resolved_path = Path::join(base, path);
-	struct stat buf;
-	if (::stat(resolved_path.c_str(), &buf) < 0)
-		return false;
-
 	if (S_ISREG(buf.st_mode))
 		stat.type = PathType::File;
 	else if (S_ISDIR(buf.st_mode))
@@ -431,7 +500,240 @@ bool OSFilesystem::stat(const std::string &path, FileStat &stat)
 #else
 	stat.last_modified = buf.st_mtimespec.tv_sec * 1000000000ull + buf.st_mtimespec.tv_nsec;
 #endif
+}
+
+bool OSFilesystem::stat(const std::string &path, FileStat &stat)
+{
+	auto resolved_path = Path::join(base, path);
+	struct stat buf;
+	if (::stat(resolved_path.c_str(), &buf) < 0)
+		return false;
+
+	fill_stat(buf, stat);
+	return true;
+}
+
+bool OSFilesystem::remove(const std::string &path)
+{
+	auto resolved_path = Path::join(base, path);
+	return ::unlink(resolved_path.c_str()) == 0;
+}
+
+bool OSFilesystem::move_replace(const std::string &dst, const std::string &src)
+{
+	auto resolved_dst = Path::join(base, dst);
+	auto resolved_src = Path::join(base, src);
+	return ::rename(resolved_src.c_str(), resolved_dst.c_str()) == 0;
+}
+
+// Stats an entry relative to an open directory, which spares the kernel resolving the full path again.
+static bool stat_at(int dir_fd, const char *name, FileStat &stat)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+	// Only ask for what FileStat needs, network filesystems may skip fetching the rest.
+	struct statx buf;
+	if (statx(dir_fd, name, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME, &buf) < 0)
+		return false;
+
+	if (S_ISREG(buf.stx_mode))
+		stat.type = PathType::File;
+	else if (S_ISDIR(buf.stx_mode))
+		stat.type = PathType::Directory;
+	else
+		stat.type = PathType::Special;
+
+	stat.size = buf.stx_size;
+	stat.last_modified = buf.stx_mtime.tv_sec * 1000000000ull + buf.stx_mtime.tv_nsec;
+	return true;
+#else
+	struct stat buf;
+	if (fstatat(dir_fd, name, &buf, 0) < 0)
+		return false;
+
+	fill_stat(buf, stat);
+	return true;
+#endif
+}
+
+// Calls func(name, d_type) for every entry in the directory except . and ..
+template <typename Func>
+static bool for_each_directory_entry(int dir_fd, const Func &func)
+{
+#ifdef __linux__
+	// Same layout as the kernel's linux_dirent64.
+	struct Dirent64
+	{
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+
+	// Large directories are read in a few syscalls rather than readdir()'s 32 KiB at a time.
+	vector<uint64_t> buffer(64 * 1024 / sizeof(uint64_t));
+	auto *bytes = reinterpret_cast<const char *>(buffer.data());
+
+	for (;;)
+	{
+		long ret = syscall(SYS_getdents64, dir_fd, buffer.data(), buffer.size() * sizeof(uint64_t));
+		if (ret < 0)
+			return false;
+		else if (ret == 0)
+			return true;
+
+		for (long offset = 0; offset < ret; )
+		{
+			auto *entry = reinterpret_cast<const Dirent64 *>(bytes + offset);
+			offset += entry->d_reclen;
+			if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+				func(entry->d_name, entry->d_type);
+		}
+	}
+#else
+	int dup_fd = dup(dir_fd);
+	DIR *dir = dup_fd >= 0 ? fdopendir(dup_fd) : nullptr;
+	if (!dir)
+	{
+		if (dup_fd >= 0)
+			close(dup_fd);
+		return false;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)))
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			func(entry->d_name, entry->d_type);
+
+	closedir(dir);
 	return true;
+#endif
+}
+
+namespace
+{
+// One directory of a walk, with one subdirectory per directory entry, in the same order.
+struct WalkDirectory
+{
+	string path;
+	vector<WalkEntry> entries;
+	vector<unique_ptr<WalkDirectory>> subdirectories;
+};
+}
+
+static void read_walk_directory(const string &base, WalkDirectory &dir, bool with_stat)
+{
+	auto directory = Path::join(base, dir.path);
+	int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		LOGE("Failed to open directory %s\n", dir.path.c_str());
+		return;
+	}
+
+	bool success = for_each_directory_entry(fd, [&](const char *name, unsigned char type) {
+		WalkEntry entry = {};
+		entry.path = Path::join(dir.path, name);
+
+		if (with_stat || type == DT_UNKNOWN || type == DT_LNK)
+		{
+			if (!stat_at(fd, name, entry.stat))
+			{
+				LOGE("Failed to stat file: %s\n", entry.path.c_str());
+				return;
+			}
+		}
+		else if (type == DT_DIR)
+			entry.stat.type = PathType::Directory;
+		else if (type == DT_REG)
+			entry.stat.type = PathType::File;
+		else
+			entry.stat.type = PathType::Special;
+
+		if (entry.stat.type == PathType::Directory)
+		{
+			dir.subdirectories.emplace_back(new WalkDirectory);
+			dir.subdirectories.back()->path = entry.path;
+		}
+
+		if (entry.stat.type != PathType::Special)
+			dir.entries.push_back(move(entry));
+	});
+
+	if (!success)
+		LOGE("Failed to read directory %s\n", dir.path.c_str());
+	close(fd);
+}
+
+static void flatten_walk(WalkDirectory &dir, vector<WalkEntry> &entries)
+{
+	auto subdirectory = begin(dir.subdirectories);
+	for (auto &entry : dir.entries)
+	{
+		bool is_directory = entry.stat.type == PathType::Directory;
+		entries.push_back(move(entry));
+		if (is_directory)
+			flatten_walk(**subdirectory++, entries);
+	}
+}
+
+// Reads one depth of the tree at a time, with every directory in that depth read in parallel.
+// The result is in the same order a sequential walk would produce.
+static vector<WalkEntry> walk_directories(const string &base, const string &path, bool with_stat)
+{
+	WalkDirectory root;
+	root.path = path;
+
+	auto *workers = Global::thread_group();
+	bool parallel = workers && workers->get_num_threads() > 1 && !workers->current_thread_is_worker();
+
+	vector<WalkDirectory *> level = { &root };
+	vector<WalkDirectory *> next_level;
+	while (!level.empty())
+	{
+		if (parallel && level.size() > 1)
+		{
+			auto task = workers->create_task();
+			for (auto *dir : level)
+			{
+				task->enqueue_task([&base, dir, with_stat]() {
+					read_walk_directory(base, *dir, with_stat);
+				});
+			}
+			task->flush();
+			task->wait();
+		}
+		else
+		{
+			for (auto *dir : level)
+				read_walk_directory(base, *dir, with_stat);
+		}
+
+		next_level.clear();
+		for (auto *dir : level)
+			for (auto &subdirectory : dir->subdirectories)
+				next_level.push_back(subdirectory.get());
+		swap(level, next_level);
+	}
+
+	vector<WalkEntry> entries;
+	flatten_walk(root, entries);
+	return entries;
+}
+
+vector<ListEntry> OSFilesystem::walk(const string &path)
+{
+	auto entries = walk_directories(base, path, false);
+	vector<ListEntry> list;
+	list.reserve(entries.size());
+	for (auto &entry : entries)
+		list.push_back({ move(entry.path), entry.stat.type });
+	return list;
+}
+
+vector<WalkEntry> OSFilesystem::walk_stat(const string &path)
+{
+	return walk_directories(base, path, true);
 }
 
 }
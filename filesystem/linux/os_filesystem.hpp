@@ -23,6 +23,7 @@
 #pragma once
 #include "../filesystem.hpp"
 #include <unordered_map>
+#include <mutex>
 
 namespace Granite
 {
@@ -36,6 +37,8 @@ public:
 	void unmap() override;
 	size_t get_size() override;
 	bool reopen() override;
+	void *map_range(size_t offset, size_t range_size) override;
+	size_t read(size_t offset, void *dst, size_t read_size) override;
 
 private:
 	MMapFile() = default;
@@ -43,25 +46,43 @@ private:
 	int fd = -1;
 	void *mapped = nullptr;
 	size_t size = 0;
+
+	struct MappedRange
+	{
+		void *ptr;
+		size_t size;
+	};
+	std::vector<MappedRange> ranges;
 };
 
+class IOUringReader;
+
 class OSFilesystem : public FilesystemBackend
 {
 public:
 	OSFilesystem(const std::string &base);
 	~OSFilesystem();
 	std::vector<ListEntry> list(const std::string &path) override;
+	std::vector<ListEntry> walk(const std::string &path) override;
+	std::vector<WalkEntry> walk_stat(const std::string &path) override;
 	std::unique_ptr<File> open(const std::string &path, FileMode mode) override;
 	bool stat(const std::string &path, FileStat &stat) override;
+	bool remove(const std::string &path) override;
+	bool move_replace(const std::string &dst, const std::string &src) override;
 	FileNotifyHandle install_notification(const std::string &path, std::function<void (const FileNotifyInfo &)> func) override;
 	void uninstall_notification(FileNotifyHandle handle) override;
 	void poll_notifications() override;
 	int get_notification_fd() const override;
+	bool read_async(const std::string &path, uint64_t offset, size_t size, void *dst, AsyncReadCallback callback) override;
 	std::string get_filesystem_path(const std::string &path) override;
 
 private:
 	std::string base;
 
+	// Created on first use. Set GRANITE_IO_URING=0 to use the thread group fallback instead.
+	std::unique_ptr<IOUringReader> io_uring;
+	std::once_flag io_uring_once;
+
 	struct VirtualHandler
 	{
 		std::string path;
@@ -23,7 +23,13 @@
 #include "fs-netfs.hpp"
 #include "../path.hpp"
 #include "logging.hpp"
+#include "lz4_block.hpp"
+#include "hash.hpp"
+#include "global_managers.hpp"
 #include <queue>
+#include <deque>
+#include <chrono>
+#include <unordered_set>
 #include <assert.h>
 
 #define HOST_IP "localhost"
@@ -281,6 +287,22 @@ struct FSReadCommand : LooperHandler
 		state = WriteCommand;
 	}
 
+	// NETFS_READ_FILE_RANGE, the range goes in front of the path.
+	FSReadCommand(const string &path, uint64_t offset, uint64_t size, unique_ptr<Socket> socket_)
+		: LooperHandler(move(socket_))
+	{
+		reply_builder.begin();
+		reply_builder.add_u32(NETFS_READ_FILE_RANGE);
+		reply_builder.add_u32(NETFS_BEGIN_CHUNK_REQUEST);
+		reply_builder.add_u64(2 * sizeof(uint64_t) + path.size());
+		reply_builder.add_u64(offset);
+		reply_builder.add_u64(size);
+		auto &buffer = reply_builder.get_buffer();
+		buffer.insert(end(buffer), path.begin(), path.end());
+		command_writer.start(buffer);
+		state = WriteCommand;
+	}
+
 	bool write_command(Looper &looper)
 	{
 		auto ret = command_writer.process(*socket);
@@ -365,6 +387,11 @@ struct FSReader : FSReadCommand
 	{
 	}
 
+	FSReader(const string &path, uint64_t offset, uint64_t size, unique_ptr<Socket> socket_)
+		: FSReadCommand(path, offset, size, move(socket_))
+	{
+	}
+
 	~FSReader()
 	{
 		if (!got_reply)
@@ -376,21 +403,90 @@ struct FSReader : FSReadCommand
 		got_reply = true;
 		try
 		{
-			result.set_value(reply_builder.consume_buffer());
+			NetFSReply reply;
+			reply.data = reply_builder.consume_buffer();
+			result.set_value(move(reply));
 		}
 		catch (...)
 		{
 		}
 	}
 
-	promise<vector<uint8_t>> result;
+	promise<NetFSReply> result;
 	bool got_reply = false;
 };
 
+static vector<ListEntry> decode_list(ReplyBuilder &builder)
+{
+	uint32_t entries = builder.read_u32();
+	vector<ListEntry> list;
+	for (uint32_t i = 0; i < entries; i++)
+	{
+		auto path = builder.read_string();
+		auto type = builder.read_u32();
+
+		switch (type)
+		{
+		case NETFS_FILE_TYPE_PLAIN:
+			list.push_back({ move(path), PathType::File });
+			break;
+		case NETFS_FILE_TYPE_DIRECTORY:
+			list.push_back({ move(path), PathType::Directory });
+			break;
+		case NETFS_FILE_TYPE_SPECIAL:
+			list.push_back({ move(path), PathType::Special });
+			break;
+		}
+	}
+
+	return list;
+}
+
+static FileStat decode_stat(ReplyBuilder &builder)
+{
+	uint64_t size = builder.read_u64();
+	uint32_t type = builder.read_u32();
+	uint64_t last_modified = builder.read_u64();
+	FileStat s;
+	s.size = size;
+	s.last_modified = last_modified;
+
+	switch (type)
+	{
+	case NETFS_FILE_TYPE_PLAIN:
+		s.type = PathType::File;
+		break;
+	case NETFS_FILE_TYPE_DIRECTORY:
+		s.type = PathType::Directory;
+		break;
+	case NETFS_FILE_TYPE_SPECIAL:
+		s.type = PathType::Special;
+		break;
+	}
+
+	return s;
+}
+
+static vector<WalkEntry> decode_walk_stat(ReplyBuilder &builder)
+{
+	uint32_t entries = builder.read_u32();
+	vector<WalkEntry> list;
+	list.reserve(entries);
+	for (uint32_t i = 0; i < entries; i++)
+	{
+		auto path = builder.read_string();
+		auto s = decode_stat(builder);
+		list.push_back({ move(path), s });
+	}
+
+	return list;
+}
+
+// NETFS_LIST or NETFS_WALK.
 struct FSList : FSReadCommand
 {
-	FSList(const string &path, unique_ptr<Socket> socket_)
-		: FSReadCommand(path, NETFS_LIST, move(socket_))
+	FSList(const string &path, NetFSCommand command, unique_ptr<Socket> socket_)
+		: FSReadCommand(path, command, move(socket_))
 	{
 	}
 
@@ -402,27 +498,37 @@ struct FSList : FSReadCommand
 
 	void parse_reply() override
 	{
-		uint32_t entries = reply_builder.read_u32();
-		vector<ListEntry> list;
-		for (uint32_t i = 0; i < entries; i++)
+		auto list = decode_list(reply_builder);
+		got_reply = true;
+		try
+		{
+			result.set_value(move(list));
+		}
+		catch (...)
 		{
-			auto path = reply_builder.read_string();
-			auto type = reply_builder.read_u32();
-
-			switch (type)
-			{
-			case NETFS_FILE_TYPE_PLAIN:
-				list.push_back({ move(path), PathType::File });
-				break;
-			case NETFS_FILE_TYPE_DIRECTORY:
-				list.push_back({ move(path), PathType::Directory });
-				break;
-			case NETFS_FILE_TYPE_SPECIAL:
-				list.push_back({ move(path), PathType::Special });
-				break;
-			}
 		}
+	}
+
+	promise<vector<ListEntry>> result;
+	bool got_reply = false;
+};
+
+struct FSWalkStat : FSReadCommand
+{
+	FSWalkStat(const string &path, unique_ptr<Socket> socket_)
+		: FSReadCommand(path, NETFS_WALK_STAT, move(socket_))
+	{
+	}
+
+	~FSWalkStat()
+	{
+		if (!got_reply)
+			result.set_exception(make_exception_ptr(runtime_error("Walk failed")));
+	}
 
+	void parse_reply() override
+	{
+		auto list = decode_walk_stat(reply_builder);
 		got_reply = true;
 		try
 		{
@@ -433,7 +539,7 @@ struct FSList : FSReadCommand
 		}
 	}
 
-	promise<vector<ListEntry>> result;
+	promise<vector<WalkEntry>> result;
 	bool got_reply = false;
 };
 
@@ -453,26 +559,7 @@ struct FSStat : FSReadCommand
 
 	void parse_reply() override
 	{
-		uint64_t size = reply_builder.read_u64();
-		uint32_t type = reply_builder.read_u32();
-		uint64_t last_modified = reply_builder.read_u64();
-		FileStat s;
-		s.size = size;
-		s.last_modified = last_modified;
-
-		switch (type)
-		{
-		case NETFS_FILE_TYPE_PLAIN:
-			s.type = PathType::File;
-			break;
-		case NETFS_FILE_TYPE_DIRECTORY:
-			s.type = PathType::Directory;
-			break;
-		case NETFS_FILE_TYPE_SPECIAL:
-			s.type = PathType::Special;
-			break;
-		}
-
+		auto s = decode_stat(reply_builder);
 		got_reply = true;
 		try
 		{
@@ -594,193 +681,986 @@ struct FSWriteCommand : LooperHandler
 	bool got_reply = false;
 };
 
-NetworkFilesystem::NetworkFilesystem()
-{
-	looper_thread = thread(&NetworkFilesystem::looper_entry, this);
-}
-
-void NetworkFilesystem::looper_entry()
-{
-	while (looper.wait_idle(-1) >= 0);
-}
-
-void NetworkFilesystem::setup_notification()
-{
-	auto socket = Socket::connect(HOST_IP, 7070);
-	if (!socket)
-		return;
-	notify = new FSNotifyCommand(protocol, move(socket));
-	notify->set_notify_cb([this](const FileNotifyInfo &info) {
-		signal_notification(info);
-	});
-
-	// Move capture would be nice ...
-	looper.run_in_looper([this]() {
-		looper.register_handler(EVENT_OUT, unique_ptr<FSNotifyCommand>(notify));
-	});
-}
-
-void NetworkFilesystem::uninstall_notification(FileNotifyHandle handle)
+// One connection speaking the multiplexed protocol. Any number of requests can be in flight,
+// replies are matched up by request id as their frames arrive.
+struct FSMuxConnection : LooperHandler
 {
-	if (!notify)
-		setup_notification();
-	if (!notify)
-		return;
-
-	auto itr = handlers.find(handle);
-	if (itr == end(handlers))
-		return;
-	handlers.erase(itr);
-
-	auto *value = new promise<FileNotifyHandle>;
-	auto result = value->get_future();
-	looper.run_in_looper([this, value, handle]() {
-		notify->push_unregister_notification(handle, move(*value));
-		delete value;
-	});
-
-	try
+	FSMuxConnection(unique_ptr<Socket> socket_, bool compress)
+		: LooperHandler(move(socket_))
 	{
-		result.wait();
+		outgoing.emplace_back();
+		auto &handshake = outgoing.back();
+		handshake.add_u32(NETFS_MUX);
+		handshake.add_u32(NETFS_MUX_VERSION);
+		handshake.add_u32(compress ? NETFS_MUX_CAPABILITY_LZ4 : 0);
+		writer.start(handshake.get_buffer());
+
+		begin_frame_header();
 	}
-	catch (...)
+
+	~FSMuxConnection()
 	{
-	}
-}
+		if (on_close)
+			on_close(this);
 
-void NetworkFilesystem::signal_notification(const FileNotifyInfo &info)
-{
-	lock_guard<mutex> holder{lock};
-	pending.push_back(info);
-}
+		if (handshake_result)
+		{
+			handshake_result->set_value(got_handshake ? NetworkFilesystem::MuxState::Available :
+			                            NetworkFilesystem::MuxState::Unavailable);
+		}
 
-void NetworkFilesystem::poll_notifications()
-{
-	vector<FileNotifyInfo> tmp_pending;
-	{
-		lock_guard<mutex> holder{lock};
-		swap(tmp_pending, pending);
+		for (auto &pending : requests)
+			pending.second.result.set_exception(make_exception_ptr(runtime_error("NetFS connection closed")));
 	}
 
-	for (auto &notification : tmp_pending)
+	void push_request(NetFSCommand command, const vector<uint8_t> &payload, promise<NetFSReply> result)
 	{
-		auto &func = handlers[notification.handle];
-		if (func)
-			func(notification);
-	}
-}
-
-FileNotifyHandle NetworkFilesystem::install_notification(const std::string &path,
-                                                         std::function<void(const FileNotifyInfo &)> func)
-{
-	if (!notify)
-		setup_notification();
-	if (!notify)
-		return -1;
+		if (!next_id)
+			next_id++;
+		uint32_t id = next_id++;
 
-	auto *value = new promise<FileNotifyHandle>;
-	auto result = value->get_future();
+		if (outgoing.empty() && socket->get_parent_looper())
+			socket->get_parent_looper()->modify_handler(EVENT_IN | EVENT_OUT, *this);
 
-	looper.run_in_looper([this, value, path]() {
-		notify->push_register_notification(path, move(*value));
-		delete value;
-	});
+		outgoing.emplace_back();
+		auto &request_frame = outgoing.back();
+		request_frame.add_u32(command);
+		request_frame.add_u32(id);
+		request_frame.add_u64(payload.size());
+		request_frame.add_buffer(payload);
+		if (outgoing.size() == 1)
+			writer.start(request_frame.get_buffer());
 
-	try
-	{
-		auto handle = result.get();
-		handlers[handle] = move(func);
-		return handle;
+		requests[id].result = move(result);
 	}
-	catch (...)
+
+	void begin_frame_header()
 	{
-		return -1;
+		frame.begin(NETFS_MUX_FRAME_HEADER_SIZE);
+		reader.start(frame.get_buffer());
+		state = ReadFrameHeader;
 	}
-}
-
-vector<ListEntry> NetworkFilesystem::list(const std::string &path)
-{
-	auto joined = protocol + "://" + path;
-	auto socket = Socket::connect(HOST_IP, 7070);
-	if (!socket)
-		return {};
 
-	unique_ptr<FSList> handler(new FSList(joined, move(socket)));
-	auto fut = handler->result.get_future();
+	bool complete_request(uint32_t id)
+	{
+		auto itr = requests.find(id);
+		auto &pending = itr->second;
 
-	looper.run_in_looper([&]() {
-		looper.register_handler(EVENT_OUT, move(handler));
-	});
+		if (pending.error == NETFS_ERROR_IO)
+			pending.result.set_exception(make_exception_ptr(runtime_error("NetFS request failed")));
+		else if (pending.encoding == NETFS_ENCODING_LZ4)
+		{
+			NetFSReply reply;
+			reply.error = pending.error;
+			reply.hash = pending.hash;
+			reply.data.resize(pending.decoded_size);
+			if (!Util::lz4_decompress(reply.data.data(), reply.data.size(), pending.data.data(), pending.data.size()))
+			{
+				LOGE("Failed to decompress NetFS reply.\n");
+				return false;
+			}
+			pending.result.set_value(move(reply));
+		}
+		else if (pending.encoding == NETFS_ENCODING_RAW)
+		{
+			NetFSReply reply;
+			reply.error = pending.error;
+			reply.hash = pending.hash;
+			reply.data = move(pending.data);
+			pending.result.set_value(move(reply));
+		}
+		else
+			return false;
 
-	try
-	{
-		return fut.get();
-	}
-	catch (...)
-	{
-		return {};
+		requests.erase(itr);
+		return true;
 	}
-}
-
-NetworkFile::~NetworkFile()
-{
-	unmap();
-}
 
-NetworkFile *NetworkFile::open(Granite::Looper &looper, const std::string &path, Granite::FileMode mode)
-{
-	auto *file = new NetworkFile;
-	if (!file->init(looper, path, mode))
+	bool parse_frame_header()
 	{
-		delete file;
-		return nullptr;
-	}
-	else
-		return file;
-}
+		frame_type = frame.read_u32();
+		frame_id = frame.read_u32();
+		uint64_t size = frame.read_u64();
 
-bool NetworkFile::init(Looper &looper_, const std::string &path_, FileMode mode_)
-{
-	path = path_;
-	mode = mode_;
-	looper = &looper_;
+		// Every frame carries a payload.
+		if (!size)
+			return false;
 
-	if (mode == FileMode::ReadWrite)
-	{
-		LOGE("Unsupported file mode.\n");
-		return false;
-	}
+		if (frame_type == NETFS_MUX_DATA)
+		{
+			auto itr = requests.find(frame_id);
+			if (itr == end(requests) || !itr->second.has_reply ||
+			    size > itr->second.data.size() - itr->second.received)
+			{
+				LOGE("Unexpected NetFS data frame.\n");
+				return false;
+			}
 
-	if (mode == FileMode::ReadOnly)
-	{
-		if (!reopen())
+			// Data lands directly in the reply buffer.
+			auto &pending = itr->second;
+			reader.start(pending.data.data() + pending.received, size);
+			pending.received += size;
+			state = ReadFramePayload;
+			return true;
+		}
+		else if (frame_type == NETFS_MUX_REPLY || frame_type == NETFS_MUX)
 		{
-			LOGE("Failed to connect to server.\n");
+			if (size > NETFS_MUX_MAX_REQUEST_SIZE)
+				return false;
+			frame.begin(size);
+			reader.start(frame.get_buffer());
+			state = ReadFramePayload;
+			return true;
+		}
+		else
+		{
+			LOGE("Unexpected NetFS frame type %u.\n", frame_type);
 			return false;
 		}
 	}
 
-	return true;
-}
-
-void NetworkFile::unmap()
-{
-	if (mode == FileMode::WriteOnly && has_buffer && need_flush)
+	bool parse_frame_payload()
 	{
-		need_flush = false;
-		auto socket = Socket::connect(HOST_IP, 7070);
-		if (!socket)
-			throw runtime_error("Failed to connect to server.");
-
-		auto handler = unique_ptr<FSWriteCommand>(new FSWriteCommand(path, buffer, move(socket)));
-		auto reply = handler->result.get_future();
-		looper->run_in_looper([&handler, this]() {
-			looper->register_handler(EVENT_OUT | EVENT_IN, move(handler));
-		});
-
-		try
+		if (frame_type == NETFS_MUX)
 		{
-			NetFSError error = reply.get();
+			if (frame.read_u32() != NETFS_MUX_VERSION)
+				return false;
+			frame.read_u32();
+			got_handshake = true;
+			if (handshake_result)
+			{
+				handshake_result->set_value(NetworkFilesystem::MuxState::Available);
+				handshake_result = nullptr;
+			}
+			return true;
+		}
+
+		auto itr = requests.find(frame_id);
+		if (itr == end(requests))
+		{
+			LOGE("NetFS reply for unknown request %u.\n", frame_id);
+			return false;
+		}
+
+		auto &pending = itr->second;
+		if (frame_type == NETFS_MUX_REPLY)
+		{
+			if (pending.has_reply)
+				return false;
+
+			pending.error = NetFSError(frame.read_u32());
+			pending.encoding = frame.read_u32();
+			pending.decoded_size = frame.read_u64();
+			pending.data.resize(frame.read_u64());
+			pending.hash = frame.read_u64();
+			pending.has_reply = true;
+		}
+
+		if (pending.received == pending.data.size())
+			return complete_request(frame_id);
+		return true;
+	}
+
+	bool read_frames()
+	{
+		for (;;)
+		{
+			auto ret = reader.process(*socket);
+			if (reader.complete())
+			{
+				if (state == ReadFrameHeader)
+				{
+					if (!parse_frame_header())
+						return false;
+				}
+				else
+				{
+					if (!parse_frame_payload())
+						return false;
+					begin_frame_header();
+				}
+			}
+			else if (ret == Socket::ErrorWouldBlock)
+				return true;
+			else if (ret <= 0)
+				return false;
+		}
+	}
+
+	bool write_frames(Looper &looper)
+	{
+		while (!outgoing.empty())
+		{
+			auto ret = writer.process(*socket);
+			if (writer.complete())
+			{
+				outgoing.pop_front();
+				if (!outgoing.empty())
+					writer.start(outgoing.front().get_buffer());
+			}
+			else if (ret == Socket::ErrorWouldBlock)
+				return true;
+			else if (ret <= 0)
+				return false;
+		}
+
+		looper.modify_handler(EVENT_IN, *this);
+		return true;
+	}
+
+	bool handle(Looper &looper, EventFlags flags) override
+	{
+		if ((flags & EVENT_IN) && !read_frames())
+			return false;
+		if (flags & EVENT_OUT)
+			return write_frames(looper);
+		if (flags & (EVENT_HANGUP | EVENT_ERROR))
+			return false;
+		return true;
+	}
+
+	enum State
+	{
+		ReadFrameHeader,
+		ReadFramePayload
+	};
+
+	struct PendingRequest
+	{
+		promise<NetFSReply> result;
+		vector<uint8_t> data;
+		size_t received = 0;
+		uint64_t decoded_size = 0;
+		uint64_t hash = 0;
+		NetFSError error = NETFS_ERROR_OK;
+		uint32_t encoding = NETFS_ENCODING_RAW;
+		bool has_reply = false;
+	};
+
+	State state = ReadFrameHeader;
+	SocketReader reader;
+	ReplyBuilder frame;
+	uint32_t frame_type = 0;
+	uint32_t frame_id = 0;
+
+	SocketWriter writer;
+	deque<ReplyBuilder> outgoing;
+
+	unordered_map<uint32_t, PendingRequest> requests;
+	uint32_t next_id = 1;
+
+	promise<NetworkFilesystem::MuxState> *handshake_result = nullptr;
+	bool got_handshake = false;
+	function<void (FSMuxConnection *)> on_close;
+};
+
+// Persistent copies of remote files, stored as cache://netfs/<protocol>/<path hash>.
+// Each entry records the server's size, modification time and content hash of the file it was fetched from.
+class NetworkFileCache
+{
+public:
+	explicit NetworkFileCache(const string &protocol)
+		: root("cache://netfs/" + protocol)
+	{
+		FileStat s;
+		unsigned count = 0;
+		if (Global::filesystem()->stat(root, s) && s.type == PathType::Directory)
+			count = unsigned(Global::filesystem()->list(root).size());
+		LOGI("NetFS cache for %s:// has %u entries.\n", protocol.c_str(), count);
+	}
+
+	~NetworkFileCache()
+	{
+		unsigned total = hits + misses;
+		if (total)
+		{
+			LOGI("NetFS cache %s: %u hits (%u without a round trip, %u unchanged on server), %u misses, %.1f %% hit rate.\n",
+			     root.c_str(), hits.load(), trusted_hits.load(), unchanged_hits.load(), misses.load(),
+			     100.0 * double(hits) / double(total));
+		}
+	}
+
+	// Files in a directory with an installed notification are trusted once validated,
+	// until a notification says otherwise.
+	bool lookup_trusted(const string &path, vector<uint8_t> &data, uint64_t &hash)
+	{
+		{
+			lock_guard<mutex> holder{lock};
+			if (!validated.count(path) || (!watched.count(path) && !watched.count(Path::basedir(path))))
+				return false;
+		}
+
+		FileStat s;
+		if (!load(path, s, data, hash))
+			return false;
+
+		hits++;
+		trusted_hits++;
+		return true;
+	}
+
+	// Loads the entry if it matches what the server reported.
+	// Otherwise, data and hash hold the outdated copy, if any, so it can be offered to the server as a known hash.
+	bool lookup(const string &path, const FileStat &remote, vector<uint8_t> &data, uint64_t &hash)
+	{
+		FileStat s;
+		if (!load(path, s, data, hash))
+		{
+			data.clear();
+			hash = 0;
+			return false;
+		}
+
+		if (s.size != remote.size || s.last_modified != remote.last_modified)
+			return false;
+
+		mark_validated(path);
+		hits++;
+		return true;
+	}
+
+	void store(const string &path, const FileStat &remote, uint64_t hash, const vector<uint8_t> &data, bool unchanged)
+	{
+		if (unchanged)
+		{
+			hits++;
+			unchanged_hits++;
+		}
+		else
+			misses++;
+
+		// Servers without content hashes report 0, the entry still gets one so load() can verify it.
+		uint64_t content_hash = netfs_content_hash(data.data(), data.size());
+		if (hash && hash != content_hash)
+		{
+			LOGW("NetFS cache: content hash of %s does not match the server, not caching it.\n", path.c_str());
+			return;
+		}
+
+		Header header = {};
+		header.magic = Magic;
+		header.size = data.size();
+		header.last_modified = remote.last_modified;
+		header.hash = content_hash;
+		header.path_length = path.size();
+
+		// Write a complete copy next to the entry and rename it over, so neither a crash
+		// nor a reader in another process ever sees a partially written entry.
+		auto dst_path = entry_path(path);
+		auto tmp_path = temp_path(dst_path);
+		{
+			auto file = Global::filesystem()->open(tmp_path, FileMode::WriteOnly);
+			auto *dst = file ? static_cast<uint8_t *>(file->map_write(sizeof(header) + path.size() + data.size())) : nullptr;
+			if (!dst)
+				return;
+
+			memcpy(dst, &header, sizeof(header));
+			memcpy(dst + sizeof(header), path.data(), path.size());
+			if (!data.empty())
+				memcpy(dst + sizeof(header) + path.size(), data.data(), data.size());
+			file->unmap();
+		}
+
+		bool moved;
+		{
+			lock_guard<mutex> holder{entry_lock(path)};
+			moved = Global::filesystem()->move_replace(dst_path, tmp_path);
+		}
+
+		if (!moved)
+		{
+			Global::filesystem()->remove(tmp_path);
+			return;
+		}
+
+		mark_validated(path);
+	}
+
+	void invalidate(const string &path)
+	{
+		lock_guard<mutex> holder{lock};
+		validated.erase(path);
+	}
+
+	void set_watched(const string &path, bool watch)
+	{
+		lock_guard<mutex> holder{lock};
+		if (watch)
+			watched[path]++;
+		else
+		{
+			auto itr = watched.find(path);
+			if (itr != end(watched) && --itr->second == 0)
+				watched.erase(itr);
+		}
+	}
+
+private:
+	static constexpr uint64_t Magic = 0x314346534654454eull;
+
+	struct Header
+	{
+		uint64_t magic;
+		uint64_t size;
+		uint64_t last_modified;
+		uint64_t hash;
+		uint64_t path_length;
+	};
+
+	string root;
+	mutex lock;
+	unordered_set<string> validated;
+	unordered_map<string, unsigned> watched;
+
+	// Entries are replaced by renaming, which fails on some platforms while the entry is open,
+	// so readers and the rename of the same entry do not overlap within this process.
+	mutex entry_locks[16];
+	atomic_uint temp_count{0};
+
+	atomic_uint hits{0};
+	atomic_uint trusted_hits{0};
+	atomic_uint unchanged_hits{0};
+	atomic_uint misses{0};
+
+	mutex &entry_lock(const string &path)
+	{
+		return entry_locks[hash<string>()(path) % 16];
+	}
+
+	string entry_path(const string &path) const
+	{
+		Util::Hasher h;
+		h.string(path);
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx", static_cast<unsigned long long>(h.get()));
+		return root + name;
+	}
+
+	// Unique among writers in this and other processes sharing the cache.
+	string temp_path(const string &dst_path)
+	{
+		Util::Hasher h;
+		h.pointer(this);
+		h.u32(temp_count++);
+		h.u64(uint64_t(chrono::steady_clock::now().time_since_epoch().count()));
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%016llx.tmp", static_cast<unsigned long long>(h.get()));
+		return dst_path + suffix;
+	}
+
+	void mark_validated(const string &path)
+	{
+		lock_guard<mutex> holder{lock};
+		validated.insert(path);
+	}
+
+	// Read rather than mapped, so a concurrent writer in another process cannot fault us.
+	bool load(const string &path, FileStat &s, vector<uint8_t> &data, uint64_t &hash)
+	{
+		lock_guard<mutex> holder{entry_lock(path)};
+		auto file = Global::filesystem()->open(entry_path(path), FileMode::ReadOnly);
+		if (!file)
+			return false;
+
+		Header header;
+		size_t file_size = file->get_size();
+		if (file->read(0, &header, sizeof(header)) != sizeof(header) || header.magic != Magic ||
+		    header.path_length != path.size() ||
+		    file_size != sizeof(header) + header.path_length + header.size)
+		{
+			return false;
+		}
+
+		string cached_path(path.size(), '\0');
+		if (file->read(sizeof(header), &cached_path[0], path.size()) != path.size() || cached_path != path)
+			return false;
+
+		// Callers may hold an older copy in data, leave it alone unless the entry checks out.
+		vector<uint8_t> contents(header.size);
+		if (file->read(sizeof(header) + path.size(), contents.data(), contents.size()) != contents.size())
+			return false;
+
+		if (netfs_content_hash(contents.data(), contents.size()) != header.hash)
+		{
+			LOGW("NetFS cache: entry for %s is corrupt, dropping it.\n", path.c_str());
+			file.reset();
+			Global::filesystem()->remove(entry_path(path));
+			return false;
+		}
+
+		data = move(contents);
+
+		s.size = header.size;
+		s.last_modified = header.last_modified;
+		s.type = PathType::File;
+		hash = header.hash;
+		return true;
+	}
+};
+
+NetworkFilesystem::NetworkFilesystem()
+{
+	const char *use_mux_env = getenv("GRANITE_NETFS_MUX");
+	const char *compress_env = getenv("GRANITE_NETFS_COMPRESS");
+	set_multiplexing(!use_mux_env || strtol(use_mux_env, nullptr, 0) != 0,
+	                 !compress_env || strtol(compress_env, nullptr, 0) != 0);
+	const char *cache_env = getenv("GRANITE_NETFS_CACHE");
+	set_caching(!cache_env || strtol(cache_env, nullptr, 0) != 0);
+	looper_thread = thread(&NetworkFilesystem::looper_entry, this);
+}
+
+void NetworkFilesystem::set_multiplexing(bool enable, bool compress)
+{
+	lock_guard<mutex> holder{mux_probe_lock};
+	mux_state = enable ? MuxState::Unknown : MuxState::Unavailable;
+	mux_compress = compress;
+
+	// Make sure the next request connects with the new settings.
+	looper.run_in_looper([this]() {
+		if (mux)
+			looper.unregister_handler(mux->get_socket());
+	});
+}
+
+void NetworkFilesystem::set_caching(bool enable)
+{
+	cache_enabled = enable;
+}
+
+NetworkFileCache *NetworkFilesystem::get_cache()
+{
+	call_once(cache_once, [this]() {
+		if (!cache_enabled || protocol == "cache")
+			return;
+
+		// Caching is pointless if cache:// itself lives on the server.
+		auto *backend = Global::filesystem() ? Global::filesystem()->get_backend("cache") : nullptr;
+		if (!backend || dynamic_cast<NetworkFilesystem *>(backend))
+			return;
+
+		cache.reset(new NetworkFileCache(protocol));
+	});
+
+	return cache.get();
+}
+
+void NetworkFilesystem::connect_mux(promise<MuxState> *handshake)
+{
+	auto socket = Socket::connect(HOST_IP, 7070);
+	if (!socket)
+	{
+		// No server at all, try again next time.
+		if (handshake)
+			handshake->set_value(MuxState::Unknown);
+		return;
+	}
+
+	auto handler = unique_ptr<FSMuxConnection>(new FSMuxConnection(move(socket), mux_compress));
+	handler->handshake_result = handshake;
+	handler->on_close = [this](FSMuxConnection *conn) {
+		if (mux == conn)
+			mux = nullptr;
+	};
+	mux = handler.get();
+	looper.register_handler(EVENT_IN | EVENT_OUT, move(handler));
+}
+
+bool NetworkFilesystem::use_mux()
+{
+	if (mux_state == MuxState::Unknown)
+	{
+		// The first request waits for the handshake, an older server simply drops the connection.
+		lock_guard<mutex> holder{mux_probe_lock};
+		if (mux_state == MuxState::Unknown)
+		{
+			promise<MuxState> handshake;
+			auto result = handshake.get_future();
+			looper.run_in_looper([this, &handshake]() {
+				if (mux)
+					looper.unregister_handler(mux->get_socket());
+				connect_mux(&handshake);
+			});
+
+			auto state = result.get();
+			if (state == MuxState::Unavailable)
+				LOGW("NetFS server does not support multiplexing, falling back to one connection per request.\n");
+			mux_state = state;
+		}
+	}
+
+	return mux_state == MuxState::Available;
+}
+
+future<NetFSReply> NetworkFilesystem::mux_request(NetFSCommand command, vector<uint8_t> payload)
+{
+	auto *result = new promise<NetFSReply>;
+	auto fut = result->get_future();
+
+	looper.run_in_looper([this, command, result, payload]() {
+		// Reconnect if the server went away since the last request.
+		if (!mux)
+			connect_mux(nullptr);
+
+		if (mux)
+			mux->push_request(command, payload, move(*result));
+		else
+			result->set_exception(make_exception_ptr(runtime_error("Failed to connect to server.")));
+		delete result;
+	});
+
+	return fut;
+}
+
+static vector<uint8_t> encode_path_request(const string &path, const uint64_t *prefix, unsigned prefix_count)
+{
+	ReplyBuilder builder;
+	for (unsigned i = 0; i < prefix_count; i++)
+		builder.add_u64(prefix[i]);
+	auto &buffer = builder.get_buffer();
+	buffer.insert(end(buffer), path.begin(), path.end());
+	return move(buffer);
+}
+
+future<NetFSReply> NetworkFilesystem::request_read(const string &path, uint64_t offset, uint64_t size,
+                                                   bool whole_file, uint64_t known_hash)
+{
+	if (use_mux())
+	{
+		if (whole_file)
+			return mux_request(NETFS_READ_FILE, encode_path_request(path, &known_hash, 1));
+
+		const uint64_t range[] = { offset, size };
+		return mux_request(NETFS_READ_FILE_RANGE, encode_path_request(path, range, 2));
+	}
+
+	auto socket = Socket::connect(HOST_IP, 7070);
+	if (!socket)
+		return {};
+
+	auto *handler = whole_file ? new FSReader(path, move(socket)) : new FSReader(path, offset, size, move(socket));
+	auto fut = handler->result.get_future();
+
+	// Capture-by-move would be nice here.
+	looper.run_in_looper([handler, this]() {
+		looper.register_handler(EVENT_OUT, unique_ptr<FSReader>(handler));
+	});
+	return fut;
+}
+
+void NetworkFilesystem::looper_entry()
+{
+	while (looper.wait_idle(-1) >= 0);
+}
+
+void NetworkFilesystem::setup_notification()
+{
+	auto socket = Socket::connect(HOST_IP, 7070);
+	if (!socket)
+		return;
+	notify = new FSNotifyCommand(protocol, move(socket));
+	notify->set_notify_cb([this](const FileNotifyInfo &info) {
+		signal_notification(info);
+	});
+
+	// Move capture would be nice ...
+	looper.run_in_looper([this]() {
+		looper.register_handler(EVENT_OUT, unique_ptr<FSNotifyCommand>(notify));
+	});
+}
+
+void NetworkFilesystem::uninstall_notification(FileNotifyHandle handle)
+{
+	if (!notify)
+		setup_notification();
+	if (!notify)
+		return;
+
+	auto itr = handlers.find(handle);
+	if (itr == end(handlers))
+		return;
+	handlers.erase(itr);
+
+	auto path_itr = notification_paths.find(handle);
+	if (path_itr != end(notification_paths))
+	{
+		if (auto *c = get_cache())
+			c->set_watched(path_itr->second, false);
+		notification_paths.erase(path_itr);
+	}
+
+	auto *value = new promise<FileNotifyHandle>;
+	auto result = value->get_future();
+	looper.run_in_looper([this, value, handle]() {
+		notify->push_unregister_notification(handle, move(*value));
+		delete value;
+	});
+
+	try
+	{
+		result.wait();
+	}
+	catch (...)
+	{
+	}
+}
+
+void NetworkFilesystem::signal_notification(const FileNotifyInfo &info)
+{
+	// Runs on the looper thread before the application sees the notification, so a reload reads fresh data.
+	if (info.type != FileNotifyType::FileCreated)
+		if (auto *c = get_cache())
+			c->invalidate(info.path);
+
+	lock_guard<mutex> holder{lock};
+	pending.push_back(info);
+}
+
+void NetworkFilesystem::poll_notifications()
+{
+	vector<FileNotifyInfo> tmp_pending;
+	{
+		lock_guard<mutex> holder{lock};
+		swap(tmp_pending, pending);
+	}
+
+	for (auto &notification : tmp_pending)
+	{
+		auto &func = handlers[notification.handle];
+		if (func)
+			func(notification);
+	}
+}
+
+FileNotifyHandle NetworkFilesystem::install_notification(const std::string &path,
+                                                         std::function<void(const FileNotifyInfo &)> func)
+{
+	if (!notify)
+		setup_notification();
+	if (!notify)
+		return -1;
+
+	auto *value = new promise<FileNotifyHandle>;
+	auto result = value->get_future();
+
+	looper.run_in_looper([this, value, path]() {
+		notify->push_register_notification(path, move(*value));
+		delete value;
+	});
+
+	try
+	{
+		auto handle = result.get();
+		handlers[handle] = move(func);
+
+		if (auto *c = get_cache())
+		{
+			// Match the form of Path::basedir() on file paths.
+			auto joined = Path::join(protocol + "://", path);
+			if (joined.back() == '/' && !Path::is_root_path(joined))
+				joined.pop_back();
+			c->set_watched(joined, true);
+			notification_paths[handle] = move(joined);
+		}
+		return handle;
+	}
+	catch (...)
+	{
+		return -1;
+	}
+}
+
+vector<ListEntry> NetworkFilesystem::list(const std::string &path)
+{
+	return list_remote(path, NETFS_LIST);
+}
+
+// The server walks its own filesystem, so the whole tree comes back in one round trip.
+vector<ListEntry> NetworkFilesystem::walk(const std::string &path)
+{
+	return list_remote(path, NETFS_WALK);
+}
+
+vector<ListEntry> NetworkFilesystem::list_remote(const string &path, NetFSCommand command)
+{
+	auto joined = protocol + "://" + path;
+
+	if (use_mux())
+	{
+		try
+		{
+			ReplyBuilder builder;
+			builder.begin();
+			builder.get_buffer() = mux_request(command, encode_path_request(joined, nullptr, 0)).get().data;
+			return decode_list(builder);
+		}
+		catch (...)
+		{
+			return {};
+		}
+	}
+
+	auto socket = Socket::connect(HOST_IP, 7070);
+	if (!socket)
+		return {};
+
+	unique_ptr<FSList> handler(new FSList(joined, command, move(socket)));
+	auto fut = handler->result.get_future();
+
+	looper.run_in_looper([&]() {
+		looper.register_handler(EVENT_OUT, move(handler));
+	});
+
+	try
+	{
+		return fut.get();
+	}
+	catch (...)
+	{
+		return {};
+	}
+}
+
+vector<WalkEntry> NetworkFilesystem::walk_stat(const std::string &path)
+{
+	auto joined = protocol + "://" + path;
+
+	if (use_mux())
+	{
+		try
+		{
+			ReplyBuilder builder;
+			builder.begin();
+			builder.get_buffer() = mux_request(NETFS_WALK_STAT, encode_path_request(joined, nullptr, 0)).get().data;
+			return decode_walk_stat(builder);
+		}
+		catch (...)
+		{
+			return {};
+		}
+	}
+
+	auto socket = Socket::connect(HOST_IP, 7070);
+	if (!socket)
+		return {};
+
+	unique_ptr<FSWalkStat> handler(new FSWalkStat(joined, move(socket)));
+	auto fut = handler->result.get_future();
+
+	looper.run_in_looper([&]() {
+		looper.register_handler(EVENT_OUT, move(handler));
+	});
+
+	try
+	{
+		return fut.get();
+	}
+	catch (...)
+	{
+		return {};
+	}
+}
+
+bool NetworkFilesystem::stat_remote(const string &path, FileStat &stat)
+{
+	if (use_mux())
+	{
+		try
+		{
+			ReplyBuilder builder;
+			builder.begin();
+			builder.get_buffer() = mux_request(NETFS_STAT, encode_path_request(path, nullptr, 0)).get().data;
+			stat = decode_stat(builder);
+			return true;
+		}
+		catch (...)
+		{
+			return false;
+		}
+	}
+
+	auto socket = Socket::connect(HOST_IP, 7070);
+	if (!socket)
+		return false;
+
+	unique_ptr<FSStat> handler(new FSStat(path, move(socket)));
+	auto fut = handler->result.get_future();
+
+	looper.run_in_looper([&]() {
+		looper.register_handler(EVENT_OUT, move(handler));
+	});
+
+	try
+	{
+		stat = fut.get();
+		return true;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+NetworkFile::~NetworkFile()
+{
+	unmap();
+}
+
+NetworkFile *NetworkFile::open(NetworkFilesystem &fs, const std::string &path, Granite::FileMode mode)
+{
+	auto *file = new NetworkFile;
+	if (!file->init(fs, path, mode))
+	{
+		delete file;
+		return nullptr;
+	}
+	else
+		return file;
+}
+
+bool NetworkFile::init(NetworkFilesystem &fs_, const std::string &path_, FileMode mode_)
+{
+	path = path_;
+	mode = mode_;
+	fs = &fs_;
+
+	if (mode == FileMode::ReadWrite)
+	{
+		LOGE("Unsupported file mode.\n");
+		return false;
+	}
+
+	if (mode == FileMode::ReadOnly)
+	{
+		if (!reopen())
+		{
+			LOGE("Failed to connect to server.\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void NetworkFile::unmap()
+{
+	ranges.clear();
+
+	if (mode == FileMode::WriteOnly && has_buffer && need_flush)
+	{
+		need_flush = false;
+		auto socket = Socket::connect(HOST_IP, 7070);
+		if (!socket)
+			throw runtime_error("Failed to connect to server.");
+
+		auto handler = unique_ptr<FSWriteCommand>(new FSWriteCommand(path, buffer, move(socket)));
+		auto reply = handler->result.get_future();
+		fs->looper.run_in_looper([&handler, this]() {
+			fs->looper.register_handler(EVENT_OUT | EVENT_IN, move(handler));
+		});
+
+		try
+		{
+			NetFSError error = reply.get();
 			if (error != NETFS_ERROR_OK)
 				LOGE("Failed to write file: %s\n", path.c_str());
 		}
@@ -795,20 +1675,90 @@ bool NetworkFile::reopen()
 {
 	if (mode == FileMode::ReadOnly)
 	{
+		// Nothing is fetched until it is needed, so reading a range does not pull in the whole file.
+		// The old contents are kept around, if they are still current the server does not send them again.
 		has_buffer = false;
-		auto socket = Socket::connect(HOST_IP, 7070);
-		if (!socket)
-			return false;
+		has_size = false;
+		ranges.clear();
+	}
+	return true;
+}
+
+size_t NetworkFile::read(size_t offset, void *dst, size_t size)
+{
+	if (mode != FileMode::ReadOnly)
+		return 0;
+	if (has_buffer)
+		return File::read(offset, dst, size);
 
-		auto *handler = new FSReader(path, move(socket));
-		future = handler->result.get_future();
+	size_t file_size = get_size();
+	if (offset >= file_size)
+		return 0;
+	size = std::min(size, file_size - offset);
 
-		// Capture-by-move would be nice here.
-		looper->run_in_looper([handler, this]() {
-			looper->register_handler(EVENT_OUT, unique_ptr<FSReader>(handler));
-		});
+	// Chunks are pipelined, but only a few at a time. Without mux, every request is its own connection,
+	// and a large read would otherwise open hundreds of them and buffer the whole range at once.
+	static const size_t ChunkSize = 4 * 1024 * 1024;
+	static const size_t MaxChunksInFlight = 8;
+
+	deque<future<NetFSReply>> chunks;
+	size_t requested = 0;
+	const auto request_chunks = [&]() {
+		while (requested < size && chunks.size() < MaxChunksInFlight)
+		{
+			size_t chunk_size = std::min(ChunkSize, size - requested);
+			auto fut = fs->request_read(path, offset + requested, chunk_size, false, 0);
+			if (!fut.valid())
+				break;
+			chunks.push_back(move(fut));
+			requested += chunk_size;
+		}
+	};
+
+	auto *ptr = static_cast<uint8_t *>(dst);
+	size_t done = 0;
+	request_chunks();
+	while (!chunks.empty())
+	{
+		auto chunk = move(chunks.front());
+		chunks.pop_front();
+
+		try
+		{
+			auto data = chunk.get().data;
+			size_t expected = std::min(ChunkSize, size - done);
+			memcpy(ptr + done, data.data(), std::min(data.size(), expected));
+			done += std::min(data.size(), expected);
+			if (data.size() != expected)
+				break;
+		}
+		catch (...)
+		{
+			break;
+		}
+
+		request_chunks();
 	}
-	return true;
+
+	// Requests still in flight after a failure complete on the looper, their replies are simply dropped.
+	return done;
+}
+
+void *NetworkFile::map_range(size_t offset, size_t size)
+{
+	if (has_buffer || mode != FileMode::ReadOnly)
+		return File::map_range(offset, size);
+
+	size_t file_size = get_size();
+	if (offset > file_size || size > file_size - offset)
+		return nullptr;
+
+	vector<uint8_t> range(size);
+	if (read(offset, range.data(), size) != size)
+		return nullptr;
+
+	ranges.push_back(move(range));
+	return ranges.back().data();
 }
 
 void *NetworkFile::map_write(size_t size)
@@ -823,10 +1773,55 @@ void *NetworkFile::map()
 {
 	try
 	{
-		if (!has_buffer)
+		if (!has_buffer && mode == FileMode::ReadOnly)
 		{
-			buffer = future.get();
+			auto *cache = fs->get_cache();
+			FileStat remote = {};
+
+			if (cache)
+			{
+				if (cache->lookup_trusted(path, buffer, buffer_hash))
+				{
+					has_buffer = true;
+					return buffer.empty() ? nullptr : buffer.data();
+				}
+
+				if (!fs->stat_remote(path, remote) || remote.type != PathType::File)
+					return nullptr;
+
+				// Keep a stale buffer from before reopen() if the cache has nothing, it still has a usable hash.
+				vector<uint8_t> cached;
+				uint64_t cached_hash = 0;
+				bool hit = cache->lookup(path, remote, cached, cached_hash);
+				if (hit || cached_hash)
+				{
+					buffer = move(cached);
+					buffer_hash = cached_hash;
+				}
+
+				if (hit)
+				{
+					has_buffer = true;
+					return buffer.empty() ? nullptr : buffer.data();
+				}
+			}
+
+			auto fut = fs->request_read(path, 0, 0, true, buffer_hash);
+			if (!fut.valid())
+				return nullptr;
+
+			auto reply = fut.get();
+			bool unchanged = reply.error == NETFS_ERROR_UNCHANGED;
+			if (!unchanged)
+			{
+				buffer = move(reply.data);
+				buffer_hash = reply.hash;
+			}
 			has_buffer = true;
+
+			// The stat was taken before the read, if the file changed in between the entry fails validation next time.
+			if (cache)
+				cache->store(path, remote, buffer_hash, buffer, unchanged);
 		}
 		return buffer.empty() ? nullptr : buffer.data();
 	}
@@ -838,50 +1833,30 @@ void *NetworkFile::map()
 
 size_t NetworkFile::get_size()
 {
-	try
-	{
-		if (!has_buffer)
-		{
-			buffer = future.get();
-			has_buffer = true;
-		}
+	if (has_buffer || mode != FileMode::ReadOnly)
 		return buffer.size();
-	}
-	catch (...)
+
+	if (!has_size)
 	{
-		return 0;
+		FileStat s;
+		if (!fs->stat_remote(path, s) || s.type != PathType::File)
+			return 0;
+		remote_size = s.size;
+		has_size = true;
 	}
+
+	return remote_size;
 }
 
 unique_ptr<File> NetworkFilesystem::open(const std::string &path, FileMode mode)
 {
 	auto joined = protocol + "://" + path;
-	return unique_ptr<File>(NetworkFile::open(looper, move(joined), mode));
+	return unique_ptr<File>(NetworkFile::open(*this, move(joined), mode));
 }
 
 bool NetworkFilesystem::stat(const std::string &path, FileStat &stat)
 {
-	auto joined = protocol + "://" + path;
-	auto socket = Socket::connect(HOST_IP, 7070);
-	if (!socket)
-		return false;
-
-	unique_ptr<FSStat> handler(new FSStat(joined, move(socket)));
-	auto fut = handler->result.get_future();
-
-	looper.run_in_looper([&]() {
-		looper.register_handler(EVENT_OUT, move(handler));
-	});
-
-	try
-	{
-		stat = fut.get();
-		return true;
-	}
-	catch (...)
-	{
-		return false;
-	}
+	return stat_remote(protocol + "://" + path, stat);
 }
 
 NetworkFilesystem::~NetworkFilesystem()
@@ -892,5 +1867,9 @@ NetworkFilesystem::~NetworkFilesystem()
 	looper.kill();
 	if (looper_thread.joinable())
 		looper_thread.join();
+
+	// The looper thread is gone, the connection is torn down along with the looper.
+	if (mux)
+		mux->on_close = {};
 }
 }
@@ -28,40 +28,58 @@
 #include <unordered_map>
 #include <future>
 #include <thread>
+#include <atomic>
 
 namespace Granite
 {
-struct FSReader;
+struct NetFSReply
+{
+	NetFSError error = NETFS_ERROR_OK;
+	uint64_t hash = 0;
+	std::vector<uint8_t> data;
+};
+
+class NetworkFilesystem;
 class NetworkFile : public File
 {
 public:
-	static NetworkFile *open(Looper &looper, const std::string &path, FileMode mode);
+	static NetworkFile *open(NetworkFilesystem &fs, const std::string &path, FileMode mode);
 	~NetworkFile();
 	void *map() override;
 	void *map_write(size_t size) override;
 	void unmap() override;
 	size_t get_size() override;
 	bool reopen() override;
+	void *map_range(size_t offset, size_t size) override;
+	size_t read(size_t offset, void *dst, size_t size) override;
 
 private:
 	NetworkFile() = default;
-	bool init(Looper &looper, const std::string &path, FileMode mode);
+	bool init(NetworkFilesystem &fs, const std::string &path, FileMode mode);
 	std::string path;
 	FileMode mode;
-	Looper *looper = nullptr;
-	std::future<std::vector<uint8_t>> future;
+	NetworkFilesystem *fs = nullptr;
 	std::vector<uint8_t> buffer;
+	std::vector<std::vector<uint8_t>> ranges;
+	size_t remote_size = 0;
+	// Content hash of buffer. After reopen() the stale buffer is kept so the server can skip sending it again.
+	uint64_t buffer_hash = 0;
 	bool has_buffer = false;
+	bool has_size = false;
 	bool need_flush = false;
 };
 
 struct FSNotifyCommand;
+struct FSMuxConnection;
+class NetworkFileCache;
 class NetworkFilesystem : public FilesystemBackend
 {
 public:
 	NetworkFilesystem();
 	~NetworkFilesystem();
 	std::vector<ListEntry> list(const std::string &path) override;
+	std::vector<ListEntry> walk(const std::string &path) override;
+	std::vector<WalkEntry> walk_stat(const std::string &path) override;
 	std::unique_ptr<File> open(const std::string &path, FileMode mode) override;
 	bool stat(const std::string &path, FileStat &stat) override;
 
@@ -76,17 +94,54 @@ public:
 		return -1;
 	}
 
+	// Whether to use the multiplexed protocol if the server supports it.
+	// Defaults to on, GRANITE_NETFS_MUX=0 disables it and GRANITE_NETFS_COMPRESS=0 disables compression.
+	void set_multiplexing(bool enable, bool compress);
+
+	// Whether to keep fetched files under cache://netfs/ across sessions, must be set before opening files.
+	// Defaults to on unless cache:// is a network filesystem itself, GRANITE_NETFS_CACHE=0 disables it.
+	void set_caching(bool enable);
+
 private:
+	friend class NetworkFile;
+	friend struct FSMuxConnection;
 	std::thread looper_thread;
 	Looper looper;
 	void looper_entry();
 	FSNotifyCommand *notify = nullptr;
 
 	std::unordered_map<FileNotifyHandle, std::function<void (const FileNotifyInfo &)>> handlers;
+	std::unordered_map<FileNotifyHandle, std::string> notification_paths;
 	std::mutex lock;
 	std::vector<FileNotifyInfo> pending;
 
 	void setup_notification();
 	void signal_notification(const FileNotifyInfo &info);
+
+	std::future<NetFSReply> request_read(const std::string &path, uint64_t offset, uint64_t size,
+	                                     bool whole_file, uint64_t known_hash);
+	bool stat_remote(const std::string &path, FileStat &stat);
+	std::vector<ListEntry> list_remote(const std::string &path, NetFSCommand command);
+
+	enum class MuxState
+	{
+		Unknown,
+		Available,
+		Unavailable
+	};
+	std::atomic<MuxState> mux_state;
+	std::mutex mux_probe_lock;
+	bool mux_compress = true;
+	// Only accessed on the looper thread.
+	FSMuxConnection *mux = nullptr;
+
+	bool use_mux();
+	void connect_mux(std::promise<MuxState> *handshake);
+	std::future<NetFSReply> mux_request(NetFSCommand command, std::vector<uint8_t> payload);
+
+	std::unique_ptr<NetworkFileCache> cache;
+	std::once_flag cache_once;
+	bool cache_enabled = true;
+	NetworkFileCache *get_cache();
 };
 }
@@ -0,0 +1,287 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pack_filesystem.hpp"
+#include "lz4_block.hpp"
+#include "path.hpp"
+#include "logging.hpp"
+#include <string.h>
+
+using namespace std;
+
+namespace Granite
+{
+struct PackFile : File
+{
+	PackFile(shared_ptr<File> archive_, const uint8_t *data_, const Pack::Entry &entry_)
+		: archive(move(archive_)), data(data_), entry(entry_)
+	{
+	}
+
+	void *map() override
+	{
+		if (entry.compression == Pack::Compression::None)
+			return const_cast<uint8_t *>(data);
+
+		if (decoded.empty() && entry.size)
+		{
+			decoded.resize(entry.size);
+			if (!Util::lz4_decompress(decoded.data(), decoded.size(), data, entry.stored_size))
+			{
+				LOGE("Corrupt compressed entry in pack archive.\n");
+				decoded.clear();
+				return nullptr;
+			}
+		}
+		return decoded.data();
+	}
+
+	void *map_write(size_t) override
+	{
+		return nullptr;
+	}
+
+	void unmap() override
+	{
+	}
+
+	size_t get_size() override
+	{
+		return entry.size;
+	}
+
+	bool reopen() override
+	{
+		return true;
+	}
+
+	// Keeps the archive mapping alive for as long as any file refers into it.
+	shared_ptr<File> archive;
+	const uint8_t *data;
+	Pack::Entry entry;
+	vector<uint8_t> decoded;
+};
+
+unique_ptr<PackFilesystem> PackFilesystem::create(unique_ptr<File> archive)
+{
+	unique_ptr<PackFilesystem> fs(new PackFilesystem);
+	if (!fs->init(move(archive)))
+		return {};
+	return fs;
+}
+
+bool PackFilesystem::init(unique_ptr<File> archive_)
+{
+	if (!archive_)
+		return false;
+
+	archive = move(archive_);
+	size = archive->get_size();
+	data = static_cast<const uint8_t *>(archive->map());
+	if (!data || size < sizeof(Pack::Header))
+	{
+		LOGE("Pack archive is too small.\n");
+		return false;
+	}
+
+	Pack::Header header;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != Pack::Magic || header.version != Pack::Version)
+	{
+		LOGE("Invalid pack archive header.\n");
+		return false;
+	}
+
+	if (header.index_offset > size ||
+	    uint64_t(header.entry_count) * sizeof(Pack::Entry) > size - header.index_offset ||
+	    (header.index_offset & (alignof(Pack::Entry) - 1)) != 0 ||
+	    header.string_offset > size ||
+	    header.string_size > size - header.string_offset)
+	{
+		LOGE("Pack archive index is out of range.\n");
+		return false;
+	}
+
+	entries = reinterpret_cast<const Pack::Entry *>(data + header.index_offset);
+	entry_count = header.entry_count;
+	strings = reinterpret_cast<const char *>(data + header.string_offset);
+
+	// Validate everything up front so lookups and maps never need to.
+	for (uint32_t i = 0; i < entry_count; i++)
+	{
+		auto &e = entries[i];
+		bool valid = e.offset <= size && e.stored_size <= size - e.offset &&
+		             e.path_offset <= header.string_size &&
+		             e.path_length <= header.string_size - e.path_offset;
+
+		if (valid && e.compression == Pack::Compression::None)
+			valid = e.stored_size == e.size;
+		else if (valid && e.compression != Pack::Compression::LZ4)
+			valid = false;
+
+		if (!valid)
+		{
+			LOGE("Pack archive entry %u is out of range.\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static string normalize_path(const string &path)
+{
+	auto canonical = Path::canonicalize_path(path);
+	while (canonical == "." || canonical.compare(0, 2, "./") == 0)
+		canonical = canonical.size() > 2 ? canonical.substr(2) : string();
+	return canonical;
+}
+
+int PackFilesystem::compare(const Pack::Entry &entry, const string &path) const
+{
+	size_t len = min<size_t>(entry.path_length, path.size());
+	int ret = memcmp(strings + entry.path_offset, path.data(), len);
+	if (ret != 0)
+		return ret;
+	if (entry.path_length == path.size())
+		return 0;
+	return entry.path_length < path.size() ? -1 : 1;
+}
+
+const Pack::Entry *PackFilesystem::lower_bound(const string &path) const
+{
+	uint32_t lo = 0;
+	uint32_t hi = entry_count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (compare(entries[mid], path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return entries + lo;
+}
+
+const Pack::Entry *PackFilesystem::find(const string &path) const
+{
+	auto *entry = lower_bound(path);
+	if (entry != entries + entry_count && compare(*entry, path) == 0)
+		return entry;
+	else
+		return nullptr;
+}
+
+bool PackFilesystem::has_prefix(const Pack::Entry &entry, const string &prefix) const
+{
+	return entry.path_length >= prefix.size() &&
+	       memcmp(strings + entry.path_offset, prefix.data(), prefix.size()) == 0;
+}
+
+vector<ListEntry> PackFilesystem::list(const string &path)
+{
+	auto dir = normalize_path(path);
+	string prefix = dir.empty() ? string() : dir + "/";
+
+	// Everything below a directory is contiguous in the sorted index.
+	vector<ListEntry> list;
+	string last_subdir;
+	for (auto *entry = lower_bound(prefix); entry != entries + entry_count && has_prefix(*entry, prefix); entry++)
+	{
+		string name(strings + entry->path_offset + prefix.size(), entry->path_length - prefix.size());
+		auto slash = name.find('/');
+		if (slash == string::npos)
+		{
+			list.push_back({ Path::join(path, name), PathType::File });
+		}
+		else
+		{
+			name.resize(slash);
+			if (name != last_subdir)
+			{
+				list.push_back({ Path::join(path, name), PathType::Directory });
+				last_subdir = name;
+			}
+		}
+	}
+
+	return list;
+}
+
+bool PackFilesystem::stat(const string &path, FileStat &stat)
+{
+	auto normalized = normalize_path(path);
+	auto *entry = find(normalized);
+	if (entry)
+	{
+		stat.size = entry->size;
+		stat.type = PathType::File;
+		stat.last_modified = entry->last_modified;
+		return true;
+	}
+
+	string prefix = normalized.empty() ? string() : normalized + "/";
+	auto *first = lower_bound(prefix);
+	if (first != entries + entry_count && has_prefix(*first, prefix))
+	{
+		stat.size = 0;
+		stat.type = PathType::Directory;
+		stat.last_modified = 0;
+		return true;
+	}
+
+	return false;
+}
+
+unique_ptr<File> PackFilesystem::open(const string &path, FileMode mode)
+{
+	if (mode != FileMode::ReadOnly)
+	{
+		LOGE("Pack archives are read-only.\n");
+		return {};
+	}
+
+	auto *entry = find(normalize_path(path));
+	if (!entry)
+		return {};
+
+	return unique_ptr<File>(new PackFile(archive, data + entry->offset, *entry));
+}
+
+int PackFilesystem::get_notification_fd() const
+{
+	return -1;
+}
+
+FileNotifyHandle PackFilesystem::install_notification(const string &, function<void(const FileNotifyInfo &)>)
+{
+	return -1;
+}
+
+void PackFilesystem::poll_notifications()
+{
+}
+
+void PackFilesystem::uninstall_notification(FileNotifyHandle)
+{
+}
+}
@@ -0,0 +1,109 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "filesystem.hpp"
+#include <stdint.h>
+
+namespace Granite
+{
+// On-disk layout of a pack archive, shared with tools/pack_archive.cpp.
+// Header, then file data with each entry aligned, then the index sorted by path, then the path string table.
+namespace Pack
+{
+static const uint64_t Magic = 0x4b4341504e415247ull; // "GRANPACK" little-endian.
+static const uint32_t Version = 1;
+
+enum class Compression : uint32_t
+{
+	None = 0,
+	LZ4 = 1
+};
+
+struct Header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t entry_count;
+	uint64_t index_offset;
+	uint64_t string_offset;
+	uint64_t string_size;
+	uint64_t reserved;
+};
+
+struct Entry
+{
+	uint64_t offset;
+	uint64_t stored_size;
+	uint64_t size;
+	uint64_t last_modified;
+	uint32_t path_offset;
+	uint32_t path_length;
+	Compression compression;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(Header) == 48, "Unexpected pack header size.");
+static_assert(sizeof(Entry) == 48, "Unexpected pack entry size.");
+}
+
+// Read-only backend serving every file out of a single archive, which is mapped once.
+// Uncompressed entries are returned as views into that mapping, compressed entries are decoded on first map().
+class PackFilesystem : public FilesystemBackend
+{
+public:
+	// Returns nullptr if the archive is malformed.
+	static std::unique_ptr<PackFilesystem> create(std::unique_ptr<File> archive);
+
+	std::vector<ListEntry> list(const std::string &path) override;
+
+	std::unique_ptr<File> open(const std::string &path, FileMode mode = FileMode::ReadOnly) override;
+
+	bool stat(const std::string &path, FileStat &stat) override;
+
+	FileNotifyHandle install_notification(const std::string &path, std::function<void(const FileNotifyInfo &)> func) override;
+
+	void uninstall_notification(FileNotifyHandle handle) override;
+
+	void poll_notifications() override;
+
+	int get_notification_fd() const override;
+
+private:
+	PackFilesystem() = default;
+	bool init(std::unique_ptr<File> archive);
+
+	std::shared_ptr<File> archive;
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	const Pack::Entry *entries = nullptr;
+	uint32_t entry_count = 0;
+	const char *strings = nullptr;
+
+	int compare(const Pack::Entry &entry, const std::string &path) const;
+	const Pack::Entry *lower_bound(const std::string &path) const;
+	const Pack::Entry *find(const std::string &path) const;
+	bool has_prefix(const Pack::Entry &entry, const std::string &prefix) const;
+};
+}
@@ -26,6 +26,7 @@
 #include <stdexcept>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <io.h>
 
 using namespace std;
 
@@ -385,6 +386,20 @@ bool OSFilesystem::stat(const std::string &path, FileStat &stat)
 	return true;
 }
 
+bool OSFilesystem::remove(const std::string &path)
+{
+	auto joined = Path::join(base, path);
+	return _wunlink(Path::to_utf16(joined).c_str()) == 0;
+}
+
+bool OSFilesystem::move_replace(const std::string &dst, const std::string &src)
+{
+	auto joined_dst = Path::join(base, dst);
+	auto joined_src = Path::join(base, src);
+	return MoveFileExW(Path::to_utf16(joined_src).c_str(), Path::to_utf16(joined_dst).c_str(),
+	                   MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
 int OSFilesystem::get_notification_fd() const
 {
 	return -1;
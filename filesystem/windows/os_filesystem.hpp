@@ -56,6 +56,8 @@ public:
 	std::vector<ListEntry> list(const std::string &path) override;
 	std::unique_ptr<File> open(const std::string &path, FileMode mode) override;
 	bool stat(const std::string &path, FileStat &stat) override;
+	bool remove(const std::string &path) override;
+	bool move_replace(const std::string &dst, const std::string &src) override;
 	FileNotifyHandle install_notification(const std::string &path, std::function<void (const FileNotifyInfo &)> func) override;
 	void uninstall_notification(FileNotifyHandle handle) override;
 	void poll_notifications() override;
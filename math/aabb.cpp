@@ -53,4 +53,10 @@ void AABB::expand(const AABB &aabb)
 	maximum.v3 = max(maximum.v3, aabb.maximum.v3);
 }
 
+bool AABB::intersects(const AABB &aabb) const
+{
+	return all(lessThanEqual(minimum.v3, aabb.maximum.v3)) &&
+	       all(lessThanEqual(aabb.minimum.v3, maximum.v3));
+}
+
 }
\ No newline at end of file
@@ -42,6 +42,7 @@ public:
 	AABB transform(const mat4 &m) const;
 
 	void expand(const AABB &aabb);
+	bool intersects(const AABB &aabb) const;
 
 	const vec3 &get_minimum() const
 	{
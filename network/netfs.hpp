@@ -28,8 +28,10 @@
 #else
 #include <arpa/inet.h>
 #endif
+#include <stdint.h>
 #include <string.h>
 #include <string>
+#include "hash.hpp"
 
 namespace Granite
 {
@@ -45,13 +47,66 @@ enum NetFSCommand
 	NETFS_UNREGISTER_NOTIFICATION = 8,
 	NETFS_BEGIN_CHUNK_REQUEST = 9,
 	NETFS_BEGIN_CHUNK_REPLY = 10,
-	NETFS_BEGIN_CHUNK_NOTIFICATION = 11
+	NETFS_BEGIN_CHUNK_NOTIFICATION = 11,
+	NETFS_READ_FILE_RANGE = 12,
+
+	// Switches the connection to the multiplexed protocol, see below.
+	NETFS_MUX = 13,
+	NETFS_MUX_REPLY = 14,
+	NETFS_MUX_DATA = 15,
+
+	// Like NETFS_WALK, with stat information for every entry, so clients need no stat round trip per file.
+	NETFS_WALK_STAT = 16
 };
 
 enum NetFSError
 {
 	NETFS_ERROR_OK = 0,
-	NETFS_ERROR_IO = 1
+	NETFS_ERROR_IO = 1,
+	// The client already holds the contents with the content hash it sent.
+	NETFS_ERROR_UNCHANGED = 2
+};
+
+// The content hash servers report for a file. Clients use it to verify the copies they keep.
+// 0 means "no hash" on the wire, so it is never returned.
+static inline uint64_t netfs_content_hash(const void *data, size_t size)
+{
+	Util::WordHasher h;
+	h.data(data, size);
+	h.u64(size);
+	uint64_t hash = h.get();
+	return hash ? hash : 1;
+}
+
+// Multiplexed protocol.
+// The client opens with u32 NETFS_MUX, u32 version, u32 capabilities and the server answers with a
+// NETFS_MUX frame holding u32 version, u32 accepted capabilities.
+// After that every message in either direction is a frame:
+//   u32 type, u32 request id, u64 payload size, payload.
+// Requests use the NetFSCommand as type, with these payloads (path takes up the rest of the payload):
+//   NETFS_READ_FILE: u64 known content hash (0 if none), path.
+//   NETFS_READ_FILE_RANGE: u64 offset, u64 size, path.
+//   NETFS_STAT, NETFS_LIST, NETFS_WALK, NETFS_WALK_STAT: path.
+// Each request is answered by one NETFS_MUX_REPLY frame with
+//   u32 NetFSError, u32 NetFSEncoding, u64 decoded size, u64 encoded size, u64 content hash,
+// followed by NETFS_MUX_DATA frames carrying the encoded size worth of data.
+// Data frames of different requests are interleaved, so small replies are not stuck behind large files.
+// The payloads match the legacy one-command-per-connection replies.
+static const uint32_t NETFS_MUX_VERSION = 1;
+static const size_t NETFS_MUX_FRAME_HEADER_SIZE = 16;
+static const size_t NETFS_MUX_REPLY_SIZE = 32;
+static const size_t NETFS_MUX_MAX_DATA_FRAME_SIZE = 256 * 1024;
+static const size_t NETFS_MUX_MAX_REQUEST_SIZE = 64 * 1024;
+
+enum NetFSMuxCapabilityBits
+{
+	NETFS_MUX_CAPABILITY_LZ4 = 1 << 0
+};
+
+enum NetFSEncoding
+{
+	NETFS_ENCODING_RAW = 0,
+	NETFS_ENCODING_LZ4 = 1
 };
 
 enum NetFSNotification
@@ -25,8 +25,12 @@
 #include "netfs.hpp"
 #include "filesystem.hpp"
 #include "event.hpp"
+#include "hash.hpp"
+#include "lz4_block.hpp"
 #include <unordered_set>
+#include <algorithm>
 #include <queue>
+#include <deque>
 
 using namespace Granite;
 using namespace std;
@@ -63,32 +67,29 @@ struct NotificationSystem : EventHandler
 	{
 		EVENT_MANAGER_REGISTER(NotificationSystem, on_filesystem, FilesystemProtocolEvent);
 		for (auto &proto : Global::filesystem()->get_protocols())
-		{
-			auto &fs = proto.second;
-			if (fs->get_notification_fd() >= 0)
-			{
-				auto socket = unique_ptr<Socket>(new Socket(fs->get_notification_fd(), false));
-				auto handler = unique_ptr<FilesystemHandler>(new FilesystemHandler(move(socket), *fs));
-				auto *ptr = handler.get();
-				looper.register_handler(EVENT_IN, move(handler));
-				protocols[proto.first] = ptr;
-			}
-		}
+			add_protocol(proto.first, *proto.second);
 	}
 
 	bool on_filesystem(const FilesystemProtocolEvent &fs)
 	{
-		if (fs.get_backend().get_notification_fd() >= 0)
-		{
-			auto socket = unique_ptr<Socket>(new Socket(fs.get_backend().get_notification_fd(), false));
-			auto handler = unique_ptr<FilesystemHandler>(new FilesystemHandler(move(socket), fs.get_backend()));
-			auto *ptr = handler.get();
-			looper.register_handler(EVENT_IN, move(handler));
-			protocols[fs.get_protocol()] = ptr;
-		}
+		add_protocol(fs.get_protocol(), fs.get_backend());
 		return true;
 	}
 
+	// The filesystem may be created lazily by the loop above, in which case its protocols are
+	// also seen through on_filesystem(). Watching the same notification fd twice fails.
+	void add_protocol(const string &protocol, FilesystemBackend &backend)
+	{
+		if (backend.get_notification_fd() < 0 || protocols.count(protocol))
+			return;
+
+		auto socket = unique_ptr<Socket>(new Socket(backend.get_notification_fd(), false));
+		auto handler = unique_ptr<FilesystemHandler>(new FilesystemHandler(move(socket), backend));
+		auto *ptr = handler.get();
+		if (looper.register_handler(EVENT_IN, move(handler)))
+			protocols[protocol] = ptr;
+	}
+
 	void uninstall_all_notifications(FSHandler *handler)
 	{
 		for (auto &proto : protocols)
@@ -117,10 +118,107 @@ struct NotificationSystem : EventHandler
 	std::unordered_map<std::string, FilesystemHandler *> protocols;
 };
 
+static void encode_list(ReplyBuilder &builder, const vector<ListEntry> &list)
+{
+	builder.add_u32(list.size());
+	for (auto &l : list)
+	{
+		builder.add_string(l.path);
+		switch (l.type)
+		{
+		case PathType::File:
+			builder.add_u32(NETFS_FILE_TYPE_PLAIN);
+			break;
+		case PathType::Directory:
+			builder.add_u32(NETFS_FILE_TYPE_DIRECTORY);
+			break;
+		case PathType::Special:
+			builder.add_u32(NETFS_FILE_TYPE_SPECIAL);
+			break;
+		}
+	}
+}
+
+static void encode_stat(ReplyBuilder &builder, const FileStat &s)
+{
+	builder.add_u64(s.size);
+	switch (s.type)
+	{
+	case PathType::File:
+		builder.add_u32(NETFS_FILE_TYPE_PLAIN);
+		break;
+	case PathType::Directory:
+		builder.add_u32(NETFS_FILE_TYPE_DIRECTORY);
+		break;
+	case PathType::Special:
+		builder.add_u32(NETFS_FILE_TYPE_SPECIAL);
+		break;
+	}
+	builder.add_u64(s.last_modified);
+}
+
+// Same as encode_list(), with each entry's type replaced by the full stat reply.
+static void encode_walk_stat(ReplyBuilder &builder, const vector<WalkEntry> &list)
+{
+	builder.add_u32(list.size());
+	for (auto &l : list)
+	{
+		builder.add_string(l.path);
+		encode_stat(builder, l.stat);
+	}
+}
+
+// Content hashes are only recomputed when a file changes size or modification time,
+// so clients asking about files they already hold cost a stat rather than a full read.
+struct ContentHashCache
+{
+	uint64_t get(const string &path, const void *data, size_t size)
+	{
+		FileStat s;
+		bool has_stat = Global::filesystem()->stat(path, s);
+
+		if (has_stat)
+		{
+			auto itr = entries.find(path);
+			if (itr != end(entries) && itr->second.size == s.size && itr->second.last_modified == s.last_modified)
+				return itr->second.hash;
+		}
+
+		uint64_t hash = netfs_content_hash(data, size);
+		if (has_stat)
+			entries[path] = { s.size, s.last_modified, hash };
+		return hash;
+	}
+
+	struct Entry
+	{
+		uint64_t size;
+		uint64_t last_modified;
+		uint64_t hash;
+	};
+	unordered_map<string, Entry> entries;
+};
+
+struct MuxReply
+{
+	// The first frame written, either the NETFS_MUX_REPLY frame or the handshake reply.
+	ReplyBuilder header;
+
+	// The data is either a mapping of file or owned by payload.
+	unique_ptr<File> file;
+	vector<uint8_t> payload;
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	uint32_t id = 0;
+	size_t offset = 0;
+	bool sent_header = false;
+};
+
 struct FSHandler : LooperHandler
 {
-	FSHandler(NotificationSystem &notify_system_, unique_ptr<Socket> socket_)
-		: LooperHandler(move(socket_)), notify_system(notify_system_)
+	FSHandler(NotificationSystem &notify_system_, ContentHashCache &hash_cache_, unique_ptr<Socket> socket_)
+		: LooperHandler(move(socket_)), notify_system(notify_system_), hash_cache(hash_cache_)
 	{
 		reply_builder.begin(4);
 		command_reader.start(reply_builder.get_buffer());
@@ -175,8 +273,10 @@ struct FSHandler : LooperHandler
 		switch (command_id)
 		{
 		case NETFS_WALK:
+		case NETFS_WALK_STAT:
 		case NETFS_LIST:
 		case NETFS_READ_FILE:
+		case NETFS_READ_FILE_RANGE:
 		case NETFS_WRITE_FILE:
 		case NETFS_STAT:
 		case NETFS_NOTIFICATION:
@@ -185,6 +285,12 @@ struct FSHandler : LooperHandler
 			command_reader.start(reply_builder.get_buffer());
 			return true;
 
+		case NETFS_MUX:
+			state = ReadMuxHandshake;
+			reply_builder.begin(2 * sizeof(uint32_t));
+			command_reader.start(reply_builder.get_buffer());
+			return true;
+
 		default:
 			return false;
 		}
@@ -308,9 +414,10 @@ struct FSHandler : LooperHandler
 		reply_builder.begin();
 		if (mapped)
 		{
+			mapped_size = file->get_size();
 			reply_builder.add_u32(NETFS_BEGIN_CHUNK_REPLY);
 			reply_builder.add_u32(NETFS_ERROR_OK);
-			reply_builder.add_u64(file->get_size());
+			reply_builder.add_u64(mapped_size);
 		}
 		else
 		{
@@ -322,29 +429,43 @@ struct FSHandler : LooperHandler
 		return true;
 	}
 
+	bool begin_read_file_range(const string &arg, uint64_t offset, uint64_t size)
+	{
+		file = Global::filesystem()->open(arg);
+		mapped = nullptr;
+		mapped_size = 0;
+
+		// Only the requested range is mapped, the rest of the file is never touched.
+		if (file && offset < file->get_size())
+		{
+			mapped_size = size_t(std::min<uint64_t>(size, file->get_size() - offset));
+			mapped = file->map_range(offset, mapped_size);
+		}
+
+		reply_builder.begin();
+		reply_builder.add_u32(NETFS_BEGIN_CHUNK_REPLY);
+		if (mapped && mapped_size)
+		{
+			reply_builder.add_u32(NETFS_ERROR_OK);
+			reply_builder.add_u64(mapped_size);
+		}
+		else
+		{
+			mapped = nullptr;
+			reply_builder.add_u32(NETFS_ERROR_IO);
+			reply_builder.add_u64(0);
+		}
+		command_writer.start(reply_builder.get_buffer());
+		return true;
+	}
+
 	void write_string_list(const vector<ListEntry> &list)
 	{
 		reply_builder.begin();
 		reply_builder.add_u32(NETFS_BEGIN_CHUNK_REPLY);
 		reply_builder.add_u32(NETFS_ERROR_OK);
 		auto offset = reply_builder.add_u64(0);
-		reply_builder.add_u32(list.size());
-		for (auto &l : list)
-		{
-			reply_builder.add_string(l.path);
-			switch (l.type)
-			{
-			case PathType::File:
-				reply_builder.add_u32(NETFS_FILE_TYPE_PLAIN);
-				break;
-			case PathType::Directory:
-				reply_builder.add_u32(NETFS_FILE_TYPE_DIRECTORY);
-				break;
-			case PathType::Special:
-				reply_builder.add_u32(NETFS_FILE_TYPE_SPECIAL);
-				break;
-			}
-		}
+		encode_list(reply_builder, list);
 		reply_builder.poke_u64(offset, reply_builder.get_buffer().size() - (offset + 8));
 		command_writer.start(reply_builder.get_buffer());
 	}
@@ -358,20 +479,7 @@ struct FSHandler : LooperHandler
 		{
 			reply_builder.add_u32(NETFS_ERROR_OK);
 			reply_builder.add_u64(8 + 4 + 8);
-			reply_builder.add_u64(s.size);
-			switch (s.type)
-			{
-			case PathType::File:
-				reply_builder.add_u32(NETFS_FILE_TYPE_PLAIN);
-				break;
-			case PathType::Directory:
-				reply_builder.add_u32(NETFS_FILE_TYPE_DIRECTORY);
-				break;
-			case PathType::Special:
-				reply_builder.add_u32(NETFS_FILE_TYPE_SPECIAL);
-				break;
-			}
-			reply_builder.add_u64(s.last_modified);
+			encode_stat(reply_builder, s);
 		}
 		else
 		{
@@ -396,11 +504,32 @@ struct FSHandler : LooperHandler
 		return true;
 	}
 
+	bool begin_walk_stat(const string &arg)
+	{
+		auto list = Global::filesystem()->walk_stat(arg);
+		reply_builder.begin();
+		reply_builder.add_u32(NETFS_BEGIN_CHUNK_REPLY);
+		reply_builder.add_u32(NETFS_ERROR_OK);
+		auto offset = reply_builder.add_u64(0);
+		encode_walk_stat(reply_builder, list);
+		reply_builder.poke_u64(offset, reply_builder.get_buffer().size() - (offset + 8));
+		command_writer.start(reply_builder.get_buffer());
+		return true;
+	}
+
 	bool read_chunk_data(Looper &looper)
 	{
 		auto ret = command_reader.process(*socket);
 		if (command_reader.complete())
 		{
+			uint64_t range_offset = 0;
+			uint64_t range_size = 0;
+			if (command_id == NETFS_READ_FILE_RANGE)
+			{
+				range_offset = reply_builder.read_u64();
+				range_size = reply_builder.read_u64();
+			}
+
 			auto str = reply_builder.read_string_implicit_count();
 
 			switch (command_id)
@@ -411,6 +540,12 @@ struct FSHandler : LooperHandler
 				begin_read_file(str);
 				break;
 
+			case NETFS_READ_FILE_RANGE:
+				looper.modify_handler(EVENT_OUT, *this);
+				state = WriteReplyChunk;
+				begin_read_file_range(str, range_offset, range_size);
+				break;
+
 			case NETFS_WRITE_FILE:
 				begin_write_file(looper, str);
 				break;
@@ -433,6 +568,12 @@ struct FSHandler : LooperHandler
 				begin_walk(str);
 				break;
 
+			case NETFS_WALK_STAT:
+				looper.modify_handler(EVENT_OUT, *this);
+				state = WriteReplyChunk;
+				begin_walk_stat(str);
+				break;
+
 			case NETFS_NOTIFICATION:
 				protocol = move(str);
 				looper.modify_handler(EVENT_IN, *this);
@@ -468,9 +609,10 @@ struct FSHandler : LooperHandler
 			switch (command_id)
 			{
 			case NETFS_READ_FILE:
+			case NETFS_READ_FILE_RANGE:
 				if (mapped)
 				{
-					command_writer.start(mapped, file->get_size());
+					command_writer.start(mapped, mapped_size);
 					state = WriteReplyData;
 					return true;
 				}
@@ -551,6 +693,280 @@ struct FSHandler : LooperHandler
 		return (ret > 0) || (ret == Socket::ErrorWouldBlock);
 	}
 
+	bool read_mux_handshake(Looper &looper)
+	{
+		auto ret = command_reader.process(*socket);
+		if (command_reader.complete())
+		{
+			uint32_t version = reply_builder.read_u32();
+			uint32_t capabilities = reply_builder.read_u32();
+			if (version != NETFS_MUX_VERSION)
+			{
+				LOGE("Unsupported NetFS mux version %u.\n", version);
+				return false;
+			}
+
+			mux_capabilities = capabilities & NETFS_MUX_CAPABILITY_LZ4;
+
+			auto reply = unique_ptr<MuxReply>(new MuxReply);
+			reply->header.add_u32(NETFS_MUX);
+			reply->header.add_u32(0);
+			reply->header.add_u64(2 * sizeof(uint32_t));
+			reply->header.add_u32(NETFS_MUX_VERSION);
+			reply->header.add_u32(mux_capabilities);
+			mux_replies.push_back(move(reply));
+
+			begin_mux_frame_header();
+			state = MuxLoop;
+			looper.modify_handler(EVENT_IN | EVENT_OUT, *this);
+			return true;
+		}
+
+		return (ret > 0) || (ret == Socket::ErrorWouldBlock);
+	}
+
+	void begin_mux_frame_header()
+	{
+		reply_builder.begin(NETFS_MUX_FRAME_HEADER_SIZE);
+		command_reader.start(reply_builder.get_buffer());
+		mux_reading_payload = false;
+	}
+
+	void compress_mux_reply(MuxReply &reply, uint32_t &encoding)
+	{
+		// Not worth it for tiny files, and incompressible data is sent as-is.
+		if (!(mux_capabilities & NETFS_MUX_CAPABILITY_LZ4) || reply.size < 4096)
+			return;
+
+		vector<uint8_t> compressed(Util::lz4_compress_bound(reply.size));
+		size_t compressed_size = Util::lz4_compress(compressed.data(), compressed.size(), reply.data, reply.size);
+		if (!compressed_size || compressed_size > reply.size - reply.size / 8)
+			return;
+
+		compressed.resize(compressed_size);
+		reply.payload = move(compressed);
+		reply.data = reply.payload.data();
+		reply.size = reply.payload.size();
+		reply.file.reset();
+		encoding = NETFS_ENCODING_LZ4;
+	}
+
+	void handle_mux_request(uint32_t type, uint32_t id)
+	{
+		auto reply = unique_ptr<MuxReply>(new MuxReply);
+		reply->id = id;
+
+		NetFSError error = NETFS_ERROR_OK;
+		uint32_t encoding = NETFS_ENCODING_RAW;
+		uint64_t decoded_size = 0;
+		uint64_t hash = 0;
+		ReplyBuilder builder;
+
+		switch (type)
+		{
+		case NETFS_READ_FILE:
+		{
+			uint64_t known_hash = reply_builder.read_u64();
+			auto path = reply_builder.read_string_implicit_count();
+			reply->file = Global::filesystem()->open(path);
+			const void *mapped_data = reply->file ? reply->file->map() : nullptr;
+			if (mapped_data)
+			{
+				decoded_size = reply->file->get_size();
+				hash = hash_cache.get(path, mapped_data, decoded_size);
+				if (known_hash && known_hash == hash)
+				{
+					error = NETFS_ERROR_UNCHANGED;
+					decoded_size = 0;
+					reply->file.reset();
+				}
+				else
+				{
+					reply->data = static_cast<const uint8_t *>(mapped_data);
+					reply->size = decoded_size;
+				}
+			}
+			else
+				error = NETFS_ERROR_IO;
+			break;
+		}
+
+		case NETFS_READ_FILE_RANGE:
+		{
+			uint64_t offset = reply_builder.read_u64();
+			uint64_t size = reply_builder.read_u64();
+			auto path = reply_builder.read_string_implicit_count();
+			reply->file = Global::filesystem()->open(path);
+			if (reply->file && offset < reply->file->get_size())
+			{
+				decoded_size = std::min<uint64_t>(size, reply->file->get_size() - offset);
+				reply->data = static_cast<const uint8_t *>(reply->file->map_range(offset, decoded_size));
+				reply->size = decoded_size;
+			}
+
+			if (!reply->data || !decoded_size)
+			{
+				error = NETFS_ERROR_IO;
+				decoded_size = 0;
+				reply->data = nullptr;
+				reply->size = 0;
+			}
+			break;
+		}
+
+		case NETFS_STAT:
+		{
+			FileStat s;
+			if (Global::filesystem()->stat(reply_builder.read_string_implicit_count(), s))
+				encode_stat(builder, s);
+			else
+				error = NETFS_ERROR_IO;
+			break;
+		}
+
+		case NETFS_LIST:
+			encode_list(builder, Global::filesystem()->list(reply_builder.read_string_implicit_count()));
+			break;
+
+		case NETFS_WALK:
+			encode_list(builder, Global::filesystem()->walk(reply_builder.read_string_implicit_count()));
+			break;
+
+		case NETFS_WALK_STAT:
+			encode_walk_stat(builder, Global::filesystem()->walk_stat(reply_builder.read_string_implicit_count()));
+			break;
+
+		default:
+			LOGE("Unsupported NetFS mux request %u.\n", type);
+			error = NETFS_ERROR_IO;
+			break;
+		}
+
+		if (!builder.get_buffer().empty())
+		{
+			reply->payload = move(builder.get_buffer());
+			reply->data = reply->payload.data();
+			reply->size = reply->payload.size();
+			decoded_size = reply->size;
+		}
+
+		// Walks of large trees repeat the same directory prefixes over and over, they compress as well as files do.
+		if (error == NETFS_ERROR_OK)
+			compress_mux_reply(*reply, encoding);
+
+		reply->header.add_u32(NETFS_MUX_REPLY);
+		reply->header.add_u32(id);
+		reply->header.add_u64(NETFS_MUX_REPLY_SIZE);
+		reply->header.add_u32(error);
+		reply->header.add_u32(encoding);
+		reply->header.add_u64(decoded_size);
+		reply->header.add_u64(reply->size);
+		reply->header.add_u64(hash);
+		mux_replies.push_back(move(reply));
+	}
+
+	bool read_mux_request()
+	{
+		auto ret = command_reader.process(*socket);
+		if (!command_reader.complete())
+			return (ret > 0) || (ret == Socket::ErrorWouldBlock);
+
+		if (!mux_reading_payload)
+		{
+			mux_request_type = reply_builder.read_u32();
+			mux_request_id = reply_builder.read_u32();
+			uint64_t size = reply_builder.read_u64();
+			if (!size || size > NETFS_MUX_MAX_REQUEST_SIZE)
+			{
+				LOGE("Invalid NetFS mux request size.\n");
+				return false;
+			}
+
+			reply_builder.begin(size);
+			command_reader.start(reply_builder.get_buffer());
+			mux_reading_payload = true;
+		}
+		else
+		{
+			handle_mux_request(mux_request_type, mux_request_id);
+			begin_mux_frame_header();
+		}
+
+		return true;
+	}
+
+	bool write_mux_replies(Looper &looper)
+	{
+		for (;;)
+		{
+			if (!mux_current)
+			{
+				if (mux_replies.empty())
+				{
+					looper.modify_handler(EVENT_IN, *this);
+					return true;
+				}
+
+				// Round-robin one frame at a time between replies.
+				mux_current = move(mux_replies.front());
+				mux_replies.pop_front();
+
+				if (!mux_current->sent_header)
+				{
+					mux_chunk_size = 0;
+					mux_header_writer.start(mux_current->header.get_buffer());
+				}
+				else
+				{
+					mux_chunk_size = std::min(NETFS_MUX_MAX_DATA_FRAME_SIZE, mux_current->size - mux_current->offset);
+					mux_frame.begin();
+					mux_frame.add_u32(NETFS_MUX_DATA);
+					mux_frame.add_u32(mux_current->id);
+					mux_frame.add_u64(mux_chunk_size);
+					mux_header_writer.start(mux_frame.get_buffer());
+					mux_data_writer.start(mux_current->data + mux_current->offset, mux_chunk_size);
+				}
+			}
+
+			int ret = 0;
+			if (!mux_header_writer.complete())
+				ret = mux_header_writer.process(*socket);
+			if (mux_header_writer.complete() && mux_chunk_size && !mux_data_writer.complete())
+				ret = mux_data_writer.process(*socket);
+
+			if (mux_header_writer.complete() && (!mux_chunk_size || mux_data_writer.complete()))
+			{
+				mux_current->offset += mux_chunk_size;
+				mux_current->sent_header = true;
+				if (mux_current->offset < mux_current->size)
+					mux_replies.push_back(move(mux_current));
+				mux_current.reset();
+			}
+			else if (ret == Socket::ErrorWouldBlock)
+				return true;
+			else if (ret <= 0)
+				return false;
+		}
+	}
+
+	bool mux_loop(Looper &looper, EventFlags flags)
+	{
+		if (flags & EVENT_IN)
+		{
+			bool had_replies = mux_current || !mux_replies.empty();
+			if (!read_mux_request())
+				return false;
+
+			if (!had_replies && !mux_replies.empty())
+				looper.modify_handler(EVENT_IN | EVENT_OUT, *this);
+		}
+
+		if (flags & EVENT_OUT)
+			return write_mux_replies(looper);
+
+		return true;
+	}
+
 	void modify_looper(Looper &looper)
 	{
 		uint32_t mask = reply_queue.empty() ? EVENT_IN : (EVENT_IN | EVENT_OUT);
@@ -640,6 +1056,10 @@ struct FSHandler : LooperHandler
 			return notification_loop_register_notification(looper);
 		else if (state == NotificationLoopUnregister)
 			return notification_loop_unregister_notification(looper);
+		else if (state == ReadMuxHandshake)
+			return read_mux_handshake(looper);
+		else if (state == MuxLoop)
+			return mux_loop(looper, flags);
 		else
 			return false;
 	}
@@ -655,10 +1075,13 @@ struct FSHandler : LooperHandler
 		WriteReplyData,
 		NotificationLoop,
 		NotificationLoopRegister,
-		NotificationLoopUnregister
+		NotificationLoopUnregister,
+		ReadMuxHandshake,
+		MuxLoop
 	};
 
 	NotificationSystem &notify_system;
+	ContentHashCache &hash_cache;
 	State state = ReadCommand;
 	SocketReader command_reader;
 	SocketWriter command_writer;
@@ -675,8 +1098,20 @@ struct FSHandler : LooperHandler
 
 	unique_ptr<File> file;
 	void *mapped = nullptr;
+	size_t mapped_size = 0;
 
 	bool is_notify_fs = false;
+
+	uint32_t mux_capabilities = 0;
+	uint32_t mux_request_type = 0;
+	uint32_t mux_request_id = 0;
+	bool mux_reading_payload = false;
+	deque<unique_ptr<MuxReply>> mux_replies;
+	unique_ptr<MuxReply> mux_current;
+	size_t mux_chunk_size = 0;
+	ReplyBuilder mux_frame;
+	SocketWriter mux_header_writer;
+	SocketWriter mux_data_writer;
 };
 
 FileNotifyHandle FilesystemHandler::install_notification(const std::string &path, FSHandler *handler)
@@ -720,11 +1155,12 @@ struct ListenerHandler : TCPListener
 	{
 		auto client = accept();
 		if (client)
-			looper.register_handler(EVENT_IN, unique_ptr<FSHandler>(new FSHandler(notify_system, move(client))));
+			looper.register_handler(EVENT_IN, unique_ptr<FSHandler>(new FSHandler(notify_system, hash_cache, move(client))));
 		return true;
 	}
 
 	NotificationSystem &notify_system;
+	ContentHashCache hash_cache;
 };
 
 int main()
@@ -27,6 +27,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -123,6 +125,10 @@ unique_ptr<Socket> Socket::connect(const char *addr, uint16_t port)
 		return {};
 	}
 
+	// Requests are small and latency bound.
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
 	return unique_ptr<Socket>(new Socket(fd));
 #else
 	return {};
@@ -50,6 +50,8 @@ TCPListener::TCPListener(uint16_t port)
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -83,6 +85,10 @@ unique_ptr<Socket> TCPListener::accept()
 		return {};
 	}
 
+	// Replies are written as a small header followed by data, don't let Nagle hold back the tail.
+	int one = 1;
+	setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
 	return unique_ptr<Socket>(new Socket(new_fd));
 }
 
@@ -298,6 +298,18 @@ static uint32_t reassign_indices_legacy(T &type)
 	return partial_mask;
 }
 
+bool LightClusterer::light_static_shadow_invalidated(const RenderInfoComponent *info) const
+{
+	if (!info)
+		return false;
+
+	for (auto &aabb : scene->get_static_shadow_invalidations())
+		if (info->world_aabb.intersects(aabb))
+			return true;
+
+	return false;
+}
+
 void LightClusterer::render_shadow(Vulkan::CommandBuffer &cmd, RenderContext &depth_context, VisibilityList &visible,
                                    unsigned off_x, unsigned off_y, unsigned res_x, unsigned res_y,
                                    const Vulkan::ImageView &rt, unsigned layer, Renderer::RendererFlushFlags flags)
@@ -433,6 +445,11 @@ void LightClusterer::render_atlas_point(RenderContext &context_)
 	bool vsm = shadow_type == ShadowType::VSM;
 	uint32_t partial_mask = reassign_indices_legacy(legacy.points);
 
+	// Cached shadows are only valid as long as no static caster moved inside the light volume.
+	for (unsigned i = 0; i < legacy.points.count; i++)
+		if (light_static_shadow_invalidated(legacy.points.infos[i]))
+			partial_mask |= 1u << i;
+
 	if (!legacy.points.atlas || force_update_shadows)
 		partial_mask = ~0u;
 
@@ -648,7 +665,7 @@ void LightClusterer::begin_bindless_barriers(Vulkan::CommandBuffer &cmd)
 		                                                  (point ? 6 : 1) *
 		                                                  (vsm ? 8 : 2));
 
-		if (image && !force_update_shadows)
+		if (image && !force_update_shadows && !light_static_shadow_invalidated(bindless.infos[i]))
 			continue;
 
 		if (!image)
@@ -780,6 +797,11 @@ void LightClusterer::render_atlas_spot(RenderContext &context_)
 	bool vsm = shadow_type == ShadowType::VSM;
 	uint32_t partial_mask = reassign_indices_legacy(legacy.spots);
 
+	// Cached shadows are only valid as long as no static caster moved inside the light volume.
+	for (unsigned i = 0; i < legacy.spots.count; i++)
+		if (light_static_shadow_invalidated(legacy.spots.infos[i]))
+			partial_mask |= 1u << i;
+
 	if (!legacy.spots.atlas || force_update_shadows)
 		partial_mask = ~0u;
 
@@ -909,6 +931,7 @@ void LightClusterer::refresh_legacy(RenderContext& context_)
 			{
 				legacy.spots.lights[legacy.spots.count] = spot.get_shader_info(transform->transform->world_transform);
 				legacy.spots.handles[legacy.spots.count] = &spot;
+				legacy.spots.infos[legacy.spots.count] = transform;
 				legacy.spots.count++;
 			}
 		}
@@ -920,6 +943,7 @@ void LightClusterer::refresh_legacy(RenderContext& context_)
 			{
 				legacy.points.lights[legacy.points.count] = point.get_shader_info(transform->transform->world_transform);
 				legacy.points.handles[legacy.points.count] = &point;
+				legacy.points.infos[legacy.points.count] = transform;
 				legacy.points.count++;
 			}
 		}
@@ -985,6 +1009,7 @@ void LightClusterer::refresh_bindless(RenderContext &context_)
 				bindless.transforms.lights[index] = spot.get_shader_info(transform->transform->world_transform);
 				bindless.transforms.model[index] = spot.build_model_matrix(transform->transform->world_transform);
 				bindless.handles[index] = &l;
+				bindless.infos[index] = transform;
 				index++;
 			}
 		}
@@ -999,6 +1024,7 @@ void LightClusterer::refresh_bindless(RenderContext &context_)
 				                                           1.0f / bindless.transforms.lights[index].inv_radius);
 				bindless.transforms.type_mask[index >> 5] |= 1u << (index & 31u);
 				bindless.handles[index] = &l;
+				bindless.infos[index] = transform;
 				index++;
 			}
 		}
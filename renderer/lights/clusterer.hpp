@@ -127,6 +127,7 @@ private:
 		{
 			PositionalFragmentInfo lights[MaxLights] = {};
 			PointLight *handles[MaxLights] = {};
+			const RenderInfoComponent *infos[MaxLights] = {};
 			PointTransform shadow_transforms[MaxLights] = {};
 			vec4 model_transforms[MaxLights] = {};
 			unsigned cookie[MaxLights] = {};
@@ -139,6 +140,7 @@ private:
 		{
 			PositionalFragmentInfo lights[MaxLights] = {};
 			SpotLight *handles[MaxLights] = {};
+			const RenderInfoComponent *infos[MaxLights] = {};
 			mat4 shadow_transforms[MaxLights] = {};
 			unsigned cookie[MaxLights] = {};
 			unsigned count = 0;
@@ -168,6 +170,7 @@ private:
 	bool enable_bindless = false;
 	bool force_update_shadows = false;
 	ShadowType shadow_type = ShadowType::PCF;
+	bool light_static_shadow_invalidated(const RenderInfoComponent *info) const;
 
 	struct CPUGlobalAccelState
 	{
@@ -212,6 +215,7 @@ private:
 		ClustererParametersBindless parameters;
 		ClustererBindlessTransforms transforms;
 		PositionalLight *handles[MaxLightsBindless] = {};
+		const RenderInfoComponent *infos[MaxLightsBindless] = {};
 
 		Vulkan::BindlessDescriptorPoolHandle descriptor_pool;
 		Util::LRUCache<Vulkan::ImageHandle> shadow_map_cache;
@@ -31,6 +31,29 @@ using namespace Vulkan;
 
 namespace Granite
 {
+// Feeds texture streaming with the fraction of the screen height the mesh covers.
+static void request_material_residency(const RenderContext &context, const Material &material, const AABB &aabb)
+{
+	auto &params = context.get_render_parameters();
+	float radius = aabb.get_radius();
+	float coverage;
+
+	if (params.projection[2][3] == 0.0f)
+	{
+		// Orthographic, size does not depend on distance.
+		coverage = radius * params.projection[1][1];
+	}
+	else
+	{
+		float dist = std::max(distance(aabb.get_center(), params.camera_position) - radius, params.z_near);
+		coverage = radius * params.projection[1][1] / dist;
+	}
+
+	for (auto *texture : material.textures)
+		if (texture)
+			texture->request_screen_coverage(coverage);
+}
+
 Hash StaticMesh::get_instance_key() const
 {
 	Hasher h;
@@ -242,6 +265,7 @@ void StaticMesh::get_render_info(const RenderContext &context, const RenderInfoC
 
 	auto instance_key = get_baked_instance_key();
 	auto sorting_key = RenderInfo::get_sort_key(context, type, pipe_hash, h.get(), transform->world_aabb.get_center());
+	request_material_residency(context, *material, transform->world_aabb);
 
 	auto *t = transform->transform;
 	auto *instance_data = queue.allocate_one<StaticMeshInstanceInfo>();
@@ -294,6 +318,7 @@ void SkinnedMesh::get_render_info(const RenderContext &context, const RenderInfo
 
 	auto instance_key = get_baked_instance_key() ^ 1;
 	auto sorting_key = RenderInfo::get_sort_key(context, type, pipe_hash, h.get(), transform->world_aabb.get_center());
+	request_material_residency(context, *material, transform->world_aabb);
 
 	auto *instance_data = queue.allocate_one<SkinnedMeshInstanceInfo>();
 
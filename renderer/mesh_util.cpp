@@ -39,6 +39,11 @@ using namespace Granite::SceneFormats;
 namespace Granite
 {
 ImportedSkinnedMesh::ImportedSkinnedMesh(const Mesh &mesh_, const MaterialInfo &info_)
+	: ImportedSkinnedMesh(mesh_, info_, Util::make_derived_handle<Material, MaterialFile>(info_))
+{
+}
+
+ImportedSkinnedMesh::ImportedSkinnedMesh(const Mesh &mesh_, const MaterialInfo &info_, MaterialHandle material_)
 	: mesh(mesh_), info(info_)
 {
 	topology = mesh.topology;
@@ -52,7 +57,7 @@ ImportedSkinnedMesh::ImportedSkinnedMesh(const Mesh &mesh_, const MaterialInfo &
 	vertex_offset = 0;
 	ibo_offset = 0;
 
-	material = Util::make_derived_handle<Material, MaterialFile>(info);
+	material = std::move(material_);
 	static_aabb = mesh.static_aabb;
 
 	EVENT_MANAGER_REGISTER_LATCH(ImportedSkinnedMesh, on_device_created, on_device_destroyed, DeviceCreatedEvent);
@@ -103,6 +108,11 @@ const SceneFormats::MaterialInfo &ImportedSkinnedMesh::get_material_info() const
 }
 
 ImportedMesh::ImportedMesh(const Mesh &mesh_, const MaterialInfo &info_)
+	: ImportedMesh(mesh_, info_, Util::make_derived_handle<Material, MaterialFile>(info_))
+{
+}
+
+ImportedMesh::ImportedMesh(const Mesh &mesh_, const MaterialInfo &info_, MaterialHandle material_)
 	: mesh(mesh_), info(info_)
 {
 	topology = mesh.topology;
@@ -117,7 +127,7 @@ ImportedMesh::ImportedMesh(const Mesh &mesh_, const MaterialInfo &info_)
 	vertex_offset = 0;
 	ibo_offset = 0;
 
-	material = Util::make_derived_handle<Material, MaterialFile>(info);
+	material = std::move(material_);
 	static_aabb = mesh.static_aabb;
 
 	EVENT_MANAGER_REGISTER_LATCH(ImportedMesh, on_device_created, on_device_destroyed, DeviceCreatedEvent);
@@ -35,6 +35,8 @@ class ImportedMesh : public StaticMesh, public EventHandler
 {
 public:
 	ImportedMesh(const SceneFormats::Mesh &mesh, const SceneFormats::MaterialInfo &info);
+	// Uses an existing material instead of creating one from info, e.g. to share it between primitives.
+	ImportedMesh(const SceneFormats::Mesh &mesh, const SceneFormats::MaterialInfo &info, MaterialHandle material);
 
 	const SceneFormats::Mesh &get_mesh() const;
 	const SceneFormats::MaterialInfo &get_material_info() const;
@@ -51,6 +53,8 @@ class ImportedSkinnedMesh : public SkinnedMesh, public EventHandler
 {
 public:
 	ImportedSkinnedMesh(const SceneFormats::Mesh &mesh, const SceneFormats::MaterialInfo &info);
+	// Uses an existing material instead of creating one from info, e.g. to share it between primitives.
+	ImportedSkinnedMesh(const SceneFormats::Mesh &mesh, const SceneFormats::MaterialInfo &info, MaterialHandle material);
 
 	const SceneFormats::Mesh &get_mesh() const;
 	const SceneFormats::MaterialInfo &get_material_info() const;
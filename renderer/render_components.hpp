@@ -30,6 +30,7 @@
 #include "abstract_renderable.hpp"
 #include "renderer_enums.hpp"
 #include "camera.hpp"
+#include <vector>
 
 namespace Granite
 {
@@ -225,6 +226,17 @@ struct AmbientLightComponent : ComponentBase
 struct CastsStaticShadowComponent : ComponentBase
 {
 	GRANITE_COMPONENT_TYPE_DECL(CastsStaticShadowComponent)
+
+	// Filled in by Scene::update_cached_transforms(). When the caster goes away, with its entity or on its own,
+	// its last world bounds are handed back so cached shadows covering it are invalidated.
+	~CastsStaticShadowComponent()
+	{
+		if (removed_bounds)
+			removed_bounds->push_back(last_world_aabb);
+	}
+
+	std::vector<AABB> *removed_bounds = nullptr;
+	AABB last_world_aabb;
 };
 
 struct CastsDynamicShadowComponent : ComponentBase
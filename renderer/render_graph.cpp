@@ -25,6 +25,12 @@
 #include "format.hpp"
 #include "quirks.hpp"
 #include "muglm/muglm_impl.hpp"
+#include "timer.hpp"
+#include "thread_group.hpp"
+#include "global_managers.hpp"
+#ifdef GRANITE_VULKAN_MT
+#include "thread_id.hpp"
+#endif
 #include <algorithm>
 
 using namespace std;
@@ -326,6 +332,7 @@ RenderGraph::RenderGraph()
 {
 	EVENT_MANAGER_REGISTER_LATCH(RenderGraph, on_swapchain_changed, on_swapchain_destroyed, Vulkan::SwapchainParameterEvent);
 	EVENT_MANAGER_REGISTER_LATCH(RenderGraph, on_device_created, on_device_destroyed, Vulkan::DeviceCreatedEvent);
+	dependency_cache.set_total_cost(MaxDependencyCacheEntries);
 }
 
 void RenderGraph::on_swapchain_destroyed(const Vulkan::SwapchainParameterEvent &)
@@ -1382,6 +1389,23 @@ void RenderGraph::log()
 			     Vulkan::stage_flags_to_string(barrier.stages).c_str());
 		}
 	}
+
+	LOGI("Memory: %.3f MiB allocated, %.3f MiB without aliasing, %.3f MiB peak live, %.3f MiB transient.\n",
+	     memory_stats.allocated / (1024.0 * 1024.0), memory_stats.summed / (1024.0 * 1024.0),
+	     memory_stats.peak / (1024.0 * 1024.0), memory_stats.transient / (1024.0 * 1024.0));
+
+	LOGI("Scheduling: %u hoisted async compute passes, predicted overlap %.3f ms, achieved overlap %.3f ms.\n",
+	     scheduling_stats.hoisted_passes, scheduling_stats.predicted_overlap * 1e3,
+	     scheduling_stats.achieved_overlap * 1e3);
+
+	LOGI("Bake: %.3f ms total (dependencies %s cached).\n", bake_stats.total_ns * 1e-6,
+	     bake_stats.dependency_cache_hit ? "were" : "not");
+	LOGI("  validate: %.3f ms, dependencies: %.3f ms, physical resources: %.3f ms\n",
+	     bake_stats.validate_ns * 1e-6, bake_stats.dependencies_ns * 1e-6, bake_stats.physical_resources_ns * 1e-6);
+	LOGI("  physical passes: %.3f ms, transients: %.3f ms, render pass info: %.3f ms\n",
+	     bake_stats.physical_passes_ns * 1e-6, bake_stats.transients_ns * 1e-6, bake_stats.render_pass_info_ns * 1e-6);
+	LOGI("  barriers: %.3f ms, physical barriers: %.3f ms, aliases: %.3f ms\n",
+	     bake_stats.barriers_ns * 1e-6, bake_stats.physical_barriers_ns * 1e-6, bake_stats.aliases_ns * 1e-6);
 }
 
 void RenderGraph::enqueue_mipmap_requests(Vulkan::CommandBuffer &cmd, const std::vector<MipmapRequests> &requests)
@@ -1559,6 +1583,9 @@ void RenderGraph::build_aliases()
 	for (auto &v : physical_aliases)
 		v = RenderResource::Unused;
 
+	vector<unsigned> alias_candidates;
+	alias_candidates.reserve(physical_dimensions.size());
+
 	for (unsigned i = 0; i < physical_dimensions.size(); i++)
 	{
 		// No aliases for buffers.
@@ -1569,50 +1596,85 @@ void RenderGraph::build_aliases()
 		if (physical_image_has_history[i])
 			continue;
 
-		// Only try to alias with lower-indexed resources, because we allocate them one-by-one starting from index 0.
-		for (unsigned j = 0; j < i; j++)
+		if (!pass_range[i].is_used() || !pass_range[i].can_alias())
+			continue;
+
+		alias_candidates.push_back(i);
+	}
+
+	// Pack images into alias chains with interval coloring.
+	// Visit images in order of first use, and append each one to the first compatible chain
+	// whose most recently appended image is dead by the time this image is first used.
+	// This way, every image in a chain has a lifetime which is disjoint with every other image in the chain,
+	// not just with the first image in the chain.
+	stable_sort(begin(alias_candidates), end(alias_candidates), [&](unsigned a, unsigned b) -> bool {
+		return pass_range[a].first_used_pass() < pass_range[b].first_used_pass();
+	});
+
+	vector<unsigned> chain_heads;
+	for (auto i : alias_candidates)
+	{
+		bool placed = false;
+		for (auto head : chain_heads)
 		{
-			if (physical_image_has_history[j])
+			if (physical_dimensions[i] != physical_dimensions[head])
 				continue;
 
-			if (physical_dimensions[i] == physical_dimensions[j])
-			{
-				// Only alias if the resources are used in the same queue, this way we avoid introducing
-				// multi-queue shenanigans. We can only use events to pass aliasing barriers.
-				// Also, only alias if we have one single queue.
-				bool same_single_queue = physical_dimensions[i].queues == physical_dimensions[j].queues;
-				if ((physical_dimensions[i].queues & (physical_dimensions[i].queues - 1)) != 0)
-					same_single_queue = false;
+			// Only alias if the resources are used in the same queue, this way we avoid introducing
+			// multi-queue shenanigans. We can only use events to pass aliasing barriers.
+			// Also, only alias if we have one single queue.
+			bool same_single_queue = physical_dimensions[i].queues == physical_dimensions[head].queues;
+			if ((physical_dimensions[i].queues & (physical_dimensions[i].queues - 1)) != 0)
+				same_single_queue = false;
+			if (!same_single_queue)
+				continue;
 
-				if (pass_range[i].disjoint_lifetime(pass_range[j]) && same_single_queue)
-				{
-					// We can alias!
-					physical_aliases[i] = j;
-					if (alias_chains[j].empty())
-						alias_chains[j].push_back(j);
-					alias_chains[j].push_back(i);
-
-					// We might have different image usage, propagate this information.
-					auto merged_image_usage =
-							physical_dimensions[j].image_usage |= physical_dimensions[i].image_usage;
-					physical_dimensions[i].image_usage = merged_image_usage;
-					physical_dimensions[j].image_usage = merged_image_usage;
-					break;
-				}
+			auto &chain = alias_chains[head];
+			if (pass_range[chain.back()].last_used_pass() < pass_range[i].first_used_pass())
+			{
+				chain.push_back(i);
+				placed = true;
+				break;
 			}
 		}
+
+		if (!placed)
+		{
+			chain_heads.push_back(i);
+			alias_chains[i].push_back(i);
+		}
+	}
+
+	for (auto head : chain_heads)
+	{
+		auto &chain = alias_chains[head];
+		if (chain.size() < 2)
+			continue;
+
+		// We allocate images one-by-one starting from index 0,
+		// so the lowest-indexed image in the chain must own the memory.
+		unsigned owner = *min_element(begin(chain), end(chain));
+
+		// We might have different image usage, propagate this information.
+		VkImageUsageFlags merged_image_usage = 0;
+		for (auto i : chain)
+			merged_image_usage |= physical_dimensions[i].image_usage;
+
+		for (auto i : chain)
+		{
+			physical_dimensions[i].image_usage = merged_image_usage;
+			if (i != owner)
+				physical_aliases[i] = owner;
+		}
 	}
 
 	// Now we've found the aliases, so set up the transfer barriers in order of use.
+	// Chains are already sorted in order of use.
 	for (auto &chain : alias_chains)
 	{
-		if (chain.empty())
+		if (chain.size() < 2)
 			continue;
 
-		sort(begin(chain), end(chain), [&](unsigned a, unsigned b) -> bool {
-			return pass_range[a].last_used_pass() < pass_range[b].first_used_pass();
-		});
-
 		for (unsigned i = 0; i < chain.size(); i++)
 		{
 			if (i + 1 < chain.size())
@@ -1621,6 +1683,75 @@ void RenderGraph::build_aliases()
 				physical_passes[pass_range[chain[i]].last_used_pass()].alias_transfer.push_back(make_pair(chain[i], chain[0]));
 		}
 	}
+
+	// Unused resources get an empty lifetime.
+	vector<pair<unsigned, unsigned>> lifetimes(physical_dimensions.size(), make_pair(1u, 0u));
+	for (unsigned i = 0; i < physical_dimensions.size(); i++)
+		if (pass_range[i].is_used())
+			lifetimes[i] = make_pair(pass_range[i].first_used_pass(), pass_range[i].last_used_pass());
+	build_memory_statistics(lifetimes);
+}
+
+static VkDeviceSize estimate_resource_size(const ResourceDimensions &dim)
+{
+	if (dim.buffer_info.size)
+		return dim.buffer_info.size;
+
+	VkDeviceSize size = 0;
+	unsigned width = dim.width;
+	unsigned height = dim.height;
+	unsigned depth = dim.depth;
+
+	for (unsigned level = 0; level < dim.levels; level++)
+	{
+		Util::for_each_bit(Vulkan::format_to_aspect_mask(dim.format), [&](uint32_t bit) {
+			size += Vulkan::format_get_layer_size(dim.format, 1u << bit, width, height, depth);
+		});
+
+		width = std::max(width >> 1u, 1u);
+		height = std::max(height >> 1u, 1u);
+		depth = std::max(depth >> 1u, 1u);
+	}
+
+	return size * dim.layers * dim.samples;
+}
+
+void RenderGraph::build_memory_statistics(const std::vector<std::pair<unsigned, unsigned>> &lifetimes)
+{
+	memory_stats = {};
+	vector<VkDeviceSize> live_size(physical_passes.size());
+
+	for (unsigned i = 0; i < physical_dimensions.size(); i++)
+	{
+		auto &dim = physical_dimensions[i];
+		auto size = estimate_resource_size(dim);
+
+		// Transient attachments are not allocated by the render graph.
+		if (dim.transient && !dim.is_buffer_like())
+		{
+			memory_stats.transient += size;
+			continue;
+		}
+
+		memory_stats.summed += size;
+		if (physical_aliases[i] == RenderResource::Unused)
+			memory_stats.allocated += size;
+
+		// Buffers and images with history must stay alive for the entire frame.
+		unsigned first_pass = 0;
+		unsigned last_pass = unsigned(physical_passes.size()) - 1;
+		if (!dim.buffer_info.size && !physical_image_has_history[i])
+		{
+			first_pass = lifetimes[i].first;
+			last_pass = lifetimes[i].second;
+		}
+
+		for (unsigned pass = first_pass; pass <= last_pass && pass < physical_passes.size(); pass++)
+			live_size[pass] += size;
+	}
+
+	for (auto &size : live_size)
+		memory_stats.peak = std::max(memory_stats.peak, size);
 }
 
 bool RenderGraph::need_invalidate(const Barrier &barrier, const PipelineEvent &event)
@@ -1633,6 +1764,98 @@ bool RenderGraph::need_invalidate(const Barrier &barrier, const PipelineEvent &e
 	return need_invalidate;
 }
 
+void RenderGraph::record_physical_pass(Vulkan::CommandBuffer &cmd, PhysicalPass &physical_pass, bool graphics,
+                                       vector<PassTimestamps> &timestamps)
+{
+	if (graphics)
+	{
+		Vulkan::QueryPoolHandle start_vertex, start_fragment, end_vertex, end_fragment;
+		if (enabled_timestamps)
+		{
+			start_vertex = cmd.write_timestamp(VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
+			start_fragment = cmd.write_timestamp(VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT);
+		}
+
+		// TODO: Replace with multiview.
+		VK_ASSERT(physical_pass.layers != ~0u);
+		for (unsigned layer = 0; layer < physical_pass.layers; layer++)
+		{
+			physical_pass.render_pass_info.base_layer = layer;
+			cmd.begin_region("begin-render-pass");
+			cmd.begin_render_pass(physical_pass.render_pass_info);
+			cmd.end_region();
+
+			for (auto &subpass : physical_pass.passes)
+			{
+				auto subpass_index = unsigned(&subpass - physical_pass.passes.data());
+				auto &scaled_requests = physical_pass.scaled_clear_requests[subpass_index];
+				enqueue_scaled_requests(cmd, scaled_requests);
+
+				auto &pass = *passes[subpass];
+
+				// If we have started the render pass, we have to do it, even if a lone subpass might not be required,
+				// due to clearing and so on.
+				// This should be an extremely unlikely scenario.
+				// Either you need all subpasses or none.
+				cmd.begin_region(pass.get_name().c_str());
+				pass.build_render_pass(cmd, layer);
+				cmd.end_region();
+
+				if (&subpass != &physical_pass.passes.back())
+					cmd.next_subpass();
+			}
+
+			cmd.begin_region("end-render-pass");
+			cmd.end_render_pass();
+			cmd.end_region();
+		}
+
+		if (enabled_timestamps)
+		{
+			end_vertex = cmd.write_timestamp(VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
+			end_fragment = cmd.write_timestamp(VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT);
+			string name;
+			if (physical_pass.passes.size() == 1)
+				name = passes[physical_pass.passes.front()]->get_name();
+			else
+			{
+				for (auto &pass : physical_pass.passes)
+				{
+					name += passes[pass]->get_name();
+					if (&pass != &physical_pass.passes.back())
+						name += " + ";
+				}
+			}
+			if (physical_pass.passes.size() == 1 && start_fragment && end_fragment)
+				timestamps.push_back({ name, start_fragment, end_fragment, false });
+			device->register_time_interval("geometry", std::move(start_vertex), std::move(end_vertex), name.c_str());
+			device->register_time_interval("fragment", std::move(start_fragment), std::move(end_fragment), name.c_str());
+		}
+		enqueue_mipmap_requests(cmd, physical_pass.mipmap_requests);
+	}
+	else
+	{
+		assert(physical_pass.passes.size() == 1);
+		auto &pass = *passes[physical_pass.passes.front()];
+		Vulkan::QueryPoolHandle start_ts, end_ts;
+		if (enabled_timestamps)
+			start_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+		cmd.begin_region(pass.get_name().c_str());
+		pass.build_render_pass(cmd, 0);
+		cmd.end_region();
+		if (enabled_timestamps)
+		{
+			end_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+			if (start_ts && end_ts)
+			{
+				timestamps.push_back({ pass.get_name(), start_ts, end_ts,
+				                       pass.get_queue() == RENDER_GRAPH_QUEUE_ASYNC_COMPUTE_BIT });
+			}
+			device->register_time_interval("compute", std::move(start_ts), std::move(end_ts), pass.get_name().c_str());
+		}
+	}
+}
+
 void RenderGraph::enqueue_render_passes(Vulkan::Device &device_)
 {
 	vector<VkBufferMemoryBarrier> buffer_barriers;
@@ -1670,8 +1893,18 @@ void RenderGraph::enqueue_render_passes(Vulkan::Device &device_)
 		}
 	};
 
-	for (auto &physical_pass : physical_passes)
+	if (enabled_timestamps)
+		resolve_pass_timestamps(device_);
+	vector<PassTimestamps> pass_timestamps;
+
+	// Figure out which physical passes we need to run this frame.
+	// Consumers always come after producers, so walk backwards to cull passes whose outputs nobody needs.
+	vector<bool> physical_pass_active(physical_passes.size());
+	scheduling_stats.culled_physical_passes = 0;
+	for (unsigned i = physical_passes.size(); i; i--)
 	{
+		auto &physical_pass = physical_passes[i - 1];
+
 		bool require_pass = false;
 		for (auto &pass : physical_pass.passes)
 		{
@@ -1679,40 +1912,117 @@ void RenderGraph::enqueue_render_passes(Vulkan::Device &device_)
 				require_pass = true;
 		}
 
-		if (!require_pass)
+		if (require_pass && physical_pass.may_cull)
 		{
-			transfer_ownership(physical_pass);
-			continue;
+			bool has_active_consumer = false;
+			for (auto consumer : physical_pass.consumers)
+			{
+				if (physical_pass_active[consumer])
+				{
+					has_active_consumer = true;
+					break;
+				}
+			}
+
+			if (!has_active_consumer)
+			{
+				require_pass = false;
+				scheduling_stats.culled_physical_passes++;
+			}
 		}
 
-		bool graphics;
-		Vulkan::CommandBuffer::Type queue_type;
+		physical_pass_active[i - 1] = require_pass;
+	}
+
+	const auto get_queue_type = [this](const PhysicalPass &physical_pass, bool &graphics) {
 		switch (passes[physical_pass.passes.front()]->get_queue())
 		{
 		default:
 		case RENDER_GRAPH_QUEUE_GRAPHICS_BIT:
 			graphics = true;
-			queue_type = Vulkan::CommandBuffer::Type::Generic;
-			break;
+			return Vulkan::CommandBuffer::Type::Generic;
 
 		case RENDER_GRAPH_QUEUE_COMPUTE_BIT:
 			graphics = false;
-			queue_type = Vulkan::CommandBuffer::Type::Generic;
-			break;
+			return Vulkan::CommandBuffer::Type::Generic;
 
 		case RENDER_GRAPH_QUEUE_ASYNC_COMPUTE_BIT:
 			graphics = false;
-			queue_type = Vulkan::CommandBuffer::Type::AsyncCompute;
-			break;
+			return Vulkan::CommandBuffer::Type::AsyncCompute;
 
 		case RENDER_GRAPH_QUEUE_ASYNC_GRAPHICS_BIT:
 			graphics = true;
-			queue_type = Vulkan::CommandBuffer::Type::AsyncGraphics;
-			break;
+			return Vulkan::CommandBuffer::Type::AsyncGraphics;
 		}
+	};
 
-		auto cmd = device_.request_command_buffer(queue_type);
-		cmd->begin_region("render-graph-sync-pre");
+	const auto setup_clear_requests = [](PhysicalPass &physical_pass) {
+		for (auto &clear_req : physical_pass.color_clear_requests)
+			clear_req.pass->get_clear_color(clear_req.index, clear_req.target);
+
+		if (physical_pass.depth_clear_request.pass)
+		{
+			physical_pass.depth_clear_request.pass->get_clear_depth_stencil(
+				physical_pass.depth_clear_request.target);
+		}
+	};
+
+	// Recording a pass only depends on its own state, so with multithreaded recording,
+	// record all active passes up front on worker threads. Synchronization still has to be
+	// resolved in submission order below, so barriers are recorded separately on this thread.
+	vector<Vulkan::CommandBufferHandle> recorded_command_buffers;
+	vector<vector<PassTimestamps>> recorded_timestamps;
+
+#ifdef GRANITE_VULKAN_MT
+	auto *workers = Global::thread_group();
+	bool threaded_recording = enabled_multithreaded_recording && workers && workers->get_num_threads() != 0 &&
+	                          device_.get_num_thread_indices() > workers->get_num_threads();
+
+	if (threaded_recording)
+	{
+		recorded_command_buffers.resize(physical_passes.size());
+		recorded_timestamps.resize(physical_passes.size());
+
+		auto task = workers->create_task();
+		for (unsigned i = 0; i < physical_passes.size(); i++)
+		{
+			if (!physical_pass_active[i])
+				continue;
+
+			auto &physical_pass = physical_passes[i];
+			bool graphics;
+			auto queue_type = get_queue_type(physical_pass, graphics);
+			if (graphics)
+				setup_clear_requests(physical_pass);
+
+			task->enqueue_task([&, i, graphics, queue_type]() {
+				auto &cmd = recorded_command_buffers[i];
+				cmd = device_.request_command_buffer_for_thread(Vulkan::get_current_thread_index(), queue_type);
+				record_physical_pass(*cmd, physical_passes[i], graphics, recorded_timestamps[i]);
+			});
+		}
+		task->flush();
+		task->wait();
+	}
+#else
+	bool threaded_recording = false;
+#endif
+
+	for (auto &physical_pass : physical_passes)
+	{
+		unsigned physical_pass_index = unsigned(&physical_pass - physical_passes.data());
+		if (!physical_pass_active[physical_pass_index])
+		{
+			transfer_ownership(physical_pass);
+			continue;
+		}
+
+		bool graphics;
+		auto queue_type = get_queue_type(physical_pass, graphics);
+
+		Vulkan::CommandBufferHandle cmd;
+		if (!threaded_recording)
+			cmd = device_.request_command_buffer(queue_type);
 
 		const auto wait_for_semaphore_in_queue = [&](Vulkan::Semaphore sem, VkPipelineStageFlags stages) {
 			if (sem->get_semaphore() != VK_NULL_HANDLE && !sem->is_pending_wait())
@@ -1890,120 +2200,64 @@ void RenderGraph::enqueue_render_passes(Vulkan::Device &device_)
 			}
 		}
 
-		// Submit barriers.
-		if (!semaphore_handover_barriers.empty())
-		{
-			cmd->barrier(handover_stages, handover_stages,
-			             0, nullptr, 0, nullptr,
-			             semaphore_handover_barriers.size(),
-			             semaphore_handover_barriers.empty() ? nullptr : semaphore_handover_barriers.data());
-		}
-
-		if (!image_barriers.empty() || !buffer_barriers.empty())
-		{
-			cmd->wait_events(events.size(), events.data(),
-			                 src_stages, dst_stages,
-			                 0, nullptr,
-			                 buffer_barriers.size(), buffer_barriers.empty() ? nullptr : buffer_barriers.data(),
-			                 image_barriers.size(), image_barriers.empty() ? nullptr : image_barriers.data());
-		}
+		bool need_barriers = !semaphore_handover_barriers.empty() ||
+		                     !image_barriers.empty() || !buffer_barriers.empty() ||
+		                     !immediate_image_barriers.empty();
 
-		if (!immediate_image_barriers.empty())
-		{
-			cmd->barrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, immediate_dst_stages,
-			             0, nullptr, 0, nullptr, immediate_image_barriers.size(), immediate_image_barriers.data());
-		}
-
-		cmd->end_region();
+		Vulkan::CommandBufferHandle sync_cmd;
+		if (!threaded_recording)
+			sync_cmd = cmd;
+		else if (need_barriers)
+			sync_cmd = device_.request_command_buffer(queue_type);
 
-		if (graphics)
+		// Submit barriers.
+		if (sync_cmd)
 		{
-			for (auto &clear_req : physical_pass.color_clear_requests)
-				clear_req.pass->get_clear_color(clear_req.index, clear_req.target);
+			sync_cmd->begin_region("render-graph-sync-pre");
 
-			if (physical_pass.depth_clear_request.pass)
+			if (!semaphore_handover_barriers.empty())
 			{
-				physical_pass.depth_clear_request.pass->get_clear_depth_stencil(
-					physical_pass.depth_clear_request.target);
+				sync_cmd->barrier(handover_stages, handover_stages,
+				                  0, nullptr, 0, nullptr,
+				                  semaphore_handover_barriers.size(),
+				                  semaphore_handover_barriers.empty() ? nullptr : semaphore_handover_barriers.data());
 			}
 
-			Vulkan::QueryPoolHandle start_vertex, start_fragment, end_vertex, end_fragment;
-			if (enabled_timestamps)
+			if (!image_barriers.empty() || !buffer_barriers.empty())
 			{
-				start_vertex = cmd->write_timestamp(VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
-				start_fragment = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT);
+				sync_cmd->wait_events(events.size(), events.data(),
+				                      src_stages, dst_stages,
+				                      0, nullptr,
+				                      buffer_barriers.size(), buffer_barriers.empty() ? nullptr : buffer_barriers.data(),
+				                      image_barriers.size(), image_barriers.empty() ? nullptr : image_barriers.data());
 			}
 
-			// TODO: Replace with multiview.
-			VK_ASSERT(physical_pass.layers != ~0u);
-			for (unsigned layer = 0; layer < physical_pass.layers; layer++)
+			if (!immediate_image_barriers.empty())
 			{
-				physical_pass.render_pass_info.base_layer = layer;
-				cmd->begin_region("begin-render-pass");
-				cmd->begin_render_pass(physical_pass.render_pass_info);
-				cmd->end_region();
+				sync_cmd->barrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, immediate_dst_stages,
+				                  0, nullptr, 0, nullptr, immediate_image_barriers.size(), immediate_image_barriers.data());
+			}
 
-				for (auto &subpass : physical_pass.passes)
-				{
-					auto subpass_index = unsigned(&subpass - physical_pass.passes.data());
-					auto &scaled_requests = physical_pass.scaled_clear_requests[subpass_index];
-					enqueue_scaled_requests(*cmd, scaled_requests);
-
-					auto &pass = *passes[subpass];
-
-					// If we have started the render pass, we have to do it, even if a lone subpass might not be required,
-					// due to clearing and so on.
-					// This should be an extremely unlikely scenario.
-					// Either you need all subpasses or none.
-					cmd->begin_region(pass.get_name().c_str());
-					pass.build_render_pass(*cmd, layer);
-					cmd->end_region();
-
-					if (&subpass != &physical_pass.passes.back())
-						cmd->next_subpass();
-				}
+			sync_cmd->end_region();
+		}
 
-				cmd->begin_region("end-render-pass");
-				cmd->end_render_pass();
-				cmd->end_region();
-			}
+		if (threaded_recording)
+		{
+			// The pass itself was recorded up front, so barriers have to go in a separate command buffer
+			// which is submitted right before it.
+			if (sync_cmd)
+				device_.submit(sync_cmd);
 
-			if (enabled_timestamps)
-			{
-				end_vertex = cmd->write_timestamp(VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
-				end_fragment = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT);
-				string name;
-				if (physical_pass.passes.size() == 1)
-					name = passes[physical_pass.passes.front()]->get_name();
-				else
-				{
-					for (auto &pass : physical_pass.passes)
-					{
-						name += passes[pass]->get_name();
-						if (&pass != &physical_pass.passes.back())
-							name += " + ";
-					}
-				}
-				device->register_time_interval("geometry", std::move(start_vertex), std::move(end_vertex), name.c_str());
-				device->register_time_interval("fragment", std::move(start_fragment), std::move(end_fragment), name.c_str());
-			}
-			enqueue_mipmap_requests(*cmd, physical_pass.mipmap_requests);
+			cmd = move(recorded_command_buffers[physical_pass_index]);
+			auto &recorded = recorded_timestamps[physical_pass_index];
+			pass_timestamps.insert(end(pass_timestamps),
+			                       make_move_iterator(begin(recorded)), make_move_iterator(end(recorded)));
 		}
 		else
 		{
-			assert(physical_pass.passes.size() == 1);
-			auto &pass = *passes[physical_pass.passes.front()];
-			Vulkan::QueryPoolHandle start_ts, end_ts;
-			if (enabled_timestamps)
-				start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-			cmd->begin_region(pass.get_name().c_str());
-			pass.build_render_pass(*cmd, 0);
-			cmd->end_region();
-			if (enabled_timestamps)
-			{
-				end_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-				device->register_time_interval("compute", std::move(start_ts), std::move(end_ts), pass.get_name().c_str());
-			}
+			if (graphics)
+				setup_clear_requests(physical_pass);
+			record_physical_pass(*cmd, physical_pass, graphics, pass_timestamps);
 		}
 
 		cmd->begin_region("render-graph-sync-post");
@@ -2083,6 +2337,9 @@ void RenderGraph::enqueue_render_passes(Vulkan::Device &device_)
 		transfer_ownership(physical_pass);
 	}
 
+	if (enabled_timestamps)
+		pending_pass_timestamps.push_back(move(pass_timestamps));
+
 	// Scale to swapchain.
 	if (swapchain_physical_index == RenderResource::Unused)
 	{
@@ -2538,6 +2795,12 @@ void RenderGraph::reorder_passes(std::vector<unsigned> &flattened_passes)
 			{
 				overlap_factor = ~0u;
 			}
+			else if (hoisted_passes.count(unscheduled_passes[i]))
+			{
+				// Long-running async compute passes should start as early as possible,
+				// so they can overlap with as much graphics work as possible.
+				overlap_factor = ~0u - 1;
+			}
 			else
 			{
 				for (auto itr = flattened_passes.rbegin(); itr != flattened_passes.rend(); ++itr)
@@ -2586,15 +2849,78 @@ bool RenderGraph::depends_on_pass(unsigned dst_pass, unsigned src_pass)
 	return false;
 }
 
-void RenderGraph::bake()
+Util::Hash RenderGraph::compute_structural_hash() const
 {
-	// First, validate that the graph is sane.
-	validate_passes();
+	Util::Hasher h;
+
+	const auto hash_resource = [&](const RenderResource *resource) {
+		h.u32(resource ? resource->get_index() : RenderResource::Unused);
+	};
+
+	const auto hash_resources = [&](const auto &list) {
+		h.u32(uint32_t(list.size()));
+		for (auto *resource : list)
+			hash_resource(resource);
+	};
+
+	h.u32(uint32_t(resources.size()));
 
+	h.u32(uint32_t(passes.size()));
+	for (auto &pass : passes)
+	{
+		h.u32(pass->get_queue());
+		hash_resources(pass->get_color_outputs());
+		hash_resources(pass->get_resolve_outputs());
+		hash_resources(pass->get_color_inputs());
+		hash_resources(pass->get_color_scale_inputs());
+		hash_resources(pass->get_storage_texture_inputs());
+		hash_resources(pass->get_storage_texture_outputs());
+		hash_resources(pass->get_blit_texture_inputs());
+		hash_resources(pass->get_blit_texture_outputs());
+		hash_resources(pass->get_attachment_inputs());
+		hash_resources(pass->get_history_inputs());
+		hash_resources(pass->get_storage_inputs());
+		hash_resources(pass->get_storage_outputs());
+		hash_resources(pass->get_transfer_outputs());
+		hash_resource(pass->get_depth_stencil_input());
+		hash_resource(pass->get_depth_stencil_output());
+
+		h.u32(uint32_t(pass->get_generic_texture_inputs().size()));
+		for (auto &input : pass->get_generic_texture_inputs())
+			hash_resource(input.texture);
+		h.u32(uint32_t(pass->get_generic_buffer_inputs().size()));
+		for (auto &input : pass->get_generic_buffer_inputs())
+			hash_resource(input.buffer);
+	}
+
+	return h.get();
+}
+
+void RenderGraph::build_dependencies()
+{
 	auto itr = resource_to_index.find(backbuffer_source);
 	if (itr == end(resource_to_index))
 		throw logic_error("Backbuffer source does not exist.");
 
+	// validate_passes() might have turned color inputs into scaled inputs,
+	// so this must be computed after validation.
+	Util::Hasher h(compute_structural_hash());
+	h.u32(itr->second);
+	// Scheduling also depends on which passes have been measured to be long-running.
+	for (unsigned i = 0; i < passes.size(); i++)
+		h.u32(uint32_t(hoisted_passes.count(i)));
+	auto hash = h.get();
+
+	auto *cached = dependency_cache.find_and_mark_as_recent(hash);
+	if (cached)
+	{
+		pass_stack = cached->pass_stack;
+		pass_dependencies = cached->pass_dependencies;
+		pass_merge_dependencies = cached->pass_merge_dependencies;
+		bake_stats.dependency_cache_hit = true;
+		return;
+	}
+
 	pass_stack.clear();
 
 	pass_dependencies.clear();
@@ -2624,23 +2950,54 @@ void RenderGraph::bake()
 	// Now, reorder passes to extract better pipelining.
 	reorder_passes(pass_stack);
 
-	// Now, we have a linear list of passes to submit in-order which would obey the dependencies.
+	auto *entry = dependency_cache.allocate(hash, 1);
+	entry->pass_stack = pass_stack;
+	entry->pass_dependencies = pass_dependencies;
+	entry->pass_merge_dependencies = pass_merge_dependencies;
+	dependency_cache.prune();
+}
+
+void RenderGraph::bake()
+{
+	bake_stats = {};
+	auto start_time = Util::get_current_time_nsecs();
+	auto stage_time = start_time;
+
+	const auto end_stage = [&](int64_t &elapsed) {
+		auto current_time = Util::get_current_time_nsecs();
+		elapsed = current_time - stage_time;
+		stage_time = current_time;
+	};
+
+	// First, validate that the graph is sane.
+	validate_passes();
+	end_stage(bake_stats.validate_ns);
+
+	// Sort out all dependencies and find a linear list of passes to submit in-order which would obey the dependencies.
+	build_hoisted_passes();
+	build_dependencies();
+	end_stage(bake_stats.dependencies_ns);
 
 	// Figure out which physical resources we need. Here we will alias resources which can trivially alias via renaming.
 	// E.g. depth input -> depth output is just one physical attachment, similar with color.
 	build_physical_resources();
+	end_stage(bake_stats.physical_resources_ns);
 
 	// Next, try to merge adjacent passes together.
 	build_physical_passes();
+	end_stage(bake_stats.physical_passes_ns);
 
 	// After merging physical passes and resources, if an image resource is only used in a single physical pass, make it transient.
 	build_transients();
+	end_stage(bake_stats.transients_ns);
 
 	// Now that we are done, we can make render passes.
 	build_render_pass_info();
+	end_stage(bake_stats.render_pass_info_ns);
 
 	// For each render pass in isolation, figure out the barriers required.
 	build_barriers();
+	end_stage(bake_stats.barriers_ns);
 
 	// Check if the swapchain needs to be blitted to in case the geometry does not match the backbuffer,
 	// or the usage of the image makes that impossible.
@@ -2670,10 +3027,17 @@ void RenderGraph::bake()
 	// Based on our render graph, figure out the barriers we actually need.
 	// Some barriers are implicit (transients), and some are redundant, i.e. same texture read in multiple passes.
 	build_physical_barriers();
+	end_stage(bake_stats.physical_barriers_ns);
 
 	// Figure out which images can alias with each other.
 	// Also build virtual "transfer" barriers. These things only copy events over to other physical resources.
 	build_aliases();
+	end_stage(bake_stats.aliases_ns);
+
+	build_pass_culling();
+	build_predicted_overlap();
+
+	bake_stats.total_ns = stage_time - start_time;
 }
 
 ResourceDimensions RenderGraph::get_resource_dimensions(const RenderBufferResource &resource) const
@@ -3278,6 +3642,195 @@ void RenderGraph::filter_passes(std::vector<unsigned> &list)
 void RenderGraph::enable_timestamps(bool enable)
 {
 	enabled_timestamps = enable;
+	if (!enable)
+		pending_pass_timestamps.clear();
+}
+
+void RenderGraph::set_async_compute_hoist_threshold(double seconds)
+{
+	async_compute_hoist_threshold = seconds;
+}
+
+void RenderGraph::enable_multithreaded_recording(bool enable)
+{
+	enabled_multithreaded_recording = enable;
+}
+
+void RenderGraph::resolve_pass_timestamps(Vulkan::Device &device_)
+{
+	// Timestamps are resolved when the frame context they were written in is recycled,
+	// so results trail behind by a few frames.
+	auto itr = begin(pending_pass_timestamps);
+	for (; itr != end(pending_pass_timestamps); ++itr)
+	{
+		bool signalled = all_of(begin(*itr), end(*itr), [](const PassTimestamps &ts) {
+			return ts.start_ts->is_signalled() && ts.end_ts->is_signalled();
+		});
+
+		if (!signalled)
+			break;
+
+		double achieved_overlap = 0.0;
+		for (auto &ts : *itr)
+		{
+			uint64_t start_ticks = ts.start_ts->get_timestamp_ticks();
+			uint64_t end_ticks = ts.end_ts->get_timestamp_ticks();
+			double t = device_.convert_timestamp_delta(start_ticks, end_ticks);
+
+			auto time_itr = pass_gpu_times.find(ts.name);
+			if (time_itr != end(pass_gpu_times))
+				time_itr->second = 0.9 * time_itr->second + 0.1 * t;
+			else
+				pass_gpu_times[ts.name] = t;
+
+			if (!ts.async_compute)
+				continue;
+
+			// Timestamps share a timebase across queues, so we can intersect the intervals directly.
+			for (auto &other : *itr)
+			{
+				if (other.async_compute)
+					continue;
+
+				uint64_t overlap_start = std::max(start_ticks, other.start_ts->get_timestamp_ticks());
+				uint64_t overlap_end = std::min(end_ticks, other.end_ts->get_timestamp_ticks());
+				if (overlap_end > overlap_start)
+					achieved_overlap += device_.convert_timestamp_delta(overlap_start, overlap_end);
+			}
+		}
+
+		scheduling_stats.achieved_overlap = achieved_overlap;
+	}
+
+	pending_pass_timestamps.erase(begin(pending_pass_timestamps), itr);
+
+	// Don't let unresolved frames pile up if timestamps never complete.
+	if (pending_pass_timestamps.size() > 8)
+		pending_pass_timestamps.erase(begin(pending_pass_timestamps));
+}
+
+void RenderGraph::build_hoisted_passes()
+{
+	hoisted_passes.clear();
+
+	// Hoisting only makes sense if async compute actually runs on its own queue.
+	if (!enabled_timestamps || !device ||
+	    device->get_physical_queue_type(Vulkan::CommandBuffer::Type::AsyncCompute) ==
+	    Vulkan::CommandBuffer::Type::Generic)
+	{
+		return;
+	}
+
+	for (auto &pass : passes)
+	{
+		if (pass->get_queue() != RENDER_GRAPH_QUEUE_ASYNC_COMPUTE_BIT)
+			continue;
+
+		auto itr = pass_gpu_times.find(pass->get_name());
+		if (itr != end(pass_gpu_times) && itr->second >= async_compute_hoist_threshold)
+			hoisted_passes.insert(pass->get_index());
+	}
+}
+
+void RenderGraph::build_predicted_overlap()
+{
+	scheduling_stats.predicted_overlap = 0.0;
+	scheduling_stats.hoisted_passes = 0;
+
+	const auto get_time = [&](unsigned pass) -> double {
+		auto itr = pass_gpu_times.find(passes[pass]->get_name());
+		return itr != end(pass_gpu_times) ? itr->second : 0.0;
+	};
+
+	for (unsigned i = 0; i < pass_stack.size(); i++)
+	{
+		unsigned pass = pass_stack[i];
+		if (passes[pass]->get_queue() != RENDER_GRAPH_QUEUE_ASYNC_COMPUTE_BIT)
+			continue;
+
+		if (hoisted_passes.count(pass))
+			scheduling_stats.hoisted_passes++;
+
+		// Graphics work scheduled before the first consumer of an async compute pass can overlap with it.
+		double graphics_time = 0.0;
+		for (unsigned j = i + 1; j < pass_stack.size(); j++)
+		{
+			if (depends_on_pass(pass_stack[j], pass))
+				break;
+			if (passes[pass_stack[j]]->get_queue() != RENDER_GRAPH_QUEUE_ASYNC_COMPUTE_BIT)
+				graphics_time += get_time(pass_stack[j]);
+		}
+
+		scheduling_stats.predicted_overlap += std::min(get_time(pass), graphics_time);
+	}
+}
+
+void RenderGraph::build_pass_culling()
+{
+	unsigned backbuffer_index = resource_to_index[backbuffer_source];
+
+	for (auto &physical_pass : physical_passes)
+	{
+		unsigned physical_pass_index = unsigned(&physical_pass - physical_passes.data());
+		physical_pass.consumers.clear();
+		physical_pass.may_cull = true;
+
+		const auto add_output = [&](const RenderTextureResource *resource) {
+			if (!resource)
+				return;
+
+			// Backbuffer and history are consumed outside the graph's view of this frame.
+			unsigned phys = resource->get_physical_index();
+			if (resource->get_index() == backbuffer_index ||
+			    (phys != RenderResource::Unused && physical_image_has_history[phys]))
+			{
+				physical_pass.may_cull = false;
+			}
+
+			for (auto &read_pass : resource->get_read_passes())
+			{
+				unsigned consumer = passes[read_pass]->get_physical_pass_index();
+
+				// Reading before the write means the contents must be preserved across frames.
+				if (consumer != RenderPass::Unused && consumer < physical_pass_index)
+					physical_pass.may_cull = false;
+
+				if (consumer != RenderPass::Unused && consumer > physical_pass_index &&
+				    find(begin(physical_pass.consumers), end(physical_pass.consumers), consumer) ==
+				    end(physical_pass.consumers))
+				{
+					physical_pass.consumers.push_back(consumer);
+				}
+			}
+		};
+
+		for (auto &pass_index : physical_pass.passes)
+		{
+			auto &pass = *passes[pass_index];
+
+			// Storage resources might be consumed in a feedback fashion in later frames,
+			// and fake aliases hand their contents over to other resources.
+			if (!pass.get_storage_outputs().empty() ||
+			    !pass.get_storage_texture_outputs().empty() ||
+			    !pass.get_transfer_outputs().empty() ||
+			    !pass.get_fake_resource_aliases().empty())
+			{
+				physical_pass.may_cull = false;
+			}
+
+			for (auto *output : pass.get_color_outputs())
+				add_output(output);
+			for (auto *output : pass.get_resolve_outputs())
+				add_output(output);
+			for (auto *output : pass.get_blit_texture_outputs())
+				add_output(output);
+			add_output(pass.get_depth_stencil_output());
+		}
+
+		// A pass without any consumers has side effects we cannot see, so keep it.
+		if (physical_pass.consumers.empty())
+			physical_pass.may_cull = false;
+	}
 }
 
 void RenderGraph::reset()
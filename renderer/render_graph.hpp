@@ -32,6 +32,7 @@
 #include "vulkan_headers.hpp"
 #include "device.hpp"
 #include "stack_allocator.hpp"
+#include "lru_cache.hpp"
 #include "application_wsi_events.hpp"
 #include "quirks.hpp"
 
@@ -648,6 +649,71 @@ public:
 
 	void enable_timestamps(bool enable);
 
+	// With timestamps enabled, measured GPU time of passes is fed back into scheduling on the next bake().
+	// Async compute passes which take longer than this (in seconds) are scheduled as early as
+	// their dependencies allow, so they overlap with as much graphics work as possible.
+	void set_async_compute_hoist_threshold(double seconds);
+
+	// Records physical passes in parallel on the global thread group, each into its own command buffer.
+	// Submission order and synchronization are unchanged, but build_render_pass() of different passes
+	// may run concurrently, so only enable this if those callbacks are thread-safe
+	// and do not wait on the thread group themselves.
+	void enable_multithreaded_recording(bool enable);
+
+	struct SchedulingStatistics
+	{
+		// Seconds of async compute work expected to overlap with graphics work, based on measured pass times.
+		double predicted_overlap = 0.0;
+		// Seconds of async compute work which actually overlapped with graphics work in the last measured frame.
+		double achieved_overlap = 0.0;
+		unsigned hoisted_passes = 0;
+		// Physical passes skipped in the last frame because nothing consumed their outputs.
+		unsigned culled_physical_passes = 0;
+	};
+
+	const SchedulingStatistics &get_scheduling_statistics() const
+	{
+		return scheduling_stats;
+	}
+
+	// CPU time spent in the individual stages of the last call to bake().
+	struct BakeStatistics
+	{
+		int64_t validate_ns = 0;
+		int64_t dependencies_ns = 0;
+		int64_t physical_resources_ns = 0;
+		int64_t physical_passes_ns = 0;
+		int64_t transients_ns = 0;
+		int64_t render_pass_info_ns = 0;
+		int64_t barriers_ns = 0;
+		int64_t physical_barriers_ns = 0;
+		int64_t aliases_ns = 0;
+		int64_t total_ns = 0;
+		bool dependency_cache_hit = false;
+	};
+
+	const BakeStatistics &get_bake_statistics() const
+	{
+		return bake_stats;
+	}
+
+	// Estimated memory footprint of the physical resources from the last call to bake().
+	// summed is the footprint if no resources were aliased, allocated is the footprint after aliasing,
+	// and peak is the largest amount of memory live in any one physical pass, i.e. a lower bound for
+	// what perfect aliasing could achieve. Transient attachments are tracked separately.
+	struct MemoryStatistics
+	{
+		VkDeviceSize summed = 0;
+		VkDeviceSize allocated = 0;
+		VkDeviceSize peak = 0;
+		VkDeviceSize transient = 0;
+	};
+
+	const MemoryStatistics &get_memory_statistics() const
+	{
+		return memory_stats;
+	}
+
 	void bake();
 	void reset();
 	void log();
@@ -823,6 +889,11 @@ private:
 		std::vector<std::vector<ScaledClearRequests>> scaled_clear_requests;
 		std::vector<MipmapRequests> mipmap_requests;
 		unsigned layers = 1;
+
+		// Physical passes which read resources written by this pass.
+		std::vector<unsigned> consumers;
+		// If all consumers are skipped in a frame, this pass can be skipped as well.
+		bool may_cull = false;
 	};
 	std::vector<PhysicalPass> physical_passes;
 	void build_physical_passes();
@@ -831,6 +902,9 @@ private:
 	void build_physical_barriers();
 	void build_render_pass_info();
 	void build_aliases();
+	void build_pass_culling();
+	void build_hoisted_passes();
+	void build_predicted_overlap();
 
 	bool enabled_timestamps = false;
 
@@ -884,5 +958,41 @@ private:
 
 	void reorder_passes(std::vector<unsigned> &passes);
 	static bool need_invalidate(const Barrier &barrier, const PipelineEvent &event);
+
+	// Pass ordering only depends on how passes and resources are wired together,
+	// not on any resource dimensions, so it can be reused when an identical graph is rebaked,
+	// e.g. after a swapchain resize. This cache survives reset().
+	// Only the most recently used graphs are kept, so toggling through many configurations stays bounded.
+	struct DependencyCache
+	{
+		std::vector<unsigned> pass_stack;
+		std::vector<std::unordered_set<unsigned>> pass_dependencies;
+		std::vector<std::unordered_set<unsigned>> pass_merge_dependencies;
+	};
+	enum { MaxDependencyCacheEntries = 16 };
+	Util::LRUCache<DependencyCache> dependency_cache;
+	Util::Hash compute_structural_hash() const;
+	void build_dependencies();
+
+	BakeStatistics bake_stats;
+	MemoryStatistics memory_stats;
+
+	struct PassTimestamps
+	{
+		std::string name;
+		Vulkan::QueryPoolHandle start_ts, end_ts;
+		bool async_compute;
+	};
+	std::vector<std::vector<PassTimestamps>> pending_pass_timestamps;
+	// Running average of GPU time per pass name. Survives reset().
+	std::unordered_map<std::string, double> pass_gpu_times;
+	std::unordered_set<unsigned> hoisted_passes;
+	double async_compute_hoist_threshold = 0.0005;
+	SchedulingStatistics scheduling_stats;
+	void resolve_pass_timestamps(Vulkan::Device &device);
+	void record_physical_pass(Vulkan::CommandBuffer &cmd, PhysicalPass &physical_pass, bool graphics,
+	                          std::vector<PassTimestamps> &timestamps);
+	bool enabled_multithreaded_recording = false;
+	void build_memory_statistics(const std::vector<std::pair<unsigned, unsigned>> &lifetimes);
 };
 }
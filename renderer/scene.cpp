@@ -38,6 +38,7 @@ Scene::Scene()
 	  positional_lights(pool.get_component_group<RenderInfoComponent, RenderableComponent, PositionalLightComponent>()),
 	  static_shadowing(pool.get_component_group<RenderInfoComponent, RenderableComponent, CastsStaticShadowComponent>()),
 	  dynamic_shadowing(pool.get_component_group<RenderInfoComponent, RenderableComponent, CastsDynamicShadowComponent>()),
+	  static_shadowing_spatials(pool.get_component_group<RenderInfoComponent, CachedSpatialTransformTimestampComponent, CastsStaticShadowComponent>()),
 	  render_pass_shadowing(pool.get_component_group<RenderPassComponent, RenderableComponent, CastsDynamicShadowComponent>()),
 	  backgrounds(pool.get_component_group<UnboundedComponent, RenderableComponent>()),
 	  cameras(pool.get_component_group<CameraComponent, CachedTransformComponent>()),
@@ -184,6 +185,11 @@ void Scene::gather_visible_static_shadow_renderables(const Frustum &frustum, Vis
 	gather_visible_renderables(frustum, list, static_shadowing);
 }
 
+const std::vector<AABB> &Scene::get_static_shadow_invalidations() const
+{
+	return static_shadow_invalidations;
+}
+
 void Scene::gather_visible_positional_lights(const Frustum &frustum, VisibilityList &list,
                                              unsigned max_spot_lights, unsigned max_point_lights)
 {
@@ -303,6 +309,32 @@ void Scene::update_cached_transforms()
 	if (root_node)
 		update_transform_tree(*root_node, mat4(1.0f), false);
 
+	static_shadow_invalidations.clear();
+	moved_static_shadow_casters.clear();
+
+	// Casters removed since the last update leave a hole where they were.
+	static_shadow_invalidations.insert(end(static_shadow_invalidations),
+	                                   begin(removed_static_shadow_casters), end(removed_static_shadow_casters));
+	removed_static_shadow_casters.clear();
+
+	// Static shadow casters which move must invalidate any cached shadow map covering
+	// both where they were and where they end up. New casters only cover where they end up.
+	for (auto &s : static_shadowing_spatials)
+	{
+		RenderInfoComponent *cached_transform;
+		CachedSpatialTransformTimestampComponent *timestamp;
+		CastsStaticShadowComponent *caster;
+		tie(cached_transform, timestamp, caster) = s;
+
+		if (cached_transform->transform &&
+		    (timestamp->last_timestamp != *timestamp->current_timestamp || !caster->removed_bounds))
+		{
+			if (caster->removed_bounds)
+				static_shadow_invalidations.push_back(caster->last_world_aabb);
+			moved_static_shadow_casters.push_back({ cached_transform, caster });
+		}
+	}
+
 	for (auto &s : spatials)
 	{
 		BoundedComponent *aabb;
@@ -332,6 +364,13 @@ void Scene::update_cached_transforms()
 		}
 	}
 
+	for (auto &moved : moved_static_shadow_casters)
+	{
+		static_shadow_invalidations.push_back(moved.first->world_aabb);
+		moved.second->last_world_aabb = moved.first->world_aabb;
+		moved.second->removed_bounds = &removed_static_shadow_casters;
+	}
+
 	// Update camera transforms.
 	for (auto &c : cameras)
 	{
@@ -51,6 +51,12 @@ public:
 
 	void refresh_per_frame(RenderContext &context);
 	void update_cached_transforms();
+
+	// World-space bounds (before and after the move) of static shadow casters
+	// which changed transform in the last call to update_cached_transforms(),
+	// along with the last bounds of static shadow casters removed since the call before.
+	// Used to invalidate cached shadow maps.
+	const std::vector<AABB> &get_static_shadow_invalidations() const;
 	void gather_visible_opaque_renderables(const Frustum &frustum, VisibilityList &list);
 	void gather_visible_transparent_renderables(const Frustum &frustum, VisibilityList &list);
 	void gather_visible_static_shadow_renderables(const Frustum &frustum, VisibilityList &list);
@@ -209,6 +215,7 @@ private:
 	const ComponentGroupVector<RenderInfoComponent, RenderableComponent, PositionalLightComponent> &positional_lights;
 	const ComponentGroupVector<RenderInfoComponent, RenderableComponent, CastsStaticShadowComponent> &static_shadowing;
 	const ComponentGroupVector<RenderInfoComponent, RenderableComponent, CastsDynamicShadowComponent> &dynamic_shadowing;
+	const ComponentGroupVector<RenderInfoComponent, CachedSpatialTransformTimestampComponent, CastsStaticShadowComponent> &static_shadowing_spatials;
 	const ComponentGroupVector<RenderPassComponent, RenderableComponent, CastsDynamicShadowComponent> &render_pass_shadowing;
 	const ComponentGroupVector<UnboundedComponent, RenderableComponent> &backgrounds;
 	const ComponentGroupVector<CameraComponent, CachedTransformComponent> &cameras;
@@ -224,6 +231,11 @@ private:
 	void destroy_entities(Util::IntrusiveList<Entity> &entity_list);
 	void update_transform_tree(Node &node, const mat4 &transform, bool parent_is_dirty);
 
+	std::vector<AABB> static_shadow_invalidations;
+	std::vector<std::pair<const RenderInfoComponent *, CastsStaticShadowComponent *>> moved_static_shadow_casters;
+	// Appended to by CastsStaticShadowComponent as casters are destroyed.
+	std::vector<AABB> removed_static_shadow_casters;
+
 	void update_skinning(Node &node);
 };
 }
\ No newline at end of file
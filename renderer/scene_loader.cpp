@@ -27,6 +27,11 @@
 #include "mesh_util.hpp"
 #include "enum_cast.hpp"
 #include "ground.hpp"
+#include "material_manager.hpp"
+#include "thread_group.hpp"
+#include "timer.hpp"
+#include "transforms.hpp"
+#include <algorithm>
 
 using namespace std;
 using namespace rapidjson;
@@ -73,7 +78,266 @@ void SceneLoader::load_scene(const std::string &path)
 	scene->set_root_node(node);
 }
 
-Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subscene)
+SceneLoader::AsyncLoadHandle SceneLoader::load_scene_async(const std::string &path, Scene::NodeHandle parent,
+                                                           AsyncLoadCallback callback)
+{
+	auto load = Util::make_handle<AsyncLoad>();
+	load->path = path;
+	load->parent = move(parent);
+	load->callback = move(callback);
+
+	auto ext = Path::ext(path);
+	if (ext == "gltf" || ext == "glb")
+	{
+		// The task holds its own reference, so the loader may go away while parsing is in flight.
+		AsyncLoadHandle task_load = load;
+		auto work = [task_load]() {
+			try
+			{
+				task_load->subscene.parser = make_unique<GLTF::Parser>(task_load->path);
+			}
+			catch (const exception &e)
+			{
+				task_load->error = e.what();
+			}
+			task_load->parsed.store(true, memory_order_release);
+		};
+
+		auto *workers = Global::thread_group();
+		if (workers && workers->get_num_threads())
+		{
+			auto task = workers->create_task(move(work));
+			task->flush();
+		}
+		else
+			work();
+	}
+	else
+		load->parsed.store(true, memory_order_release);
+
+	async_loads.push_back(load);
+	return load;
+}
+
+bool SceneLoader::has_pending_async_loads() const
+{
+	return !async_loads.empty();
+}
+
+void SceneLoader::update_async_loads(const vec3 &camera_position, double budget_seconds)
+{
+	int64_t deadline = get_current_time_nsecs() + int64_t(budget_seconds * 1e9);
+
+	for (auto &load : async_loads)
+		if (!step_async_load(*load, camera_position, deadline))
+			break;
+
+	auto itr = remove_if(begin(async_loads), end(async_loads), [](const AsyncLoadHandle &load) {
+		return load->is_done();
+	});
+	async_loads.erase(itr, end(async_loads));
+}
+
+AbstractRenderableHandle SceneLoader::create_async_mesh(AsyncLoad &load, uint32_t mesh_index)
+{
+	auto &parser = *load.subscene.parser;
+	auto &mesh = parser.get_meshes()[mesh_index];
+	if (!mesh.has_material)
+		return create_imported_mesh(mesh, nullptr);
+
+	// Meshes start out with an untextured copy of their material so they can be drawn right away.
+	// Texture requests are held back until every mesh has been created.
+	auto &info = parser.get_materials()[mesh.material_index];
+	auto &placeholder = load.placeholder_materials[mesh.material_index];
+	if (!placeholder)
+	{
+		auto untextured = info;
+		untextured.base_color.path.clear();
+		untextured.normal.path.clear();
+		untextured.metallic_roughness.path.clear();
+		untextured.occlusion.path.clear();
+		untextured.emissive.path.clear();
+		placeholder = Util::make_derived_handle<Material, MaterialFile>(untextured);
+	}
+
+	StaticMesh *static_mesh;
+	AbstractRenderableHandle renderable;
+	if (mesh.attribute_layout[ecast(MeshAttribute::BoneIndex)].format != VK_FORMAT_UNDEFINED)
+	{
+		auto skinned = Util::make_handle<ImportedSkinnedMesh>(mesh, info, placeholder);
+		static_mesh = skinned.get();
+		renderable = skinned;
+	}
+	else
+	{
+		auto imported = Util::make_handle<ImportedMesh>(mesh, info, placeholder);
+		static_mesh = imported.get();
+		renderable = imported;
+	}
+
+	load.material_users[mesh.material_index].push_back(static_mesh);
+	return renderable;
+}
+
+void SceneLoader::begin_async_meshes(AsyncLoad &load)
+{
+	auto &parser = *load.subscene.parser;
+	load.subscene.meshes.resize(parser.get_meshes().size());
+	load.material_users.resize(parser.get_materials().size());
+	load.placeholder_materials.resize(parser.get_materials().size());
+
+	load.progress.instance_count = unsigned(load.pending.size());
+	load.progress.material_count = unsigned(parser.get_materials().size());
+
+	// Re-sorting is O(n log n), so only do it once the camera has moved a meaningful distance.
+	if (!load.pending.empty())
+	{
+		AABB bounds(load.pending.front().center, load.pending.front().center);
+		for (auto &pending : load.pending)
+			bounds.expand(AABB(pending.center - vec3(pending.radius), pending.center + vec3(pending.radius)));
+		load.resort_distance = 0.05f * bounds.get_radius();
+	}
+}
+
+bool SceneLoader::step_async_load(AsyncLoad &load, const vec3 &camera_position, int64_t deadline)
+{
+	auto old_stage = load.progress.stage;
+	bool progressed = false;
+
+	const auto attach_root = [&]() {
+		if (load.parent)
+			load.parent->add_child(load.root);
+		else
+			scene->set_root_node(load.root);
+	};
+
+	// Always make some progress, even if an earlier load used up the budget.
+	while (!load.is_done() && (!progressed || get_current_time_nsecs() < deadline))
+	{
+		auto &progress = load.progress;
+
+		if (progress.stage == AsyncLoadStage::Parsing)
+		{
+			if (!load.parsed.load(memory_order_acquire))
+				break;
+
+			if (!load.error.empty())
+			{
+				LOGE("Failed to load scene %s: %s\n", load.path.c_str(), load.error.c_str());
+				progress.stage = AsyncLoadStage::Failed;
+			}
+			else
+				progress.stage = AsyncLoadStage::Hierarchy;
+		}
+		else if (progress.stage == AsyncLoadStage::Hierarchy)
+		{
+			progressed = true;
+
+			if (!load.subscene.parser)
+			{
+				try
+				{
+					load.root = load_scene_to_root_node(load.path);
+					attach_root();
+					progress.stage = AsyncLoadStage::Complete;
+				}
+				catch (const exception &e)
+				{
+					LOGE("Failed to load scene %s: %s\n", load.path.c_str(), e.what());
+					progress.stage = AsyncLoadStage::Failed;
+				}
+			}
+			else
+			{
+				if (!animation_system && !load.subscene.parser->get_animations().empty())
+				{
+					LOGW("Animation system was consumed before %s was loaded, its animations are dropped.\n",
+					     load.path.c_str());
+				}
+
+				load.root = build_tree_for_subscene(load.subscene, &load.pending);
+				attach_root();
+				add_environment(*load.subscene.parser);
+				begin_async_meshes(load);
+				progress.stage = AsyncLoadStage::Meshes;
+			}
+		}
+		else if (progress.stage == AsyncLoadStage::Meshes)
+		{
+			if (load.pending.empty())
+			{
+				progress.stage = AsyncLoadStage::Textures;
+				continue;
+			}
+
+			if (!load.sorted || distance(load.sorted_position, camera_position) > load.resort_distance)
+			{
+				// Most important last, so we can pop from the back.
+				const auto importance = [&](const DeferredRenderable &r) {
+					return r.radius / std::max(distance(r.center, camera_position), 1e-3f);
+				};
+				sort(begin(load.pending), end(load.pending), [&](const DeferredRenderable &a, const DeferredRenderable &b) {
+					return importance(a) < importance(b);
+				});
+				load.sorted_position = camera_position;
+				load.sorted = true;
+			}
+
+			auto renderable = move(load.pending.back());
+			load.pending.pop_back();
+
+			auto &mesh = load.subscene.meshes[renderable.mesh_index];
+			if (!mesh)
+				mesh = create_async_mesh(load, renderable.mesh_index);
+			scene->create_renderable(mesh, renderable.node.get());
+			progress.instances_created++;
+			progressed = true;
+		}
+		else if (progress.stage == AsyncLoadStage::Textures)
+		{
+			auto &parser = *load.subscene.parser;
+			if (progress.materials_resolved == progress.material_count)
+			{
+				// The scene holds on to the meshes now, the parser and its file mappings can go.
+				load.placeholder_materials.clear();
+				load.material_users.clear();
+				load.subscene.parser.reset();
+				progress.stage = AsyncLoadStage::Complete;
+				continue;
+			}
+
+			auto &users = load.material_users[progress.materials_resolved];
+			if (!users.empty())
+			{
+				auto material = Util::make_derived_handle<Material, MaterialFile>(
+						parser.get_materials()[progress.materials_resolved]);
+				for (auto *user : users)
+					user->material = material;
+			}
+
+			progress.materials_resolved++;
+			progressed = true;
+		}
+	}
+
+	if (load.callback && (progressed || load.progress.stage != old_stage))
+		load.callback(load.progress);
+
+	return get_current_time_nsecs() < deadline;
+}
+
+static void compute_world_transforms(const vector<SceneFormats::Node> &nodes, vector<mat4> &world,
+                                     uint32_t index, const mat4 &parent)
+{
+	auto &node = nodes[index];
+	compute_model_transform(world[index], node.transform.scale, node.transform.rotation,
+	                        node.transform.translation, parent);
+	for (auto &child : node.children)
+		compute_world_transforms(nodes, world, child, world[index]);
+}
+
+Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subscene,
+                                                       vector<DeferredRenderable> *deferred)
 {
 	auto &parser = *subscene.parser;
 	std::vector<Scene::NodeHandle> nodes;
@@ -96,7 +360,7 @@ Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subsc
 				auto skin_compat = parser.get_skins()[node.skin].skin_compat;
 				for (auto &animation : parser.get_animations())
 				{
-					if (animation.skin_compat == skin_compat)
+					if (animation_system && animation.skin_compat == skin_compat)
 					{
 						auto animation_id = animation_system->register_animation(animation.name, animation);
 						auto state_id = animation_system->start_animation(*nodeptr, animation_id, 0.0);
@@ -121,7 +385,7 @@ Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subsc
 
 	for (auto &animation : parser.get_animations())
 	{
-		if (!animation.skinning)
+		if (animation_system && !animation.skinning)
 		{
 			auto animation_id = animation_system->register_animation(animation.name, animation);
 			auto state_id = animation_system->start_animation_multi(nodes.data(), nodes.size(), animation_id, 0.0);
@@ -129,6 +393,15 @@ Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subsc
 		}
 	}
 
+	// Deferred renderables are created later in order of importance, which needs their bounds up front.
+	vector<mat4> world_transforms;
+	if (deferred)
+	{
+		world_transforms.resize(parser.get_nodes().size(), mat4(1.0f));
+		for (auto &scene_node_index : scene_nodes.node_indices)
+			compute_world_transforms(parser.get_nodes(), world_transforms, scene_node_index, mat4(1.0f));
+	}
+
 	unsigned i = 0;
 	for (auto &node : parser.get_nodes())
 	{
@@ -139,7 +412,15 @@ Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subsc
 					nodes[i]->add_child(nodes[child]);
 
 			for (auto &mesh : node.meshes)
-				scene->create_renderable(subscene.meshes[mesh], nodes[i].get());
+			{
+				if (deferred)
+				{
+					auto aabb = parser.get_meshes()[mesh].static_aabb.transform(world_transforms[i]);
+					deferred->push_back({ nodes[i], mesh, aabb.get_center(), aabb.get_radius() });
+				}
+				else
+					scene->create_renderable(subscene.meshes[mesh], nodes[i].get());
+			}
 		}
 		i++;
 	}
@@ -263,17 +544,11 @@ void SceneLoader::load_animation(const std::string &path, SceneFormats::Animatio
 	animation.update_length();
 }
 
-Scene::NodeHandle SceneLoader::parse_gltf(const std::string &path)
+void SceneLoader::add_environment(const GLTF::Parser &parser)
 {
-	SubsceneData subscene;
-	subscene.parser = make_unique<GLTF::Parser>(path);
-
-	for (auto &mesh : subscene.parser->get_meshes())
-		subscene.meshes.push_back(create_imported_mesh(mesh, subscene.parser->get_materials().data()));
-
-	if (!subscene.parser->get_environments().empty())
+	if (!parser.get_environments().empty())
 	{
-		auto &env = subscene.parser->get_environments().front();
+		auto &env = parser.get_environments().front();
 
 		Entity *entity = nullptr;
 		Util::IntrusivePtr<Skybox> skybox;
@@ -306,7 +581,17 @@ Scene::NodeHandle SceneLoader::parse_gltf(const std::string &path)
 			entity->allocate_component<EnvironmentComponent>()->fog = params;
 		}
 	}
+}
+
+Scene::NodeHandle SceneLoader::parse_gltf(const std::string &path)
+{
+	SubsceneData subscene;
+	subscene.parser = make_unique<GLTF::Parser>(path);
+
+	for (auto &mesh : subscene.parser->get_meshes())
+		subscene.meshes.push_back(create_imported_mesh(mesh, subscene.parser->get_materials().data()));
 
+	add_environment(*subscene.parser);
 	return build_tree_for_subscene(subscene);
 }
 
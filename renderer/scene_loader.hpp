@@ -25,6 +25,9 @@
 #include "scene.hpp"
 #include "gltf.hpp"
 #include "animation_system.hpp"
+#include "intrusive.hpp"
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -47,9 +50,47 @@ public:
 		return *scene;
 	}
 
+	// Animations of scenes whose hierarchy is built after this call are dropped.
 	std::unique_ptr<AnimationSystem> consume_animation_system();
 	AnimationSystem &get_animation_system();
 
+	enum class AsyncLoadStage
+	{
+		Parsing,
+		Hierarchy,
+		Meshes,
+		Textures,
+		Complete,
+		Failed
+	};
+
+	struct AsyncLoadProgress
+	{
+		AsyncLoadStage stage = AsyncLoadStage::Parsing;
+		unsigned instances_created = 0;
+		unsigned instance_count = 0;
+		unsigned materials_resolved = 0;
+		unsigned material_count = 0;
+	};
+	using AsyncLoadCallback = std::function<void (const AsyncLoadProgress &)>;
+
+	class AsyncLoad;
+	using AsyncLoadHandle = Util::IntrusivePtr<AsyncLoad>;
+
+	// Starts loading a glTF / GLB scene without blocking. Parsing runs on the thread group,
+	// and update_async_loads() then builds the scene incrementally from the main thread:
+	// the node hierarchy, animations and environment first, then meshes ordered by their projected size,
+	// then materials with textures.
+	// The root node is added to parent, or becomes the scene root if parent is null.
+	// Other scene formats are loaded in one go on the first update.
+	AsyncLoadHandle load_scene_async(const std::string &path, Scene::NodeHandle parent = {},
+	                                 AsyncLoadCallback callback = {});
+
+	// Call once per frame. Spends at most roughly budget_seconds on main thread work.
+	// camera_position is in the space of the loaded root node and decides which meshes are created first.
+	void update_async_loads(const vec3 &camera_position, double budget_seconds);
+	bool has_pending_async_loads() const;
+
 private:
 	struct SubsceneData
 	{
@@ -58,12 +99,71 @@ private:
 	};
 	std::unordered_map<std::string, SubsceneData> subscenes;
 
+	struct DeferredRenderable
+	{
+		Scene::NodeHandle node;
+		uint32_t mesh_index;
+		vec3 center;
+		float radius;
+	};
+
+public:
+	class AsyncLoad : public Util::IntrusivePtrEnabled<AsyncLoad, std::default_delete<AsyncLoad>, Util::MultiThreadCounter>
+	{
+	public:
+		const AsyncLoadProgress &get_progress() const
+		{
+			return progress;
+		}
+
+		bool is_done() const
+		{
+			return progress.stage == AsyncLoadStage::Complete || progress.stage == AsyncLoadStage::Failed;
+		}
+
+		// Valid once the hierarchy stage has run.
+		Scene::NodeHandle get_root_node() const
+		{
+			return root;
+		}
+
+	private:
+		friend class SceneLoader;
+		std::string path;
+		Scene::NodeHandle parent;
+		AsyncLoadCallback callback;
+		AsyncLoadProgress progress;
+
+		// Written by the parsing task, read on the main thread once parsed is set.
+		SubsceneData subscene;
+		std::string error;
+		std::atomic_bool parsed{false};
+
+		Scene::NodeHandle root;
+		std::vector<DeferredRenderable> pending;
+		vec3 sorted_position = vec3(0.0f);
+		float resort_distance = 0.0f;
+		bool sorted = false;
+
+		// Meshes waiting for their real material, indexed by material index.
+		std::vector<std::vector<StaticMesh *>> material_users;
+		std::vector<MaterialHandle> placeholder_materials;
+	};
+
+private:
+	std::vector<AsyncLoadHandle> async_loads;
+	bool step_async_load(AsyncLoad &load, const vec3 &camera_position, int64_t deadline);
+	void begin_async_meshes(AsyncLoad &load);
+	AbstractRenderableHandle create_async_mesh(AsyncLoad &load, uint32_t mesh_index);
+
 	std::unique_ptr<Scene> scene;
 	std::unique_ptr<AnimationSystem> animation_system;
 	Scene::NodeHandle parse_scene_format(const std::string &path, const std::string &json);
 	Scene::NodeHandle parse_gltf(const std::string &path);
+	void add_environment(const GLTF::Parser &parser);
 
-	Scene::NodeHandle build_tree_for_subscene(const SubsceneData &subscene);
+	Scene::NodeHandle build_tree_for_subscene(const SubsceneData &subscene,
+	                                          std::vector<DeferredRenderable> *deferred = nullptr);
 	void load_animation(const std::string &path, SceneFormats::Animation &animation);
 };
 }
\ No newline at end of file
@@ -67,6 +67,12 @@ Vulkan::Program *ShaderSuite::get_program(DrawPipeline pipeline, uint32_t attrib
 		return nullptr;
 	}
 
+	return program->get_program(get_variant(pipeline, attribute_mask, texture_mask, variant_id));
+}
+
+unsigned ShaderSuite::get_variant(DrawPipeline pipeline, uint32_t attribute_mask,
+                                  uint32_t texture_mask, uint32_t variant_id)
+{
 	Hasher h;
 	assert(base_define_hash != 0);
 	h.u64(base_define_hash);
@@ -119,11 +125,20 @@ Vulkan::Program *ShaderSuite::get_program(DrawPipeline pipeline, uint32_t attrib
 			defines.emplace_back("HAVE_EMISSIVEMAP", !!(texture_mask & MATERIAL_TEXTURE_EMISSIVE_BIT));
 		}
 
-		unsigned var_id = program->register_variant(defines);
+		unsigned var_id;
+		if ((texture_mask != 0 || variant_id != 0) && manager->get_async_variant_compile())
+		{
+			// Render with the untextured variant for the same vertex layout until the real one is ready.
+			unsigned fallback = get_variant(pipeline, attribute_mask, 0, 0);
+			var_id = program->register_variant_async(defines, fallback);
+		}
+		else
+			var_id = program->register_variant(defines);
+
 		variant = variants.emplace_yield(hash, var_id);
 	}
 
-	return program->get_program(variant->get());
+	return variant->get();
 }
 
 }
@@ -48,5 +48,7 @@ private:
 	Vulkan::ShaderProgram *program = nullptr;
 	Util::ThreadSafeIntrusiveHashMap<Util::IntrusivePODWrapper<unsigned>> variants;
 	std::vector<std::pair<std::string, int>> base_defines;
+
+	unsigned get_variant(DrawPipeline pipeline, uint32_t attribute_mask, uint32_t texture_mask, uint32_t variant_id);
 };
 }
\ No newline at end of file
@@ -23,9 +23,13 @@
 #include "gltf.hpp"
 #include "vulkan_headers.hpp"
 #include "filesystem.hpp"
+#include "global_managers.hpp"
+#include "thread_group.hpp"
+#include "scene_cache.hpp"
 #include "mesh.hpp"
 #include <unordered_map>
 #include <algorithm>
+#include <exception>
 #include "rapidjson_wrapper.hpp"
 #include "muglm/matrix_helper.hpp"
 
@@ -50,16 +54,22 @@ Parser::Buffer Parser::read_buffer(const string &path, uint64_t length)
 	if (!mapped)
 		throw runtime_error("Failed to map file.");
 
-	Buffer buf(length);
-	memcpy(buf.data(), mapped, length);
-	return buf;
+	mapped_files.push_back(move(file));
+	external_buffer_paths.push_back(path);
+	return { static_cast<const uint8_t *>(mapped), size_t(length) };
 }
 
 Parser::Buffer Parser::read_base64(const char *data, uint64_t length)
 {
-	Buffer buf(length);
-	auto *ptr = buf.data();
+	vector<uint8_t> buf(length);
+	decode_base64(buf.data(), data, length);
+	Buffer view = { buf.data(), buf.size() };
+	decoded_buffers.push_back(move(buf));
+	return view;
+}
 
+void Parser::decode_base64(uint8_t *ptr, const char *data, uint64_t length)
+{
 	const auto base64_index = [](char c) -> uint32_t {
 		if (c >= 'A' && c <= 'Z')
 			return uint32_t(c - 'A');
@@ -117,13 +127,24 @@ Parser::Buffer Parser::read_base64(const char *data, uint64_t length)
 
 		i += outbytes;
 	}
+}
 
-	return buf;
+Parser::~Parser()
+{
 }
 
 Parser::Parser(const std::string &path)
+	: Parser(path, Global::thread_group())
+{
+}
+
+Parser::Parser(const std::string &path, ThreadGroup *workers_, ParserFlags flags)
+	: workers(workers_)
 {
 	string json;
+	unique_ptr<Granite::File> glb_file;
+	size_t glb_binary_offset = 0;
+	size_t glb_binary_length = 0;
 
 	{
 		auto file = Global::filesystem()->open(path, FileMode::ReadOnly);
@@ -131,61 +152,108 @@ Parser::Parser(const std::string &path)
 			throw runtime_error("Failed to load GLTF file.");
 
 		auto size = file->get_size();
-		void *mapped = file->map();
-		if (!mapped)
-			throw runtime_error("Failed to map GLTF file.");
-
-		bool is_glb = false;
-
-		if (size >= 12 && memcmp("glTF", mapped, 4) == 0)
-			is_glb = true;
+		uint32_t words[5];
+		bool is_glb = size >= 12 && file->read(0, words, 12) == 12 && memcmp("glTF", words, 4) == 0;
 
 		if (is_glb)
 		{
-			// GLB is little endian. Just parse it lazily.
-			auto *words = static_cast<const uint32_t *>(mapped);
+			// GLB is little endian. Only the chunk headers and JSON are read here,
+			// the BIN chunk is not touched unless the scene has to be parsed.
 			if (words[1] != 2)
 				throw runtime_error("GLB version is not 2.");
 			if (words[2] > size)
 				throw runtime_error("GLB length is larger than the file size.");
 
 			auto glb_size = words[2];
-			words += 3;
-
-			auto json_length = words[0];
-			if (memcmp(&words[1], "JSON", 4) != 0)
+			if (file->read(12, words + 3, 8) != 8 || memcmp(&words[4], "JSON", 4) != 0)
 				throw runtime_error("Could not find JSON chunk.");
-			words += 2;
 
+			auto json_length = words[3];
 			if (json_length + 12 > glb_size)
 				throw logic_error("Header error, JSON chunk lengths out of range.");
 
-			json = string(reinterpret_cast<const char *>(words),
-			              reinterpret_cast<const char *>(words) + json_length);
-			words += (json_length + 3) >> 2;
+			json.resize(json_length);
+			if (file->read(20, &json[0], json_length) != json_length)
+				throw runtime_error("Failed to read JSON chunk.");
 
 			// If there is another chunk, it's BIN chunk.
 			if (json_length + 12 + 8 < glb_size)
 			{
-				auto binary_length = words[0];
-				if (memcmp(&words[1], "BIN\0", 4) != 0)
+				size_t binary_header_offset = 20 + ((json_length + 3) & ~3u);
+				uint32_t binary_header[2];
+				if (file->read(binary_header_offset, binary_header, 8) != 8 ||
+				    memcmp(&binary_header[1], "BIN\0", 4) != 0)
+				{
 					throw runtime_error("Could not find BIN chunk.");
-				words += 2;
+				}
 
+				auto binary_length = binary_header[0];
 				if (((binary_length + 3) & ~3) + ((json_length + 3) & ~3) + (2 * 2 + 3) * sizeof(uint32_t) != glb_size)
 					throw logic_error(
 							"Header error, binary chunk and JSON chunk lengths do not match up with GLB size.");
 
-				// The first buffer in the JSON must be this embedded buffer.
-				Buffer buffer(reinterpret_cast<const uint8_t *>(words),
-				              reinterpret_cast<const uint8_t *>(words) + binary_length);
-				json_buffers.push_back(move(buffer));
+				glb_binary_offset = binary_header_offset + 8;
+				glb_binary_length = binary_length;
+				glb_file = move(file);
 			}
 		}
 		else
-			json = string(static_cast<const char *>(mapped), static_cast<const char *>(mapped) + size);
+		{
+			json.resize(size);
+			if (file->read(0, &json[0], size) != size)
+				throw runtime_error("Failed to read GLTF file.");
+		}
+	}
+
+	bool use_cache = (flags & PARSER_BYPASS_SCENE_CACHE_BIT) == 0 && SceneCache::is_enabled();
+	Hash cache_key = 0;
+
+	if (use_cache)
+	{
+		cache_key = SceneCache::compute_key(path, json);
+		SceneCacheContents contents;
+		if (SceneCache::load(cache_key, contents))
+		{
+			swap_cache_contents(contents);
+			return;
+		}
 	}
+
+	if (glb_file)
+	{
+		// The first buffer in the JSON must be this embedded buffer.
+		// Reference it in-place, the mapping is kept alive until the parser is destroyed.
+		auto *binary = static_cast<const uint8_t *>(glb_file->map_range(glb_binary_offset, glb_binary_length));
+		if (!binary && glb_binary_length)
+			throw runtime_error("Failed to map BIN chunk.");
+		json_buffers.push_back({ binary, glb_binary_length });
+		mapped_files.push_back(move(glb_file));
+	}
+
 	parse(path, json);
+
+	if (use_cache)
+	{
+		SceneCacheContents contents;
+		swap_cache_contents(contents);
+		SceneCache::store(cache_key, contents);
+		swap_cache_contents(contents);
+	}
+}
+
+void Parser::swap_cache_contents(SceneCacheContents &contents)
+{
+	swap(meshes, contents.meshes);
+	swap(materials, contents.materials);
+	swap(nodes, contents.nodes);
+	swap(json_skins, contents.skins);
+	swap(animations, contents.animations);
+	swap(json_cameras, contents.cameras);
+	swap(json_lights, contents.lights);
+	swap(json_environments, contents.environments);
+	swap(json_scenes, contents.scenes);
+	swap(default_scene_index, contents.default_scene);
+	swap(external_buffer_paths, contents.dependencies);
 }
 
 #define GL_BYTE                           0x1400
@@ -856,7 +924,6 @@ void Parser::parse(const string &original_path, const string &json)
 				if (base64_data[str_length - 2] == '=')
 					data_length--;
 
-				auto base64_buffer = read_base64(uri + strlen(base64_type_jpg), data_length);
 				auto fake_path = string("memory://") + original_path + "_base64_" + to_string(json_images.size());
 
 				auto file = Global::filesystem()->open(fake_path, FileMode::WriteOnly);
@@ -867,7 +934,7 @@ void Parser::parse(const string &original_path, const string &json)
 				if (!mapped)
 					throw runtime_error("Failed to map memory file.");
 
-				memcpy(mapped, base64_buffer.data(), base64_buffer.size());
+				decode_base64(static_cast<uint8_t *>(mapped), base64_data, data_length);
 				json_images.push_back({ move(fake_path), swizzle });
 			}
 		}
@@ -1586,9 +1653,8 @@ static uint32_t padded_type_size(uint32_t type_size)
 		return type_size;
 }
 
-void Parser::build_primitive(const MeshData::AttributeData &prim)
+void Parser::build_primitive(const MeshData::AttributeData &prim, Mesh &mesh) const
 {
-	Mesh mesh;
 	mesh.topology = prim.topology;
 	mesh.primitive_restart = prim.primitive_restart;
 	mesh.has_material = prim.has_material;
@@ -1771,6 +1837,11 @@ void Parser::build_primitive(const MeshData::AttributeData &prim)
 				memcpy(&output[mesh.attribute_layout[i].offset + output_stride * v], weights, sizeof(weights));
 			}
 		}
+		else if (attr.stride == output_stride && mesh.attribute_layout[i].offset == 0 && type_size == output_stride)
+		{
+			// Tightly packed on both ends (typically positions), copy straight out of the mapped buffer.
+			memcpy(output.data(), &buffer[view.offset + attr.offset], size_t(vertex_count) * output_stride);
+		}
 		else
 		{
 			for (uint32_t v = 0; v < vertex_count; v++)
@@ -1804,6 +1875,12 @@ void Parser::build_primitive(const MeshData::AttributeData &prim)
 				*outdata = uint16_t((*indata == 0xff) ? 0xffff : *indata);
 			}
 		}
+		else if (type_size == 2 && indices.stride == sizeof(uint16_t))
+		{
+			mesh.indices.resize(sizeof(uint16_t) * index_count);
+			mesh.index_type = VK_INDEX_TYPE_UINT16;
+			memcpy(mesh.indices.data(), &buffer[offset], mesh.indices.size());
+		}
 		else if (type_size == 2)
 		{
 			mesh.indices.resize(sizeof(uint16_t) * index_count);
@@ -1826,6 +1903,12 @@ void Parser::build_primitive(const MeshData::AttributeData &prim)
 				*outdata = uint16_t(*indata);
 			}
 		}
+		else if (indices.stride == sizeof(uint32_t))
+		{
+			mesh.indices.resize(sizeof(uint32_t) * index_count);
+			mesh.index_type = VK_INDEX_TYPE_UINT32;
+			memcpy(mesh.indices.data(), &buffer[offset], mesh.indices.size());
+		}
 		else
 		{
 			mesh.indices.resize(sizeof(uint32_t) * index_count);
@@ -1844,26 +1927,69 @@ void Parser::build_primitive(const MeshData::AttributeData &prim)
 		mesh_recompute_normals(mesh);
 	if (rebuild_tangents)
 		mesh_recompute_tangents(mesh);
-
-	meshes.push_back(move(mesh));
 }
 
 void Parser::build_meshes()
 {
 	mesh_index_to_primitives.resize(json_meshes.size());
-	uint32_t primitive_count = 0;
+	vector<const MeshData::AttributeData *> primitives;
 	uint32_t mesh_count = 0;
 
 	for (auto &mesh : json_meshes)
 	{
 		for (auto &prim : mesh.primitives)
 		{
-			mesh_index_to_primitives[mesh_count].push_back(primitive_count);
-			build_primitive(prim);
-			primitive_count++;
+			mesh_index_to_primitives[mesh_count].push_back(uint32_t(primitives.size()));
+			primitives.push_back(&prim);
 		}
 		mesh_count++;
 	}
+
+	// Every primitive is built into its own slot, so the output order does not depend on scheduling.
+	meshes.resize(primitives.size());
+
+	unsigned num_threads = 0;
+	if (workers && !workers->current_thread_is_worker())
+		num_threads = workers->get_num_threads();
+
+	if (num_threads <= 1 || primitives.size() <= 1)
+	{
+		for (size_t i = 0; i < primitives.size(); i++)
+			build_primitive(*primitives[i], meshes[i]);
+		return;
+	}
+
+	// A few batches per worker evens out primitives of very different sizes.
+	size_t batch_count = std::min(primitives.size(), size_t(num_threads) * 4);
+	size_t batch_size = (primitives.size() + batch_count - 1) / batch_count;
+
+	mutex error_lock;
+	exception_ptr error;
+
+	auto task = workers->create_task();
+	for (size_t begin = 0; begin < primitives.size(); begin += batch_size)
+	{
+		size_t end = std::min(primitives.size(), begin + batch_size);
+		task->enqueue_task([&, begin, end]() {
+			try
+			{
+				for (size_t i = begin; i < end; i++)
+					build_primitive(*primitives[i], meshes[i]);
+			}
+			catch (...)
+			{
+				lock_guard<mutex> holder{error_lock};
+				if (!error)
+					error = current_exception();
+			}
+		});
+	}
+
+	task->flush();
+	task->wait();
+
+	if (error)
+		rethrow_exception(error);
 }
 
 }
@@ -24,9 +24,21 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include "math.hpp"
 #include "scene_formats.hpp"
 
+namespace Granite
+{
+class File;
+class ThreadGroup;
+
+namespace SceneFormats
+{
+struct SceneCacheContents;
+}
+}
+
 namespace GLTF
 {
 using namespace Granite;
@@ -52,10 +64,20 @@ enum class ScalarType
 	A2Bgr10Int
 };
 
+enum ParserFlagBits
+{
+	// Always parse from source and leave the scene cache untouched, e.g. for benchmarking the parser itself.
+	PARSER_BYPASS_SCENE_CACHE_BIT = 1 << 0
+};
+using ParserFlags = uint32_t;
+
 class Parser
 {
 public:
 	explicit Parser(const std::string &path);
+	// Primitives are built in parallel on workers unless it is null.
+	Parser(const std::string &path, Granite::ThreadGroup *workers, ParserFlags flags = 0);
+	~Parser();
 
 	const std::vector<SceneNodes> &get_scenes() const
 	{
@@ -108,7 +130,28 @@ public:
 	}
 
 private:
-	using Buffer = std::vector<uint8_t>;
+	// Buffers point straight into the mapped .glb / .bin files (or decoded base64 data),
+	// which stay alive for the lifetime of the parser, so nothing is copied until meshes are built.
+	struct Buffer
+	{
+		const uint8_t *ptr;
+		size_t length;
+
+		const uint8_t *data() const
+		{
+			return ptr;
+		}
+
+		size_t size() const
+		{
+			return length;
+		}
+
+		const uint8_t &operator[](size_t index) const
+		{
+			return ptr[index];
+		}
+	};
 
 	struct BufferView
 	{
@@ -166,13 +209,18 @@ private:
 	std::vector<Mesh> meshes;
 	std::vector<MaterialInfo> materials;
 	static VkFormat components_to_padded_format(ScalarType type, uint32_t components);
-	static Buffer read_buffer(const std::string &path, uint64_t length);
-	static Buffer read_base64(const char *data, uint64_t length);
+	Buffer read_buffer(const std::string &path, uint64_t length);
+	Buffer read_base64(const char *data, uint64_t length);
+	static void decode_base64(uint8_t *ptr, const char *data, uint64_t length);
 	static uint32_t type_stride(ScalarType type);
 	static void resolve_component_type(uint32_t component_type, const char *type, bool normalized,
 	                                   ScalarType &scalar_type, uint32_t &components, uint32_t &stride);
 
 	std::vector<Buffer> json_buffers;
+	std::vector<std::unique_ptr<Granite::File>> mapped_files;
+	std::vector<std::vector<uint8_t>> decoded_buffers;
+	std::vector<std::string> external_buffer_paths;
+	void swap_cache_contents(SceneCacheContents &contents);
 	std::vector<BufferView> json_views;
 	std::vector<Accessor> json_accessors;
 	std::vector<MeshData> json_meshes;
@@ -193,8 +241,9 @@ private:
 	std::vector<SceneNodes> json_scenes;
 	uint32_t default_scene_index = 0;
 
+	Granite::ThreadGroup *workers = nullptr;
 	void build_meshes();
-	void build_primitive(const MeshData::AttributeData &prim);
+	void build_primitive(const MeshData::AttributeData &prim, Mesh &mesh) const;
 
 	void extract_attribute(std::vector<float> &attributes, const Accessor &accessor);
 	void extract_attribute(std::vector<vec3> &attributes, const Accessor &accessor);
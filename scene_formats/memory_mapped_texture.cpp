@@ -102,20 +102,38 @@ void MemoryMappedTexture::set_cube(VkFormat format, uint32_t size, uint32_t cube
 	cube = true;
 }
 
+void MemoryMappedTexture::fill_header(void *header_) const
+{
+	MemoryMappedHeader header = {};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.width = layout.get_width();
+	header.height = layout.get_height();
+	header.depth = layout.get_depth();
+	header.flags = get_flags();
+	header.layers = layout.get_layers();
+	header.levels = layout.get_levels();
+	header.payload_size = layout.get_required_size();
+	header.type = layout.get_image_type();
+	header.format = layout.get_format();
+	memcpy(header_, &header, sizeof(header));
+}
+
 bool MemoryMappedTexture::copy_to_path(const std::string &path)
 {
-	if (layout.get_required_size() == 0 || !mapped)
+	if (layout.get_required_size() == 0 || !layout.get_buffer())
 		return false;
 
 	auto target_file = Global::filesystem()->open(path, FileMode::WriteOnly);
 	if (!target_file)
 		return false;
 
-	void *new_mapped = target_file->map_write(get_required_size());
+	auto *new_mapped = static_cast<uint8_t *>(target_file->map_write(get_required_size()));
 	if (!new_mapped)
 		return false;
 
-	memcpy(new_mapped, mapped, get_required_size());
+	// The payload is not necessarily preceded by a header in memory, see map_read_levels().
+	fill_header(new_mapped);
+	memcpy(new_mapped + sizeof(MemoryMappedHeader), layout.get_buffer(), layout.get_required_size());
 	target_file->unmap();
 	return true;
 }
@@ -124,21 +142,8 @@ bool MemoryMappedTexture::map_write(unique_ptr<Granite::File> new_file, void *ma
 {
 	file = move(new_file);
 	mapped = static_cast<uint8_t *>(mapped_);
-
-	MemoryMappedHeader header = {};
-	memcpy(header.magic, MAGIC, sizeof(MAGIC));
-	header.width = layout.get_width();
-	header.height = layout.get_height();
-	header.depth = layout.get_depth();
-	header.flags = get_flags();
-	header.layers = layout.get_layers();
-	header.levels = layout.get_levels();
-	header.payload_size = layout.get_required_size();
-	header.type = layout.get_image_type();
-	header.format = layout.get_format();
-	memcpy(mapped, &header, sizeof(header));
-
-	layout.set_buffer(mapped + sizeof(header), layout.get_required_size());
+	fill_header(mapped);
+	layout.set_buffer(mapped + sizeof(MemoryMappedHeader), layout.get_required_size());
 	return true;
 }
 
@@ -199,11 +204,10 @@ void MemoryMappedTexture::make_local_copy()
 	if (empty())
 		return;
 
-	auto new_file = make_unique<ScratchFile>(mapped, get_required_size());
-	file = move(new_file);
-	mapped = static_cast<uint8_t *>(file->map());
-	layout.set_buffer(static_cast<uint8_t *>(mapped) + sizeof(MemoryMappedHeader),
-	                  get_required_size() - sizeof(MemoryMappedHeader));
+	auto new_file = make_unique<ScratchFile>(nullptr, get_required_size());
+	auto *new_mapped = static_cast<uint8_t *>(new_file->map());
+	memcpy(new_mapped + sizeof(MemoryMappedHeader), layout.get_buffer(), layout.get_required_size());
+	map_write(move(new_file), new_mapped);
 }
 
 bool MemoryMappedTexture::map_write_scratch()
@@ -285,12 +289,9 @@ bool MemoryMappedTexture::map_copy(const void *mapped_, size_t size)
 	return map_read(move(new_file), new_mapped);
 }
 
-bool MemoryMappedTexture::map_read(unique_ptr<Granite::File> new_file, void *mapped_)
+bool MemoryMappedTexture::parse_header(const void *header_)
 {
-	mapped = static_cast<uint8_t *>(mapped_);
-	file = move(new_file);
-
-	auto *header = reinterpret_cast<const MemoryMappedHeader *>(mapped);
+	auto *header = static_cast<const MemoryMappedHeader *>(header_);
 	switch (header->type)
 	{
 	case VK_IMAGE_TYPE_1D:
@@ -315,6 +316,17 @@ bool MemoryMappedTexture::map_read(unique_ptr<Granite::File> new_file, void *map
 	swizzle.g = static_cast<VkComponentSwizzle>((header->flags >> MEMORY_MAPPED_TEXTURE_SWIZZLE_G_SHIFT) & MEMORY_MAPPED_TEXTURE_SWIZZLE_MASK);
 	swizzle.b = static_cast<VkComponentSwizzle>((header->flags >> MEMORY_MAPPED_TEXTURE_SWIZZLE_B_SHIFT) & MEMORY_MAPPED_TEXTURE_SWIZZLE_MASK);
 	swizzle.a = static_cast<VkComponentSwizzle>((header->flags >> MEMORY_MAPPED_TEXTURE_SWIZZLE_A_SHIFT) & MEMORY_MAPPED_TEXTURE_SWIZZLE_MASK);
+	return true;
+}
+
+bool MemoryMappedTexture::map_read(unique_ptr<Granite::File> new_file, void *mapped_)
+{
+	mapped = static_cast<uint8_t *>(mapped_);
+	file = move(new_file);
+
+	auto *header = reinterpret_cast<const MemoryMappedHeader *>(mapped);
+	if (!parse_header(header))
+		return false;
 
 	if ((layout.get_required_size() + sizeof(MemoryMappedHeader)) < file->get_size())
 		return false;
@@ -341,6 +353,66 @@ bool MemoryMappedTexture::map_read(const std::string &path)
 	return map_read(move(loaded_file), new_mapped);
 }
 
+bool MemoryMappedTexture::map_read_levels(const std::string &path, unsigned base_level)
+{
+	auto loaded_file = Granite::Global::filesystem()->open(path, Granite::FileMode::ReadOnly);
+	if (!loaded_file || !read_header(*loaded_file))
+		return false;
+	if (base_level >= layout.get_levels())
+		return false;
+
+	// Mip levels are laid out back to back with aligned offsets, so the tail of the chain
+	// is laid out exactly like a full chain starting at the base level's size.
+	size_t base_offset = layout.get_mip_info(base_level).offset;
+	size_t tail_size = layout.get_required_size() - base_offset;
+	uint32_t width = layout.get_width(base_level);
+	uint32_t height = layout.get_height(base_level);
+	uint32_t depth = layout.get_depth(base_level);
+	uint32_t levels = layout.get_levels() - base_level;
+
+	switch (layout.get_image_type())
+	{
+	case VK_IMAGE_TYPE_1D:
+		layout.set_1d(layout.get_format(), width, layout.get_layers(), levels);
+		break;
+
+	case VK_IMAGE_TYPE_2D:
+		layout.set_2d(layout.get_format(), width, height, layout.get_layers(), levels);
+		break;
+
+	default:
+		layout.set_3d(layout.get_format(), width, height, depth, levels);
+		break;
+	}
+
+	if (layout.get_required_size() != tail_size)
+		return false;
+
+	void *payload = loaded_file->map_range(sizeof(MemoryMappedHeader) + base_offset, tail_size);
+	if (!payload)
+		return false;
+
+	file = move(loaded_file);
+	mapped = nullptr;
+	layout.set_buffer(payload, tail_size);
+	return true;
+}
+
+bool MemoryMappedTexture::read_header(Granite::File &header_file)
+{
+	MemoryMappedHeader header;
+	if (header_file.read(0, &header, sizeof(header)) != sizeof(header) || !is_header(&header, sizeof(header)))
+		return false;
+
+	if (!parse_header(&header) || header.payload_size != layout.get_required_size())
+		return false;
+
+	file.reset();
+	mapped = nullptr;
+	layout.set_buffer(nullptr, 0);
+	return true;
+}
+
 bool MemoryMappedTexture::is_header(const void *mapped_, size_t size)
 {
 	if (size < sizeof(MemoryMappedHeader))
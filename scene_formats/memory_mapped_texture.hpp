@@ -55,6 +55,12 @@ public:
 	bool map_write(std::unique_ptr<Granite::File> file, void *mapped);
 	bool map_read(const std::string &path);
 	bool map_read(std::unique_ptr<Granite::File> file, void *mapped);
+	// Reads only mip levels base_level and smaller, which become levels 0 and up of this texture.
+	// The larger levels are never read, which is useful for loading a low resolution version of a big texture.
+	bool map_read_levels(const std::string &path, unsigned base_level);
+	// Parses the header only, the layout describes the full texture but has no data.
+	// Useful to decide which levels to read with map_read_levels().
+	bool read_header(Granite::File &file);
 	bool map_copy(const void *mapped, size_t size);
 	bool map_write_scratch();
 	bool copy_to_path(const std::string &path);
@@ -81,6 +87,9 @@ public:
 	}
 
 private:
+	bool parse_header(const void *header);
+	void fill_header(void *header) const;
+
 	Vulkan::TextureFormatLayout layout;
 	std::unique_ptr<Granite::File> file;
 	uint8_t *mapped = nullptr;
@@ -0,0 +1,620 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "scene_cache.hpp"
+#include "filesystem.hpp"
+#include "global_managers.hpp"
+#include "logging.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+
+using namespace std;
+using namespace Util;
+
+namespace Granite
+{
+namespace SceneFormats
+{
+// Bump whenever the layout of the serialized structs changes.
+static const uint32_t SceneCacheVersion = 1;
+static const uint64_t SceneCacheMagic = 0x4e435345544e5247ull; // "GRNTESCN" in little endian.
+static const size_t SceneCacheAlignment = 16;
+
+struct SceneCacheHeader
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t payload_size;
+};
+
+namespace
+{
+// Writer and Reader expose the same interface, so one serialize() per type handles both directions.
+class Writer
+{
+public:
+	template <typename T>
+	void value(const T &v)
+	{
+		static_assert(is_trivially_copyable<T>::value, "Type must be trivially copyable.");
+		raw(&v, sizeof(v));
+	}
+
+	void string(const std::string &str)
+	{
+		value(uint32_t(str.size()));
+		raw(str.data(), str.size());
+	}
+
+	template <typename T>
+	void pod_array(const vector<T> &v)
+	{
+		static_assert(is_trivially_copyable<T>::value, "Type must be trivially copyable.");
+		value(uint64_t(v.size()));
+		align();
+		raw(v.data(), v.size() * sizeof(T));
+	}
+
+	size_t count(size_t count)
+	{
+		value(uint64_t(count));
+		return count;
+	}
+
+	vector<uint8_t> buffer;
+
+private:
+	void raw(const void *data, size_t size)
+	{
+		auto *bytes = static_cast<const uint8_t *>(data);
+		buffer.insert(end(buffer), bytes, bytes + size);
+	}
+
+	void align()
+	{
+		// The header is also a multiple of the alignment, so offsets in the file match.
+		buffer.resize((buffer.size() + SceneCacheAlignment - 1) & ~(SceneCacheAlignment - 1));
+	}
+};
+
+class Reader
+{
+public:
+	Reader(const uint8_t *data_, size_t size_)
+		: data(data_), size(size_)
+	{
+	}
+
+	template <typename T>
+	void value(T &v)
+	{
+		static_assert(is_trivially_copyable<T>::value, "Type must be trivially copyable.");
+		if (check(sizeof(T)))
+		{
+			memcpy(&v, data + offset, sizeof(T));
+			offset += sizeof(T);
+		}
+		else
+			memset(&v, 0, sizeof(T));
+	}
+
+	void string(std::string &str)
+	{
+		uint32_t len = 0;
+		value(len);
+		if (check(len))
+		{
+			str.assign(reinterpret_cast<const char *>(data + offset), len);
+			offset += len;
+		}
+		else
+			str.clear();
+	}
+
+	template <typename T>
+	void pod_array(vector<T> &v)
+	{
+		uint64_t len = 0;
+		value(len);
+		align();
+		if (len <= size / sizeof(T) && check(len * sizeof(T)))
+		{
+			v.resize(len);
+			memcpy(v.data(), data + offset, len * sizeof(T));
+			offset += len * sizeof(T);
+		}
+		else
+		{
+			failed = true;
+			v.clear();
+		}
+	}
+
+	size_t count(size_t)
+	{
+		// Every element takes at least one byte, which bounds the allocation on corrupt input.
+		uint64_t len = 0;
+		value(len);
+		if (len > size - offset)
+		{
+			failed = true;
+			return 0;
+		}
+		return size_t(len);
+	}
+
+	bool is_complete() const
+	{
+		return !failed && offset == size;
+	}
+
+private:
+	const uint8_t *data;
+	size_t size;
+	size_t offset = 0;
+	bool failed = false;
+
+	bool check(uint64_t bytes)
+	{
+		if (failed || bytes > size - offset)
+		{
+			failed = true;
+			return false;
+		}
+		return true;
+	}
+
+	void align()
+	{
+		size_t aligned = (offset + SceneCacheAlignment - 1) & ~(SceneCacheAlignment - 1);
+		if (aligned > size)
+			failed = true;
+		else
+			offset = aligned;
+	}
+};
+}
+
+template <typename Stream, typename T>
+static void serialize_array(Stream &s, vector<T> &v);
+
+template <typename Stream>
+static void serialize(Stream &s, MaterialInfo::Texture &tex)
+{
+	s.string(tex.path);
+	s.value(tex.swizzle);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, Mesh &mesh)
+{
+	s.pod_array(mesh.positions);
+	s.pod_array(mesh.attributes);
+	s.pod_array(mesh.indices);
+	s.value(mesh.position_stride);
+	s.value(mesh.attribute_stride);
+	s.value(mesh.attribute_layout);
+	s.value(mesh.index_type);
+	s.value(mesh.topology);
+	s.value(mesh.material_index);
+	s.value(mesh.has_material);
+	s.value(mesh.primitive_restart);
+	s.value(mesh.static_aabb);
+	s.value(mesh.count);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, MaterialInfo &info)
+{
+	serialize(s, info.base_color);
+	serialize(s, info.normal);
+	serialize(s, info.metallic_roughness);
+	serialize(s, info.occlusion);
+	serialize(s, info.emissive);
+	s.value(info.uniform_base_color);
+	s.value(info.uniform_emissive_color);
+	s.value(info.uniform_metallic);
+	s.value(info.uniform_roughness);
+	s.value(info.normal_scale);
+	s.value(info.pipeline);
+	s.value(info.sampler);
+	s.value(info.two_sided);
+	s.value(info.bandlimited_pixel);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, Node &node)
+{
+	s.pod_array(node.meshes);
+	s.pod_array(node.children);
+	s.value(node.transform);
+	s.value(node.skin);
+	s.value(node.has_skin);
+	s.value(node.joint);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, Skin::Bone &bone)
+{
+	s.value(bone.index);
+	serialize_array(s, bone.children);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, Skin &skin)
+{
+	s.pod_array(skin.inverse_bind_pose);
+	s.pod_array(skin.joint_transforms);
+	serialize_array(s, skin.skeletons);
+	s.value(skin.skin_compat);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, AnimationChannel &channel)
+{
+	s.value(channel.node_index);
+	s.value(channel.type);
+	s.pod_array(channel.timestamps);
+	s.pod_array(channel.linear.values);
+	s.pod_array(channel.spherical.values);
+	s.pod_array(channel.cubic.values);
+	s.value(channel.joint_index);
+	s.value(channel.joint);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, Animation &animation)
+{
+	serialize_array(s, animation.channels);
+	s.string(animation.name);
+	s.value(animation.length);
+	s.value(animation.skin_compat);
+	s.value(animation.skinning);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, CameraInfo &camera)
+{
+	s.string(camera.name);
+	s.value(camera.node_index);
+	s.value(camera.type);
+	s.value(camera.aspect_ratio);
+	s.value(camera.znear);
+	s.value(camera.zfar);
+	s.value(camera.yfov);
+	s.value(camera.xmag);
+	s.value(camera.ymag);
+	s.value(camera.attached_to_node);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, LightInfo &light)
+{
+	s.string(light.name);
+	s.value(light.node_index);
+	s.value(light.type);
+	s.value(light.inner_cone);
+	s.value(light.outer_cone);
+	s.value(light.color);
+	s.value(light.range);
+	s.value(light.attached_to_node);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, EnvironmentInfo &env)
+{
+	serialize(s, env.cube);
+	serialize(s, env.reflection);
+	serialize(s, env.irradiance);
+	s.value(env.intensity);
+	s.value(env.fog);
+}
+
+template <typename Stream>
+static void serialize(Stream &s, SceneNodes &nodes)
+{
+	s.string(nodes.name);
+	s.pod_array(nodes.node_indices);
+}
+
+template <typename Stream, typename T>
+static void serialize_array(Stream &s, vector<T> &v)
+{
+	v.resize(s.count(v.size()));
+	for (auto &elem : v)
+		serialize(s, elem);
+}
+
+struct FileDependency
+{
+	std::string path;
+	uint64_t size;
+	uint64_t last_modified;
+};
+
+template <typename Stream>
+static void serialize(Stream &s, FileDependency &dep)
+{
+	s.string(dep.path);
+	s.value(dep.size);
+	s.value(dep.last_modified);
+}
+
+struct MemoryFile
+{
+	std::string path;
+	vector<uint8_t> data;
+};
+
+template <typename Stream>
+static void serialize(Stream &s, MemoryFile &file)
+{
+	s.string(file.path);
+	s.pod_array(file.data);
+}
+
+// Dependencies are stored in front of this, so a stale entry is rejected before decoding the rest.
+template <typename Stream>
+static void serialize_payload(Stream &s, SceneCacheContents &contents, vector<MemoryFile> &memory_files)
+{
+	serialize_array(s, memory_files);
+	serialize_array(s, contents.meshes);
+	serialize_array(s, contents.materials);
+	serialize_array(s, contents.nodes);
+	serialize_array(s, contents.skins);
+	serialize_array(s, contents.animations);
+	serialize_array(s, contents.cameras);
+	serialize_array(s, contents.lights);
+	serialize_array(s, contents.environments);
+	serialize_array(s, contents.scenes);
+	s.value(contents.default_scene);
+}
+
+static const char SceneCacheProtocol[] = "cache";
+static const char SceneCacheDirectory[] = "scene-cache";
+
+// Relative to the cache protocol.
+static string get_scene_cache_entry(Hash key)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%016llx.scene", SceneCacheDirectory, static_cast<unsigned long long>(key));
+	return path;
+}
+
+static string get_scene_cache_path(Hash key)
+{
+	return string(SceneCacheProtocol) + "://" + get_scene_cache_entry(key);
+}
+
+static uint64_t get_scene_cache_max_size()
+{
+	uint64_t max_mib = 2048;
+	if (const char *env = getenv("GRANITE_SCENE_CACHE_MAX_MIB"))
+		max_mib = strtoull(env, nullptr, 0);
+	return max_mib * 1024 * 1024;
+}
+
+// Removes the oldest entries until the cache fits its budget again. The entry which was just written is kept.
+static void evict_scene_cache_entries(Hash keep_key)
+{
+	auto *backend = Global::filesystem()->get_backend(SceneCacheProtocol);
+	if (!backend)
+		return;
+
+	auto entries = backend->walk_stat(SceneCacheDirectory);
+	uint64_t total_size = 0;
+	for (auto &entry : entries)
+		if (entry.stat.type == PathType::File)
+			total_size += entry.stat.size;
+
+	uint64_t max_size = get_scene_cache_max_size();
+	if (total_size <= max_size)
+		return;
+
+	sort(begin(entries), end(entries), [](const WalkEntry &a, const WalkEntry &b) {
+		return a.stat.last_modified < b.stat.last_modified;
+	});
+
+	auto keep = get_scene_cache_entry(keep_key);
+	for (auto &entry : entries)
+	{
+		if (total_size <= max_size)
+			break;
+		if (entry.stat.type != PathType::File || entry.path == keep)
+			continue;
+
+		if (backend->remove(entry.path))
+		{
+			LOGI("Evicted scene cache entry %s.\n", entry.path.c_str());
+			total_size -= entry.stat.size;
+		}
+	}
+}
+
+static bool is_memory_path(const std::string &path)
+{
+	return path.compare(0, 9, "memory://") == 0;
+}
+
+bool SceneCache::is_enabled()
+{
+	const char *env = getenv("GRANITE_SCENE_CACHE");
+	return !env || strtoul(env, nullptr, 0) != 0;
+}
+
+Hash SceneCache::compute_key(const std::string &path, const std::string &json)
+{
+	WordHasher h;
+	h.u32(SceneCacheVersion);
+
+	// Struct layouts are stored verbatim, so different math library layouts must not share entries.
+	h.u32(uint32_t(sizeof(vec3)));
+	h.u32(uint32_t(sizeof(quat)));
+	h.u32(uint32_t(sizeof(mat4)));
+	h.u32(uint32_t(sizeof(AABB)));
+	h.u32(uint32_t(sizeof(MeshAttributeLayout)));
+
+	h.data(path.data(), path.size());
+	h.data(json.data(), json.size());
+
+	// Binary data of a GLB is covered by size and modification time rather than by hashing gigabytes.
+	FileStat s;
+	if (Global::filesystem()->stat(path, s))
+	{
+		h.u64(s.size);
+		h.u64(s.last_modified);
+	}
+
+	return h.get();
+}
+
+bool SceneCache::load(Hash key, SceneCacheContents &contents)
+{
+	auto file = Global::filesystem()->open(get_scene_cache_path(key), FileMode::ReadOnly);
+	if (!file)
+		return false;
+
+	size_t size = file->get_size();
+	auto *mapped = static_cast<const uint8_t *>(file->map());
+	if (!mapped || size < sizeof(SceneCacheHeader))
+		return false;
+
+	SceneCacheHeader header;
+	memcpy(&header, mapped, sizeof(header));
+	if (header.magic != SceneCacheMagic || header.version != SceneCacheVersion || header.key != key ||
+	    header.payload_size != size - sizeof(header))
+	{
+		LOGW("Ignoring corrupt scene cache entry %016llx.\n", static_cast<unsigned long long>(key));
+		return false;
+	}
+
+	Reader reader(mapped + sizeof(header), size_t(header.payload_size));
+
+	vector<FileDependency> dependencies;
+	serialize_array(reader, dependencies);
+	for (auto &dep : dependencies)
+	{
+		FileStat s;
+		if (!Global::filesystem()->stat(dep.path, s) || s.size != dep.size || s.last_modified != dep.last_modified)
+		{
+			LOGI("Scene cache entry %016llx is stale, %s changed.\n",
+			     static_cast<unsigned long long>(key), dep.path.c_str());
+			return false;
+		}
+	}
+
+	SceneCacheContents loaded;
+	vector<MemoryFile> memory_files;
+	serialize_payload(reader, loaded, memory_files);
+
+	if (!reader.is_complete())
+	{
+		LOGW("Ignoring corrupt scene cache entry %016llx.\n", static_cast<unsigned long long>(key));
+		return false;
+	}
+
+	for (auto &memory_file : memory_files)
+	{
+		auto out = Global::filesystem()->open(memory_file.path, FileMode::WriteOnly);
+		void *dst = out ? out->map_write(memory_file.data.size()) : nullptr;
+		if (!dst)
+			return false;
+		memcpy(dst, memory_file.data.data(), memory_file.data.size());
+	}
+
+	for (auto &dep : dependencies)
+		loaded.dependencies.push_back(move(dep.path));
+	contents = move(loaded);
+	return true;
+}
+
+bool SceneCache::store(Hash key, const SceneCacheContents &contents)
+{
+	vector<FileDependency> dependencies;
+	for (auto &path : contents.dependencies)
+	{
+		FileStat s;
+		if (!Global::filesystem()->stat(path, s))
+			return false;
+		dependencies.push_back({ path, s.size, s.last_modified });
+	}
+
+	vector<MemoryFile> memory_files;
+	const auto add_memory_file = [&](const std::string &path) {
+		if (!is_memory_path(path))
+			return true;
+		for (auto &file : memory_files)
+			if (file.path == path)
+				return true;
+
+		auto file = Global::filesystem()->open(path, FileMode::ReadOnly);
+		auto *mapped = file ? static_cast<const uint8_t *>(file->map()) : nullptr;
+		if (!mapped)
+			return false;
+		memory_files.push_back({ path, vector<uint8_t>(mapped, mapped + file->get_size()) });
+		return true;
+	};
+
+	for (auto &material : contents.materials)
+	{
+		if (!add_memory_file(material.base_color.path) ||
+		    !add_memory_file(material.normal.path) ||
+		    !add_memory_file(material.metallic_roughness.path) ||
+		    !add_memory_file(material.occlusion.path) ||
+		    !add_memory_file(material.emissive.path))
+		{
+			return false;
+		}
+	}
+
+	Writer writer;
+	writer.buffer.resize(sizeof(SceneCacheHeader));
+	static_assert(sizeof(SceneCacheHeader) % SceneCacheAlignment == 0, "Header must keep payload aligned.");
+
+	// Writing does not modify anything, only the Reader needs non-const access.
+	serialize_array(writer, dependencies);
+	serialize_payload(writer, const_cast<SceneCacheContents &>(contents), memory_files);
+
+	SceneCacheHeader header = {};
+	header.magic = SceneCacheMagic;
+	header.version = SceneCacheVersion;
+	header.key = key;
+	header.payload_size = writer.buffer.size() - sizeof(header);
+	memcpy(writer.buffer.data(), &header, sizeof(header));
+
+	// Not having a writable cache is not an error, we just parse again next time.
+	if (!Global::filesystem()->write_buffer_to_file(get_scene_cache_path(key),
+	                                               writer.buffer.data(), writer.buffer.size()))
+	{
+		return false;
+	}
+
+	evict_scene_cache_entries(key);
+	return true;
+}
+}
+}
@@ -0,0 +1,70 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "scene_formats.hpp"
+#include "hash.hpp"
+#include <string>
+#include <vector>
+
+namespace Granite
+{
+namespace SceneFormats
+{
+// Everything a parsed scene consists of, with meshes already in their final vertex layout.
+struct SceneCacheContents
+{
+	std::vector<Mesh> meshes;
+	std::vector<MaterialInfo> materials;
+	std::vector<Node> nodes;
+	std::vector<Skin> skins;
+	std::vector<Animation> animations;
+	std::vector<CameraInfo> cameras;
+	std::vector<LightInfo> lights;
+	std::vector<EnvironmentInfo> environments;
+	std::vector<SceneNodes> scenes;
+	uint32_t default_scene = 0;
+
+	// Files other than the source file itself which the scene was built from, e.g. external .bin buffers.
+	// If any of them changed size or modification time, the cache entry is stale.
+	std::vector<std::string> dependencies;
+};
+
+// Compact binary cache of parsed scenes, stored as one file per entry under cache://scene-cache/.
+// Mesh data is laid out 16-byte aligned in the file, so loading is a map and a few bulk copies.
+// Once the entries exceed GRANITE_SCENE_CACHE_MAX_MIB (2048 by default), the oldest ones are evicted on store.
+// memory:// textures referenced by materials (images embedded in a GLB) are stored alongside and recreated on load.
+class SceneCache
+{
+public:
+	// Combines the source file identity with the cache format, so entries from older builds are never used.
+	static Util::Hash compute_key(const std::string &path, const std::string &json);
+
+	static bool load(Util::Hash key, SceneCacheContents &contents);
+	static bool store(Util::Hash key, const SceneCacheContents &contents);
+
+	// Set GRANITE_SCENE_CACHE=0 to always parse from source.
+	static bool is_enabled();
+};
+}
+}
@@ -0,0 +1,148 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Hammers DeviceAllocator with small allocations from several threads, like asset streaming does,
+// and reports throughput with and without the per-thread allocation caches.
+
+#include "device.hpp"
+#include "timer.hpp"
+#include "logging.hpp"
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifdef GRANITE_VULKAN_MT
+#include "thread_id.hpp"
+#endif
+
+using namespace Vulkan;
+
+static bool run_stress(Device &device, uint32_t memory_type, unsigned num_threads, unsigned iterations,
+                       bool thread_cache)
+{
+	DeviceAllocator allocator;
+	allocator.init(&device);
+
+	// Thread index 0 belongs to the main thread.
+	if (thread_cache)
+		allocator.init_thread_caches(num_threads + 1);
+
+	std::atomic_bool failed;
+	failed.store(false);
+
+	std::vector<std::thread> threads;
+	int64_t start = Util::get_current_time_nsecs();
+
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&, i]() {
+#ifdef GRANITE_VULKAN_MT
+			register_thread_index(i + 1);
+#endif
+
+			// Keep a window of live allocations around so frees are interleaved with allocations.
+			std::vector<DeviceAllocation> live(64);
+			uint32_t seed = 1 + i * 7919u;
+
+			for (unsigned iter = 0; iter < iterations; iter++)
+			{
+				auto &slot = live[iter % live.size()];
+				slot.free_immediate();
+
+				// 64 bytes to 2 KiB.
+				seed = seed * 1103515245u + 12345u;
+				uint32_t size = 64u << ((seed >> 16) % 6);
+
+				if (!allocator.allocate(size, 16, memory_type, ALLOCATION_TILING_LINEAR, &slot))
+				{
+					failed.store(true);
+					break;
+				}
+			}
+
+			for (auto &slot : live)
+				slot.free_immediate();
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	int64_t end = Util::get_current_time_nsecs();
+
+	if (failed.load())
+	{
+		LOGE("Allocation failed.\n");
+		return false;
+	}
+
+	double seconds = double(end - start) * 1e-9;
+	double operations = 2.0 * double(num_threads) * double(iterations);
+	LOGI("%u threads, thread cache %s: %.3f Mops/s (%.1f ns / allocation + free).\n",
+	     num_threads, thread_cache ? "on " : "off",
+	     1e-6 * operations / seconds, 2e9 * seconds / operations);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned num_threads = argc >= 2 ? unsigned(strtoul(argv[1], nullptr, 0)) : std::thread::hardware_concurrency();
+	unsigned iterations = argc >= 3 ? unsigned(strtoul(argv[2], nullptr, 0)) : 1000000;
+	if (!num_threads || !iterations)
+		return EXIT_FAILURE;
+
+#ifndef GRANITE_VULKAN_MT
+	// The allocator is not thread-safe without GRANITE_VULKAN_MT.
+	LOGW("Built without GRANITE_VULKAN_MT, only testing one thread.\n");
+	num_threads = 1;
+#endif
+
+	if (!Context::init_loader(nullptr))
+		return EXIT_FAILURE;
+
+	Context ctx;
+	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0))
+		return EXIT_FAILURE;
+
+	Device device;
+	device.set_context(ctx);
+
+	auto &mem_props = device.get_memory_properties();
+	uint32_t memory_type = UINT32_MAX;
+	for (uint32_t i = 0; i < mem_props.memoryTypeCount && memory_type == UINT32_MAX; i++)
+		if (mem_props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+			memory_type = i;
+
+	if (memory_type == UINT32_MAX)
+		return EXIT_FAILURE;
+
+	for (unsigned threads = 1; threads <= num_threads; threads *= 2)
+	{
+		if (!run_stress(device, memory_type, threads, iterations, false))
+			return EXIT_FAILURE;
+		if (!run_stress(device, memory_type, threads, iterations, true))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Compares loading a directory of files through mmap page faults on the thread group
+// against FilesystemBackend::read_async, both with io_uring and with the thread group fallback.
+// The page cache is dropped for every file before each run, so this measures cold loads.
+
+#include "os_filesystem.hpp"
+#include "global_managers.hpp"
+#include "thread_group.hpp"
+#include "path.hpp"
+#include "timer.hpp"
+#include "logging.hpp"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+using namespace Granite;
+
+struct BenchFile
+{
+	std::string path;
+	size_t size;
+};
+
+// Only evicts clean pages, which is all there should be for an asset directory.
+static void drop_page_cache(const std::string &dir, const std::vector<BenchFile> &files)
+{
+	for (auto &file : files)
+	{
+		int fd = open(Path::join(dir, file.path).c_str(), O_RDONLY);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void report(const char *tag, int64_t start, int64_t end, uint64_t bytes, uint64_t expected)
+{
+	double seconds = double(end - start) * 1e-9;
+	LOGI("%-22s %8.3f ms, %8.1f MB/s%s\n", tag, seconds * 1e3, 1e-6 * double(bytes) / seconds,
+	     bytes == expected ? "" : " (short read!)");
+}
+
+static uint64_t run_mmap(OSFilesystem &fs, const std::vector<BenchFile> &files)
+{
+	std::atomic<uint64_t> total;
+	total.store(0);
+
+	auto *workers = Global::thread_group();
+	auto task = workers->create_task();
+	for (auto &file : files)
+	{
+		workers->enqueue_task(task, [&]() {
+			auto f = fs.open(file.path, FileMode::ReadOnly);
+			auto *mapped = f ? static_cast<const volatile uint8_t *>(f->map()) : nullptr;
+			if (!mapped)
+				return;
+
+			// Touch every page, which is what consuming the data would do.
+			size_t size = f->get_size();
+			uint8_t sum = 0;
+			for (size_t i = 0; i < size; i += 4096)
+				sum += mapped[i];
+			(void)sum;
+			total.fetch_add(size, std::memory_order_relaxed);
+		});
+	}
+	task->flush();
+	task->wait();
+	return total.load();
+}
+
+static uint64_t run_async(OSFilesystem &fs, const std::vector<BenchFile> &files, bool io_uring)
+{
+	// Bound memory use by keeping at most this much data in flight.
+	const uint64_t max_inflight_bytes = 256 * 1024 * 1024;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	uint64_t inflight_bytes = 0;
+	unsigned pending = 0;
+	uint64_t total = 0;
+
+	for (auto &file : files)
+	{
+		auto *buffer = new uint8_t[file.size ? file.size : 1];
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			cond.wait(holder, [&]() {
+				return inflight_bytes == 0 || inflight_bytes + file.size <= max_inflight_bytes;
+			});
+			inflight_bytes += file.size;
+			pending++;
+		}
+
+		auto callback = [&, buffer, size = file.size](int64_t result) {
+			delete[] buffer;
+			std::lock_guard<std::mutex> holder{lock};
+			if (result > 0)
+				total += uint64_t(result);
+			inflight_bytes -= size;
+			pending--;
+			cond.notify_all();
+		};
+
+		bool submitted = io_uring ?
+		                 fs.read_async(file.path, 0, file.size, buffer, callback) :
+		                 fs.FilesystemBackend::read_async(file.path, 0, file.size, buffer, callback);
+
+		if (!submitted)
+			callback(-1);
+	}
+
+	std::unique_lock<std::mutex> holder{lock};
+	cond.wait(holder, [&]() { return pending == 0; });
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		LOGE("Usage: %s <directory> [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::string dir = argv[1];
+	unsigned iterations = argc >= 3 ? unsigned(strtoul(argv[2], nullptr, 0)) : 3;
+
+	Global::init(Global::MANAGER_FEATURE_THREAD_GROUP_BIT);
+	OSFilesystem fs(dir);
+
+	std::vector<BenchFile> files;
+	uint64_t total_size = 0;
+	for (auto &entry : fs.walk_stat(""))
+	{
+		if (entry.stat.type == PathType::File)
+		{
+			files.push_back({ entry.path, size_t(entry.stat.size) });
+			total_size += entry.stat.size;
+		}
+	}
+
+	LOGI("%u files, %.1f MB, %u worker threads.\n", unsigned(files.size()), 1e-6 * double(total_size),
+	     Global::thread_group()->get_num_threads());
+
+	for (unsigned i = 0; i < iterations; i++)
+	{
+		drop_page_cache(dir, files);
+		int64_t start = Util::get_current_time_nsecs();
+		uint64_t bytes = run_mmap(fs, files);
+		report("mmap page faults:", start, Util::get_current_time_nsecs(), bytes, total_size);
+
+		drop_page_cache(dir, files);
+		start = Util::get_current_time_nsecs();
+		bytes = run_async(fs, files, false);
+		report("async, thread group:", start, Util::get_current_time_nsecs(), bytes, total_size);
+
+		drop_page_cache(dir, files);
+		start = Util::get_current_time_nsecs();
+		bytes = run_async(fs, files, true);
+		report("async, OSFilesystem:", start, Util::get_current_time_nsecs(), bytes, total_size);
+	}
+
+	Global::deinit();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Measures CPU cost of recording draws, i.e. state hashing, pipeline lookup and descriptor set lookup.
+// Run against lavapipe (VK_ICD_FILENAMES) to get stable numbers which are not dominated by a GPU driver.
+
+#include "device.hpp"
+#include "global_managers.hpp"
+#include "timer.hpp"
+#include "logging.hpp"
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace Vulkan;
+
+static void record_draws(CommandBuffer &cmd, const ImageView &rt, const ImageView *const textures[2], unsigned num_draws)
+{
+	auto rp = RenderPassInfo{};
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &rt;
+	rp.store_attachments = 1;
+	cmd.begin_render_pass(rp);
+
+	CommandBufferUtil::setup_fullscreen_quad(cmd, "builtin://shaders/quad.vert", "builtin://shaders/blit.frag");
+
+	for (unsigned i = 0; i < num_draws; i++)
+	{
+		// Cycle through a few pipelines and descriptor sets like a typical scene would.
+		cmd.set_texture(0, 0, *textures[i & 1], StockSampler::LinearClamp);
+		cmd.set_blend_enable((i & 2) != 0);
+		cmd.set_cull_mode((i & 4) ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE);
+		cmd.draw(3);
+	}
+
+	cmd.end_render_pass();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned num_draws = argc >= 2 ? unsigned(strtoul(argv[1], nullptr, 0)) : 100000;
+	if (!num_draws)
+		return EXIT_FAILURE;
+
+	Granite::Global::init();
+	if (!Context::init_loader(nullptr))
+		return EXIT_FAILURE;
+
+	Context ctx;
+	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0))
+		return EXIT_FAILURE;
+
+	Device device;
+	device.set_context(ctx);
+	LOGI("Recording %u draws on %s.\n", num_draws, ctx.get_gpu_props().deviceName);
+
+	auto rt_info = ImageCreateInfo::render_target(64, 64, VK_FORMAT_R8G8B8A8_UNORM);
+	auto rt = device.create_image(rt_info);
+
+	const uint32_t texels[2] = { 0xff0000ffu, 0xff00ff00u };
+	ImageHandle images[2];
+	const ImageView *textures[2];
+	for (unsigned i = 0; i < 2; i++)
+	{
+		ImageInitialData initial = {};
+		initial.data = &texels[i];
+		images[i] = device.create_image(ImageCreateInfo::immutable_2d_image(1, 1, VK_FORMAT_R8G8B8A8_UNORM), &initial);
+		textures[i] = &images[i]->get_view();
+	}
+
+	// The first iteration compiles pipelines and allocates descriptor sets, only time the following ones.
+	int64_t best_time = INT64_MAX;
+	for (unsigned iteration = 0; iteration < 6; iteration++)
+	{
+		auto cmd = device.request_command_buffer();
+		int64_t start = Util::get_current_time_nsecs();
+		record_draws(*cmd, rt->get_view(), textures, num_draws);
+		int64_t end = Util::get_current_time_nsecs();
+		device.submit(cmd);
+		device.wait_idle();
+		device.next_frame_context();
+
+		if (iteration != 0)
+			best_time = std::min(best_time, end - start);
+	}
+
+	LOGI("CPU cost: %.3f ns / draw.\n", double(best_time) / double(num_draws));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan_headers.hpp"
+#include "device.hpp"
+#include "global_managers.hpp"
+#include "logging.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace Vulkan;
+
+static constexpr VkDeviceSize BufferSize = 64 * 1024;
+static constexpr unsigned NumBuffers = 256;
+
+static BufferHandle create_pattern_buffer(Device &device, uint32_t seed, VkBufferUsageFlags usage)
+{
+	std::vector<uint32_t> data(BufferSize / sizeof(uint32_t));
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = seed * 0x9e3779b9u + uint32_t(i);
+
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::Device;
+	info.size = BufferSize;
+	info.usage = usage;
+	info.misc = BUFFER_MISC_RELOCATABLE_BIT;
+	return device.create_buffer(info, data.data());
+}
+
+static bool verify_pattern_buffer(Device &device, const Buffer &buffer, uint32_t seed)
+{
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::CachedHost;
+	info.size = BufferSize;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	auto readback = device.create_buffer(info);
+
+	auto cmd = device.request_command_buffer();
+	cmd->copy_buffer(*readback, buffer);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+	Fence fence;
+	device.submit(cmd, &fence);
+	fence->wait();
+
+	auto *mapped = static_cast<const uint32_t *>(device.map_host_buffer(*readback, MEMORY_ACCESS_READ_BIT));
+	bool ok = true;
+	for (size_t i = 0; i < BufferSize / sizeof(uint32_t) && ok; i++)
+		ok = mapped[i] == seed * 0x9e3779b9u + uint32_t(i);
+	device.unmap_host_buffer(*readback, MEMORY_ACCESS_READ_BIT);
+	return ok;
+}
+
+int main()
+{
+	Granite::Global::init();
+	if (!Context::init_loader(nullptr))
+		return EXIT_FAILURE;
+
+	Context ctx;
+	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0))
+		return EXIT_FAILURE;
+
+	Device device;
+	device.set_context(ctx);
+
+	// A defragment pass which deadlocks against buffer destruction never returns, so fail instead of hanging.
+	std::mutex watchdog_lock;
+	std::condition_variable watchdog_cond;
+	bool done = false;
+	std::thread watchdog([&]() {
+		std::unique_lock<std::mutex> holder{watchdog_lock};
+		if (!watchdog_cond.wait_for(holder, std::chrono::seconds(60), [&]() { return done; }))
+		{
+			LOGE("Defragmentation deadlocked.\n");
+			_Exit(EXIT_FAILURE);
+		}
+	});
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT;
+	std::vector<BufferHandle> buffers;
+	for (unsigned i = 0; i < NumBuffers; i++)
+		buffers.push_back(create_pattern_buffer(device, i, usage));
+
+	// Punch holes in the mini-heaps so there is something to compact.
+	for (unsigned i = 0; i < NumBuffers; i++)
+		if (i % 4 != 0)
+			buffers[i].reset();
+
+	// A buffer with a view must never move.
+	auto pinned = create_pattern_buffer(device, NumBuffers, usage);
+	BufferViewCreateInfo view_info = {};
+	view_info.buffer = pinned.get();
+	view_info.format = VK_FORMAT_R32_UINT;
+	view_info.range = BufferSize;
+	auto view = device.create_buffer_view(view_info);
+	VkBuffer pinned_handle = pinned->get_buffer();
+
+	// Destroy relocatable buffers from another thread while passes run, the pending uploads often hold the last reference.
+	std::atomic_bool stop{false};
+	std::thread churn([&]() {
+		uint32_t seed = NumBuffers + 1;
+		while (!stop.load(std::memory_order_relaxed))
+		{
+			std::vector<BufferHandle> transient;
+			for (unsigned i = 0; i < 16; i++)
+				transient.push_back(create_pattern_buffer(device, seed++, usage));
+			transient.erase(transient.begin(), transient.begin() + 8);
+			std::this_thread::yield();
+		}
+	});
+
+	VkDeviceSize relocated = 0;
+	for (unsigned frame = 0; frame < 200; frame++)
+	{
+		relocated += device.defragment_memory(BufferSize * 8);
+		device.next_frame_context();
+	}
+
+	stop.store(true, std::memory_order_relaxed);
+	churn.join();
+	device.wait_idle();
+
+	{
+		std::lock_guard<std::mutex> holder{watchdog_lock};
+		done = true;
+	}
+	watchdog_cond.notify_one();
+	watchdog.join();
+
+	bool ok = true;
+	for (unsigned i = 0; i < NumBuffers; i++)
+	{
+		if (buffers[i] && !verify_pattern_buffer(device, *buffers[i], i))
+		{
+			LOGE("Buffer %u was corrupted by relocation.\n", i);
+			ok = false;
+		}
+	}
+
+	if (pinned->get_buffer() != pinned_handle || !verify_pattern_buffer(device, *pinned, NumBuffers))
+	{
+		LOGE("Buffer with a view was relocated.\n");
+		ok = false;
+	}
+
+	auto stats = device.get_defragment_statistics();
+	LOGI("Relocated %llu buffers (%llu bytes) in %llu passes.\n",
+	     static_cast<unsigned long long>(stats.relocated_buffers),
+	     static_cast<unsigned long long>(relocated),
+	     static_cast<unsigned long long>(stats.passes));
+
+	view.reset();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,326 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Round trips the LZ4 block codec and the pack archive backend.
+// The pack part runs the pack-archive tool, which is passed as the first argument
+// or baked in by the build when tools are enabled.
+
+#include "lz4_block.hpp"
+#include "pack_filesystem.hpp"
+#include "os_filesystem.hpp"
+#include "path.hpp"
+#include "logging.hpp"
+#include <random>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Granite;
+using namespace Util;
+
+static bool round_trip(const char *tag, const std::vector<uint8_t> &input)
+{
+	std::vector<uint8_t> compressed(lz4_compress_bound(input.size()));
+	size_t compressed_size = lz4_compress(compressed.data(), compressed.size(), input.data(), input.size());
+	if (!compressed_size)
+	{
+		LOGE("%s: compression failed.\n", tag);
+		return false;
+	}
+
+	std::vector<uint8_t> decompressed(input.size());
+	if (!lz4_decompress(decompressed.data(), decompressed.size(), compressed.data(), compressed_size) ||
+	    decompressed != input)
+	{
+		LOGE("%s: round trip mismatch.\n", tag);
+		return false;
+	}
+
+	LOGI("%s: %u -> %u bytes.\n", tag, unsigned(input.size()), unsigned(compressed_size));
+	return true;
+}
+
+static bool expect_rejected(const char *tag, const std::vector<uint8_t> &block, size_t decoded_size)
+{
+	std::vector<uint8_t> decoded(decoded_size);
+	if (lz4_decompress(decoded.data(), decoded.size(), block.data(), block.size()))
+	{
+		LOGE("%s: malformed block was accepted.\n", tag);
+		return false;
+	}
+	return true;
+}
+
+static bool test_lz4()
+{
+	std::mt19937 rnd(1234);
+	bool ok = true;
+
+	ok = round_trip("empty", {}) && ok;
+	ok = round_trip("single byte", { 42 }) && ok;
+
+	std::vector<uint8_t> random(256 * 1024);
+	for (auto &v : random)
+		v = uint8_t(rnd());
+	ok = round_trip("incompressible", random) && ok;
+
+	// Runs far longer than the 15 + 255 * n length encoding and the 64 KiB window.
+	std::vector<uint8_t> zeroes(300 * 1024);
+	ok = round_trip("long match", zeroes) && ok;
+
+	// Short periods make matches overlap the bytes they are copying.
+	std::vector<uint8_t> periodic(100 * 1024);
+	for (size_t i = 0; i < periodic.size(); i++)
+		periodic[i] = uint8_t("abc"[i % 3]);
+	ok = round_trip("overlapping copy", periodic) && ok;
+
+	std::vector<uint8_t> mixed;
+	for (unsigned i = 0; i < 64; i++)
+	{
+		size_t literal_count = rnd() % 300;
+		for (size_t j = 0; j < literal_count; j++)
+			mixed.push_back(uint8_t(rnd()));
+		size_t repeat = rnd() % 1000;
+		size_t offset = 1 + rnd() % 70000;
+		for (size_t j = 0; j < repeat && offset <= mixed.size(); j++)
+			mixed.push_back(mixed[mixed.size() - offset]);
+	}
+	ok = round_trip("mixed", mixed) && ok;
+
+	// A compressed block must not decode to anything else, truncated or not.
+	std::vector<uint8_t> block(lz4_compress_bound(mixed.size()));
+	block.resize(lz4_compress(block.data(), block.size(), mixed.data(), mixed.size()));
+
+	for (size_t cut : { size_t(1), size_t(2), block.size() / 2, block.size() - 1 })
+	{
+		std::vector<uint8_t> truncated(block.begin(), block.begin() + (block.size() - cut));
+		ok = expect_rejected("truncated", truncated, mixed.size()) && ok;
+	}
+
+	ok = expect_rejected("output too small", block, mixed.size() - 1) && ok;
+	ok = expect_rejected("output too large", block, mixed.size() + 1) && ok;
+
+	// Token with 4 literals and a match reaching back before the start of the output.
+	ok = expect_rejected("offset out of range", { 0x40, 'a', 'b', 'c', 'd', 0x10, 0x00, 0x00 }, 12) && ok;
+	ok = expect_rejected("zero offset", { 0x40, 'a', 'b', 'c', 'd', 0x00, 0x00, 0x00 }, 12) && ok;
+	// Literal length continuation bytes running past the end of the block.
+	ok = expect_rejected("literal length overrun", { 0xf0, 0xff, 0xff }, 1000) && ok;
+	ok = expect_rejected("literal overrun", { 0x80, 'a', 'b' }, 8) && ok;
+
+	return ok;
+}
+
+static bool write_file(const std::string &path, const std::vector<uint8_t> &data)
+{
+	FILE *file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = data.empty() || fwrite(data.data(), 1, data.size(), file) == data.size();
+	return fclose(file) == 0 && ok;
+}
+
+static std::unique_ptr<PackFilesystem> open_pack(const std::string &dir, const std::string &name)
+{
+	OSFilesystem fs(dir);
+	return PackFilesystem::create(fs.open(name, FileMode::ReadOnly));
+}
+
+static bool test_pack(const std::string &tool)
+{
+	char dir_template[] = "/tmp/granite-pack-test-XXXXXX";
+	if (!mkdtemp(dir_template))
+	{
+		LOGE("Failed to create temporary directory.\n");
+		return false;
+	}
+
+	std::string dir = dir_template;
+	std::string input = Path::join(dir, "input");
+	mkdir(input.c_str(), 0750);
+	mkdir(Path::join(input, "sub").c_str(), 0750);
+	mkdir(Path::join(input, "sub/deeper").c_str(), 0750);
+
+	std::mt19937 rnd(5678);
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	files.push_back({ "empty.bin", {} });
+
+	std::vector<uint8_t> random(100 * 1024);
+	for (auto &v : random)
+		v = uint8_t(rnd());
+	files.push_back({ "random.bin", random });
+
+	std::string text;
+	while (text.size() < 64 * 1024)
+		text += "The quick brown fox jumps over the lazy dog. ";
+	files.push_back({ "sub/text.txt", { text.begin(), text.end() } });
+	files.push_back({ "sub/deeper/tiny.txt", { 'h', 'i' } });
+	files.push_back({ "sub/zeroes.bin", std::vector<uint8_t>(200 * 1024) });
+
+	for (auto &f : files)
+	{
+		if (!write_file(Path::join(input, f.first), f.second))
+		{
+			LOGE("Failed to write %s.\n", f.first.c_str());
+			return false;
+		}
+	}
+
+	std::string pack = Path::join(dir, "test.pack");
+	std::string cmd = "\"" + tool + "\" --compress --output \"" + pack + "\" \"" + input + "\"";
+	if (system(cmd.c_str()) != 0)
+	{
+		LOGE("pack-archive failed.\n");
+		return false;
+	}
+
+	bool ok = true;
+	auto fs = open_pack(dir, "test.pack");
+	if (!fs)
+	{
+		LOGE("Failed to open the archive.\n");
+		return false;
+	}
+
+	for (auto &f : files)
+	{
+		FileStat s;
+		auto file = fs->open(f.first);
+		if (!file || !fs->stat(f.first, s) || s.type != PathType::File || s.size != f.second.size() ||
+		    file->get_size() != f.second.size())
+		{
+			LOGE("%s: missing or wrong size.\n", f.first.c_str());
+			ok = false;
+			continue;
+		}
+
+		auto *mapped = static_cast<const uint8_t *>(file->map());
+		if (!f.second.empty() && (!mapped || memcmp(mapped, f.second.data(), f.second.size()) != 0))
+		{
+			LOGE("%s: contents mismatch.\n", f.first.c_str());
+			ok = false;
+		}
+	}
+
+	auto root = fs->list("");
+	auto sub = fs->list("sub");
+	FileStat s;
+	if (root.size() != 3 || sub.size() != 3 || !fs->stat("sub/deeper", s) || s.type != PathType::Directory ||
+	    fs->stat("missing.bin", s) || fs->open("missing.bin"))
+	{
+		LOGE("Directory structure mismatch.\n");
+		ok = false;
+	}
+
+	// A truncated archive must be rejected up front.
+	FILE *archive = fopen(pack.c_str(), "rb");
+	std::vector<uint8_t> contents;
+	if (archive)
+	{
+		fseek(archive, 0, SEEK_END);
+		contents.resize(size_t(ftell(archive)));
+		fseek(archive, 0, SEEK_SET);
+		if (fread(contents.data(), 1, contents.size(), archive) != contents.size())
+			contents.clear();
+		fclose(archive);
+	}
+
+	if (contents.size() < sizeof(Pack::Header))
+	{
+		LOGE("Failed to read back the archive.\n");
+		return false;
+	}
+
+	std::vector<uint8_t> truncated(contents.begin(), contents.end() - 16);
+	if (!write_file(Path::join(dir, "truncated.pack"), truncated) || open_pack(dir, "truncated.pack"))
+	{
+		LOGE("Truncated archive was accepted.\n");
+		ok = false;
+	}
+
+	Pack::Header header;
+	memcpy(&header, contents.data(), sizeof(header));
+	std::vector<uint8_t> corrupt = contents;
+	corrupt[header.index_offset + offsetof(Pack::Entry, stored_size)] = 0xff;
+	corrupt[header.index_offset + offsetof(Pack::Entry, stored_size) + 7] = 0xff;
+	if (!write_file(Path::join(dir, "corrupt.pack"), corrupt) || open_pack(dir, "corrupt.pack"))
+	{
+		LOGE("Archive with an out of range entry was accepted.\n");
+		ok = false;
+	}
+
+	// Compressed entries which do not decode to their recorded size are only caught on map(),
+	// which must fail rather than return garbage.
+	std::vector<uint8_t> damaged = contents;
+	for (uint32_t i = 0; i < header.entry_count; i++)
+	{
+		Pack::Entry entry;
+		size_t entry_offset = header.index_offset + i * sizeof(entry);
+		memcpy(&entry, contents.data() + entry_offset, sizeof(entry));
+		if (entry.compression == Pack::Compression::LZ4)
+		{
+			entry.size++;
+			memcpy(damaged.data() + entry_offset, &entry, sizeof(entry));
+		}
+	}
+
+	auto damaged_fs = write_file(Path::join(dir, "damaged.pack"), damaged) ? open_pack(dir, "damaged.pack") : nullptr;
+	auto damaged_file = damaged_fs ? damaged_fs->open("sub/zeroes.bin") : nullptr;
+	if (!damaged_file || damaged_file->map())
+	{
+		LOGE("Damaged compressed entry was not rejected.\n");
+		ok = false;
+	}
+
+	system(("rm -rf \"" + dir + "\"").c_str());
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	bool ok = test_lz4();
+
+	std::string tool;
+	if (argc > 1)
+		tool = argv[1];
+#ifdef PACK_ARCHIVE_TOOL
+	else
+		tool = PACK_ARCHIVE_TOOL;
+#endif
+
+	if (tool.empty())
+		LOGW("No pack-archive tool given, skipping the pack test.\n");
+	else
+		ok = test_pack(tool) && ok;
+
+	if (!ok)
+	{
+		LOGE("Test failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Test passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// Measures asset loading through NetworkFilesystem against a running netfs-server, comparing the
+// legacy one-connection-per-request protocol with the multiplexed protocol, with and without compression.
+// "walk" lists the whole tree with stat information, "stat" stats every file with one request each.
+// "reload" reopens every file, as hot reloading does, which lets the multiplexed protocol skip unchanged contents.
+// The cached runs keep files under cache://netfs/, the first one fills the cache unless an earlier run already did.
+
+#include "fs-netfs.hpp"
+#include "global_managers.hpp"
+#include "thread_group.hpp"
+#include "timer.hpp"
+#include "logging.hpp"
+#include <stdlib.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+using namespace Granite;
+
+struct BenchFile
+{
+	std::string path;
+	size_t size;
+	std::unique_ptr<File> file;
+};
+
+static void report(const char *mode, const char *phase, int64_t start, int64_t end, uint64_t bytes)
+{
+	double seconds = double(end - start) * 1e-9;
+	LOGI("%-10s %-7s %9.3f ms, %8.1f MB/s\n", mode, phase, seconds * 1e3, 1e-6 * double(bytes) / seconds);
+}
+
+template <typename Func>
+static uint64_t for_each_file(std::vector<BenchFile> &files, const Func &func)
+{
+	std::atomic<uint64_t> total;
+	total.store(0);
+
+	auto *workers = Global::thread_group();
+	auto task = workers->create_task();
+	for (auto &file : files)
+	{
+		workers->enqueue_task(task, [&]() {
+			total.fetch_add(func(file), std::memory_order_relaxed);
+		});
+	}
+	task->flush();
+	task->wait();
+	return total.load();
+}
+
+static bool run(const char *mode, const std::string &protocol, bool multiplex, bool compress, bool cache,
+                const std::vector<ListEntry> &entries)
+{
+	NetworkFilesystem fs;
+	fs.set_protocol(protocol);
+	fs.set_multiplexing(multiplex, compress);
+	fs.set_caching(cache);
+
+	std::vector<BenchFile> files;
+	for (auto &entry : entries)
+		if (entry.type == PathType::File)
+			files.push_back({ entry.path, 0, {} });
+
+	int64_t start = Util::get_current_time_nsecs();
+	auto walked = fs.walk_stat("");
+	report(mode, "walk", start, Util::get_current_time_nsecs(), 0);
+
+	if (walked.size() != entries.size())
+	{
+		LOGE("%s: walk found %u entries, expected %u.\n", mode, unsigned(walked.size()), unsigned(entries.size()));
+		return false;
+	}
+
+	start = Util::get_current_time_nsecs();
+	for_each_file(files, [&](BenchFile &file) -> uint64_t {
+		FileStat s;
+		if (fs.stat(file.path, s))
+			file.size = s.size;
+		return 0;
+	});
+	report(mode, "stat", start, Util::get_current_time_nsecs(), 0);
+
+	uint64_t expected = 0;
+	for (auto &file : files)
+		expected += file.size;
+
+	start = Util::get_current_time_nsecs();
+	uint64_t bytes = for_each_file(files, [&](BenchFile &file) -> uint64_t {
+		file.file = fs.open(file.path, FileMode::ReadOnly);
+		return file.file && file.file->map() ? file.file->get_size() : 0;
+	});
+	report(mode, "load", start, Util::get_current_time_nsecs(), bytes);
+
+	start = Util::get_current_time_nsecs();
+	uint64_t reloaded_bytes = for_each_file(files, [&](BenchFile &file) -> uint64_t {
+		if (!file.file || !file.file->reopen())
+			return 0;
+		return file.file->map() ? file.file->get_size() : 0;
+	});
+	report(mode, "reload", start, Util::get_current_time_nsecs(), reloaded_bytes);
+
+	if (bytes != expected || reloaded_bytes != expected)
+	{
+		LOGE("%s: short read, expected %llu bytes.\n", mode, static_cast<unsigned long long>(expected));
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		LOGE("Usage: %s <protocol> [iterations]\n", argv[0]);
+		LOGE("netfs-server must be running and serving <protocol>.\n");
+		return EXIT_FAILURE;
+	}
+
+	std::string protocol = argv[1];
+	unsigned iterations = argc >= 3 ? unsigned(strtoul(argv[2], nullptr, 0)) : 3;
+
+	Global::init(Global::MANAGER_FEATURE_THREAD_GROUP_BIT | Global::MANAGER_FEATURE_FILESYSTEM_BIT);
+
+	std::vector<ListEntry> entries;
+	{
+		NetworkFilesystem fs;
+		fs.set_protocol(protocol);
+		fs.set_caching(false);
+		entries = fs.walk("");
+	}
+
+	if (entries.empty())
+	{
+		LOGE("Found nothing in %s://, is netfs-server running?\n", protocol.c_str());
+		Global::deinit();
+		return EXIT_FAILURE;
+	}
+
+	LOGI("%u entries, %u worker threads.\n", unsigned(entries.size()), Global::thread_group()->get_num_threads());
+
+	bool success = true;
+	for (unsigned i = 0; i < iterations && success; i++)
+	{
+		success = run("legacy", protocol, false, false, false, entries) &&
+		          run("mux", protocol, true, false, false, entries) &&
+		          run("mux + lz4", protocol, true, true, false, entries) &&
+		          run("cached", protocol, true, false, true, entries) &&
+		          run("cached", protocol, true, false, true, entries);
+	}
+
+	Global::deinit();
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,282 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Loads a small glTF scene with an external buffer through the parser, once from source and
+// then through the scene cache, and checks that corrupt and stale cache entries are not used.
+// The repository has no sample scenes, so the scene is written to a temporary directory.
+
+#include "gltf.hpp"
+#include "scene_cache.hpp"
+#include "global_managers.hpp"
+#include "filesystem.hpp"
+#include "os_filesystem.hpp"
+#include "path.hpp"
+#include "logging.hpp"
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using namespace Granite;
+using namespace Granite::SceneFormats;
+
+static const char scene_json[] = R"({
+	"asset": { "version": "2.0" },
+	"buffers": [ { "uri": "scene.bin", "byteLength": 44 } ],
+	"bufferViews": [
+		{ "buffer": 0, "byteOffset": 0, "byteLength": 36 },
+		{ "buffer": 0, "byteOffset": 36, "byteLength": 6 }
+	],
+	"accessors": [
+		{ "bufferView": 0, "componentType": 5126, "count": 3, "type": "VEC3", "min": [ 0, 0, 0 ], "max": [ 1, 1, 0 ] },
+		{ "bufferView": 1, "componentType": 5123, "count": 3, "type": "SCALAR" }
+	],
+	"materials": [
+		{ "pbrMetallicRoughness": { "baseColorFactor": [ 1, 0, 0, 1 ] } },
+		{ "pbrMetallicRoughness": { "baseColorFactor": [ 0, 1, 0, 1 ] } }
+	],
+	"meshes": [
+		{ "primitives": [ { "attributes": { "POSITION": 0 }, "indices": 1, "material": 0 } ] },
+		{ "primitives": [ { "attributes": { "POSITION": 0 }, "indices": 1, "material": 1 } ] }
+	],
+	"nodes": [
+		{ "children": [ 1, 2 ] },
+		{ "mesh": 0, "translation": [ 1, 0, 0 ] },
+		{ "mesh": 1, "translation": [ -1, 0, 0 ] }
+	],
+	"scenes": [ { "nodes": [ 0 ] } ],
+	"scene": 0
+})";
+
+static const char scene_path[] = "test://scene.gltf";
+static const char buffer_path[] = "test://scene.bin";
+
+static bool write_buffer(float scale, int64_t mtime_sec)
+{
+	std::vector<uint8_t> data(44);
+	const float positions[9] = { 0.0f, 0.0f, 0.0f, scale, 0.0f, 0.0f, 0.0f, scale, 0.0f };
+	const uint16_t indices[3] = { 0, 1, 2 };
+	memcpy(data.data(), positions, sizeof(positions));
+	memcpy(data.data() + 36, indices, sizeof(indices));
+	if (!Global::filesystem()->write_buffer_to_file(buffer_path, data.data(), data.size()))
+		return false;
+
+	// Rewriting a file quickly may not move its modification time on coarse clocks, so set it explicitly.
+	auto native = Global::filesystem()->get_filesystem_path(buffer_path);
+	struct timespec times[2] = {};
+	times[0].tv_sec = mtime_sec;
+	times[1].tv_sec = mtime_sec;
+	return utimensat(AT_FDCWD, native.c_str(), times, 0) == 0;
+}
+
+static bool parse(GLTF::ParserFlags flags, std::vector<Mesh> &meshes, size_t &material_count, size_t &node_count)
+{
+	try
+	{
+		GLTF::Parser parser(scene_path, nullptr, flags);
+		meshes = parser.get_meshes();
+		material_count = parser.get_materials().size();
+		node_count = parser.get_nodes().size();
+		return true;
+	}
+	catch (const std::exception &e)
+	{
+		LOGE("Failed to parse scene: %s\n", e.what());
+		return false;
+	}
+}
+
+static bool same_meshes(const std::vector<Mesh> &a, const std::vector<Mesh> &b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	for (size_t i = 0; i < a.size(); i++)
+	{
+		if (a[i].positions != b[i].positions || a[i].attributes != b[i].attributes ||
+		    a[i].indices != b[i].indices || a[i].count != b[i].count ||
+		    a[i].material_index != b[i].material_index || a[i].has_material != b[i].has_material)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct Reference
+{
+	std::vector<Mesh> meshes;
+	size_t materials;
+	size_t nodes;
+};
+
+// Parses through the cache and expects the same scene as the reference.
+static bool check_parse(const char *tag, const Reference &reference)
+{
+	Reference loaded;
+	if (!parse(0, loaded.meshes, loaded.materials, loaded.nodes))
+		return false;
+
+	if (loaded.nodes != reference.nodes || loaded.materials != reference.materials ||
+	    !same_meshes(loaded.meshes, reference.meshes))
+	{
+		LOGE("%s: got %u nodes, %u meshes, %u materials, expected %u, %u, %u.\n", tag,
+		     unsigned(loaded.nodes), unsigned(loaded.meshes.size()), unsigned(loaded.materials),
+		     unsigned(reference.nodes), unsigned(reference.meshes.size()), unsigned(reference.materials));
+		return false;
+	}
+
+	return true;
+}
+
+static bool check_load(const char *tag, Util::Hash key, bool expected)
+{
+	SceneCacheContents contents;
+	if (SceneCache::load(key, contents) != expected)
+	{
+		LOGE("%s: cache entry was %s.\n", tag, expected ? "rejected" : "accepted");
+		return false;
+	}
+	return true;
+}
+
+static std::string get_entry_path(Util::Hash key)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "cache://scene-cache/%016llx.scene", static_cast<unsigned long long>(key));
+	return path;
+}
+
+static bool run_test()
+{
+	if (!write_buffer(1.0f, 1000000) || !Global::filesystem()->write_string_to_file(scene_path, scene_json))
+	{
+		LOGE("Failed to write scene.\n");
+		return false;
+	}
+
+	Reference reference;
+	if (!parse(GLTF::PARSER_BYPASS_SCENE_CACHE_BIT, reference.meshes, reference.materials, reference.nodes))
+		return false;
+
+	if (reference.nodes != 3 || reference.meshes.size() != 2 || reference.materials != 2)
+	{
+		LOGE("Unexpected scene contents.\n");
+		return false;
+	}
+
+	std::string json;
+	if (!Global::filesystem()->read_file_to_string(scene_path, json))
+		return false;
+	auto key = SceneCache::compute_key(scene_path, json);
+	auto entry_path = get_entry_path(key);
+
+	bool ok = true;
+	FileStat s;
+	if (Global::filesystem()->stat(entry_path, s))
+	{
+		LOGE("Bypassing the cache still wrote an entry.\n");
+		ok = false;
+	}
+
+	// First load parses and writes the entry, the second one is served from it.
+	ok = check_parse("parse", reference) && ok;
+	ok = check_load("stored", key, true) && ok;
+	ok = check_parse("cached", reference) && ok;
+
+	std::string entry;
+	if (!Global::filesystem()->read_file_to_string(entry_path, entry) || entry.size() < 64)
+	{
+		LOGE("Failed to read back the cache entry.\n");
+		return false;
+	}
+
+	// A truncated entry must be ignored, and the next load replaces it.
+	Global::filesystem()->write_string_to_file(entry_path, entry.substr(0, entry.size() - 8));
+	ok = check_load("truncated", key, false) && ok;
+	ok = check_parse("truncated", reference) && ok;
+	ok = check_load("rewritten", key, true) && ok;
+
+	// An intact header in front of a payload which does not decode.
+	const size_t header_size = 32;
+	Global::filesystem()->write_string_to_file(entry_path, entry.substr(0, header_size) +
+	                                                       std::string(entry.size() - header_size, '\xff'));
+	ok = check_load("garbage payload", key, false) && ok;
+	ok = check_parse("garbage payload", reference) && ok;
+
+	// A valid entry filed under the wrong key, e.g. after a hash collision on the file name.
+	auto other_key = key ^ 1;
+	Global::filesystem()->write_string_to_file(get_entry_path(other_key), entry);
+	ok = check_load("wrong key", other_key, false) && ok;
+
+	// Changing the external buffer makes the entry stale even though the glTF itself is unchanged.
+	if (!write_buffer(2.0f, 2000000))
+		return false;
+	ok = check_load("stale buffer", key, false) && ok;
+
+	Reference changed;
+	if (!parse(GLTF::PARSER_BYPASS_SCENE_CACHE_BIT, changed.meshes, changed.materials, changed.nodes))
+		return false;
+	if (same_meshes(changed.meshes, reference.meshes))
+	{
+		LOGE("Rewriting the buffer did not change the scene.\n");
+		ok = false;
+	}
+	ok = check_parse("stale buffer", changed) && ok;
+	ok = check_load("refreshed", key, true) && ok;
+
+	return ok;
+}
+
+int main()
+{
+	char dir_template[] = "/tmp/granite-scene-cache-test-XXXXXX";
+	if (!mkdtemp(dir_template))
+	{
+		LOGE("Failed to create temporary directory.\n");
+		return EXIT_FAILURE;
+	}
+
+	std::string dir = dir_template;
+	setenv("GRANITE_SCENE_CACHE", "1", 1);
+	Global::init(Global::MANAGER_FEATURE_FILESYSTEM_BIT);
+	Global::filesystem()->register_protocol("test", std::make_unique<OSFilesystem>(Path::join(dir, "scene")));
+	Global::filesystem()->register_protocol("cache", std::make_unique<OSFilesystem>(Path::join(dir, "cache")));
+
+	bool ok = run_test();
+
+	Global::deinit();
+	system(("rm -rf \"" + dir + "\"").c_str());
+
+	if (!ok)
+	{
+		LOGE("Test failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Test passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Checks which bounds Scene reports for cached static shadow invalidation
+// as static casters are added, moved, destroyed or stop casting.
+
+#include "scene.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+using namespace Granite;
+
+struct BoxRenderable : AbstractRenderable
+{
+	void get_render_info(const RenderContext &, const RenderInfoComponent *, RenderQueue &) const override
+	{
+	}
+
+	bool has_static_aabb() const override
+	{
+		return true;
+	}
+
+	const AABB *get_static_aabb() const override
+	{
+		return &aabb;
+	}
+
+	AABB aabb = AABB(vec3(-1.0f), vec3(1.0f));
+};
+
+static bool near(const vec3 &a, const vec3 &b)
+{
+	return fabsf(a.x - b.x) < 1e-4f && fabsf(a.y - b.y) < 1e-4f && fabsf(a.z - b.z) < 1e-4f;
+}
+
+// Expects exactly the unit boxes centered at x, in any order.
+static bool check(Scene &scene, const char *tag, std::vector<float> xs)
+{
+	scene.update_cached_transforms();
+	auto &invalidations = scene.get_static_shadow_invalidations();
+
+	bool ok = invalidations.size() == xs.size();
+	for (auto &aabb : invalidations)
+	{
+		auto itr = std::find_if(xs.begin(), xs.end(), [&](float x) {
+			return near(aabb.get_minimum(), vec3(x - 1.0f, -1.0f, -1.0f)) &&
+			       near(aabb.get_maximum(), vec3(x + 1.0f, 1.0f, 1.0f));
+		});
+
+		if (itr == xs.end())
+			ok = false;
+		else
+			xs.erase(itr);
+	}
+
+	if (!ok)
+		LOGE("%s: got %u unexpected invalidations.\n", tag, unsigned(invalidations.size()));
+	return ok;
+}
+
+int main()
+{
+	Scene scene;
+	auto root = scene.create_node();
+	scene.set_root_node(root);
+
+	AbstractRenderableHandle box(new BoxRenderable);
+	Scene::NodeHandle nodes[3];
+	Entity *entities[3];
+	for (unsigned i = 0; i < 3; i++)
+	{
+		nodes[i] = scene.create_node();
+		nodes[i]->transform.translation = vec3(10.0f * float(i), 0.0f, 0.0f);
+		root->add_child(nodes[i]);
+		entities[i] = scene.create_renderable(box, nodes[i].get());
+	}
+
+	bool ok = true;
+	ok = check(scene, "created", { 0.0f, 10.0f, 20.0f }) && ok;
+	ok = check(scene, "unchanged", {}) && ok;
+
+	nodes[0]->transform.translation = vec3(-10.0f, 0.0f, 0.0f);
+	nodes[0]->invalidate_cached_transform();
+	ok = check(scene, "moved", { 0.0f, -10.0f }) && ok;
+
+	scene.destroy_entity(entities[1]);
+	ok = check(scene, "destroyed", { 10.0f }) && ok;
+
+	entities[2]->free_component<CastsStaticShadowComponent>();
+	ok = check(scene, "stopped casting", { 20.0f }) && ok;
+
+	// Once removed, the caster is forgotten, even if its node moves later.
+	nodes[2]->transform.translation = vec3(30.0f, 0.0f, 0.0f);
+	nodes[2]->invalidate_cached_transform();
+	ok = check(scene, "after removal", {}) && ok;
+
+	if (!ok)
+	{
+		LOGE("Test failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Test passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -259,6 +259,15 @@ bool ThreadGroup::is_idle()
 	return total_tasks.load(memory_order_acquire) == completed_tasks.load(memory_order_acquire);
 }
 
+bool ThreadGroup::current_thread_is_worker() const
+{
+	auto id = this_thread::get_id();
+	for (auto &t : thread_group)
+		if (t->get_id() == id)
+			return true;
+	return false;
+}
+
 void ThreadGroup::thread_looper(unsigned index)
 {
 #ifdef GRANITE_VULKAN_MT
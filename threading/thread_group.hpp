@@ -154,6 +154,10 @@ public:
 	void wait_idle();
 	bool is_idle();
 
+	// Waiting for a task group from inside a worker can deadlock once every worker does it.
+	// Code which fans out and waits should check this and run inline instead.
+	bool current_thread_is_worker() const;
+
 private:
 	Util::ThreadSafeObjectPool<Internal::Task> task_pool;
 	Util::ThreadSafeObjectPool<Internal::TaskGroup> task_group_pool;
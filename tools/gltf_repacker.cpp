@@ -25,6 +25,9 @@
 #include "logging.hpp"
 #include "cli_parser.hpp"
 #include "rapidjson_wrapper.hpp"
+#include "thread_group.hpp"
+#include "timer.hpp"
+#include <algorithm>
 
 using namespace Granite;
 using namespace Util;
@@ -45,6 +48,59 @@ static SceneFormats::TextureCompressionFamily string_to_compression(const string
 	}
 }
 
+static int bench_load(const string &path, unsigned max_threads)
+{
+	if (!max_threads)
+		max_threads = std::thread::hardware_concurrency();
+
+	try
+	{
+		// Warm up the page cache so the first measurement isn't dominated by disk I/O.
+		// The scene cache is bypassed throughout, otherwise every run after the first one would just load the cache.
+		GLTF::Parser warmup(path, nullptr, GLTF::PARSER_BYPASS_SCENE_CACHE_BIT);
+
+		double serial_ms = 0.0;
+		unsigned threads = 1;
+		for (;;)
+		{
+			// With one thread there are no workers and the parser builds everything inline.
+			unique_ptr<ThreadGroup> workers;
+			if (threads > 1)
+			{
+				workers.reset(new ThreadGroup);
+				workers->start(threads);
+			}
+
+			auto start_time = get_current_time_nsecs();
+			GLTF::Parser parser(path, workers.get(), GLTF::PARSER_BYPASS_SCENE_CACHE_BIT);
+			auto end_time = get_current_time_nsecs();
+
+			double ms = 1e-6 * double(end_time - start_time);
+			if (threads == 1)
+				serial_ms = ms;
+
+			size_t vertex_count = 0;
+			for (auto &mesh : parser.get_meshes())
+				vertex_count += mesh.position_stride ? mesh.positions.size() / mesh.position_stride : 0;
+
+			LOGI("%3u threads: %9.3f ms (%.2fx), %u primitives, %u vertices.\n",
+			     threads, ms, serial_ms / ms,
+			     unsigned(parser.get_meshes().size()), unsigned(vertex_count));
+
+			if (threads >= max_threads)
+				break;
+			threads = std::min(threads * 2, max_threads);
+		}
+	}
+	catch (const exception &e)
+	{
+		LOGE("Failed to load %s: %s\n", path.c_str(), e.what());
+		return 1;
+	}
+
+	return 0;
+}
+
 static void print_help()
 {
 	LOGI("Usage: [--output <out.glb>] [--texcomp <type>]\n");
@@ -63,6 +119,7 @@ static void print_help()
 	LOGI("[--flip-tangent-w]\n");
 	LOGI("[--renormalize-normals]\n");
 	LOGI("[--gltf]\n");
+	LOGI("[--bench-load] (measure parse time of input.gltf with 1 to --threads threads, then exit)\n");
 }
 
 int main(int argc, char *argv[])
@@ -80,6 +137,7 @@ int main(int argc, char *argv[])
 	bool animate_cameras = false;
 	bool flip_tangent_w = false;
 	bool renormalize_normals = false;
+	bool bench = false;
 
 	CLICallbacks cbs;
 	cbs.add("--output", [&](CLIParser &parser) { args.output = parser.next_string(); });
@@ -98,6 +156,7 @@ int main(int argc, char *argv[])
 	cbs.add("--flip-tangent-w", [&](CLIParser &) { flip_tangent_w = true; });
 	cbs.add("--renormalize-normals", [&](CLIParser &) { renormalize_normals = true; });
 	cbs.add("--gltf", [&](CLIParser &) { options.gltf = true; });
+	cbs.add("--bench-load", [&](CLIParser &) { bench = true; });
 
 	cbs.add("--fog-color", [&](CLIParser &parser) {
 		for (unsigned i = 0; i < 3; i++)
@@ -130,6 +189,9 @@ int main(int argc, char *argv[])
 	else if (cli_parser.is_ended_state())
 		return 0;
 
+	if (bench && !args.input.empty())
+		return bench_load(args.input, options.threads);
+
 	if (args.input.empty() || args.output.empty())
 	{
 		print_help();
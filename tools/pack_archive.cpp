@@ -0,0 +1,219 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pack_filesystem.hpp"
+#include "os_filesystem.hpp"
+#include "lz4_block.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include "global_managers.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+using namespace Granite;
+using namespace Util;
+using namespace std;
+
+static void print_help()
+{
+	LOGI("Usage: pack-archive --output <archive.pack> [--compress] [--alignment <bytes>] <input directory>\n");
+	LOGI("Entries are stored uncompressed unless --compress is used and LZ4 saves at least 1/8th of the size.\n");
+	LOGI("--alignment defaults to 16 and must be a power of two.\n");
+}
+
+static bool write_padding(FILE *file, uint64_t &offset, uint64_t alignment)
+{
+	static const uint8_t zeroes[256] = {};
+	uint64_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+	while (offset < aligned)
+	{
+		size_t to_write = size_t(min<uint64_t>(aligned - offset, sizeof(zeroes)));
+		if (fwrite(zeroes, 1, to_write, file) != to_write)
+			return false;
+		offset += to_write;
+	}
+	return true;
+}
+
+static bool write_data(FILE *file, uint64_t &offset, const void *data, size_t size)
+{
+	if (size && fwrite(data, 1, size, file) != size)
+		return false;
+	offset += size;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	string input;
+	string output;
+	bool compress = false;
+	unsigned alignment = 16;
+
+	CLICallbacks cbs;
+	cbs.add("--output", [&](CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--compress", [&](CLIParser &) { compress = true; });
+	cbs.add("--alignment", [&](CLIParser &parser) { alignment = parser.next_uint(); });
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.default_handler = [&](const char *arg) { input = arg; };
+	CLIParser cli_parser(move(cbs), argc - 1, argv + 1);
+	if (!cli_parser.parse())
+		return 1;
+	else if (cli_parser.is_ended_state())
+		return 0;
+
+	// The index is read in place, so the data section must keep it at least 8-byte aligned.
+	if (input.empty() || output.empty() || alignment < 8 || (alignment & (alignment - 1)) != 0)
+	{
+		print_help();
+		return 1;
+	}
+
+	// Directories are read in parallel on the thread group.
+	Global::init(Global::MANAGER_FEATURE_THREAD_GROUP_BIT);
+	OSFilesystem fs(input);
+	auto list = fs.walk_stat("");
+	Global::deinit();
+
+	list.erase(remove_if(begin(list), end(list), [](const WalkEntry &e) {
+		return e.stat.type != PathType::File;
+	}), end(list));
+
+	// Lookups binary search on the raw path bytes.
+	sort(begin(list), end(list), [](const WalkEntry &a, const WalkEntry &b) {
+		return a.path < b.path;
+	});
+
+	FILE *file = fopen(output.c_str(), "wb");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", output.c_str());
+		return 1;
+	}
+
+	Pack::Header header = {};
+	uint64_t offset = 0;
+	if (!write_data(file, offset, &header, sizeof(header)))
+	{
+		LOGE("Failed to write to %s.\n", output.c_str());
+		fclose(file);
+		return 1;
+	}
+
+	vector<Pack::Entry> entries;
+	entries.reserve(list.size());
+	string strings;
+	vector<uint8_t> compressed;
+	uint64_t total_size = 0;
+	uint64_t total_stored = 0;
+	unsigned compressed_count = 0;
+
+	for (auto &e : list)
+	{
+		auto input_file = fs.open(e.path, FileMode::ReadOnly);
+		if (!input_file)
+		{
+			LOGE("Failed to open %s.\n", e.path.c_str());
+			fclose(file);
+			return 1;
+		}
+
+		size_t size = input_file->get_size();
+		auto *mapped = static_cast<const uint8_t *>(size ? input_file->map() : nullptr);
+		if (size && !mapped)
+		{
+			LOGE("Failed to map %s.\n", e.path.c_str());
+			fclose(file);
+			return 1;
+		}
+
+		Pack::Entry entry = {};
+		entry.size = size;
+		entry.last_modified = e.stat.last_modified;
+		entry.path_offset = uint32_t(strings.size());
+		entry.path_length = uint32_t(e.path.size());
+		entry.compression = Pack::Compression::None;
+		strings += e.path;
+
+		const void *stored = mapped;
+		size_t stored_size = size;
+
+		if (compress && size)
+		{
+			compressed.resize(lz4_compress_bound(size));
+			size_t compressed_size = lz4_compress(compressed.data(), compressed.size(), mapped, size);
+			if (compressed_size && compressed_size <= size - size / 8)
+			{
+				entry.compression = Pack::Compression::LZ4;
+				stored = compressed.data();
+				stored_size = compressed_size;
+				compressed_count++;
+			}
+		}
+
+		if (!write_padding(file, offset, alignment))
+		{
+			LOGE("Failed to write to %s.\n", output.c_str());
+			fclose(file);
+			return 1;
+		}
+
+		entry.offset = offset;
+		entry.stored_size = stored_size;
+		if (!write_data(file, offset, stored, stored_size))
+		{
+			LOGE("Failed to write to %s.\n", output.c_str());
+			fclose(file);
+			return 1;
+		}
+
+		entries.push_back(entry);
+		total_size += size;
+		total_stored += stored_size;
+	}
+
+	bool ok = write_padding(file, offset, alignment);
+	header.magic = Pack::Magic;
+	header.version = Pack::Version;
+	header.entry_count = uint32_t(entries.size());
+	header.index_offset = offset;
+	ok = ok && write_data(file, offset, entries.data(), entries.size() * sizeof(Pack::Entry));
+	header.string_offset = offset;
+	header.string_size = strings.size();
+	ok = ok && write_data(file, offset, strings.data(), strings.size());
+
+	// Patch in the header last, so an interrupted write never looks like a valid archive.
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		LOGE("Failed to write to %s.\n", output.c_str());
+		return 1;
+	}
+
+	LOGI("Packed %u files (%u compressed), %llu bytes -> %llu bytes of file data.\n",
+	     unsigned(entries.size()), compressed_count,
+	     static_cast<unsigned long long>(total_size),
+	     static_cast<unsigned long long>(total_stored));
+	return 0;
+}
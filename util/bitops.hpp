@@ -32,6 +32,7 @@ namespace Util
 #define leading_zeroes(x) ((x) == 0 ? 32 : __builtin_clz(x))
 #define trailing_zeroes(x) ((x) == 0 ? 32 : __builtin_ctz(x))
 #define trailing_ones(x) __builtin_ctz(~uint32_t(x))
+#define popcount32(x) __builtin_popcount(x)
 #elif defined(_MSC_VER)
 namespace Internal
 {
@@ -52,11 +53,17 @@ static inline uint32_t ctz(uint32_t x)
 	else
 		return 32;
 }
+
+static inline uint32_t popcount(uint32_t x)
+{
+	return __popcnt(x);
+}
 }
 
 #define leading_zeroes(x) ::Util::Internal::clz(x)
 #define trailing_zeroes(x) ::Util::Internal::ctz(x)
 #define trailing_ones(x) ::Util::Internal::ctz(~uint32_t(x))
+#define popcount32(x) ::Util::Internal::popcount(x)
 #else
 #error "Implement me."
 #endif
@@ -0,0 +1,238 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lz4_block.hpp"
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+namespace Util
+{
+// Format constraints from the LZ4 block specification.
+static const size_t MinMatch = 4;
+static const size_t LastLiterals = 5;
+static const size_t MatchFindLimit = 12;
+static const size_t MaxOffset = 65535;
+static const unsigned HashBits = 16;
+
+static inline uint32_t read_u32(const uint8_t *ptr)
+{
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash_sequence(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HashBits);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = uint8_t(len);
+	return op;
+}
+
+static bool read_length(const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+	uint8_t b;
+	do
+	{
+		if (ip >= iend)
+			return false;
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+size_t lz4_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+size_t lz4_compress(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + src_size;
+
+	if (src_size > MatchFindLimit)
+	{
+		vector<uint32_t> table(1u << HashBits);
+		const uint8_t *match_start_limit = iend - MatchFindLimit;
+		const uint8_t *match_end_limit = iend - LastLiterals;
+
+		while (ip < match_start_limit)
+		{
+			uint32_t seq = read_u32(ip);
+			uint32_t h = hash_sequence(seq);
+			const uint8_t *ref = src + table[h];
+			table[h] = uint32_t(ip - src);
+
+			if (ref >= ip || size_t(ip - ref) > MaxOffset || read_u32(ref) != seq)
+			{
+				ip++;
+				continue;
+			}
+
+			const uint8_t *match_end = ip + MinMatch;
+			const uint8_t *ref_end = ref + MinMatch;
+			while (match_end < match_end_limit && *match_end == *ref_end)
+			{
+				match_end++;
+				ref_end++;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+
+			size_t literal_len = size_t(ip - anchor);
+			size_t match_len = size_t(match_end - ip) - MinMatch;
+			size_t required = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+			if (size_t(oend - op) < required)
+				return 0;
+
+			uint8_t *token = op++;
+			if (literal_len >= 15)
+			{
+				*token = 15 << 4;
+				op = write_length(op, literal_len - 15);
+			}
+			else
+				*token = uint8_t(literal_len << 4);
+
+			memcpy(op, anchor, literal_len);
+			op += literal_len;
+
+			size_t offset = size_t(ip - ref);
+			*op++ = uint8_t(offset & 0xff);
+			*op++ = uint8_t(offset >> 8);
+
+			if (match_len >= 15)
+			{
+				*token |= 15;
+				op = write_length(op, match_len - 15);
+			}
+			else
+				*token |= uint8_t(match_len);
+
+			ip = match_end;
+			anchor = ip;
+		}
+	}
+
+	// The final sequence is literals only.
+	size_t literal_len = size_t(iend - anchor);
+	size_t required = 1 + literal_len / 255 + 1 + literal_len;
+	if (size_t(oend - op) < required)
+		return 0;
+
+	if (literal_len >= 15)
+	{
+		*op++ = 15 << 4;
+		op = write_length(op, literal_len - 15);
+	}
+	else
+		*op++ = uint8_t(literal_len << 4);
+
+	// Empty input may come with a null src.
+	if (literal_len)
+	{
+		memcpy(op, anchor, literal_len);
+		op += literal_len;
+	}
+	return size_t(op - dst);
+}
+
+bool lz4_decompress(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_size;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+
+	while (ip < iend)
+	{
+		unsigned token = *ip++;
+
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && !read_length(ip, iend, literal_len))
+			return false;
+		if (size_t(iend - ip) < literal_len || size_t(oend - op) < literal_len)
+			return false;
+
+		// A sequence may have no literals, and an empty output may come with a null dst.
+		if (literal_len)
+		{
+			memcpy(op, ip, literal_len);
+			op += literal_len;
+			ip += literal_len;
+		}
+
+		// The last sequence has no match part.
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+		ip += 2;
+		if (offset == 0 || offset > size_t(op - dst))
+			return false;
+
+		size_t match_len = token & 15;
+		if (match_len == 15 && !read_length(ip, iend, match_len))
+			return false;
+		match_len += MinMatch;
+		if (size_t(oend - op) < match_len)
+			return false;
+
+		const uint8_t *ref = op - offset;
+		if (offset >= match_len)
+		{
+			memcpy(op, ref, match_len);
+			op += match_len;
+		}
+		else
+		{
+			// Overlapping match, which repeats the last offset bytes.
+			for (size_t i = 0; i < match_len; i++)
+				op[i] = ref[i];
+			op += match_len;
+		}
+	}
+
+	return op == oend;
+}
+}
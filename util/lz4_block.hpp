@@ -0,0 +1,42 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Util
+{
+// Byte-compatible with the LZ4 block format (no frame header or checksums).
+// Compression is a single greedy pass which favors decode speed over ratio.
+
+// Worst case output size of lz4_compress() for incompressible input.
+size_t lz4_compress_bound(size_t size);
+
+// Returns the compressed size, or 0 if the output did not fit in dst_size.
+size_t lz4_compress(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size);
+
+// dst_size must be the exact uncompressed size. Malformed input is rejected rather than
+// read or written out of bounds, so this is safe to use on untrusted data.
+bool lz4_decompress(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size);
+}
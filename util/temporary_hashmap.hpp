@@ -84,15 +84,28 @@ public:
 		object_pool.clear();
 	}
 
+	// Objects which have not been requested in the last lifetime calls to begin_frame() are released.
+	// Cannot exceed RingSize, which is the default.
+	void set_lifetime(unsigned lifetime_)
+	{
+		if (lifetime_ < 1)
+			lifetime_ = 1;
+		else if (lifetime_ > RingSize)
+			lifetime_ = RingSize;
+		lifetime = lifetime_;
+	}
+
+	unsigned get_lifetime() const
+	{
+		return lifetime;
+	}
+
 	void begin_frame()
 	{
 		index = (index + 1) & (RingSize - 1);
-		for (auto &node : rings[index])
-		{
-			hashmap.erase(node.get_hash());
-			free_object(&node, ReuseTag<ReuseObjects>());
-		}
-		rings[index].clear();
+		release_ring(index);
+		if (lifetime < RingSize)
+			release_ring((index + RingSize - lifetime) & (RingSize - 1));
 	}
 
 	T *request(Hash hash)
@@ -148,6 +161,7 @@ private:
 	IntrusiveList<T> rings[RingSize];
 	ObjectPool<T> object_pool;
 	unsigned index = 0;
+	unsigned lifetime = RingSize;
 	IntrusiveHashMap<IntrusivePODWrapper<typename IntrusiveList<T>::Iterator>> hashmap;
 	std::vector<typename IntrusiveList<T>::Iterator> vacants;
 
@@ -165,5 +179,15 @@ private:
 	{
 		vacants.push_back(object);
 	}
+
+	void release_ring(unsigned ring)
+	{
+		for (auto &node : rings[ring])
+		{
+			hashmap.erase(node.get_hash());
+			free_object(&node, ReuseTag<ReuseObjects>());
+		}
+		rings[ring].clear();
+	}
 };
 }
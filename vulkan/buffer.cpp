@@ -36,6 +36,14 @@ Buffer::Buffer(Device *device_, VkBuffer buffer_, const DeviceAllocation &alloc_
 
 Buffer::~Buffer()
 {
+	if (info.misc & BUFFER_MISC_RELOCATABLE_BIT)
+	{
+		if (internal_sync)
+			device->unregister_relocatable_buffer_nolock(this);
+		else
+			device->unregister_relocatable_buffer(this);
+	}
+
 	if (internal_sync)
 	{
 		device->destroy_buffer_nolock(buffer);
@@ -48,6 +56,13 @@ Buffer::~Buffer()
 	}
 }
 
+void Buffer::relocate(VkBuffer buffer_, const DeviceAllocation &alloc_)
+{
+	buffer = buffer_;
+	alloc = alloc_;
+	update_cookie(device);
+}
+
 void BufferDeleter::operator()(Buffer *buffer)
 {
 	buffer->device->handle_pool.buffers.free(buffer);
@@ -81,7 +81,12 @@ enum class BufferDomain
 
 enum BufferMiscFlagBits
 {
-	BUFFER_MISC_ZERO_INITIALIZE_BIT = 1 << 0
+	BUFFER_MISC_ZERO_INITIALIZE_BIT = 1 << 0,
+	// The buffer may be moved to other memory by Device::defragment_memory().
+	// Only honored for device-local buffers which are not host visible and do not use device addresses.
+	// Creating a BufferView pins the buffer in place for the rest of its lifetime.
+	// The VkBuffer handle changes when moved, so do not hold on to it across frames.
+	BUFFER_MISC_RELOCATABLE_BIT = 1 << 1
 };
 
 using BufferMiscFlags = uint32_t;
@@ -135,7 +140,9 @@ public:
 
 private:
 	friend class Util::ObjectPool<Buffer>;
+	friend class Device;
 	Buffer(Device *device, VkBuffer buffer, const DeviceAllocation &alloc, const BufferCreateInfo &info);
+	void relocate(VkBuffer buffer, const DeviceAllocation &alloc);
 
 	Device *device;
 	VkBuffer buffer;
@@ -68,6 +68,7 @@ BufferBlock BufferPool::allocate_block(VkDeviceSize size)
 	info.size = size;
 	info.usage = usage | extra_usage;
 
+	stats.created_blocks++;
 	block.gpu = device->create_buffer(info, nullptr);
 	device->set_name(*block.gpu, "chain-allocated-block-gpu");
 	block.gpu->set_internal_sync_object();
@@ -99,6 +100,7 @@ BufferBlock BufferPool::allocate_block(VkDeviceSize size)
 
 BufferBlock BufferPool::request_block(VkDeviceSize minimum_size)
 {
+	stats.requested_blocks++;
 	if ((minimum_size > block_size) || blocks.empty())
 	{
 		return allocate_block(max(block_size, minimum_size));
@@ -125,4 +127,137 @@ BufferPool::~BufferPool()
 	VK_ASSERT(blocks.empty());
 }
 
+FrameLinearAllocator::FrameLinearAllocator()
+{
+	head.store(0);
+	tail.store(0);
+	allocated_bytes.store(0);
+	failed_allocations.store(0);
+}
+
+FrameLinearAllocator::~FrameLinearAllocator()
+{
+}
+
+bool FrameLinearAllocator::init(Device *device, VkDeviceSize size_, VkBufferUsageFlags usage, unsigned num_frame_contexts)
+{
+	reset();
+	VK_ASSERT((size_ & (size_ - 1)) == 0);
+
+	BufferCreateInfo info;
+	info.domain = BufferDomain::LinkedDeviceHost;
+	info.size = size_;
+	info.usage = usage;
+
+	buffer = device->create_buffer(info, nullptr);
+	if (!buffer)
+		return false;
+	device->set_name(*buffer, "frame-linear-allocator");
+
+	// Kept mapped for the lifetime of the allocator.
+	mapped = static_cast<uint8_t *>(device->map_host_buffer(*buffer, MEMORY_ACCESS_WRITE_BIT));
+	if (!mapped)
+	{
+		buffer.reset();
+		return false;
+	}
+
+	size = size_;
+	frame_start.clear();
+	frame_start.resize(num_frame_contexts);
+	head.store(0, memory_order_relaxed);
+	tail.store(0, memory_order_relaxed);
+	return true;
+}
+
+void FrameLinearAllocator::reset()
+{
+	buffer.reset();
+	mapped = nullptr;
+	size = 0;
+	frame_start.clear();
+}
+
+void FrameLinearAllocator::begin_frame(unsigned frame_index)
+{
+	if (!mapped)
+		return;
+
+	VK_ASSERT(frame_index < frame_start.size());
+	VkDeviceSize current = head.load(memory_order_relaxed);
+	frame_start[frame_index] = current;
+
+	// The oldest frame context still in flight is the one we will begin next.
+	tail.store(frame_start[(frame_index + 1) % frame_start.size()], memory_order_relaxed);
+}
+
+void FrameLinearAllocator::reclaim_all()
+{
+	if (!mapped)
+		return;
+
+	VkDeviceSize current = head.load(memory_order_relaxed);
+	for (auto &start : frame_start)
+		start = current;
+	tail.store(current, memory_order_relaxed);
+}
+
+void FrameLinearAllocator::set_num_frame_contexts(unsigned count)
+{
+	if (!mapped)
+		return;
+
+	frame_start.resize(count);
+	reclaim_all();
+}
+
+bool FrameLinearAllocator::allocate(VkDeviceSize allocate_size, VkDeviceSize alignment, VkDeviceSize spill_size,
+                                    LinearAllocation &alloc)
+{
+	VkDeviceSize padded_size = std::max(allocate_size, spill_size);
+	if (!mapped || padded_size > size)
+		return false;
+
+	VkDeviceSize current = head.load(memory_order_relaxed);
+	VkDeviceSize begin;
+	VkDeviceSize end;
+
+	for (;;)
+	{
+		begin = (current + alignment - 1) & ~(alignment - 1);
+
+		// Do not let the allocation or its spill region straddle the end of the buffer.
+		VkDeviceSize physical = begin & (size - 1);
+		if (physical + padded_size > size)
+			begin += size - physical;
+
+		end = begin + allocate_size;
+		if (end + (padded_size - allocate_size) - tail.load(memory_order_relaxed) > size)
+		{
+			failed_allocations.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+
+		if (head.compare_exchange_weak(current, end, memory_order_relaxed))
+			break;
+	}
+
+	allocated_bytes.fetch_add(end - current, memory_order_relaxed);
+
+	VkDeviceSize offset = begin & (size - 1);
+	alloc.buffer = buffer.get();
+	alloc.host = mapped + offset;
+	alloc.offset = offset;
+	alloc.padded_size = padded_size;
+	return true;
+}
+
+FrameLinearAllocator::Statistics FrameLinearAllocator::consume_statistics()
+{
+	Statistics ret;
+	ret.allocated_bytes = allocated_bytes.exchange(0, memory_order_relaxed);
+	ret.failed_allocations = failed_allocations.exchange(0, memory_order_relaxed);
+	return ret;
+}
+
 }
@@ -26,6 +26,7 @@
 #include "intrusive.hpp"
 #include <vector>
 #include <algorithm>
+#include <atomic>
 
 namespace Vulkan
 {
@@ -84,9 +85,60 @@ public:
 		return block_size;
 	}
 
+	VkDeviceSize get_alignment() const
+	{
+		return alignment;
+	}
+
+	VkDeviceSize get_spill_region_size() const
+	{
+		return spill_size;
+	}
+
+	bool needs_device_local() const
+	{
+		return need_device_local;
+	}
+
 	BufferBlock request_block(VkDeviceSize minimum_size);
 	void recycle_block(BufferBlock &&block);
 
+	struct Statistics
+	{
+		// Bytes consumed from blocks, including alignment padding.
+		uint64_t allocated_bytes = 0;
+		uint64_t requested_blocks = 0;
+		// Blocks which had to be created rather than recycled, i.e. new VkBuffers.
+		uint64_t created_blocks = 0;
+		// Blocks which were retired because an allocation did not fit in the remaining space.
+		uint64_t spilled_blocks = 0;
+		// Bytes copied from host blocks to device local blocks.
+		uint64_t copy_bytes = 0;
+	};
+
+	// Not thread-safe, the device lock protects the pools.
+	const Statistics &get_statistics() const
+	{
+		return stats;
+	}
+
+	void reset_statistics()
+	{
+		stats = {};
+	}
+
+	void record_retired_block(VkDeviceSize used_size, bool spilled)
+	{
+		stats.allocated_bytes += used_size;
+		if (spilled)
+			stats.spilled_blocks++;
+	}
+
+	void record_copy(VkDeviceSize size)
+	{
+		stats.copy_bytes += size;
+	}
+
 private:
 	Device *device = nullptr;
 	VkDeviceSize block_size = 0;
@@ -96,5 +148,68 @@ private:
 	std::vector<BufferBlock> blocks;
 	BufferBlock allocate_block(VkDeviceSize size);
 	bool need_device_local = false;
+	Statistics stats;
+};
+
+struct LinearAllocation
+{
+	const Buffer *buffer;
+	uint8_t *host;
+	VkDeviceSize offset;
+	VkDeviceSize padded_size;
+};
+
+// One large persistently mapped buffer used as a ring for frame-scoped data.
+// Every frame context remembers where it started in the ring, and the space is reclaimed
+// once that frame context is recycled. Allocation is a single atomic and does not take the device lock.
+class FrameLinearAllocator
+{
+public:
+	FrameLinearAllocator();
+	~FrameLinearAllocator();
+
+	// Size must be a power of two.
+	bool init(Device *device, VkDeviceSize size, VkBufferUsageFlags usage, unsigned num_frame_contexts);
+	void reset();
+
+	bool is_active() const
+	{
+		return mapped != nullptr;
+	}
+
+	const Buffer *get_buffer() const
+	{
+		return buffer.get();
+	}
+
+	// Everything allocated before frame_index was last begun has now completed on the GPU.
+	void begin_frame(unsigned frame_index);
+	// The device is idle, everything can be reclaimed.
+	void reclaim_all();
+	void set_num_frame_contexts(unsigned count);
+
+	// The spill region is guaranteed to be addressable past the allocation, like BufferBlock.
+	bool allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize spill_size, LinearAllocation &alloc);
+
+	struct Statistics
+	{
+		uint64_t allocated_bytes = 0;
+		uint64_t failed_allocations = 0;
+	};
+	// Returns counters since the last call and resets them.
+	Statistics consume_statistics();
+
+private:
+	Util::IntrusivePtr<Buffer> buffer;
+	uint8_t *mapped = nullptr;
+	VkDeviceSize size = 0;
+
+	// Monotonic positions, the physical offset is position & (size - 1).
+	std::atomic<VkDeviceSize> head;
+	std::atomic<VkDeviceSize> tail;
+	std::vector<VkDeviceSize> frame_start;
+
+	std::atomic<uint64_t> allocated_bytes;
+	std::atomic<uint64_t> failed_allocations;
 };
 }
\ No newline at end of file
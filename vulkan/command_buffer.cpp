@@ -997,6 +997,9 @@ bool CommandBuffer::flush_compute_pipeline(bool synchronous)
 {
 	update_hash_compute_pipeline(pipeline_state);
 	current_pipeline = pipeline_state.program->get_pipeline(pipeline_state.hash);
+#ifdef GRANITE_VULKAN_FOSSILIZE
+	device->note_pipeline_use(pipeline_state.hash);
+#endif
 	if (current_pipeline == VK_NULL_HANDLE && synchronous)
 		current_pipeline = build_compute_pipeline(device, pipeline_state);
 
@@ -1030,27 +1033,30 @@ void CommandBuffer::update_hash_compute_pipeline(DeferredPipelineCompile &compil
 	compile.hash = h.get();
 }
 
-void CommandBuffer::update_hash_graphics_pipeline(DeferredPipelineCompile &compile, uint32_t &active_vbos)
+// The graphics pipeline hash is split in parts which are invalidated by different dirty bits,
+// so that flush_graphics_pipeline() only needs to rehash what actually changed.
+static Hash hash_graphics_vertex_state(const DeferredPipelineCompile &compile, uint32_t &active_vbos)
 {
-	Hasher h;
+	WordHasher h;
 	active_vbos = 0;
 	auto &layout = compile.program->get_pipeline_layout()->get_resource_layout();
 	for_each_bit(layout.attribute_mask, [&](uint32_t bit) {
-		h.u32(bit);
 		active_vbos |= 1u << compile.attribs[bit].binding;
-		h.u32(compile.attribs[bit].binding);
-		h.u32(compile.attribs[bit].format);
-		h.u32(compile.attribs[bit].offset);
+		h.u32x2(bit, compile.attribs[bit].binding);
+		h.u32x2(compile.attribs[bit].format, compile.attribs[bit].offset);
 	});
 
 	for_each_bit(active_vbos, [&](uint32_t bit) {
-		h.u32(compile.input_rates[bit]);
-		h.u32(compile.strides[bit]);
+		h.u32x2(compile.input_rates[bit], uint32_t(compile.strides[bit]));
 	});
 
-	h.u64(compile.compatible_render_pass->get_hash());
-	h.u32(compile.subpass_index);
-	h.u64(compile.program->get_hash());
+	return h.get();
+}
+
+static Hash hash_graphics_static_state(const DeferredPipelineCompile &compile)
+{
+	WordHasher h;
+	auto &layout = compile.program->get_pipeline_layout()->get_resource_layout();
 	h.data(compile.static_state.words, sizeof(compile.static_state.words));
 
 	if (compile.static_state.state.blend_enable)
@@ -1063,7 +1069,7 @@ void CommandBuffer::update_hash_graphics_pipeline(DeferredPipelineCompile &compi
 		bool b2 = needs_blend_constant(static_cast<VkBlendFactor>(compile.static_state.state.dst_color_blend));
 		bool b3 = needs_blend_constant(static_cast<VkBlendFactor>(compile.static_state.state.dst_alpha_blend));
 		if (b0 || b1 || b2 || b3)
-			h.data(reinterpret_cast<const uint32_t *>(compile.potential_static_state.blend_constants),
+			h.data(compile.potential_static_state.blend_constants,
 			       sizeof(compile.potential_static_state.blend_constants));
 	}
 
@@ -1075,17 +1081,60 @@ void CommandBuffer::update_hash_graphics_pipeline(DeferredPipelineCompile &compi
 		h.u32(compile.potential_static_state.spec_constants[bit]);
 	});
 
-	compile.hash = h.get();
+	return h.get();
 }
 
-bool CommandBuffer::flush_graphics_pipeline(bool synchronous)
+static Hash hash_graphics_pipeline(const DeferredPipelineCompile &compile, Hash vertex_hash, Hash static_state_hash)
 {
-	update_hash_graphics_pipeline(pipeline_state, active_vbos);
+	WordHasher h;
+	h.u64(compile.compatible_render_pass->get_hash());
+	h.u64(compile.program->get_hash());
+	h.u32(compile.subpass_index);
+	h.u64(vertex_hash);
+	h.u64(static_state_hash);
+	return h.get();
+}
+
+void CommandBuffer::update_hash_graphics_pipeline(DeferredPipelineCompile &compile, uint32_t &active_vbos)
+{
+	Hash vertex_hash = hash_graphics_vertex_state(compile, active_vbos);
+	Hash static_state_hash = hash_graphics_static_state(compile);
+	compile.hash = hash_graphics_pipeline(compile, vertex_hash, static_state_hash);
+}
+
+bool CommandBuffer::flush_graphics_pipeline(bool synchronous, CommandBufferDirtyFlags flags)
+{
+	// Must match update_hash_graphics_pipeline(), but only rehash the parts invalidated by the dirty flags.
+	if (flags & (COMMAND_BUFFER_DIRTY_PIPELINE_BIT | COMMAND_BUFFER_DIRTY_STATIC_VERTEX_BIT))
+		pipeline_hashes.vertex = hash_graphics_vertex_state(pipeline_state, active_vbos);
+	if (flags & (COMMAND_BUFFER_DIRTY_PIPELINE_BIT | COMMAND_BUFFER_DIRTY_STATIC_STATE_BIT))
+		pipeline_hashes.static_state = hash_graphics_static_state(pipeline_state);
+	pipeline_state.hash = hash_graphics_pipeline(pipeline_state, pipeline_hashes.vertex, pipeline_hashes.static_state);
+
+	// Draws within a command buffer tend to cycle through a handful of pipelines,
+	// so avoid the program's pipeline hashmap for those.
+	unsigned lookup_index = unsigned(pipeline_state.hash & (PipelineLookupCacheSize - 1));
+	if (pipeline_lookup.hashes[lookup_index] == pipeline_state.hash &&
+	    pipeline_lookup.pipelines[lookup_index] != VK_NULL_HANDLE)
+	{
+		current_pipeline = pipeline_lookup.pipelines[lookup_index];
+		return true;
+	}
+
 	current_pipeline = pipeline_state.program->get_pipeline(pipeline_state.hash);
+#ifdef GRANITE_VULKAN_FOSSILIZE
+	device->note_pipeline_use(pipeline_state.hash);
+#endif
 
 	if (current_pipeline == VK_NULL_HANDLE && synchronous)
 		current_pipeline = build_graphics_pipeline(device, pipeline_state);
 
+	if (current_pipeline != VK_NULL_HANDLE)
+	{
+		pipeline_lookup.hashes[lookup_index] = pipeline_state.hash;
+		pipeline_lookup.pipelines[lookup_index] = current_pipeline;
+	}
+
 	return current_pipeline != VK_NULL_HANDLE;
 }
 
@@ -1138,11 +1187,12 @@ bool CommandBuffer::flush_render_state(bool synchronous)
 		set_dirty(COMMAND_BUFFER_DIRTY_PIPELINE_BIT);
 
 	// We've invalidated pipeline state, update the VkPipeline.
-	if (get_and_clear(COMMAND_BUFFER_DIRTY_STATIC_STATE_BIT | COMMAND_BUFFER_DIRTY_PIPELINE_BIT |
-	                  COMMAND_BUFFER_DIRTY_STATIC_VERTEX_BIT))
+	auto pipeline_dirty = get_and_clear(COMMAND_BUFFER_DIRTY_STATIC_STATE_BIT | COMMAND_BUFFER_DIRTY_PIPELINE_BIT |
+	                                    COMMAND_BUFFER_DIRTY_STATIC_VERTEX_BIT);
+	if (pipeline_dirty)
 	{
 		VkPipeline old_pipe = current_pipeline;
-		if (!flush_graphics_pipeline(synchronous))
+		if (!flush_graphics_pipeline(synchronous, pipeline_dirty))
 			return false;
 
 		if (old_pipe != current_pipeline)
@@ -1402,6 +1452,14 @@ void CommandBuffer::set_program(Program *program)
 void *CommandBuffer::allocate_constant_data(unsigned set, unsigned binding, VkDeviceSize size)
 {
 	VK_ASSERT(size <= VULKAN_MAX_UBO_SIZE);
+
+	LinearAllocation linear;
+	if (device->allocate_frame_linear(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, size, linear))
+	{
+		set_uniform_buffer(set, binding, *linear.buffer, linear.offset, linear.padded_size);
+		return linear.host;
+	}
+
 	auto data = ubo_block.allocate(size);
 	if (!data.host)
 	{
@@ -1414,6 +1472,13 @@ void *CommandBuffer::allocate_constant_data(unsigned set, unsigned binding, VkDe
 
 void *CommandBuffer::allocate_index_data(VkDeviceSize size, VkIndexType index_type)
 {
+	LinearAllocation linear;
+	if (device->allocate_frame_linear(VK_BUFFER_USAGE_INDEX_BUFFER_BIT, size, linear))
+	{
+		set_index_buffer(*linear.buffer, linear.offset, index_type);
+		return linear.host;
+	}
+
 	auto data = ibo_block.allocate(size);
 	if (!data.host)
 	{
@@ -1429,6 +1494,13 @@ void *CommandBuffer::update_buffer(const Buffer &buffer, VkDeviceSize offset, Vk
 	if (size == 0)
 		return nullptr;
 
+	LinearAllocation linear;
+	if (device->allocate_frame_linear(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, linear))
+	{
+		copy_buffer(buffer, offset, *linear.buffer, linear.offset, size);
+		return linear.host;
+	}
+
 	auto data = staging_block.allocate(size);
 	if (!data.host)
 	{
@@ -1468,6 +1540,13 @@ void *CommandBuffer::update_image(const Image &image, const VkOffset3D &offset,
 	VkDeviceSize size =
 	    TextureFormatLayout::format_block_size(create_info.format, subresource.aspectMask) * subresource.layerCount * depth * blocks_x * blocks_y;
 
+	LinearAllocation linear;
+	if (device->allocate_frame_linear(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, linear))
+	{
+		copy_buffer_to_image(image, *linear.buffer, linear.offset, offset, extent, row_length, image_height, subresource);
+		return linear.host;
+	}
+
 	auto data = staging_block.allocate(size);
 	if (!data.host)
 	{
@@ -1491,6 +1570,13 @@ void *CommandBuffer::update_image(const Image &image, uint32_t row_length, uint3
 void *CommandBuffer::allocate_vertex_data(unsigned binding, VkDeviceSize size, VkDeviceSize stride,
                                           VkVertexInputRate step_rate)
 {
+	LinearAllocation linear;
+	if (device->allocate_frame_linear(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, size, linear))
+	{
+		set_vertex_binding(binding, *linear.buffer, linear.offset, stride, step_rate);
+		return linear.host;
+	}
+
 	auto data = vbo_block.allocate(size);
 	if (!data.host)
 	{
@@ -1905,7 +1991,7 @@ void CommandBuffer::flush_descriptor_set(uint32_t set)
 	auto &set_layout = layout.sets[set];
 	uint32_t num_dynamic_offsets = 0;
 	uint32_t dynamic_offsets[VULKAN_NUM_BINDINGS];
-	Hasher h;
+	WordHasher h;
 
 	h.u32(set_layout.fp_mask);
 
@@ -1929,8 +2015,8 @@ void CommandBuffer::flush_descriptor_set(uint32_t set)
 		for (unsigned i = 0; i < array_size; i++)
 		{
 			h.u64(bindings.cookies[set][binding + i]);
-			h.u32(bindings.bindings[set][binding + i].buffer.offset);
-			h.u32(bindings.bindings[set][binding + i].buffer.range);
+			h.u32x2(uint32_t(bindings.bindings[set][binding + i].buffer.offset),
+			        uint32_t(bindings.bindings[set][binding + i].buffer.range));
 			VK_ASSERT(bindings.bindings[set][binding + i].buffer.buffer != VK_NULL_HANDLE);
 		}
 	});
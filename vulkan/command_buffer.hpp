@@ -707,6 +707,19 @@ private:
 
 	DeferredPipelineCompile pipeline_state = {};
 	DynamicState dynamic_state = {};
+
+	struct
+	{
+		Util::Hash vertex = 0;
+		Util::Hash static_state = 0;
+	} pipeline_hashes;
+
+	enum { PipelineLookupCacheSize = 8 };
+	struct
+	{
+		Util::Hash hashes[PipelineLookupCacheSize] = {};
+		VkPipeline pipelines[PipelineLookupCacheSize] = {};
+	} pipeline_lookup;
 #ifndef _MSC_VER
 	static_assert(sizeof(pipeline_state.static_state.words) >= sizeof(pipeline_state.static_state.state),
 	              "Hashable pipeline state is not large enough!");
@@ -716,7 +729,7 @@ private:
 	bool flush_compute_state(bool synchronous);
 	void clear_render_state();
 
-	bool flush_graphics_pipeline(bool synchronous);
+	bool flush_graphics_pipeline(bool synchronous, CommandBufferDirtyFlags flags);
 	bool flush_compute_pipeline(bool synchronous);
 	void flush_descriptor_sets();
 	void begin_graphics();
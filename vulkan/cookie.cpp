@@ -29,4 +29,9 @@ Cookie::Cookie(Device *device)
     : cookie(device->allocate_cookie())
 {
 }
+
+void Cookie::update_cookie(Device *device)
+{
+	cookie = device->allocate_cookie();
+}
 }
@@ -40,6 +40,10 @@ public:
 		return cookie;
 	}
 
+protected:
+	// Objects whose underlying handle changes must appear as a new object to hashed state.
+	void update_cookie(Device *device);
+
 private:
 	uint64_t cookie;
 };
@@ -33,6 +33,7 @@ DescriptorSetAllocator::DescriptorSetAllocator(Hash hash, Device *device_, const
 	: IntrusiveHashMapEnabled<DescriptorSetAllocator>(hash)
 	, device(device_)
 	, table(device_->get_device_table())
+	, layout_info(layout)
 {
 	bindless = layout.array_size[0] == DescriptorSetLayout::UNSIZED_ARRAY;
 
@@ -241,15 +242,28 @@ VkDescriptorPool DescriptorSetAllocator::allocate_bindless_pool(unsigned num_set
 	return pool;
 }
 
-void DescriptorSetAllocator::begin_frame()
+void DescriptorSetAllocator::begin_frame(unsigned lifetime_)
 {
 	if (!bindless)
 	{
+		lifetime = lifetime_;
 		for (auto &thr : per_thread)
 			thr->should_begin = true;
 	}
 }
 
+DescriptorSetAllocator::Statistics DescriptorSetAllocator::get_statistics() const
+{
+	Statistics stats;
+	for (auto &thr : per_thread)
+	{
+		stats.hits += thr->stats.hits;
+		stats.misses += thr->stats.misses;
+		stats.pool_allocations += thr->stats.pool_allocations;
+	}
+	return stats;
+}
+
 pair<VkDescriptorSet, bool> DescriptorSetAllocator::find(unsigned thread_index, Hash hash)
 {
 	VK_ASSERT(!bindless);
@@ -257,18 +271,25 @@ pair<VkDescriptorSet, bool> DescriptorSetAllocator::find(unsigned thread_index,
 	auto &state = *per_thread[thread_index];
 	if (state.should_begin)
 	{
+		state.set_nodes.set_lifetime(lifetime);
 		state.set_nodes.begin_frame();
 		state.should_begin = false;
 	}
 
 	auto *node = state.set_nodes.request(hash);
 	if (node)
+	{
+		state.stats.hits++;
 		return { node->set, true };
+	}
 
+	state.stats.misses++;
 	node = state.set_nodes.request_vacant(hash);
 	if (node)
 		return { node->set, false };
 
+	state.stats.pool_allocations++;
+
 	VkDescriptorPool pool;
 	VkDescriptorPoolCreateInfo info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
 	info.maxSets = VULKAN_NUM_SETS_PER_POOL;
@@ -72,7 +72,9 @@ static inline void set_immutable_sampler(DescriptorSetLayout &layout, unsigned b
 }
 
 static const unsigned VULKAN_NUM_SETS_PER_POOL = 16;
+// Default number of frames an unused descriptor set is kept around before it is recycled.
 static const unsigned VULKAN_DESCRIPTOR_RING_SIZE = 8;
+static const unsigned VULKAN_DESCRIPTOR_MAX_LIFETIME = 32;
 
 class DescriptorSetAllocator;
 class BindlessDescriptorPool;
@@ -124,9 +126,24 @@ public:
 	void operator=(const DescriptorSetAllocator &) = delete;
 	DescriptorSetAllocator(const DescriptorSetAllocator &) = delete;
 
-	void begin_frame();
+	void begin_frame(unsigned lifetime);
 	std::pair<VkDescriptorSet, bool> find(unsigned thread_index, Util::Hash hash);
 
+	struct Statistics
+	{
+		uint64_t hits = 0;
+		// Every miss means the set has to be written again.
+		uint64_t misses = 0;
+		uint64_t pool_allocations = 0;
+	};
+
+	// Not synchronized with find(), only call when no command buffers are being recorded.
+	Statistics get_statistics() const;
+	const DescriptorSetLayout &get_layout_info() const
+	{
+		return layout_info;
+	}
+
 	VkDescriptorSetLayout get_layout() const
 	{
 		return set_layout;
@@ -156,12 +173,15 @@ private:
 	Device *device;
 	const VolkDeviceTable &table;
 	VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+	DescriptorSetLayout layout_info;
+	unsigned lifetime = VULKAN_DESCRIPTOR_RING_SIZE;
 
 	struct PerThread
 	{
-		Util::TemporaryHashmap<DescriptorSetNode, VULKAN_DESCRIPTOR_RING_SIZE, true> set_nodes;
+		Util::TemporaryHashmap<DescriptorSetNode, VULKAN_DESCRIPTOR_MAX_LIFETIME, true> set_nodes;
 		std::vector<VkDescriptorPool> pools;
 		bool should_begin = true;
+		Statistics stats;
 	};
 	std::vector<std::unique_ptr<PerThread>> per_thread;
 	std::vector<VkDescriptorPoolSize> pool_size;
@@ -45,6 +45,8 @@ static unsigned get_thread_index()
 	return Vulkan::get_current_thread_index();
 }
 #define LOCK() std::lock_guard<std::mutex> holder__{lock.lock}
+#define STAGING_LOCK() std::lock_guard<std::mutex> holder__{uploads.staging_lock}
+#define DEFRAG_LOCK() std::lock_guard<std::mutex> defrag_holder__{defrag.lock}
 #define DRAIN_FRAME_LOCK() \
 	std::unique_lock<std::mutex> holder__{lock.lock}; \
 	lock.cond.wait(holder__, [&]() { \
@@ -52,6 +54,8 @@ static unsigned get_thread_index()
 	})
 #else
 #define LOCK() ((void)0)
+#define STAGING_LOCK() ((void)0)
+#define DEFRAG_LOCK() ((void)0)
 #define DRAIN_FRAME_LOCK() VK_ASSERT(lock.counter == 0)
 static unsigned get_thread_index()
 {
@@ -82,6 +86,406 @@ Device::Device()
 		if (!init_timestamp_trace(env))
 			LOGE("Failed to init timestamp trace.\n");
 	}
+
+	if (const char *env = getenv("GRANITE_DESCRIPTOR_SET_LIFETIME"))
+		set_descriptor_set_lifetime(unsigned(strtoul(env, nullptr, 0)));
+	if (const char *env = getenv("GRANITE_DESCRIPTOR_UPDATE_TEMPLATES"))
+		descriptor_update_templates = strtol(env, nullptr, 0) != 0;
+	if (const char *env = getenv("GRANITE_DEFRAGMENT_BUDGET"))
+		set_defragment_budget(strtoull(env, nullptr, 0));
+}
+
+void Device::set_descriptor_set_lifetime(unsigned frames)
+{
+	descriptor_set_lifetime = std::min(std::max(frames, 1u), VULKAN_DESCRIPTOR_MAX_LIFETIME);
+}
+
+bool Device::uses_descriptor_update_templates() const
+{
+	return descriptor_update_templates && ext.supports_update_template;
+}
+
+void Device::log_descriptor_set_statistics()
+{
+	for (auto &allocator : descriptor_set_allocators)
+	{
+		if (allocator.is_bindless())
+			continue;
+
+		auto stats = allocator.get_statistics();
+		uint64_t lookups = stats.hits + stats.misses;
+		if (!lookups)
+			continue;
+
+		auto &layout = allocator.get_layout_info();
+		LOGI("Descriptor set layout %016llx (UBO %x, SSBO %x, sampled %x, storage image %x): "
+		     "%llu hits, %llu misses (%.1f %% hit rate), %llu pool allocations.\n",
+		     static_cast<unsigned long long>(allocator.get_hash()),
+		     layout.uniform_buffer_mask, layout.storage_buffer_mask,
+		     layout.sampled_image_mask | layout.separate_image_mask, layout.storage_image_mask,
+		     static_cast<unsigned long long>(stats.hits),
+		     static_cast<unsigned long long>(stats.misses),
+		     100.0 * double(stats.hits) / double(lookups),
+		     static_cast<unsigned long long>(stats.pool_allocations));
+	}
+}
+
+void Device::get_memory_heap_statistics(vector<MemoryHeapStatistics> &stats)
+{
+	managers.memory.get_heap_statistics(stats);
+}
+
+void Device::log_memory_statistics()
+{
+	static const char *class_names[MEMORY_CLASS_COUNT] = { "small", "medium", "large", "huge" };
+
+	vector<MemoryHeapStatistics> stats;
+	get_memory_heap_statistics(stats);
+
+	for (size_t i = 0; i < stats.size(); i++)
+	{
+		auto &heap = stats[i];
+		if (!heap.allocated)
+			continue;
+
+		LOGI("Memory heap %u: %.1f MiB allocated of %.1f MiB, %.1f MiB held for recycling.\n",
+		     unsigned(i),
+		     double(heap.allocated) / (1024.0 * 1024.0),
+		     double(heap.heap_size) / (1024.0 * 1024.0),
+		     double(heap.recycled) / (1024.0 * 1024.0));
+
+		for (unsigned c = 0; c < MEMORY_CLASS_COUNT; c++)
+		{
+			auto &clazz = heap.classes[c];
+			if (!clazz.num_heaps)
+				continue;
+
+			// Print the non-empty buckets as longest free run:count.
+			char histogram[512];
+			size_t offset = 0;
+			histogram[0] = '\0';
+			for (unsigned run = 0; run <= Block::NumSubBlocks && offset < sizeof(histogram); run++)
+			{
+				if (clazz.free_run_histogram[run])
+				{
+					offset += snprintf(histogram + offset, sizeof(histogram) - offset, " %u:%u",
+					                   run, clazz.free_run_histogram[run]);
+				}
+			}
+
+			LOGI("  %6s: %.1f KiB used of %.1f KiB (%.1f %%) in %u mini-heaps, free runs:%s\n",
+			     class_names[c],
+			     double(clazz.used) / 1024.0, double(clazz.reserved) / 1024.0,
+			     100.0 * double(clazz.used) / double(clazz.reserved),
+			     clazz.num_heaps, histogram);
+		}
+	}
+
+	auto defrag_stats = get_defragment_statistics();
+	if (defrag_stats.passes)
+	{
+		LOGI("Defragmentation: %llu buffers, %.1f MiB relocated in %llu passes.\n",
+		     static_cast<unsigned long long>(defrag_stats.relocated_buffers),
+		     double(defrag_stats.relocated_bytes) / (1024.0 * 1024.0),
+		     static_cast<unsigned long long>(defrag_stats.passes));
+	}
+}
+
+void Device::set_defragment_budget(VkDeviceSize budget)
+{
+	DEFRAG_LOCK();
+	defrag.budget = budget;
+}
+
+Device::DefragmentStatistics Device::get_defragment_statistics()
+{
+	DEFRAG_LOCK();
+	return defrag.stats;
+}
+
+void Device::register_relocatable_buffer(Buffer *buffer)
+{
+	DEFRAG_LOCK();
+	defrag.buffers.insert(buffer);
+}
+
+void Device::unregister_relocatable_buffer(const Buffer *buffer)
+{
+	// Taking the device lock first means a defragment pass cannot be moving the buffer concurrently.
+	LOCK();
+	unregister_relocatable_buffer_nolock(buffer);
+}
+
+void Device::unregister_relocatable_buffer_nolock(const Buffer *buffer)
+{
+	DEFRAG_LOCK();
+	defrag.buffers.erase(const_cast<Buffer *>(buffer));
+}
+
+VkDeviceSize Device::defragment_memory(VkDeviceSize budget)
+{
+	if (budget == 0)
+		return 0;
+
+	// Hold the device lock for the whole pass, so nothing can begin recording against the old handles,
+	// and buffers cannot be destroyed or pinned while they are being moved.
+	// The defrag lock is only held while collecting candidates, since destroying a buffer takes it as well.
+	LOCK();
+
+	// Command buffers being recorded might refer to the old handles.
+	if (lock.counter != 0)
+		return 0;
+
+	struct Candidate
+	{
+		Buffer *buffer;
+		uint32_t used_sub_blocks;
+	};
+	vector<Candidate> candidates;
+
+	{
+		DEFRAG_LOCK();
+		for (auto *buffer : defrag.buffers)
+		{
+			auto &alloc = buffer->alloc;
+			uint32_t used = alloc.alloc->get_heap_used_sub_blocks(alloc);
+
+			// Emptying mostly used mini-heaps is not worth the copies.
+			if (used <= Block::NumSubBlocks / 2)
+				candidates.push_back({ buffer, used });
+		}
+	}
+
+	if (candidates.empty())
+		return 0;
+
+	// Uploads into relocatable buffers must land before we copy out of them.
+	flush_pending_uploads_nolock();
+
+	// Drain the most sparsely used mini-heaps first, they are the ones we can give back.
+	sort(begin(candidates), end(candidates), [](const Candidate &a, const Candidate &b) {
+		return a.used_sub_blocks < b.used_sub_blocks;
+	});
+
+	CommandBufferHandle cmd;
+	VkDeviceSize relocated_bytes = 0;
+	unsigned relocated_buffers = 0;
+
+	for (auto &candidate : candidates)
+	{
+		auto &buffer = *candidate.buffer;
+		VkDeviceSize size = buffer.info.size;
+		if (relocated_bytes + size > budget)
+			continue;
+
+		VkBufferCreateInfo info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+		info.size = size;
+		info.usage = buffer.info.usage;
+		info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+		uint32_t sharing_indices[3];
+		fill_buffer_sharing_indices(info, sharing_indices);
+
+		VkBuffer new_buffer;
+		if (table->vkCreateBuffer(device, &info, nullptr, &new_buffer) != VK_SUCCESS)
+			break;
+
+		VkMemoryRequirements reqs;
+		table->vkGetBufferMemoryRequirements(device, new_buffer, &reqs);
+
+		DeviceAllocation allocation;
+		if (!managers.memory.allocate(reqs.size, reqs.alignment, buffer.alloc.memory_type,
+		                              ALLOCATION_TILING_LINEAR, &allocation))
+		{
+			table->vkDestroyBuffer(device, new_buffer, nullptr);
+			break;
+		}
+
+		// Only move if we end up in a mini-heap which is more densely used than the one we leave,
+		// otherwise we would just shuffle memory around.
+		bool denser = allocation.alloc && allocation.heap.get() != buffer.alloc.heap.get() &&
+		              allocation.alloc->get_heap_used_sub_blocks(allocation) >
+		              buffer.alloc.alloc->get_heap_used_sub_blocks(buffer.alloc);
+
+		if (!denser ||
+		    table->vkBindBufferMemory(device, new_buffer, allocation.get_memory(), allocation.get_offset()) != VK_SUCCESS)
+		{
+			allocation.free_immediate(managers.memory);
+			table->vkDestroyBuffer(device, new_buffer, nullptr);
+			continue;
+		}
+
+		if (!cmd)
+		{
+			cmd = request_command_buffer_nolock(get_thread_index(), CommandBuffer::Type::Generic, false);
+			cmd->begin_region("defragment-buffers");
+			cmd->barrier(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_WRITE_BIT,
+			             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		}
+
+		const VkBufferCopy region = { 0, 0, size };
+		table->vkCmdCopyBuffer(cmd->get_command_buffer(), buffer.buffer, new_buffer, 1, &region);
+
+		// The old buffer is still read by the copy, so release it through the regular deferred path.
+		VkBuffer old_buffer = buffer.buffer;
+		DeviceAllocation old_allocation = buffer.alloc;
+		buffer.relocate(new_buffer, allocation);
+		destroy_buffer_nolock(old_buffer);
+		free_memory_nolock(old_allocation);
+
+		relocated_bytes += size;
+		relocated_buffers++;
+	}
+
+	if (!cmd)
+		return 0;
+
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT);
+	cmd->end_region();
+
+	// Relocatable buffers can be used on any queue. The copy waits for everything submitted to the other queues so far,
+	// and the other queues wait for the copy before they can observe the new handles.
+	CommandBuffer::Type other_queues[2];
+	unsigned num_other_queues = 0;
+	for (auto type : { CommandBuffer::Type::AsyncCompute, CommandBuffer::Type::AsyncTransfer })
+	{
+		VkQueue queue = get_vk_queue(type);
+		if (queue == graphics_queue || (num_other_queues && get_vk_queue(other_queues[0]) == queue))
+			continue;
+		other_queues[num_other_queues++] = type;
+	}
+
+	for (unsigned i = 0; i < num_other_queues; i++)
+	{
+		Semaphore sem;
+		submit_empty_nolock(other_queues[i], nullptr, 1, &sem, -1);
+		add_wait_semaphore_nolock(CommandBuffer::Type::Generic, sem, VK_PIPELINE_STAGE_TRANSFER_BIT, false);
+	}
+
+	Semaphore signals[2];
+	submit_nolock(move(cmd), nullptr, num_other_queues, signals);
+	for (unsigned i = 0; i < num_other_queues; i++)
+		add_wait_semaphore_nolock(other_queues[i], signals[i], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, false);
+
+	DEFRAG_LOCK();
+	defrag.stats.relocated_buffers += relocated_buffers;
+	defrag.stats.relocated_bytes += relocated_bytes;
+	defrag.stats.passes++;
+	return relocated_bytes;
+}
+
+void Device::init_frame_linear_allocator(VkDeviceSize size)
+{
+	// Data in the old ring might still be in flight.
+	wait_idle();
+	frame_linear.reset();
+	if (!size)
+		return;
+
+	VkDeviceSize ring_size = 1;
+	while (ring_size < size)
+		ring_size <<= 1;
+
+	VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+	                           VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+	if (!frame_linear.init(this, ring_size, usage, unsigned(per_frame.size())))
+	{
+		LOGE("Failed to create frame linear allocator of %llu bytes.\n", static_cast<unsigned long long>(ring_size));
+		return;
+	}
+
+	// We never flush the ring, so it must not end up in non-coherent memory.
+	auto &alloc = frame_linear.get_buffer()->get_allocation();
+	if ((mem_props.memoryTypes[alloc.memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
+	{
+		LOGW("Frame linear allocator did not get coherent memory, disabling.\n");
+		frame_linear.reset();
+		return;
+	}
+
+	LOGI("Using frame linear allocator of %llu KiB.\n", static_cast<unsigned long long>(ring_size / 1024));
+}
+
+bool Device::allocate_frame_linear(VkBufferUsageFlagBits usage, VkDeviceSize size, LinearAllocation &alloc)
+{
+	if (!frame_linear.is_active())
+		return false;
+
+	BufferPool *pool;
+	switch (usage)
+	{
+	case VK_BUFFER_USAGE_VERTEX_BUFFER_BIT:
+		pool = &managers.vbo;
+		break;
+	case VK_BUFFER_USAGE_INDEX_BUFFER_BIT:
+		pool = &managers.ibo;
+		break;
+	case VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT:
+		pool = &managers.ubo;
+		break;
+	case VK_BUFFER_USAGE_TRANSFER_SRC_BIT:
+		pool = &managers.staging;
+		break;
+	default:
+		return false;
+	}
+
+	// The ring is host memory, which is not good enough if the pool has to copy to device local memory.
+	if (pool->needs_device_local())
+		return false;
+
+	return frame_linear.allocate(size, pool->get_alignment(), pool->get_spill_region_size(), alloc);
+}
+
+void Device::latch_buffer_pool_statistics_nolock()
+{
+	auto &stats = last_frame_buffer_pool_stats;
+	stats.vbo = managers.vbo.get_statistics();
+	stats.ibo = managers.ibo.get_statistics();
+	stats.ubo = managers.ubo.get_statistics();
+	stats.staging = managers.staging.get_statistics();
+	stats.linear = frame_linear.consume_statistics();
+
+	managers.vbo.reset_statistics();
+	managers.ibo.reset_statistics();
+	managers.ubo.reset_statistics();
+	managers.staging.reset_statistics();
+}
+
+Device::BufferPoolStatistics Device::get_buffer_pool_statistics()
+{
+	LOCK();
+	return last_frame_buffer_pool_stats;
+}
+
+void Device::log_buffer_pool_statistics()
+{
+	auto stats = get_buffer_pool_statistics();
+
+	const auto log_pool = [](const char *tag, const BufferPool::Statistics &pool) {
+		LOGI("  %8s: %llu bytes, %llu blocks requested (%llu created, %llu spilled), %llu bytes copied.\n",
+		     tag,
+		     static_cast<unsigned long long>(pool.allocated_bytes),
+		     static_cast<unsigned long long>(pool.requested_blocks),
+		     static_cast<unsigned long long>(pool.created_blocks),
+		     static_cast<unsigned long long>(pool.spilled_blocks),
+		     static_cast<unsigned long long>(pool.copy_bytes));
+	};
+
+	LOGI("Buffer pools, last frame:\n");
+	log_pool("vertex", stats.vbo);
+	log_pool("index", stats.ibo);
+	log_pool("uniform", stats.ubo);
+	log_pool("staging", stats.staging);
+
+	if (frame_linear.is_active())
+	{
+		LOGI("  %8s: %llu bytes, %llu failed allocations.\n", "linear",
+		     static_cast<unsigned long long>(stats.linear.allocated_bytes),
+		     static_cast<unsigned long long>(stats.linear.failed_allocations));
+	}
 }
 
 Semaphore Device::request_legacy_semaphore()
@@ -505,23 +909,42 @@ void Device::bake_program(Program &program)
 	program.set_pipeline_layout(request_pipeline_layout(layout));
 }
 
+// The pipeline cache blob is prefixed with enough information to reject caches from another device or driver.
+// The driver's own cache header only covers the UUID, and a driver update does not always change it.
+static const size_t pipeline_cache_prefix_size = VK_UUID_SIZE + 3 * sizeof(uint32_t);
+
+static void write_pipeline_cache_prefix(uint8_t *data, const VkPhysicalDeviceProperties &props)
+{
+	memcpy(data, props.pipelineCacheUUID, VK_UUID_SIZE);
+	data += VK_UUID_SIZE;
+	const uint32_t ids[3] = { props.vendorID, props.deviceID, props.driverVersion };
+	memcpy(data, ids, sizeof(ids));
+}
+
 bool Device::init_pipeline_cache(const uint8_t *data, size_t size)
 {
-	static const auto uuid_size = sizeof(gpu_props.pipelineCacheUUID);
+	uint8_t prefix[pipeline_cache_prefix_size];
+	write_pipeline_cache_prefix(prefix, gpu_props);
+	pipeline_cache_warm = false;
 
 	VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
-	if (!data || size < uuid_size)
+	if (!data || size < pipeline_cache_prefix_size)
 	{
 		LOGI("Creating a fresh pipeline cache.\n");
 	}
-	else if (memcmp(data, gpu_props.pipelineCacheUUID, uuid_size) != 0)
+	else if (memcmp(data, prefix, VK_UUID_SIZE) != 0)
 	{
 		LOGI("Pipeline cache UUID changed.\n");
 	}
+	else if (memcmp(data + VK_UUID_SIZE, prefix + VK_UUID_SIZE, pipeline_cache_prefix_size - VK_UUID_SIZE) != 0)
+	{
+		LOGI("Pipeline cache was created with a different device or driver version.\n");
+	}
 	else
 	{
-		info.initialDataSize = size - uuid_size;
-		info.pInitialData = data + uuid_size;
+		info.initialDataSize = size - pipeline_cache_prefix_size;
+		info.pInitialData = data + pipeline_cache_prefix_size;
+		pipeline_cache_warm = true;
 		LOGI("Initializing pipeline cache.\n");
 	}
 
@@ -553,10 +976,18 @@ string Device::get_pipeline_cache_string() const
 	return res;
 }
 
+string Device::get_cache_path(const string &path) const
+{
+	return cache_protocol + "://" + path;
+}
+
 void Device::init_pipeline_cache()
 {
+	if (const char *protocol = getenv("GRANITE_PIPELINE_CACHE_PROTOCOL"))
+		cache_protocol = protocol;
+
 #ifdef GRANITE_VULKAN_FILESYSTEM
-	auto file = Granite::Global::filesystem()->open(Util::join("cache://pipeline_cache_", get_pipeline_cache_string(), ".bin"),
+	auto file = Granite::Global::filesystem()->open(get_cache_path(Util::join("pipeline_cache_", get_pipeline_cache_string(), ".bin")),
 	                                                Granite::FileMode::ReadOnly);
 	if (file)
 	{
@@ -575,7 +1006,6 @@ size_t Device::get_pipeline_cache_size()
 	if (pipeline_cache == VK_NULL_HANDLE)
 		return 0;
 
-	static const auto uuid_size = sizeof(gpu_props.pipelineCacheUUID);
 	size_t size = 0;
 	if (table->vkGetPipelineCacheData(device, pipeline_cache, &size, nullptr) != VK_SUCCESS)
 	{
@@ -583,7 +1013,7 @@ size_t Device::get_pipeline_cache_size()
 		return 0;
 	}
 
-	return size + uuid_size;
+	return size + pipeline_cache_prefix_size;
 }
 
 bool Device::get_pipeline_cache_data(uint8_t *data, size_t size)
@@ -591,13 +1021,12 @@ bool Device::get_pipeline_cache_data(uint8_t *data, size_t size)
 	if (pipeline_cache == VK_NULL_HANDLE)
 		return false;
 
-	static const auto uuid_size = sizeof(gpu_props.pipelineCacheUUID);
-	if (size < uuid_size)
+	if (size < pipeline_cache_prefix_size)
 		return false;
 
-	size -= uuid_size;
-	memcpy(data, gpu_props.pipelineCacheUUID, uuid_size);
-	data += uuid_size;
+	size -= pipeline_cache_prefix_size;
+	write_pipeline_cache_prefix(data, gpu_props);
+	data += pipeline_cache_prefix_size;
 
 	if (table->vkGetPipelineCacheData(device, pipeline_cache, &size, data) != VK_SUCCESS)
 	{
@@ -618,7 +1047,7 @@ void Device::flush_pipeline_cache()
 		return;
 	}
 
-	auto file = Granite::Global::filesystem()->open(Util::join("cache://pipeline_cache_", get_pipeline_cache_string(), ".bin"),
+	auto file = Granite::Global::filesystem()->open(get_cache_path(Util::join("pipeline_cache_", get_pipeline_cache_string(), ".bin")),
 	                                                Granite::FileMode::WriteOnly);
 	if (!file)
 	{
@@ -725,6 +1154,11 @@ void Device::set_context(const Context &context)
 
 	managers.memory.init(this);
 	managers.memory.set_supports_dedicated_allocation(ext.supports_dedicated);
+#ifdef GRANITE_VULKAN_MT
+	const char *thread_cache_env = getenv("GRANITE_ALLOCATOR_THREAD_CACHE");
+	if (!thread_cache_env || strtol(thread_cache_env, nullptr, 0) != 0)
+		managers.memory.init_thread_caches(num_thread_indices);
+#endif
 	managers.semaphore.init(this);
 	managers.fence.init(this);
 	managers.event.init(this);
@@ -740,6 +1174,9 @@ void Device::set_context(const Context &context)
 	                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 	                      false);
 
+	if (const char *env = getenv("GRANITE_FRAME_LINEAR_ALLOCATOR_SIZE"))
+		init_frame_linear_allocator(strtoull(env, nullptr, 0));
+
 	graphics.performance_query_pool.init_device(this, graphics_queue_family_index);
 	if (graphics_queue_family_index != compute_queue_family_index)
 		compute.performance_query_pool.init_device(this, compute_queue_family_index);
@@ -921,6 +1358,9 @@ static void request_block(Device &device, BufferBlock &block, VkDeviceSize size,
 	if (block.mapped)
 		device.unmap_host_buffer(*block.cpu, MEMORY_ACCESS_WRITE_BIT);
 
+	if (block.offset != 0)
+		pool.record_retired_block(block.offset, size != 0);
+
 	if (block.offset == 0)
 	{
 		if (block.size == pool.get_block_size())
@@ -1013,6 +1453,9 @@ CommandBuffer::Type Device::get_physical_queue_type(CommandBuffer::Type queue_ty
 
 void Device::submit_nolock(CommandBufferHandle cmd, Fence *fence, unsigned semaphore_count, Semaphore *semaphores)
 {
+	// Pending uploads must land before anything which might consume them.
+	flush_pending_uploads_nolock();
+
 	auto type = cmd->get_command_buffer_type();
 	auto &submissions = get_queue_submissions(type);
 #ifdef VULKAN_DEBUG
@@ -1080,6 +1523,7 @@ void Device::submit_empty(CommandBuffer::Type type, Fence *fence,
 void Device::submit_empty_nolock(CommandBuffer::Type type, Fence *fence,
                                  unsigned semaphore_count, Semaphore *semaphores, int profiling_iteration)
 {
+	flush_pending_uploads_nolock();
 	if (type != CommandBuffer::Type::AsyncTransfer)
 		flush_frame(CommandBuffer::Type::AsyncTransfer);
 
@@ -1385,6 +1829,239 @@ void Device::submit_staging(CommandBufferHandle &cmd, VkBufferUsageFlags usage,
 	}
 }
 
+bool Device::can_batch_uploads() const
+{
+	// If the transfer queue aliases the compute queue only, keep using the regular staging paths.
+	return transfer_queue == graphics_queue || transfer_queue != compute_queue;
+}
+
+BufferHandle Device::allocate_upload_staging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset)
+{
+	constexpr VkDeviceSize staging_block_size = 16 * 1024 * 1024;
+
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::Host;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+	// Large uploads would waste most of a block, so they get a buffer of their own.
+	if (size > staging_block_size / 4)
+	{
+		info.size = size;
+		offset = 0;
+		auto buffer = create_buffer(info, nullptr);
+		if (buffer)
+			set_name(*buffer, "upload-staging-buffer");
+
+		STAGING_LOCK();
+		uploads.dedicated_staging_buffers++;
+		return buffer;
+	}
+
+	// Destroy a retired block outside the staging lock.
+	BufferHandle retired_block;
+	STAGING_LOCK();
+	VkDeviceSize aligned_offset = ((uploads.staging_offset + alignment - 1) / alignment) * alignment;
+	if (!uploads.staging_block || aligned_offset + size > staging_block_size)
+	{
+		// The previous block is kept alive by the uploads which still reference it.
+		info.size = staging_block_size;
+		retired_block = move(uploads.staging_block);
+		uploads.staging_block = create_buffer(info, nullptr);
+		if (!uploads.staging_block)
+			return BufferHandle(nullptr);
+		set_name(*uploads.staging_block, "upload-staging-ring");
+		uploads.staging_ring_blocks++;
+		aligned_offset = 0;
+	}
+
+	offset = aligned_offset;
+	uploads.staging_offset = aligned_offset + size;
+	uploads.staging_ring_bytes += size;
+	return uploads.staging_block;
+}
+
+void Device::flush_pending_uploads_nolock()
+{
+	if (uploads.images.empty() && uploads.buffers.empty())
+		return;
+
+	// Take ownership of the pending work first, the submission below will re-enter this function.
+	auto images = move(uploads.images);
+	auto buffers = move(uploads.buffers);
+	uploads.images.clear();
+	uploads.buffers.clear();
+
+	VkPipelineStageFlags graphics_stages = uploads.graphics_stages;
+	VkAccessFlags graphics_access = uploads.graphics_access;
+	VkPipelineStageFlags compute_stages = uploads.compute_stages;
+	uploads.graphics_stages = 0;
+	uploads.graphics_access = 0;
+	uploads.compute_stages = 0;
+
+	if (graphics_stages == 0)
+		graphics_stages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+	auto cmd = request_command_buffer_nolock(get_thread_index(), CommandBuffer::Type::AsyncTransfer, false);
+	cmd->begin_region("batched-upload");
+
+	bool same_queue = get_vk_queue(CommandBuffer::Type::AsyncTransfer) == graphics_queue;
+	VkDeviceSize total_size = 0;
+
+	vector<VkImageMemoryBarrier> barriers;
+	barriers.reserve(images.size());
+	for (auto &upload : images)
+	{
+		auto &create_info = upload.image->get_create_info();
+		VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+		barrier.image = upload.image->get_image();
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.subresourceRange.aspectMask = format_to_aspect_mask(create_info.format);
+		barrier.subresourceRange.levelCount = create_info.levels;
+		barrier.subresourceRange.layerCount = create_info.layers;
+		barriers.push_back(barrier);
+	}
+
+	if (!barriers.empty())
+	{
+		cmd->barrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		             0, nullptr, 0, nullptr, barriers.size(), barriers.data());
+	}
+
+	for (auto &upload : images)
+	{
+		cmd->copy_buffer_to_image(*upload.image, *upload.staging, upload.blits.size(), upload.blits.data());
+		for (auto &blit : upload.blits)
+		{
+			total_size += format_get_layer_size(upload.image->get_format(), blit.imageSubresource.aspectMask,
+			                                    blit.imageExtent.width, blit.imageExtent.height,
+			                                    blit.imageExtent.depth) * blit.imageSubresource.layerCount;
+		}
+	}
+
+	for (auto &upload : buffers)
+	{
+		cmd->copy_buffer(*upload.buffer, 0, *upload.staging, upload.staging_offset, upload.size);
+		total_size += upload.size;
+	}
+
+	// On a shared queue, a barrier makes the data visible to graphics directly.
+	// Otherwise, the semaphores take care of visibility and we only need the layout transitions here.
+	VkPipelineStageFlags dst_stages = same_queue ? graphics_stages : VkPipelineStageFlags(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+	for (unsigned i = 0; i < images.size(); i++)
+	{
+		auto &barrier = barriers[i];
+		auto &image = *images[i].image;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = same_queue ?
+		                        (image.get_access_flags() & image_layout_to_possible_access(images[i].final_layout)) : 0;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = images[i].final_layout;
+	}
+
+	VkMemoryBarrier global = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	global.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	global.dstAccessMask = graphics_access;
+	bool need_global = same_queue && !buffers.empty();
+
+	if (need_global || !barriers.empty())
+	{
+		cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stages,
+		             need_global ? 1 : 0, need_global ? &global : nullptr,
+		             0, nullptr, barriers.size(), barriers.data());
+	}
+
+	cmd->end_region();
+
+	bool wait_compute = compute_stages != 0 && compute_queue != graphics_queue &&
+	                    get_vk_queue(CommandBuffer::Type::AsyncTransfer) != compute_queue;
+
+	if ((!same_queue || wait_compute) && ext.timeline_semaphore_features.timelineSemaphore)
+	{
+		// The batch signals the transfer timeline once, and every consuming queue waits for that value.
+		Semaphore signal;
+		submit_nolock(cmd, nullptr, 1, &signal);
+		VkSemaphore timeline = signal->get_semaphore();
+		uint64_t value = signal->get_timeline_value();
+		VK_ASSERT(timeline == transfer.timeline_semaphore && value != 0);
+
+		if (!same_queue)
+		{
+			add_wait_semaphore_nolock(CommandBuffer::Type::Generic,
+			                          Semaphore(handle_pool.semaphores.allocate(this, value, timeline)),
+			                          graphics_stages, false);
+		}
+
+		if (wait_compute)
+		{
+			add_wait_semaphore_nolock(CommandBuffer::Type::AsyncCompute,
+			                          Semaphore(handle_pool.semaphores.allocate(this, value, timeline)),
+			                          compute_stages, false);
+		}
+	}
+	else if (!same_queue && wait_compute)
+	{
+		// Without timeline semaphores, each consumer needs its own binary semaphore.
+		Semaphore semaphores[2];
+		submit_nolock(cmd, nullptr, 2, semaphores);
+		add_wait_semaphore_nolock(CommandBuffer::Type::Generic, semaphores[0], graphics_stages, false);
+		add_wait_semaphore_nolock(CommandBuffer::Type::AsyncCompute, semaphores[1], compute_stages, false);
+	}
+	else if (!same_queue)
+	{
+		Semaphore sem;
+		submit_nolock(cmd, nullptr, 1, &sem);
+		add_wait_semaphore_nolock(CommandBuffer::Type::Generic, sem, graphics_stages, false);
+	}
+	else if (wait_compute)
+	{
+		Semaphore sem;
+		submit_nolock(cmd, nullptr, 1, &sem);
+		add_wait_semaphore_nolock(CommandBuffer::Type::AsyncCompute, sem, compute_stages, false);
+	}
+	else
+		submit_nolock(cmd, nullptr, 0, nullptr);
+
+	uploads.stats.batched_uploads += images.size() + buffers.size();
+	uploads.stats.batched_bytes += total_size;
+	uploads.stats.batch_submissions++;
+
+	// We might be holding the last references, and they cannot be released while the device lock is held.
+	for (auto &upload : images)
+		uploads.retired_images.push_back(move(upload));
+	for (auto &upload : buffers)
+		uploads.retired_buffers.push_back(move(upload));
+}
+
+void Device::release_retired_uploads()
+{
+	vector<PendingImageUpload> images;
+	vector<PendingBufferUpload> buffers;
+	LOCK();
+	swap(images, uploads.retired_images);
+	swap(buffers, uploads.retired_buffers);
+}
+
+Device::UploadStatistics Device::get_upload_statistics()
+{
+	UploadStatistics stats;
+	{
+		LOCK();
+		stats = uploads.stats;
+	}
+
+	STAGING_LOCK();
+	stats.staging_ring_bytes = uploads.staging_ring_bytes;
+	stats.staging_ring_blocks = uploads.staging_ring_blocks;
+	stats.dedicated_staging_buffers = uploads.dedicated_staging_buffers;
+	return stats;
+}
+
 void Device::submit_queue(CommandBuffer::Type type, InternalFence *fence,
                           unsigned semaphore_count, Semaphore *semaphores, int profiling_iteration)
 {
@@ -1719,6 +2396,7 @@ void Device::sync_buffer_blocks()
 	{
 		VK_ASSERT(block.offset != 0);
 		cmd->copy_buffer(*block.gpu, 0, *block.cpu, 0, block.offset);
+		managers.vbo.record_copy(block.offset);
 		usage |= VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
 	}
 
@@ -1726,6 +2404,7 @@ void Device::sync_buffer_blocks()
 	{
 		VK_ASSERT(block.offset != 0);
 		cmd->copy_buffer(*block.gpu, 0, *block.cpu, 0, block.offset);
+		managers.ibo.record_copy(block.offset);
 		usage |= VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
 	}
 
@@ -1733,6 +2412,7 @@ void Device::sync_buffer_blocks()
 	{
 		VK_ASSERT(block.offset != 0);
 		cmd->copy_buffer(*block.gpu, 0, *block.cpu, 0, block.offset);
+		managers.ubo.record_copy(block.offset);
 		usage |= VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
 	}
 
@@ -1755,6 +2435,8 @@ void Device::end_frame_context()
 
 void Device::end_frame_nolock()
 {
+	flush_pending_uploads_nolock();
+
 	// Kept handles alive until end-of-frame, free now if appropriate.
 	for (auto &image : frame().keep_alive_images)
 	{
@@ -2020,13 +2702,28 @@ bool Device::swapchain_touched() const
 
 Device::~Device()
 {
+#ifdef GRANITE_VULKAN_FOSSILIZE
+	wait_pipeline_warmup();
+#endif
+#ifdef GRANITE_VULKAN_FILESYSTEM
+	shader_manager.wait_async_variants();
+#endif
 	wait_idle();
 
 	managers.timestamps.log_simple();
+	if (getenv("GRANITE_DESCRIPTOR_SET_STATS"))
+		log_descriptor_set_statistics();
+	if (getenv("GRANITE_MEMORY_STATS"))
+		log_memory_statistics();
+	if (getenv("GRANITE_BUFFER_POOL_STATS"))
+		log_buffer_pool_statistics();
 
 	wsi.acquire.reset();
 	wsi.release.reset();
 	wsi.swapchain.clear();
+	release_retired_uploads();
+	uploads.staging_block.reset();
+	frame_linear.reset();
 
 	if (pipeline_cache != VK_NULL_HANDLE)
 	{
@@ -2088,6 +2785,7 @@ void Device::init_frame_contexts(unsigned count)
 	framebuffer_allocator.clear();
 	transient_allocator.clear();
 	per_frame.clear();
+	frame_linear.set_num_frame_contexts(count);
 
 	for (unsigned i = 0; i < count; i++)
 	{
@@ -2409,6 +3107,7 @@ void Device::wait_idle_nolock()
 	managers.ubo.reset();
 	managers.ibo.reset();
 	managers.staging.reset();
+	frame_linear.reclaim_all();
 	for (auto &frame : per_frame)
 	{
 		frame->vbo_blocks.clear();
@@ -2432,8 +3131,23 @@ void Device::wait_idle_nolock()
 
 void Device::next_frame_context()
 {
+	release_retired_uploads();
+
+	// Nothing is being recorded between frames, so this is a safe point to move buffers around.
+	if (defrag.budget)
+		defragment_memory(defrag.budget);
+
 	DRAIN_FRAME_LOCK();
 
+#ifdef GRANITE_VULKAN_FILESYSTEM
+	shader_manager.next_frame();
+#endif
+
+#ifdef GRANITE_VULKAN_FOSSILIZE
+	if (pipeline_usage.frame < PipelineUsageTrackingFrames)
+		pipeline_usage.frame++;
+#endif
+
 	if (frame_context_begin_ts)
 	{
 		auto frame_context_end_ts = write_calibrated_timestamp_nolock();
@@ -2443,11 +3157,15 @@ void Device::next_frame_context()
 
 	// Flush the frame here as we might have pending staging command buffers from init stage.
 	end_frame_nolock();
+	latch_buffer_pool_statistics_nolock();
 
 	framebuffer_allocator.begin_frame();
 	transient_allocator.begin_frame();
+
+	// A recycled set must not be in flight, so it has to outlive all frame contexts.
+	unsigned lifetime = std::max(descriptor_set_lifetime, unsigned(per_frame.size()));
 	for (auto &allocator : descriptor_set_allocators)
-		allocator.begin_frame();
+		allocator.begin_frame(lifetime);
 
 	VK_ASSERT(!per_frame.empty());
 	frame_context_index++;
@@ -2455,6 +3173,9 @@ void Device::next_frame_context()
 		frame_context_index = 0;
 
 	frame().begin();
+	frame_linear.begin_frame(frame_context_index);
+	// Deferred frees from the last frame all land in this thread's allocation cache.
+	managers.memory.trim_thread_cache();
 	recalibrate_timestamps();
 	frame_context_begin_ts = write_calibrated_timestamp_nolock();
 }
@@ -2983,6 +3704,10 @@ static inline VkImageViewType get_image_view_type(const ImageCreateInfo &create_
 
 BufferViewHandle Device::create_buffer_view(const BufferViewCreateInfo &view_info)
 {
+	// The view refers to the VkBuffer, so the buffer has to stay where it is from now on.
+	if (view_info.buffer->get_create_info().misc & BUFFER_MISC_RELOCATABLE_BIT)
+		unregister_relocatable_buffer(view_info.buffer);
+
 	VkBufferViewCreateInfo info = { VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO };
 	info.buffer = view_info.buffer->get_buffer();
 	info.format = view_info.format;
@@ -3388,22 +4113,42 @@ ImageHandle Device::create_imported_image(int fd, VkDeviceSize size, uint32_t me
 }
 #endif
 
-InitialImageBuffer Device::create_image_staging_buffer(const TextureFormatLayout &layout)
+static VkDeviceSize get_image_staging_alignment(const TextureFormatLayout &layout)
+{
+	// bufferOffset must be a multiple of the texel block size, and we also want 16 byte alignment for good measure.
+	VkDeviceSize alignment = 16;
+	while (alignment % layout.get_block_stride())
+		alignment += 16;
+	return alignment;
+}
+
+InitialImageBuffer Device::create_image_staging_buffer(const TextureFormatLayout &layout, unsigned base_level)
 {
 	InitialImageBuffer result;
+	VK_ASSERT(base_level < layout.get_levels());
 
-	BufferCreateInfo buffer_info = {};
-	buffer_info.domain = BufferDomain::Host;
-	buffer_info.size = layout.get_required_size();
-	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-	result.buffer = create_buffer(buffer_info, nullptr);
-	set_name(*result.buffer, "image-upload-staging-buffer");
+	// Mip levels are laid out back to back, so the tail of the mip chain is a contiguous range.
+	size_t base_offset = layout.get_mip_info(base_level).offset;
+	size_t size = layout.get_required_size() - base_offset;
+
+	VkDeviceSize offset = 0;
+	result.buffer = allocate_upload_staging(size, get_image_staging_alignment(layout), offset);
+	if (!result.buffer)
+		return {};
 
-	auto *mapped = static_cast<uint8_t *>(map_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT));
-	memcpy(mapped, layout.data(), layout.get_required_size());
-	unmap_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT);
+	auto *mapped = static_cast<uint8_t *>(map_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT, offset, size));
+	memcpy(mapped, layout.data(0, base_level), size);
+	unmap_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT, offset, size);
 
 	layout.build_buffer_image_copies(result.blits);
+	if (base_level)
+		result.blits.erase(result.blits.begin(), result.blits.begin() + base_level);
+
+	for (auto &blit : result.blits)
+	{
+		blit.bufferOffset = blit.bufferOffset - base_offset + offset;
+		blit.imageSubresource.mipLevel -= base_level;
+	}
 	return result;
 }
 
@@ -3437,18 +4182,17 @@ InitialImageBuffer Device::create_image_staging_buffer(const ImageCreateInfo &in
 		return {};
 	}
 
-	BufferCreateInfo buffer_info = {};
-	buffer_info.domain = BufferDomain::Host;
-	buffer_info.size = layout.get_required_size();
-	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-	result.buffer = create_buffer(buffer_info, nullptr);
-	set_name(*result.buffer, "image-upload-staging-buffer");
+	VkDeviceSize size = layout.get_required_size();
+	VkDeviceSize offset = 0;
+	result.buffer = allocate_upload_staging(size, get_image_staging_alignment(layout), offset);
+	if (!result.buffer)
+		return {};
 
 	// And now, do the actual copy.
-	auto *mapped = static_cast<uint8_t *>(map_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT));
+	auto *mapped = static_cast<uint8_t *>(map_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT, offset, size));
 	unsigned index = 0;
 
-	layout.set_buffer(mapped, layout.get_required_size());
+	layout.set_buffer(mapped, size);
 
 	for (unsigned level = 0; level < copy_levels; level++)
 	{
@@ -3475,8 +4219,10 @@ InitialImageBuffer Device::create_image_staging_buffer(const ImageCreateInfo &in
 		}
 	}
 
-	unmap_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT);
+	unmap_host_buffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT, offset, size);
 	layout.build_buffer_image_copies(result.blits);
+	for (auto &blit : result.blits)
+		blit.bufferOffset += offset;
 	return result;
 }
 
@@ -3881,6 +4627,29 @@ ImageHandle Device::create_image_from_staging_buffer(const ImageCreateInfo &crea
 		VK_ASSERT(create_info.domain != ImageDomain::Transient);
 		VK_ASSERT(create_info.initial_layout != VK_IMAGE_LAYOUT_UNDEFINED);
 		bool generate_mips = (create_info.misc & IMAGE_MISC_GENERATE_MIPS_BIT) != 0;
+		bool share_compute = concurrent_queue && graphics_queue != compute_queue;
+		bool share_async_graphics = get_physical_queue_type(CommandBuffer::Type::AsyncGraphics) == CommandBuffer::Type::AsyncCompute;
+
+		// Plain uploads are deferred and batched with other uploads into one transfer submission.
+		// Mip generation needs the graphics queue, and exclusive images on a separate transfer family
+		// need ownership transfers, so keep using the immediate path for those.
+		if (handle && !generate_mips && can_batch_uploads() &&
+		    (concurrent_queue || transfer_queue_family_index == graphics_queue_family_index))
+		{
+			LOCK();
+			uploads.images.push_back({ handle, staging_buffer->buffer, staging_buffer->blits, create_info.initial_layout });
+			uploads.graphics_stages |= handle->get_stage_flags();
+			uploads.graphics_access |= handle->get_access_flags() & image_layout_to_possible_access(create_info.initial_layout);
+
+			if (share_compute || share_async_graphics)
+			{
+				VkPipelineStageFlags dst_stages = handle->get_stage_flags();
+				if (graphics_queue_family_index != compute_queue_family_index)
+					dst_stages &= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+				uploads.compute_stages |= dst_stages;
+			}
+			return handle;
+		}
 
 		// If graphics_queue != transfer_queue, we will use a semaphore, so no srcAccess mask is necessary.
 		VkAccessFlags final_transition_src_access = 0;
@@ -3993,9 +4762,6 @@ ImageHandle Device::create_image_from_staging_buffer(const ImageCreateInfo &crea
 					handle->get_access_flags() & image_layout_to_possible_access(create_info.initial_layout));
 		}
 
-		bool share_compute = concurrent_queue && graphics_queue != compute_queue;
-		bool share_async_graphics = get_physical_queue_type(CommandBuffer::Type::AsyncGraphics) == CommandBuffer::Type::AsyncCompute;
-
 		// For concurrent queue, make sure that compute can see the final image as well.
 		// Also add semaphore if the compute queue can be used for async graphics as well.
 		if (share_compute || share_async_graphics)
@@ -4336,9 +5102,44 @@ BufferHandle Device::create_buffer(const BufferCreateInfo &create_info, const vo
 
 	auto tmpinfo = create_info;
 	tmpinfo.usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	// Only sub-allocated device memory can be defragmented, mapped pointers would go stale.
+	// Device addresses cannot be patched either, so such buffers stay where they are.
+	bool relocatable = (create_info.misc & BUFFER_MISC_RELOCATABLE_BIT) != 0 &&
+	                   allocation.alloc != nullptr && !memory_type_is_host_visible(memory_type) &&
+	                   (create_info.usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR) == 0;
+	if (!relocatable)
+		tmpinfo.misc &= ~BUFFER_MISC_RELOCATABLE_BIT;
+
 	BufferHandle handle(handle_pool.buffers.allocate(this, buffer, allocation, tmpinfo));
+	if (relocatable)
+		register_relocatable_buffer(handle.get());
 
-	if (create_info.domain == BufferDomain::Device && (initial || zero_initialize) && !memory_type_is_host_visible(memory_type))
+	if (create_info.domain == BufferDomain::Device && initial && !memory_type_is_host_visible(memory_type) &&
+	    can_batch_uploads())
+	{
+		VkDeviceSize offset = 0;
+		auto staging_buffer = allocate_upload_staging(create_info.size, 16, offset);
+		if (!staging_buffer)
+			return BufferHandle(nullptr);
+
+		void *ptr = map_host_buffer(*staging_buffer, MEMORY_ACCESS_WRITE_BIT, offset, create_info.size);
+		memcpy(ptr, initial, create_info.size);
+		unmap_host_buffer(*staging_buffer, MEMORY_ACCESS_WRITE_BIT, offset, create_info.size);
+
+		auto stages = buffer_usage_to_possible_stages(info.usage);
+		auto access = buffer_usage_to_possible_access(info.usage);
+
+		LOCK();
+		uploads.buffers.push_back({ handle, move(staging_buffer), offset, create_info.size });
+		uploads.graphics_stages |= stages;
+		uploads.graphics_access |= access;
+		uploads.compute_stages |= stages &
+		                          (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+		                           VK_PIPELINE_STAGE_TRANSFER_BIT |
+		                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+	}
+	else if (create_info.domain == BufferDomain::Device && (initial || zero_initialize) && !memory_type_is_host_visible(memory_type))
 	{
 		CommandBufferHandle cmd;
 		if (initial)
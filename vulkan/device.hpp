@@ -42,6 +42,7 @@
 #include <vector>
 #include <functional>
 #include <unordered_map>
+#include <unordered_set>
 #include <stdio.h>
 
 #ifdef GRANITE_VULKAN_FILESYSTEM
@@ -57,6 +58,7 @@
 
 #ifdef GRANITE_VULKAN_FOSSILIZE
 #include "fossilize.hpp"
+#include "hashmap.hpp"
 #include "thread_group.hpp"
 #endif
 
@@ -181,11 +183,24 @@ public:
 	unsigned get_num_frame_contexts() const;
 	unsigned get_swapchain_index() const;
 	unsigned get_current_frame_context() const;
+	unsigned get_num_thread_indices() const
+	{
+		return num_thread_indices;
+	}
 
 	size_t get_pipeline_cache_size();
 	bool get_pipeline_cache_data(uint8_t *data, size_t size);
 	bool init_pipeline_cache(const uint8_t *data, size_t size);
 
+	// True if the pipeline cache was initialized from data matching this device and driver.
+	bool has_warm_pipeline_cache() const
+	{
+		return pipeline_cache_warm;
+	}
+
+	// Resolves a path under the protocol used for persistent caches.
+	std::string get_cache_path(const std::string &path) const;
+
 	// Frame-pushing interface.
 	void next_frame_context();
 	void wait_idle();
@@ -250,7 +265,40 @@ public:
 
 	// Create staging buffers for images.
 	InitialImageBuffer create_image_staging_buffer(const ImageCreateInfo &info, const ImageInitialData *initial);
-	InitialImageBuffer create_image_staging_buffer(const TextureFormatLayout &layout);
+	// Only uploads mip levels from base_level and up, which become levels 0 and up in the image.
+	InitialImageBuffer create_image_staging_buffer(const TextureFormatLayout &layout, unsigned base_level = 0);
+
+	// Initial uploads of images and buffers are batched into one transfer submission,
+	// which is flushed right before the next submission to any other queue.
+	struct UploadStatistics
+	{
+		uint64_t batched_uploads = 0;
+		uint64_t batched_bytes = 0;
+		uint64_t batch_submissions = 0;
+		uint64_t staging_ring_bytes = 0;
+		uint64_t staging_ring_blocks = 0;
+		uint64_t dedicated_staging_buffers = 0;
+	};
+	UploadStatistics get_upload_statistics();
+
+	// Replaces per-command buffer BufferBlocks with sub-allocations from one persistently mapped ring buffer
+	// of the given size (a power of two), shared by all queues. A size of 0 disables the ring.
+	// Can also be enabled with GRANITE_FRAME_LINEAR_ALLOCATOR_SIZE.
+	void init_frame_linear_allocator(VkDeviceSize size);
+
+	// Frame-scoped data for the given usage, which must be one of VERTEX_BUFFER, INDEX_BUFFER,
+	// UNIFORM_BUFFER or TRANSFER_SRC. Valid until the current frame context is recycled.
+	// Fails if the ring is disabled or full, callers are expected to fall back to BufferBlocks.
+	bool allocate_frame_linear(VkBufferUsageFlagBits usage, VkDeviceSize size, LinearAllocation &alloc);
+
+	struct BufferPoolStatistics
+	{
+		BufferPool::Statistics vbo, ibo, ubo, staging;
+		FrameLinearAllocator::Statistics linear;
+	};
+	// Counters for the last completed frame context, useful to tune block and spill region sizes.
+	BufferPoolStatistics get_buffer_pool_statistics();
+	void log_buffer_pool_statistics();
 
 #ifndef _WIN32
 	ImageHandle create_imported_image(int fd,
@@ -332,6 +380,34 @@ public:
 		return ext;
 	}
 
+	// Number of frames a descriptor set can go unused before it is recycled, capped to VULKAN_DESCRIPTOR_MAX_LIFETIME.
+	// Can also be set with GRANITE_DESCRIPTOR_SET_LIFETIME.
+	void set_descriptor_set_lifetime(unsigned frames);
+	// Descriptor update templates can be disabled with GRANITE_DESCRIPTOR_UPDATE_TEMPLATES=0 for comparison.
+	bool uses_descriptor_update_templates() const;
+	// Logs hit rates for every descriptor set layout, to find layouts which churn.
+	void log_descriptor_set_statistics();
+
+	// One entry per VkMemoryHeap.
+	void get_memory_heap_statistics(std::vector<MemoryHeapStatistics> &stats);
+	void log_memory_statistics();
+
+	// Moves buffers created with BUFFER_MISC_RELOCATABLE_BIT out of sparsely used mini-heaps
+	// with GPU copies on the graphics queue, up to budget bytes. Returns the number of bytes moved.
+	// Must be called while no command buffers are being recorded, as recorded commands would refer
+	// to the old buffer. Called automatically every frame if a budget is set with
+	// set_defragment_budget() or GRANITE_DEFRAGMENT_BUDGET.
+	VkDeviceSize defragment_memory(VkDeviceSize budget);
+	void set_defragment_budget(VkDeviceSize budget);
+
+	struct DefragmentStatistics
+	{
+		uint64_t relocated_buffers = 0;
+		uint64_t relocated_bytes = 0;
+		uint64_t passes = 0;
+	};
+	DefragmentStatistics get_defragment_statistics();
+
 	bool swapchain_touched() const;
 
 	double convert_timestamp_delta(uint64_t start_ticks, uint64_t end_ticks) const;
@@ -348,6 +424,8 @@ private:
 	VkQueue transfer_queue = VK_NULL_HANDLE;
 	uint32_t timestamp_valid_bits = 0;
 	unsigned num_thread_indices = 1;
+	unsigned descriptor_set_lifetime = VULKAN_DESCRIPTOR_RING_SIZE;
+	bool descriptor_update_templates = true;
 
 #ifdef GRANITE_VULKAN_MT
 	std::atomic<uint64_t> cookie;
@@ -423,6 +501,9 @@ private:
 		TimestampIntervalManager timestamps;
 	};
 	Managers managers;
+	FrameLinearAllocator frame_linear;
+	BufferPoolStatistics last_frame_buffer_pool_stats;
+	void latch_buffer_pool_statistics_nolock();
 
 	struct
 	{
@@ -587,6 +668,10 @@ private:
 	FramebufferAllocator framebuffer_allocator;
 	TransientAttachmentAllocator transient_allocator;
 	VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+	bool pipeline_cache_warm = false;
+
+	// Persistent caches live under this filesystem protocol, overridable with GRANITE_PIPELINE_CACHE_PROTOCOL.
+	std::string cache_protocol = "cache";
 
 	SamplerHandle create_sampler(const SamplerCreateInfo &info, StockSampler sampler);
 	void init_pipeline_cache();
@@ -601,6 +686,68 @@ private:
 	void submit_staging(CommandBufferHandle &cmd, VkBufferUsageFlags usage, bool flush);
 	PipelineEvent request_pipeline_event();
 
+	struct PendingImageUpload
+	{
+		ImageHandle image;
+		BufferHandle staging;
+		std::vector<VkBufferImageCopy> blits;
+		VkImageLayout final_layout;
+	};
+
+	struct PendingBufferUpload
+	{
+		BufferHandle buffer;
+		BufferHandle staging;
+		VkDeviceSize staging_offset;
+		VkDeviceSize size;
+	};
+
+	struct
+	{
+		// Protected by the device lock.
+		std::vector<PendingImageUpload> images;
+		std::vector<PendingBufferUpload> buffers;
+		VkPipelineStageFlags graphics_stages = 0;
+		VkAccessFlags graphics_access = 0;
+		VkPipelineStageFlags compute_stages = 0;
+		UploadStatistics stats;
+
+		// Submitted uploads, released outside the device lock on the next frame.
+		std::vector<PendingImageUpload> retired_images;
+		std::vector<PendingBufferUpload> retired_buffers;
+
+		// Staging memory is sub-allocated linearly from large host buffers.
+		// A block is released through the normal deferred destruction once the ring has moved on
+		// and every upload which referenced it has been submitted.
+#ifdef GRANITE_VULKAN_MT
+		std::mutex staging_lock;
+#endif
+		BufferHandle staging_block;
+		VkDeviceSize staging_offset = 0;
+		uint64_t staging_ring_bytes = 0;
+		uint64_t staging_ring_blocks = 0;
+		uint64_t dedicated_staging_buffers = 0;
+	} uploads;
+
+	struct
+	{
+#ifdef GRANITE_VULKAN_MT
+		std::mutex lock;
+#endif
+		std::unordered_set<Buffer *> buffers;
+		VkDeviceSize budget = 0;
+		DefragmentStatistics stats;
+	} defrag;
+
+	void register_relocatable_buffer(Buffer *buffer);
+	void unregister_relocatable_buffer(const Buffer *buffer);
+	void unregister_relocatable_buffer_nolock(const Buffer *buffer);
+
+	bool can_batch_uploads() const;
+	BufferHandle allocate_upload_staging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset);
+	void flush_pending_uploads_nolock();
+	void release_retired_uploads();
+
 	std::function<void ()> queue_lock_callback;
 	std::function<void ()> queue_unlock_callback;
 	void flush_frame(CommandBuffer::Type type);
@@ -696,14 +843,52 @@ private:
 	void register_shader_module(VkShaderModule module, Fossilize::Hash hash, const VkShaderModuleCreateInfo &info);
 	void register_sampler(VkSampler sampler, Fossilize::Hash hash, const VkSamplerCreateInfo &info);
 
+	struct DeferredPipelineCompile
+	{
+		uint32_t first_use_frame;
+		std::function<void ()> func;
+	};
+
 	struct
 	{
 		std::unordered_map<VkShaderModule, Shader *> shader_map;
 		std::unordered_map<VkRenderPass, RenderPass *> render_pass_map;
 #ifdef GRANITE_VULKAN_MT
 		Granite::TaskGroup pipeline_group;
+
+		// Pipelines which were not used early in the previous run keep compiling in the background,
+		// which keeps the replayer alive until the device is destroyed.
+		std::vector<DeferredPipelineCompile> deferred_pipelines;
+		Granite::TaskGroup background_group;
+		std::unique_ptr<Fossilize::StateReplayer> replayer;
 #endif
 	} replayer_state;
+#ifdef GRANITE_VULKAN_MT
+	std::atomic_bool pipeline_warmup_cancelled{false};
+#endif
+
+	// Frame index at which each pipeline was first used, recorded over the first frames of a run.
+	// Replay compiles pipelines in this order so the ones needed for the first frame are ready first.
+	enum { PipelineUsageTrackingFrames = 64, PipelineUsageRecordedSlots = 4096 };
+	struct
+	{
+		Util::HashMap<uint32_t> first_use_frame;
+		Util::HashMap<uint32_t> previous_first_use_frame;
+#ifdef GRANITE_VULKAN_MT
+		// Hashes already in first_use_frame, indexed by their low bits.
+		std::atomic<uint64_t> recorded[PipelineUsageRecordedSlots] = {};
+		std::mutex lock;
+		std::atomic<uint32_t> frame{0};
+#else
+		uint32_t frame = 0;
+#endif
+	} pipeline_usage;
+
+	void note_pipeline_use(Fossilize::Hash hash);
+	uint32_t get_pipeline_first_use_frame(Fossilize::Hash hash) const;
+	void load_pipeline_usage();
+	void flush_pipeline_usage();
+	void wait_pipeline_warmup();
 
 	void init_pipeline_state();
 	void flush_pipeline_state();
@@ -22,6 +22,7 @@
 
 #include "device.hpp"
 #include "timer.hpp"
+#include <algorithm>
 
 using namespace std;
 
@@ -73,6 +74,42 @@ bool Device::enqueue_create_shader_module(Fossilize::Hash hash, const VkShaderMo
 void Device::notify_replayed_resources_for_type()
 {
 #ifdef GRANITE_VULKAN_MT
+	auto &deferred = replayer_state.deferred_pipelines;
+	if (!deferred.empty())
+	{
+		stable_sort(begin(deferred), end(deferred), [](const DeferredPipelineCompile &a, const DeferredPipelineCompile &b) {
+			return a.first_use_frame < b.first_use_frame;
+		});
+
+		// Without usage data from a previous run, we cannot tell what the first frames need,
+		// so compile everything up front.
+		bool has_usage = !pipeline_usage.previous_first_use_frame.empty();
+		auto *group = Granite::Global::thread_group();
+
+		for (auto &pipe : deferred)
+		{
+			if (has_usage && pipe.first_use_frame == UINT32_MAX)
+			{
+				if (!replayer_state.background_group)
+					replayer_state.background_group = group->create_task();
+
+				// Teardown does not wait for pipelines nobody has asked for yet.
+				auto func = move(pipe.func);
+				replayer_state.background_group->enqueue_task([this, func]() {
+					if (!pipeline_warmup_cancelled.load(memory_order_relaxed))
+						func();
+				});
+			}
+			else
+			{
+				if (!replayer_state.pipeline_group)
+					replayer_state.pipeline_group = group->create_task();
+				replayer_state.pipeline_group->enqueue_task(move(pipe.func));
+			}
+		}
+		deferred.clear();
+	}
+
 	if (replayer_state.pipeline_group)
 	{
 		replayer_state.pipeline_group->wait();
@@ -81,6 +118,19 @@ void Device::notify_replayed_resources_for_type()
 #endif
 }
 
+// Pipelines are compiled out of order on worker threads, so the base of a derivative pipeline
+// was usually not created yet when the replayer resolved its handle.
+// Derivatives are only a hint to the driver, so compile them standalone rather than against a null base.
+template <typename CreateInfo>
+static void resolve_base_pipeline(CreateInfo &info)
+{
+	if ((info.flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) != 0 && info.basePipelineHandle == VK_NULL_HANDLE)
+	{
+		info.flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+		info.basePipelineIndex = -1;
+	}
+}
+
 VkPipeline Device::fossilize_create_graphics_pipeline(Fossilize::Hash hash, VkGraphicsPipelineCreateInfo &info)
 {
 	if (info.stageCount != 2)
@@ -104,6 +154,7 @@ VkPipeline Device::fossilize_create_graphics_pipeline(Fossilize::Hash hash, VkGr
 
 	// The layout is dummy, resolve it here.
 	info.layout = ret->get_pipeline_layout()->get_layout();
+	resolve_base_pipeline(info);
 
 	register_graphics_pipeline(hash, info);
 
@@ -126,6 +177,7 @@ VkPipeline Device::fossilize_create_compute_pipeline(Fossilize::Hash hash, VkCom
 
 	// The layout is dummy, resolve it here.
 	info.layout = ret->get_pipeline_layout()->get_layout();
+	resolve_base_pipeline(info);
 
 	register_compute_pipeline(hash, info);
 
@@ -142,12 +194,11 @@ bool Device::enqueue_create_graphics_pipeline(Fossilize::Hash hash,
                                               VkPipeline *pipeline)
 {
 #ifdef GRANITE_VULKAN_MT
-	if (!replayer_state.pipeline_group)
-		replayer_state.pipeline_group = Granite::Global::thread_group()->create_task();
-
-	replayer_state.pipeline_group->enqueue_task([this, info = *create_info, hash, pipeline]() mutable {
+	// Compilation is kicked off once all pipelines of this type are known, see notify_replayed_resources_for_type().
+	*pipeline = VK_NULL_HANDLE;
+	replayer_state.deferred_pipelines.push_back({ get_pipeline_first_use_frame(hash), [this, info = *create_info, hash, pipeline]() mutable {
 		*pipeline = fossilize_create_graphics_pipeline(hash, info);
-	});
+	}});
 
 	return true;
 #else
@@ -162,12 +213,11 @@ bool Device::enqueue_create_compute_pipeline(Fossilize::Hash hash,
                                              VkPipeline *pipeline)
 {
 #ifdef GRANITE_VULKAN_MT
-	if (!replayer_state.pipeline_group)
-		replayer_state.pipeline_group = Granite::Global::thread_group()->create_task();
-
-	replayer_state.pipeline_group->enqueue_task([this, info = *create_info, hash, pipeline]() mutable {
+	// Compilation is kicked off once all pipelines of this type are known, see notify_replayed_resources_for_type().
+	*pipeline = VK_NULL_HANDLE;
+	replayer_state.deferred_pipelines.push_back({ get_pipeline_first_use_frame(hash), [this, info = *create_info, hash, pipeline]() mutable {
 		*pipeline = fossilize_create_compute_pipeline(hash, info);
-	});
+	}});
 
 	return true;
 #else
@@ -207,13 +257,116 @@ bool Device::enqueue_create_pipeline_layout(Fossilize::Hash, const VkPipelineLay
 	return true;
 }
 
+void Device::note_pipeline_use(Fossilize::Hash hash)
+{
+	if (pipeline_usage.frame >= PipelineUsageTrackingFrames)
+		return;
+
+#ifdef GRANITE_VULKAN_MT
+	// Nearly every use is of a pipeline which was already recorded, and those never take the lock.
+	// Hashes sharing a slot only cost a trip through the lock.
+	auto &slot = pipeline_usage.recorded[hash & (PipelineUsageRecordedSlots - 1)];
+	if (hash != 0 && slot.load(memory_order_relaxed) == hash)
+		return;
+
+	lock_guard<mutex> holder{pipeline_usage.lock};
+	// Only the first use is interesting.
+	pipeline_usage.first_use_frame.emplace(hash, pipeline_usage.frame);
+	slot.store(hash, memory_order_relaxed);
+#else
+	// Only the first use is interesting.
+	pipeline_usage.first_use_frame.emplace(hash, pipeline_usage.frame);
+#endif
+}
+
+uint32_t Device::get_pipeline_first_use_frame(Fossilize::Hash hash) const
+{
+	auto itr = pipeline_usage.previous_first_use_frame.find(hash);
+	if (itr != end(pipeline_usage.previous_first_use_frame))
+		return itr->second;
+	else
+		return UINT32_MAX;
+}
+
+struct PipelineUsageEntry
+{
+	Fossilize::Hash hash;
+	uint32_t first_use_frame;
+	uint32_t reserved;
+};
+
+void Device::load_pipeline_usage()
+{
+	pipeline_usage.previous_first_use_frame.clear();
+
+	auto file = Granite::Global::filesystem()->open(get_cache_path("pipeline_usage.bin"), Granite::FileMode::ReadOnly);
+	if (!file)
+		return;
+
+	size_t size = file->get_size();
+	auto *entries = static_cast<const PipelineUsageEntry *>(file->map());
+	if (!entries || (size % sizeof(PipelineUsageEntry)) != 0)
+	{
+		LOGE("Failed to load pipeline usage data.\n");
+		return;
+	}
+
+	size_t count = size / sizeof(PipelineUsageEntry);
+	for (size_t i = 0; i < count; i++)
+		pipeline_usage.previous_first_use_frame[entries[i].hash] = entries[i].first_use_frame;
+}
+
+void Device::flush_pipeline_usage()
+{
+	// Pipelines which were not used in this run keep their old ordering.
+	auto merged = pipeline_usage.previous_first_use_frame;
+	for (auto &usage : pipeline_usage.first_use_frame)
+		merged[usage.first] = usage.second;
+
+	if (merged.empty())
+		return;
+
+	auto file = Granite::Global::filesystem()->open(get_cache_path("pipeline_usage.bin"), Granite::FileMode::WriteOnly);
+	if (!file)
+	{
+		LOGE("Failed to open pipeline usage data for writing.\n");
+		return;
+	}
+
+	auto *entries = static_cast<PipelineUsageEntry *>(file->map_write(merged.size() * sizeof(PipelineUsageEntry)));
+	if (!entries)
+	{
+		LOGE("Failed to write pipeline usage data.\n");
+		return;
+	}
+
+	for (auto &usage : merged)
+		*entries++ = { usage.first, usage.second, 0 };
+	file->unmap();
+}
+
+void Device::wait_pipeline_warmup()
+{
+#ifdef GRANITE_VULKAN_MT
+	// Background compiles refer to the replayer and the device, so they must be drained before either goes away.
+	// Compiles which have not started yet are skipped.
+	if (replayer_state.background_group)
+	{
+		pipeline_warmup_cancelled.store(true, memory_order_relaxed);
+		replayer_state.background_group->wait();
+	}
+	replayer_state = {};
+#endif
+}
+
 void Device::init_pipeline_state()
 {
 	state_recorder.init_recording_thread(nullptr);
+	load_pipeline_usage();
 
 	auto file = Granite::Global::filesystem()->open("assets://pipelines.json", Granite::FileMode::ReadOnly);
 	if (!file)
-		file = Granite::Global::filesystem()->open("cache://pipelines.json", Granite::FileMode::ReadOnly);
+		file = Granite::Global::filesystem()->open(get_cache_path("pipelines.json"), Granite::FileMode::ReadOnly);
 
 	if (!file)
 		return;
@@ -226,16 +379,33 @@ void Device::init_pipeline_state()
 	}
 
 	LOGI("Replaying cached state.\n");
+#ifdef GRANITE_VULKAN_MT
+	// Background compilation refers to create infos owned by the replayer.
+	replayer_state.replayer.reset(new Fossilize::StateReplayer);
+	auto &replayer = *replayer_state.replayer;
+#else
 	Fossilize::StateReplayer replayer;
+#endif
 	auto start = Util::get_current_time_nsecs();
 	replayer.parse(*this, nullptr, static_cast<const char *>(mapped), file->get_size());
 	auto end = Util::get_current_time_nsecs();
 	LOGI("Completed replaying cached state in %.3f ms.\n", (end - start) * 1e-6);
+
+#ifdef GRANITE_VULKAN_MT
+	if (replayer_state.background_group)
+	{
+		LOGI("Pipelines not used early in the previous run will complete in the background.\n");
+		replayer_state.background_group->flush();
+		return;
+	}
+#endif
 	replayer_state = {};
 }
 
 void Device::flush_pipeline_state()
 {
+	flush_pipeline_usage();
+
 	uint8_t *serialized = nullptr;
 	size_t serialized_size = 0;
 	if (!state_recorder.serialize(&serialized, &serialized_size))
@@ -244,7 +414,7 @@ void Device::flush_pipeline_state()
 		return;
 	}
 
-	auto file = Granite::Global::filesystem()->open("cache://pipelines.json", Granite::FileMode::WriteOnly);
+	auto file = Granite::Global::filesystem()->open(get_cache_path("pipelines.json"), Granite::FileMode::WriteOnly);
 	if (file)
 	{
 		auto *data = static_cast<uint8_t *>(file->map_write(serialized_size));
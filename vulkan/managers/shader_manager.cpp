@@ -21,11 +21,15 @@
  */
 
 #include <cstring>
+#include <cstdlib>
 #include <algorithm>
 #include "path.hpp"
 #include "shader_manager.hpp"
 #include "device.hpp"
 #include "rapidjson_wrapper.hpp"
+#ifdef GRANITE_VULKAN_MT
+#include "thread_group.hpp"
+#endif
 
 using namespace std;
 using namespace Util;
@@ -38,11 +42,63 @@ using namespace Util;
 
 namespace Vulkan
 {
+SPIRVCache::SPIRVCache(Device *device_)
+	: device(device_)
+{
+}
+
+string SPIRVCache::get_path(Hash key) const
+{
+	char path[64];
+	snprintf(path, sizeof(path), "spirv-cache/%016llx.spv", static_cast<unsigned long long>(key));
+	return device->get_cache_path(path);
+}
+
+bool SPIRVCache::find(Hash key, vector<uint32_t> &spirv)
+{
+	auto file = Granite::Global::filesystem()->open(get_path(key), Granite::FileMode::ReadOnly);
+	if (!file)
+	{
+		misses.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	// Reject partially written files.
+	size_t size = file->get_size();
+	auto *words = static_cast<const uint32_t *>(file->map());
+	if (!words || size < sizeof(uint32_t) || (size % sizeof(uint32_t)) != 0 || words[0] != 0x07230203u)
+	{
+		LOGW("Ignoring corrupt SPIR-V cache entry %016llx.\n", static_cast<unsigned long long>(key));
+		misses.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	spirv.assign(words, words + size / sizeof(uint32_t));
+	hits.fetch_add(1, memory_order_relaxed);
+	return true;
+}
+
+void SPIRVCache::store(Hash key, const vector<uint32_t> &spirv)
+{
+	// Not having a writable cache is not an error, we just compile again next time.
+	Granite::Global::filesystem()->write_buffer_to_file(get_path(key), spirv.data(),
+	                                                    spirv.size() * sizeof(uint32_t));
+}
+
+SPIRVCache::Statistics SPIRVCache::get_statistics() const
+{
+	Statistics stats;
+	stats.hits = hits.load(memory_order_relaxed);
+	stats.misses = misses.load(memory_order_relaxed);
+	return stats;
+}
+
 ShaderTemplate::ShaderTemplate(Device *device_, const std::string &shader_path,
                                PrecomputedShaderCache &cache_,
+                               SPIRVCache &spirv_cache_,
                                Util::Hash path_hash_,
                                const std::vector<std::string> &include_directories_)
-	: device(device_), path(shader_path), cache(cache_), path_hash(path_hash_)
+	: device(device_), path(shader_path), cache(cache_), spirv_cache(spirv_cache_), path_hash(path_hash_)
 #ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
 	, include_directories(include_directories_)
 #endif
@@ -98,10 +154,8 @@ const ShaderTemplate::Variant *ShaderTemplate::register_variant(const std::vecto
 #ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
 			if (compiler)
 			{
-				variant->spirv = compiler->compile(defines);
-				if (variant->spirv.empty())
+				if (!compile_variant(defines, variant->spirv))
 				{
-					LOGE("Shader error:\n%s\n", compiler->get_error_message().c_str());
 					variants.free(variant);
 					return nullptr;
 				}
@@ -125,6 +179,25 @@ const ShaderTemplate::Variant *ShaderTemplate::register_variant(const std::vecto
 }
 
 #ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
+bool ShaderTemplate::compile_variant(const std::vector<std::pair<std::string, int>> *defines, std::vector<uint32_t> &spirv)
+{
+	auto key = compiler->get_compilation_hash(defines);
+	if (spirv_cache.find(key, spirv))
+		return true;
+
+	// Compile with a private copy, so that variants of the same template can be compiled concurrently.
+	auto variant_compiler = *compiler;
+	spirv = variant_compiler.compile(defines);
+	if (spirv.empty())
+	{
+		LOGE("Shader error: %s\n%s\n", path.c_str(), variant_compiler.get_error_message().c_str());
+		return false;
+	}
+
+	spirv_cache.store(key, spirv);
+	return true;
+}
+
 void ShaderTemplate::recompile()
 {
 	// Recompile all variants.
@@ -143,10 +216,9 @@ void ShaderTemplate::recompile()
 
 	for (auto &variant : variants)
 	{
-		auto newspirv = compiler->compile(&variant.defines);
-		if (newspirv.empty())
+		vector<uint32_t> newspirv;
+		if (!compile_variant(&variant.defines, newspirv))
 		{
-			LOGE("Failed to compile shader: %s\n%s\n", path.c_str(), compiler->get_error_message().c_str());
 			for (auto &define : variant.defines)
 				LOGE("  Define: %s = %d\n", define.first.c_str(), define.second);
 			continue;
@@ -173,6 +245,18 @@ void ShaderProgram::set_stage(Vulkan::ShaderStage stage, ShaderTemplate *shader)
 Vulkan::Program *ShaderProgram::get_program(unsigned variant)
 {
 	auto &var = variants[variant];
+#ifdef GRANITE_VULKAN_MT
+	if (!var.ready.load(std::memory_order_acquire))
+	{
+		manager->note_fallback_use();
+		return get_program(var.fallback);
+	}
+#endif
+	return resolve_program(var);
+}
+
+Vulkan::Program *ShaderProgram::resolve_program(Variant &var)
+{
 	auto *vert = var.stages[static_cast<unsigned>(Vulkan::ShaderStage::Vertex)];
 	auto *frag = var.stages[static_cast<unsigned>(Vulkan::ShaderStage::Fragment)];
 	auto *comp = var.stages[static_cast<unsigned>(Vulkan::ShaderStage::Compute)];
@@ -275,6 +359,20 @@ Vulkan::Program *ShaderProgram::get_program(unsigned variant)
 }
 
 unsigned ShaderProgram::register_variant(const std::vector<std::pair<std::string, int>> &defines)
+{
+	return register_variant_internal(defines, nullptr);
+}
+
+unsigned ShaderProgram::register_variant_async(const std::vector<std::pair<std::string, int>> &defines,
+                                               unsigned fallback_variant)
+{
+	if (!manager->get_async_variant_compile())
+		return register_variant_internal(defines, nullptr);
+	return register_variant_internal(defines, &fallback_variant);
+}
+
+unsigned ShaderProgram::register_variant_internal(const std::vector<std::pair<std::string, int>> &defines,
+                                                  const unsigned *fallback_variant)
 {
 	Hasher h;
 	for (auto &define : defines)
@@ -299,6 +397,61 @@ unsigned ShaderProgram::register_variant(const std::vector<std::pair<std::string
 	}
 
 #ifdef GRANITE_VULKAN_MT
+	auto *workers = Granite::Global::thread_group();
+	bool has_workers = workers && workers->get_num_threads() != 0;
+	bool compile_async = fallback_variant && *fallback_variant < variants.size() && has_workers;
+
+#ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
+	unsigned num_stages = 0;
+	for (auto *stage : stages)
+		if (stage)
+			num_stages++;
+
+	// Stages which miss the caches compile concurrently on the thread group.
+	// Worker threads must never wait on the thread group, so they compile serially.
+	if (!compile_async && num_stages > 1 && has_workers && !workers->current_thread_is_worker())
+	{
+		// Tasks on the group may register variants of this program, so never wait with variant_lock held.
+		variant_lock.unlock_read();
+		manager->note_sync_variant_compile();
+
+		const ShaderTemplate::Variant *compiled_stages[static_cast<unsigned>(Vulkan::ShaderStage::Count)] = {};
+		auto group = workers->create_task();
+		for (unsigned i = 0; i < static_cast<unsigned>(Vulkan::ShaderStage::Count); i++)
+		{
+			if (stages[i])
+			{
+				group->enqueue_task([&compiled_stages, &defines, this, i]() {
+					compiled_stages[i] = stages[i]->register_variant(&defines);
+				});
+			}
+		}
+		group->wait();
+
+		variant_lock.lock_write();
+
+		// Someone else might have registered the same variant while we were compiling.
+		itr = find(begin(variant_hashes), end(variant_hashes), hash);
+		if (itr != end(variant_hashes))
+		{
+			auto ret = unsigned(itr - begin(variant_hashes));
+			variant_lock.unlock_write();
+			return ret;
+		}
+
+		auto index = unsigned(variants.size());
+		variants.emplace_back();
+		auto &var = variants.back();
+		variant_hashes.push_back(hash);
+		for (unsigned i = 0; i < static_cast<unsigned>(Vulkan::ShaderStage::Count); i++)
+			var.stages[i] = compiled_stages[i];
+
+		resolve_program(var);
+		variant_lock.unlock_write();
+		return index;
+	}
+#endif
+
 	variant_lock.promote_reader_to_writer();
 #endif
 	auto index = unsigned(variants.size());
@@ -306,12 +459,39 @@ unsigned ShaderProgram::register_variant(const std::vector<std::pair<std::string
 	auto &var = variants.back();
 	variant_hashes.push_back(hash);
 
+#ifdef GRANITE_VULKAN_MT
+	if (compile_async)
+	{
+		// get_program() returns the fallback until the task has baked the real program.
+		var.fallback = *fallback_variant;
+		var.ready.store(false, std::memory_order_relaxed);
+		manager->begin_async_variant();
+
+		auto *async_var = &var;
+		workers->create_task([this, async_var, defines]() {
+			for (unsigned i = 0; i < static_cast<unsigned>(Vulkan::ShaderStage::Count); i++)
+				if (stages[i])
+					async_var->stages[i] = stages[i]->register_variant(&defines);
+			resolve_program(*async_var);
+			async_var->ready.store(true, std::memory_order_release);
+			manager->end_async_variant();
+		});
+
+		variant_lock.unlock_write();
+		return index;
+	}
+#else
+	(void)fallback_variant;
+#endif
+
+	manager->note_sync_variant_compile();
+
 	for (unsigned i = 0; i < static_cast<unsigned>(Vulkan::ShaderStage::Count); i++)
 		if (stages[i])
 			var.stages[i] = stages[i]->register_variant(&defines);
 
 	// Make sure it's compiled correctly.
-	get_program(index);
+	resolve_program(var);
 #ifdef GRANITE_VULKAN_MT
 	variant_lock.unlock_write();
 #endif
@@ -331,7 +511,7 @@ ShaderProgram *ShaderManager::register_compute(const std::string &compute)
 
 	auto *ret = programs.find(hash);
 	if (!ret)
-		ret = programs.emplace_yield(hash, device, shader_cache, tmpl);
+		ret = programs.emplace_yield(hash, device, this, shader_cache, tmpl);
 	return ret;
 }
 
@@ -344,7 +524,7 @@ ShaderTemplate *ShaderManager::get_template(const std::string &path)
 	auto *ret = shaders.find(hash);
 	if (!ret)
 	{
-		auto *shader = shaders.allocate(device, path, shader_cache, hasher.get(), include_directories);
+		auto *shader = shaders.allocate(device, path, shader_cache, spirv_cache, hasher.get(), include_directories);
 		if (!shader->init())
 		{
 			shaders.free(shader);
@@ -377,12 +557,83 @@ ShaderProgram *ShaderManager::register_graphics(const std::string &vertex, const
 
 	auto *ret = programs.find(hash);
 	if (!ret)
-		ret = programs.emplace_yield(hash, device, shader_cache, vert_tmpl, frag_tmpl);
+		ret = programs.emplace_yield(hash, device, this, shader_cache, vert_tmpl, frag_tmpl);
 	return ret;
 }
 
+ShaderManager::ShaderManager(Device *device_)
+	: device(device_), spirv_cache(device_)
+{
+	const char *async_variants = getenv("GRANITE_ASYNC_SHADER_VARIANTS");
+	if (async_variants)
+		async_variant_compile = strtol(async_variants, nullptr, 0) != 0;
+}
+
+void ShaderManager::set_async_variant_compile(bool enable)
+{
+	async_variant_compile = enable;
+}
+
+bool ShaderManager::get_async_variant_compile() const
+{
+#ifdef GRANITE_VULKAN_MT
+	return async_variant_compile;
+#else
+	return false;
+#endif
+}
+
+void ShaderManager::begin_async_variant()
+{
+#ifdef GRANITE_VULKAN_MT
+	lock_guard<mutex> holder{async_variant_lock};
+	pending_async_variants++;
+#endif
+}
+
+void ShaderManager::end_async_variant()
+{
+	async_compiles.fetch_add(1, memory_order_relaxed);
+#ifdef GRANITE_VULKAN_MT
+	lock_guard<mutex> holder{async_variant_lock};
+	if (--pending_async_variants == 0)
+		async_variant_cond.notify_all();
+#endif
+}
+
+void ShaderManager::wait_async_variants()
+{
+#ifdef GRANITE_VULKAN_MT
+	unique_lock<mutex> holder{async_variant_lock};
+	async_variant_cond.wait(holder, [this]() { return pending_async_variants == 0; });
+#endif
+}
+
+void ShaderManager::note_sync_variant_compile()
+{
+	sync_compiles.fetch_add(1, memory_order_relaxed);
+}
+
+void ShaderManager::note_fallback_use()
+{
+	fallback_uses.fetch_add(1, memory_order_relaxed);
+}
+
+void ShaderManager::next_frame()
+{
+	last_frame_statistics.sync_compiles = sync_compiles.exchange(0, memory_order_relaxed);
+	last_frame_statistics.async_compiles = async_compiles.exchange(0, memory_order_relaxed);
+	last_frame_statistics.fallback_uses = fallback_uses.exchange(0, memory_order_relaxed);
+}
+
+ShaderManager::VariantStatistics ShaderManager::get_variant_statistics() const
+{
+	return last_frame_statistics;
+}
+
 ShaderManager::~ShaderManager()
 {
+	wait_async_variants();
 #ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
 	for (auto &dir : directory_watches)
 		if (dir.second.backend)
@@ -29,6 +29,8 @@
 #include <unordered_set>
 #include <string>
 #include <vector>
+#include <deque>
+#include <atomic>
 #ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
 #include "compiler.hpp"
 #endif
@@ -36,19 +38,47 @@
 #include "hash.hpp"
 #ifdef GRANITE_VULKAN_MT
 #include "read_write_lock.hpp"
+#include <mutex>
+#include <condition_variable>
 #endif
 
 namespace Vulkan
 {
 using PrecomputedShaderCache = VulkanCache<Util::IntrusivePODWrapper<Util::Hash>>;
 
-class ShaderManager;
 class Device;
+
+// Persistent cache of SPIR-V produced by the runtime compiler, stored as one file per entry under the device's cache protocol.
+// Entries are addressed by GLSLCompiler::get_compilation_hash(), so edited sources never hit stale SPIR-V.
+class SPIRVCache
+{
+public:
+	explicit SPIRVCache(Device *device);
+
+	bool find(Util::Hash key, std::vector<uint32_t> &spirv);
+	void store(Util::Hash key, const std::vector<uint32_t> &spirv);
+
+	struct Statistics
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+	};
+	Statistics get_statistics() const;
+
+private:
+	Device *device;
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> misses{0};
+
+	std::string get_path(Util::Hash key) const;
+};
+
+class ShaderManager;
 class ShaderTemplate : public Util::IntrusiveHashMapEnabled<ShaderTemplate>
 {
 public:
-	ShaderTemplate(Device *device, const std::string &shader_path, PrecomputedShaderCache &cache, Util::Hash path_hash,
-	               const std::vector<std::string> &include_directories);
+	ShaderTemplate(Device *device, const std::string &shader_path, PrecomputedShaderCache &cache, SPIRVCache &spirv_cache,
+	               Util::Hash path_hash, const std::vector<std::string> &include_directories);
 
 	bool init();
 
@@ -74,10 +104,12 @@ private:
 	Device *device;
 	std::string path;
 	PrecomputedShaderCache &cache;
+	SPIRVCache &spirv_cache;
 	Util::Hash path_hash = 0;
 #ifdef GRANITE_VULKAN_SHADER_MANAGER_RUNTIME_COMPILER
 	std::unique_ptr<Granite::GLSLCompiler> compiler;
 	const std::vector<std::string> &include_directories;
+	bool compile_variant(const std::vector<std::pair<std::string, int>> *defines, std::vector<uint32_t> &spirv);
 #endif
 	VulkanCache<Variant> variants;
 };
@@ -85,14 +117,15 @@ private:
 class ShaderProgram : public Util::IntrusiveHashMapEnabled<ShaderProgram>
 {
 public:
-	ShaderProgram(Device *device_, PrecomputedShaderCache &cache_, ShaderTemplate *compute)
-		: device(device_), cache(cache_)
+	ShaderProgram(Device *device_, ShaderManager *manager_, PrecomputedShaderCache &cache_, ShaderTemplate *compute)
+		: device(device_), manager(manager_), cache(cache_)
 	{
 		set_stage(Vulkan::ShaderStage::Compute, compute);
 	}
 
-	ShaderProgram(Device *device_, PrecomputedShaderCache &cache_, ShaderTemplate *vert, ShaderTemplate *frag)
-		: device(device_), cache(cache_)
+	ShaderProgram(Device *device_, ShaderManager *manager_, PrecomputedShaderCache &cache_,
+	              ShaderTemplate *vert, ShaderTemplate *frag)
+		: device(device_), manager(manager_), cache(cache_)
 	{
 		set_stage(Vulkan::ShaderStage::Vertex, vert);
 		set_stage(Vulkan::ShaderStage::Fragment, frag);
@@ -102,35 +135,44 @@ public:
 	void set_stage(Vulkan::ShaderStage stage, ShaderTemplate *shader);
 	unsigned register_variant(const std::vector<std::pair<std::string, int>> &defines);
 
+	// Compiles and bakes the variant on the thread group instead of the calling thread.
+	// Until it is ready, get_program() returns the program of fallback_variant, which must already be registered.
+	// Falls back to register_variant() if async compilation is disabled in the ShaderManager.
+	unsigned register_variant_async(const std::vector<std::pair<std::string, int>> &defines, unsigned fallback_variant);
+
 private:
 	Device *device;
+	ShaderManager *manager;
 	PrecomputedShaderCache &cache;
 
 	struct Variant
 	{
 		const ShaderTemplate::Variant *stages[static_cast<unsigned>(Vulkan::ShaderStage::Count)] = {};
 		unsigned shader_instance[static_cast<unsigned>(Vulkan::ShaderStage::Count)] = {};
-		Vulkan::Program *program;
+		Vulkan::Program *program = nullptr;
 #ifdef GRANITE_VULKAN_MT
 		std::unique_ptr<Util::RWSpinLock> instance_lock = std::make_unique<Util::RWSpinLock>();
+		std::atomic_bool ready{true};
+		unsigned fallback = 0;
 #endif
 	};
 
 	ShaderTemplate *stages[static_cast<unsigned>(Vulkan::ShaderStage::Count)] = {};
-	std::vector<Variant> variants;
+	// Deque so that background compiles can hold on to a Variant while new variants are registered.
+	std::deque<Variant> variants;
 	std::vector<Util::Hash> variant_hashes;
 #ifdef GRANITE_VULKAN_MT
 	Util::RWSpinLock variant_lock;
 #endif
+
+	Vulkan::Program *resolve_program(Variant &var);
+	unsigned register_variant_internal(const std::vector<std::pair<std::string, int>> &defines, const unsigned *fallback_variant);
 };
 
 class ShaderManager
 {
 public:
-	explicit ShaderManager(Device *device_)
-		: device(device_)
-	{
-	}
+	explicit ShaderManager(Device *device_);
 
 	bool load_shader_cache(const std::string &path);
 	bool save_shader_cache(const std::string &path);
@@ -149,6 +191,36 @@ public:
 	bool get_shader_hash_by_variant_hash(Util::Hash variant_hash, Util::Hash &shader_hash);
 	void register_shader_hash_from_variant_hash(Util::Hash variant_hash, Util::Hash shader_hash);
 
+	SPIRVCache::Statistics get_spirv_cache_statistics() const
+	{
+		return spirv_cache.get_statistics();
+	}
+
+	// Enables ShaderProgram::register_variant_async(). Requires GRANITE_VULKAN_MT and a running thread group.
+	// Can be enabled by default with GRANITE_ASYNC_SHADER_VARIANTS=1.
+	void set_async_variant_compile(bool enable);
+	bool get_async_variant_compile() const;
+	void wait_async_variants();
+
+	struct VariantStatistics
+	{
+		// Variants compiled and baked on the thread which requested them, i.e. potential hitches.
+		uint32_t sync_compiles = 0;
+		// Variants which completed on the thread group.
+		uint32_t async_compiles = 0;
+		// get_program() calls which had to return a fallback program.
+		uint32_t fallback_uses = 0;
+	};
+
+	// Counts for the last completed frame.
+	VariantStatistics get_variant_statistics() const;
+	void next_frame();
+
+	void note_sync_variant_compile();
+	void note_fallback_use();
+	void begin_async_variant();
+	void end_async_variant();
+
 	Device *get_device()
 	{
 		return device;
@@ -158,6 +230,19 @@ private:
 	Device *device;
 
 	PrecomputedShaderCache shader_cache;
+	SPIRVCache spirv_cache;
+
+	bool async_variant_compile = false;
+	std::atomic_uint sync_compiles{0};
+	std::atomic_uint async_compiles{0};
+	std::atomic_uint fallback_uses{0};
+	VariantStatistics last_frame_statistics;
+#ifdef GRANITE_VULKAN_MT
+	std::mutex async_variant_lock;
+	std::condition_variable async_variant_cond;
+	unsigned pending_async_variants = 0;
+#endif
+
 	VulkanCache<ShaderTemplate> shaders;
 	VulkanCache<ShaderProgram> programs;
 	std::vector<std::string> include_directories;
@@ -25,6 +25,9 @@
 #include "stb_image.h"
 #include "memory_mapped_texture.hpp"
 #include "texture_files.hpp"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
 
 #ifdef GRANITE_VULKAN_MT
 #include "thread_group.hpp"
@@ -53,6 +56,13 @@ Texture::Texture(Device *device_)
 {
 }
 
+Texture::~Texture()
+{
+	auto &manager = device->get_texture_manager();
+	lock_guard<mutex> holder{manager.streaming_lock};
+	manager.unregister_streaming_texture_nolock(*this);
+}
+
 void Texture::set_path(const std::string &path_)
 {
 	path = path_;
@@ -66,6 +76,15 @@ void Texture::update(std::unique_ptr<Granite::File> file)
 		LOGI("Loading texture in thread index: %u\n", get_current_thread_index());
 #endif
 		unique_ptr<Granite::File> updated_file{f};
+
+		// Streamed textures never map the whole file, only the levels they upload.
+		auto &manager = device->get_texture_manager();
+		if (manager.get_streaming_budget() != 0 && manager.register_streaming_texture(*this, *updated_file))
+		{
+			manager.notify_updated_texture(path, *this);
+			return;
+		}
+
 		auto size = updated_file->get_size();
 		void *mapped = updated_file->map();
 		if (size && mapped)
@@ -117,14 +136,24 @@ void Texture::update_checkerboard()
 	replace_image(image);
 }
 
-void Texture::update_gtx(const Granite::SceneFormats::MemoryMappedTexture &mapped_file)
+bool Texture::update_gtx(const Granite::SceneFormats::MemoryMappedTexture &mapped_file)
 {
 	if (mapped_file.empty())
 	{
 		update_checkerboard();
-		return;
+		return false;
 	}
 
+	auto image = create_gtx_image(mapped_file);
+	if (!image)
+		return false;
+
+	replace_image(image);
+	return true;
+}
+
+ImageHandle Texture::create_gtx_image(const Granite::SceneFormats::MemoryMappedTexture &mapped_file)
+{
 	auto &layout = mapped_file.get_layout();
 
 	ImageCreateInfo info = {};
@@ -159,14 +188,14 @@ void Texture::update_gtx(const Granite::SceneFormats::MemoryMappedTexture &mappe
 	if (!device->image_format_is_supported(info.format, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT))
 	{
 		LOGE("Format (%u) is not supported!\n", unsigned(info.format));
-		return;
+		return {};
 	}
 
 	auto staging = device->create_image_staging_buffer(layout);
 	auto image = device->create_image_from_staging_buffer(info, &staging);
 	if (image)
 		device->set_name(*image, path.c_str());
-	replace_image(image);
+	return image;
 }
 
 void Texture::update_gtx(unique_ptr<Granite::File> file, void *mapped)
@@ -203,6 +232,10 @@ void Texture::unload()
 {
 	deinit();
 	handle.reset();
+
+	auto &manager = device->get_texture_manager();
+	lock_guard<mutex> holder{manager.streaming_lock};
+	manager.unregister_streaming_texture_nolock(*this);
 }
 
 void Texture::replace_image(ImageHandle handle_)
@@ -227,11 +260,30 @@ void Texture::set_enable_notification(bool enable)
 	enable_notification = enable;
 }
 
+void Texture::request_screen_coverage(float coverage)
+{
+	if (!(coverage > 0.0f))
+		return;
+
+	uint32_t bits;
+	memcpy(&bits, &coverage, sizeof(bits));
+	auto current = streaming_coverage.load(memory_order_relaxed);
+	while (current < bits && !streaming_coverage.compare_exchange_weak(current, bits, memory_order_relaxed))
+		;
+}
+
 TextureManager::TextureManager(Device *device_)
 	: device(device_)
 {
 }
 
+TextureManager::~TextureManager()
+{
+	// Textures unregister themselves from streaming, which needs the streaming state to still be alive.
+	textures.clear();
+	deferred_textures.clear();
+}
+
 Texture *TextureManager::request_texture(const std::string &path, VkFormat format, const VkComponentMapping &mapping)
 {
 	Util::Hasher hasher;
@@ -279,6 +331,266 @@ void TextureManager::notify_updated_texture(const std::string &path, Vulkan::Tex
 				f(texture);
 }
 
+void TextureManager::set_streaming_budget(VkDeviceSize bytes)
+{
+	streaming_budget.store(bytes);
+}
+
+VkDeviceSize TextureManager::get_streaming_budget() const
+{
+	return streaming_budget.load();
+}
+
+void TextureManager::set_streaming_upload_limit(VkDeviceSize bytes)
+{
+	lock_guard<mutex> holder{streaming_lock};
+	streaming_upload_limit = bytes;
+}
+
+void TextureManager::set_streaming_target_height(unsigned height)
+{
+	lock_guard<mutex> holder{streaming_lock};
+	streaming_target_height = height;
+}
+
+TextureManager::StreamingStatistics TextureManager::get_streaming_statistics()
+{
+	lock_guard<mutex> holder{streaming_lock};
+	return streaming_stats;
+}
+
+VkDeviceSize TextureManager::get_streaming_size(const Texture &texture, unsigned level)
+{
+	auto &layout = texture.streaming_layout;
+	return layout.get_required_size() - layout.get_mip_info(level).offset;
+}
+
+bool TextureManager::register_streaming_texture(Texture &texture, Granite::File &file)
+{
+	Granite::SceneFormats::MemoryMappedTexture header;
+	bool streamable = header.read_header(file) && !header.empty() &&
+	                  header.get_layout().get_image_type() == VK_IMAGE_TYPE_2D;
+
+	// Mips up to this size are always resident.
+	auto &layout = header.get_layout();
+	const unsigned tail_size = 64;
+	unsigned tail_level = 0;
+	while (streamable && tail_level + 1 < layout.get_levels() &&
+	       std::max(layout.get_width(tail_level), layout.get_height(tail_level)) > tail_size)
+	{
+		tail_level++;
+	}
+
+	uint64_t generation;
+	{
+		lock_guard<mutex> holder{streaming_lock};
+
+		// The file may have changed into something which cannot be streamed.
+		if (tail_level == 0)
+		{
+			unregister_streaming_texture_nolock(texture);
+			return false;
+		}
+
+		texture.streaming_layout = layout;
+		texture.streaming_tail_level = tail_level;
+		texture.streaming_resident_level = tail_level;
+		texture.streaming_last_used = streaming_frame;
+		texture.streaming_pending = true;
+		generation = ++texture.streaming_generation;
+		if (!texture.streaming_registered)
+		{
+			streaming_textures.push_back(&texture);
+			texture.streaming_registered = true;
+		}
+	}
+
+	if (stream_texture_level(texture, tail_level, generation))
+		return true;
+
+	// Unless the texture was registered again in the meantime, fall back to a regular upload.
+	lock_guard<mutex> holder{streaming_lock};
+	if (texture.streaming_generation != generation)
+		return true;
+	unregister_streaming_texture_nolock(texture);
+	return false;
+}
+
+void TextureManager::unregister_streaming_texture_nolock(Texture &texture)
+{
+	if (!texture.streaming_registered)
+		return;
+
+	auto itr = find(begin(streaming_textures), end(streaming_textures), &texture);
+	if (itr != end(streaming_textures))
+	{
+		*itr = streaming_textures.back();
+		streaming_textures.pop_back();
+	}
+
+	texture.streaming_registered = false;
+	texture.streaming_pending = false;
+	texture.streaming_generation++;
+}
+
+void TextureManager::queue_streaming_job_nolock(Texture &texture, unsigned level, vector<StreamingJob> &jobs)
+{
+	texture.streaming_pending = true;
+	jobs.push_back({ &texture, level, texture.streaming_generation });
+}
+
+bool TextureManager::stream_texture_level(Texture &texture, unsigned level, uint64_t generation)
+{
+	// Resizing the mip chain recreates the image, which only needs the levels which end up resident.
+	// They are mapped for as long as the upload takes, the previous image is kept alive until the GPU is done with it.
+	ImageHandle image;
+	{
+		Granite::SceneFormats::MemoryMappedTexture levels;
+		if (levels.map_read_levels(texture.path, level))
+			image = texture.create_gtx_image(levels);
+		else
+			LOGE("Failed to read mip levels of %s.\n", texture.path.c_str());
+	}
+
+	lock_guard<mutex> holder{streaming_lock};
+
+	// The texture was registered again or unregistered while we were uploading, this image is stale.
+	if (texture.streaming_generation != generation)
+		return false;
+
+	texture.streaming_pending = false;
+	if (!image)
+		return false;
+
+	texture.replace_image(move(image));
+	texture.streaming_resident_level = level;
+	streaming_stats.uploaded_bytes_total += get_streaming_size(texture, level);
+	return true;
+}
+
+VkDeviceSize TextureManager::evict_streaming_levels_nolock(VkDeviceSize bytes, const Texture *keep,
+                                                           vector<StreamingJob> &jobs)
+{
+	vector<Texture *> candidates;
+	for (auto *texture : streaming_textures)
+	{
+		if (texture != keep && !texture->streaming_pending &&
+		    texture->streaming_resident_level < texture->streaming_tail_level &&
+		    texture->streaming_last_used != streaming_frame)
+		{
+			candidates.push_back(texture);
+		}
+	}
+
+	sort(begin(candidates), end(candidates), [](const Texture *a, const Texture *b) {
+		return a->streaming_last_used < b->streaming_last_used;
+	});
+
+	VkDeviceSize freed = 0;
+	for (auto *texture : candidates)
+	{
+		if (freed >= bytes)
+			break;
+
+		// Drop the largest mips until we have freed enough memory.
+		unsigned old_level = texture->streaming_resident_level;
+		VkDeviceSize old_size = get_streaming_size(*texture, old_level);
+		unsigned level = old_level;
+		while (level < texture->streaming_tail_level && freed + old_size - get_streaming_size(*texture, level) < bytes)
+			level++;
+
+		queue_streaming_job_nolock(*texture, level, jobs);
+		freed += old_size - get_streaming_size(*texture, level);
+		streaming_stats.evicted_levels_total += level - old_level;
+	}
+
+	return freed;
+}
+
+void TextureManager::update_streaming()
+{
+	// Residency changes are decided under the lock, but images are created and uploaded after releasing it,
+	// so texture loads on other threads do not wait for this frame's uploads.
+	vector<StreamingJob> jobs;
+
+	{
+		lock_guard<mutex> holder{streaming_lock};
+		streaming_frame++;
+
+		struct Request
+		{
+			Texture *texture;
+			unsigned level;
+		};
+		vector<Request> requests;
+
+		VkDeviceSize budget = streaming_budget.load();
+		VkDeviceSize resident = 0;
+
+		for (auto *texture : streaming_textures)
+		{
+			uint32_t bits = texture->streaming_coverage.exchange(0, memory_order_relaxed);
+			resident += get_streaming_size(*texture, texture->streaming_resident_level);
+			if (!bits)
+				continue;
+
+			float coverage;
+			memcpy(&coverage, &bits, sizeof(coverage));
+			texture->streaming_last_used = streaming_frame;
+			if (texture->streaming_pending)
+				continue;
+
+			// Pick the mip level where one texel roughly maps to one pixel.
+			auto &layout = texture->streaming_layout;
+			float texels = float(std::max(layout.get_width(), layout.get_height()));
+			float pixels = std::max(coverage * float(streaming_target_height), 1.0f);
+			unsigned level = 0;
+			if (pixels < texels)
+				level = unsigned(std::log2(texels / pixels));
+			level = std::min(level, texture->streaming_tail_level);
+
+			if (level < texture->streaming_resident_level)
+				requests.push_back({ texture, level });
+		}
+
+		// Textures which are the furthest away from their desired resolution go first.
+		sort(begin(requests), end(requests), [](const Request &a, const Request &b) {
+			return a.texture->streaming_resident_level - a.level > b.texture->streaming_resident_level - b.level;
+		});
+
+		VkDeviceSize uploaded = 0;
+		for (auto &req : requests)
+		{
+			auto &texture = *req.texture;
+			VkDeviceSize new_size = get_streaming_size(texture, req.level);
+			VkDeviceSize old_size = get_streaming_size(texture, texture.streaming_resident_level);
+
+			if (texture.streaming_pending || (uploaded && uploaded + new_size > streaming_upload_limit))
+				continue;
+
+			VkDeviceSize needed = new_size - old_size;
+			if (budget && resident + needed > budget)
+				resident -= evict_streaming_levels_nolock(resident + needed - budget, &texture, jobs);
+			if (budget && resident + needed > budget)
+				continue;
+
+			queue_streaming_job_nolock(texture, req.level, jobs);
+			resident += needed;
+			uploaded += new_size;
+		}
+
+		streaming_stats.resident_bytes = resident;
+		streaming_stats.streamed_textures = unsigned(streaming_textures.size());
+	}
+
+	for (auto &job : jobs)
+		stream_texture_level(*job.texture, job.level, job.generation);
+
+	lock_guard<mutex> holder{streaming_lock};
+	streaming_stats.uploaded_bytes_last_update = streaming_stats.uploaded_bytes_total - streaming_uploaded_bytes_at_update;
+	streaming_uploaded_bytes_at_update = streaming_stats.uploaded_bytes_total;
+}
+
 Texture *TextureManager::register_deferred_texture(const std::string &path)
 {
 	Util::Hasher hasher;
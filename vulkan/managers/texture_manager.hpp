@@ -24,7 +24,11 @@
 
 #include "volatile_source.hpp"
 #include "image.hpp"
+#include "texture_format.hpp"
 #include "async_object_sink.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 namespace Granite
 {
@@ -44,12 +48,18 @@ public:
 	friend class TextureManager;
 	friend class Util::ObjectPool<Texture>;
 
+	~Texture();
+
 	bool init_texture();
 	void set_path(const std::string &path);
 	Image *get_image();
 	void replace_image(ImageHandle handle);
 	void set_enable_notification(bool enable);
 
+	// Feedback for texture streaming. Coverage is the fraction of the screen height
+	// the texture is expected to span this frame. Thread-safe.
+	void request_screen_coverage(float coverage);
+
 private:
 	Texture(Device *device, const std::string &path, VkFormat format = VK_FORMAT_UNDEFINED,
 	        const VkComponentMapping &swizzle = {
@@ -66,19 +76,36 @@ private:
 	VkComponentMapping swizzle;
 	void update_other(const void *data, size_t size);
 	void update_gtx(std::unique_ptr<Granite::File> file, void *mapped);
-	void update_gtx(const Granite::SceneFormats::MemoryMappedTexture &texture);
+	bool update_gtx(const Granite::SceneFormats::MemoryMappedTexture &texture);
+	ImageHandle create_gtx_image(const Granite::SceneFormats::MemoryMappedTexture &texture);
 	void update_checkerboard();
 
 	void load();
 	void unload();
 	void update(std::unique_ptr<Granite::File> file);
 	bool enable_notification = true;
+
+	// Streaming state, owned by TextureManager and protected by its streaming lock.
+	// Only the layout of the full mip chain is kept, levels are mapped from the file while they are uploaded.
+	TextureFormatLayout streaming_layout;
+	unsigned streaming_resident_level = 0;
+	unsigned streaming_tail_level = 0;
+	uint64_t streaming_last_used = 0;
+	// Bumped whenever the texture is registered or unregistered, so uploads finishing after that are dropped.
+	uint64_t streaming_generation = 0;
+	bool streaming_registered = false;
+	// An upload for this texture is running outside the streaming lock.
+	bool streaming_pending = false;
+	// Bit pattern of a non-negative float, which orders the same way as the float itself.
+	std::atomic<uint32_t> streaming_coverage{0};
 };
 
 class TextureManager
 {
 public:
 	TextureManager(Device *device);
+	~TextureManager();
+
 	Texture *request_texture(const std::string &path, VkFormat format = VK_FORMAT_UNDEFINED,
 	                         const VkComponentMapping &swizzle = {
 			                         VK_COMPONENT_SWIZZLE_R,
@@ -93,6 +120,27 @@ public:
 
 	void notify_updated_texture(const std::string &path, Vulkan::Texture &texture);
 
+	// With a non-zero budget, .gtx textures with a full mip chain only load their smallest mips up front.
+	// Larger mips are streamed in by update_streaming() based on Texture::request_screen_coverage(),
+	// and mips of the least recently used textures are evicted to stay within the budget.
+	void set_streaming_budget(VkDeviceSize bytes);
+	VkDeviceSize get_streaming_budget() const;
+	// Upper bound on bytes uploaded per call to update_streaming().
+	void set_streaming_upload_limit(VkDeviceSize bytes);
+	// Screen height in pixels which coverage feedback is relative to.
+	void set_streaming_target_height(unsigned height);
+	void update_streaming();
+
+	struct StreamingStatistics
+	{
+		VkDeviceSize resident_bytes = 0;
+		VkDeviceSize uploaded_bytes_last_update = 0;
+		VkDeviceSize uploaded_bytes_total = 0;
+		unsigned streamed_textures = 0;
+		unsigned evicted_levels_total = 0;
+	};
+	StreamingStatistics get_streaming_statistics();
+
 private:
 	Device *device;
 
@@ -100,5 +148,29 @@ private:
 	VulkanCache<Texture> deferred_textures;
 
 	std::unordered_map<std::string, std::vector<std::function<void (Texture &)>>> notifications;
+
+	friend class Texture;
+	std::mutex streaming_lock;
+	std::vector<Texture *> streaming_textures;
+	std::atomic<VkDeviceSize> streaming_budget{0};
+	VkDeviceSize streaming_upload_limit = 32 * 1024 * 1024;
+	unsigned streaming_target_height = 1080;
+	uint64_t streaming_frame = 0;
+	StreamingStatistics streaming_stats;
+	VkDeviceSize streaming_uploaded_bytes_at_update = 0;
+
+	struct StreamingJob
+	{
+		Texture *texture;
+		unsigned level;
+		uint64_t generation;
+	};
+
+	bool register_streaming_texture(Texture &texture, Granite::File &file);
+	void unregister_streaming_texture_nolock(Texture &texture);
+	void queue_streaming_job_nolock(Texture &texture, unsigned level, std::vector<StreamingJob> &jobs);
+	bool stream_texture_level(Texture &texture, unsigned level, uint64_t generation);
+	VkDeviceSize evict_streaming_levels_nolock(VkDeviceSize bytes, const Texture *keep, std::vector<StreamingJob> &jobs);
+	static VkDeviceSize get_streaming_size(const Texture &texture, unsigned level);
 };
 }
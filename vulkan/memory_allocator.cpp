@@ -24,6 +24,10 @@
 #include "device.hpp"
 #include <algorithm>
 
+#ifdef GRANITE_VULKAN_MT
+#include "thread_id.hpp"
+#endif
+
 using namespace std;
 
 #ifdef GRANITE_VULKAN_MT
@@ -119,8 +123,21 @@ void ClassAllocator::suballocate(uint32_t num_blocks, uint32_t tiling, uint32_t
 
 bool ClassAllocator::allocate(uint32_t size, AllocationTiling tiling, DeviceAllocation *alloc, bool hierarchical)
 {
-	ALLOCATOR_LOCK();
 	unsigned num_blocks = (size + sub_block_size - 1) >> sub_block_size_log2;
+
+#ifdef GRANITE_VULKAN_MT
+	// Mini-heaps carved for child classes are rare and large, they always go through the lock.
+	if (!hierarchical && !thread_caches.empty() && allocate_cached(num_blocks, tiling_mask & tiling, alloc))
+		return true;
+#endif
+
+	ALLOCATOR_LOCK();
+	return allocate_nolock(num_blocks, tiling, alloc, hierarchical);
+}
+
+bool ClassAllocator::allocate_nolock(uint32_t num_blocks, AllocationTiling tiling, DeviceAllocation *alloc,
+                                     bool hierarchical)
+{
 	uint32_t size_mask = (1u << (num_blocks - 1)) - 1;
 	uint32_t masked_tiling_mode = tiling_mask & tiling;
 	auto &m = tiling_modes[masked_tiling_mode];
@@ -225,7 +242,17 @@ ClassAllocator::~ClassAllocator()
 
 void ClassAllocator::free(DeviceAllocation *alloc)
 {
+#ifdef GRANITE_VULKAN_MT
+	if (!alloc->hierarchical && !thread_caches.empty() && free_cached(alloc))
+		return;
+#endif
+
 	ALLOCATOR_LOCK();
+	free_nolock(alloc);
+}
+
+void ClassAllocator::free_nolock(DeviceAllocation *alloc)
+{
 	auto *heap = &*alloc->heap;
 	auto &block = heap->heap;
 	bool was_full = block.full();
@@ -268,6 +295,162 @@ void ClassAllocator::free(DeviceAllocation *alloc)
 	}
 }
 
+#ifdef GRANITE_VULKAN_MT
+// Carve at most half a mini-heap per refill, and keep at most two mini-heaps worth around per thread.
+static inline size_t thread_cache_refill_count(uint32_t num_blocks)
+{
+	return Block::NumSubBlocks / (2 * num_blocks);
+}
+
+static inline size_t thread_cache_high_watermark(uint32_t num_blocks)
+{
+	return 4 * thread_cache_refill_count(num_blocks);
+}
+
+bool ClassAllocator::allocate_cached(uint32_t num_blocks, uint32_t tiling, DeviceAllocation *alloc)
+{
+	uint32_t cached_blocks = Util::next_pow2(num_blocks);
+	uint32_t size_index = trailing_zeroes(cached_blocks);
+	if (size_index >= ThreadCacheSizes)
+		return false;
+
+	unsigned thread_index = get_current_thread_index();
+	if (thread_index >= thread_caches.size())
+		return false;
+
+	auto &cache = thread_caches[thread_index]->allocations[tiling][size_index];
+	if (cache.empty())
+	{
+		// Pay for the lock once per batch.
+		ALLOCATOR_LOCK();
+		size_t count = thread_cache_refill_count(cached_blocks);
+		for (size_t i = 0; i < count; i++)
+		{
+			DeviceAllocation carved;
+			if (!allocate_nolock(cached_blocks, AllocationTiling(tiling), &carved, false))
+				break;
+			cache.push_back(carved);
+		}
+
+		if (cache.empty())
+			return false;
+	}
+
+	*alloc = cache.back();
+	cache.pop_back();
+	return true;
+}
+
+bool ClassAllocator::free_cached(DeviceAllocation *alloc)
+{
+	uint32_t num_blocks = popcount32(alloc->mask);
+	if (num_blocks & (num_blocks - 1))
+		return false;
+
+	uint32_t size_index = trailing_zeroes(num_blocks);
+	if (size_index >= ThreadCacheSizes)
+		return false;
+
+	unsigned thread_index = get_current_thread_index();
+	if (thread_index >= thread_caches.size())
+		return false;
+
+	// Undo any alignment adjustment made by Allocator::allocate(),
+	// the mini-heap cannot go away while we hold a sub-block of it.
+	auto &heap = alloc->heap->allocation;
+	uint32_t local_offset = trailing_zeroes(alloc->mask) << sub_block_size_log2;
+	alloc->offset = heap.offset + local_offset;
+	alloc->host_base = heap.host_base ? heap.host_base + local_offset : nullptr;
+
+	auto &cache = thread_caches[thread_index]->allocations[alloc->tiling][size_index];
+	cache.push_back(*alloc);
+
+	// Threads which mostly free, e.g. the one running deferred deletion, hand memory back in batches.
+	if (cache.size() > thread_cache_high_watermark(num_blocks))
+	{
+		ALLOCATOR_LOCK();
+		release_cached_nolock(cache, thread_cache_refill_count(num_blocks));
+	}
+
+	return true;
+}
+
+void ClassAllocator::release_cached_nolock(std::vector<DeviceAllocation> &allocations, size_t count)
+{
+	while (allocations.size() > count)
+	{
+		free_nolock(&allocations.back());
+		allocations.pop_back();
+	}
+}
+#endif
+
+void ClassAllocator::init_thread_caches(unsigned num_thread_indices)
+{
+#ifdef GRANITE_VULKAN_MT
+	drain_thread_caches();
+	thread_caches.clear();
+	for (unsigned i = 0; i < num_thread_indices; i++)
+		thread_caches.emplace_back(new ThreadCache);
+#else
+	(void)num_thread_indices;
+#endif
+}
+
+void ClassAllocator::drain_thread_caches()
+{
+#ifdef GRANITE_VULKAN_MT
+	ALLOCATOR_LOCK();
+	for (auto &cache : thread_caches)
+		for (auto &tiling : cache->allocations)
+			for (auto &allocations : tiling)
+				release_cached_nolock(allocations, 0);
+#endif
+}
+
+void ClassAllocator::trim_thread_cache()
+{
+#ifdef GRANITE_VULKAN_MT
+	unsigned thread_index = get_current_thread_index();
+	if (thread_index >= thread_caches.size())
+		return;
+
+	ALLOCATOR_LOCK();
+	for (auto &tiling : thread_caches[thread_index]->allocations)
+		for (uint32_t size_index = 0; size_index < ThreadCacheSizes; size_index++)
+			release_cached_nolock(tiling[size_index], thread_cache_refill_count(1u << size_index));
+#endif
+}
+
+void ClassAllocator::collect_statistics(MemoryClassStatistics &stats)
+{
+	ALLOCATOR_LOCK();
+	uint64_t heap_size = uint64_t(sub_block_size) * Block::NumSubBlocks;
+
+	const auto accumulate = [&](const MiniHeap &heap) {
+		uint32_t used_blocks = Block::NumSubBlocks - popcount32(heap.heap.get_free_mask());
+		stats.used += uint64_t(used_blocks) << sub_block_size_log2;
+		stats.reserved += heap_size;
+		stats.num_heaps++;
+		stats.free_run_histogram[heap.heap.get_longest_run()]++;
+	};
+
+	for (auto &m : tiling_modes)
+	{
+		for (auto &list : m.heaps)
+			for (auto &heap : list)
+				accumulate(heap);
+		for (auto &heap : m.full_heaps)
+			accumulate(heap);
+	}
+}
+
+uint32_t ClassAllocator::get_heap_used_sub_blocks(const DeviceAllocation &alloc)
+{
+	ALLOCATOR_LOCK();
+	return Block::NumSubBlocks - popcount32(alloc.heap.get()->heap.get_free_mask());
+}
+
 bool Allocator::allocate_global(uint32_t size, DeviceAllocation *alloc)
 {
 	// Fall back to global allocation, do not recycle.
@@ -332,6 +515,25 @@ bool Allocator::allocate(uint32_t size, uint32_t alignment, AllocationTiling mod
 	return allocate_global(size, alloc);
 }
 
+void Allocator::init_thread_caches(unsigned num_thread_indices)
+{
+	get_class_allocator(MEMORY_CLASS_SMALL).init_thread_caches(num_thread_indices);
+	get_class_allocator(MEMORY_CLASS_MEDIUM).init_thread_caches(num_thread_indices);
+}
+
+void Allocator::drain_thread_caches()
+{
+	// Smaller classes free their mini-heaps into the larger ones, so drain bottom-up.
+	for (auto &c : classes)
+		c.drain_thread_caches();
+}
+
+void Allocator::trim_thread_cache()
+{
+	for (auto &c : classes)
+		c.trim_thread_cache();
+}
+
 Allocator::Allocator()
 {
 	for (unsigned i = 0; i < MEMORY_CLASS_COUNT - 1; i++)
@@ -416,8 +618,24 @@ void DeviceAllocator::Heap::garbage_collect(Device *device_)
 	}
 }
 
+void DeviceAllocator::init_thread_caches(unsigned num_thread_indices)
+{
+	for (auto &allocator : allocators)
+		allocator->init_thread_caches(num_thread_indices);
+}
+
+void DeviceAllocator::trim_thread_cache()
+{
+	for (auto &allocator : allocators)
+		allocator->trim_thread_cache();
+}
+
 DeviceAllocator::~DeviceAllocator()
 {
+	// Cached sub-blocks keep their mini-heaps alive, give everything back before tearing down.
+	for (auto &allocator : allocators)
+		allocator->drain_thread_caches();
+
 	for (auto &heap : heaps)
 		heap.garbage_collect(device);
 }
@@ -439,6 +657,31 @@ void DeviceAllocator::free_no_recycle(uint32_t size, uint32_t memory_type, VkDev
 	heap.size -= size;
 }
 
+void DeviceAllocator::get_heap_statistics(std::vector<MemoryHeapStatistics> &stats)
+{
+	stats.clear();
+	stats.resize(heaps.size());
+
+	{
+		ALLOCATOR_LOCK();
+		for (size_t i = 0; i < heaps.size(); i++)
+		{
+			stats[i].heap_size = mem_props.memoryHeaps[i].size;
+			stats[i].allocated = heaps[i].size;
+			for (auto &block : heaps[i].blocks)
+				stats[i].recycled += block.size;
+		}
+	}
+
+	// Class allocators have their own locks.
+	for (size_t type = 0; type < allocators.size(); type++)
+	{
+		auto &heap_stats = stats[mem_props.memoryTypes[type].heapIndex];
+		for (unsigned i = 0; i < MEMORY_CLASS_COUNT; i++)
+			allocators[type]->get_class_allocator(MemoryClass(i)).collect_statistics(heap_stats.classes[i]);
+	}
+}
+
 void DeviceAllocator::garbage_collect()
 {
 	ALLOCATOR_LOCK();
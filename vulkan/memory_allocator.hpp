@@ -116,6 +116,11 @@ public:
 		return longest_run;
 	}
 
+	inline uint32_t get_free_mask() const
+	{
+		return free_blocks[0];
+	}
+
 	void allocate(uint32_t num_blocks, DeviceAllocation *block);
 	void free(uint32_t mask);
 
@@ -142,6 +147,28 @@ class DeviceAllocator;
 class Allocator;
 class Device;
 
+struct MemoryClassStatistics
+{
+	// Bytes handed out from mini-heaps of this class vs. bytes backing those mini-heaps.
+	// Mini-heaps of smaller classes are themselves allocations in the larger classes.
+	uint64_t used = 0;
+	uint64_t reserved = 0;
+	uint32_t num_heaps = 0;
+
+	// Number of mini-heaps, bucketed by the longest contiguous free run in sub-blocks.
+	// Index 0 counts full mini-heaps.
+	uint32_t free_run_histogram[Block::NumSubBlocks + 1] = {};
+};
+
+struct MemoryHeapStatistics
+{
+	VkDeviceSize heap_size = 0;
+	// Bytes currently allocated with vkAllocateMemory, including blocks kept around for recycling.
+	uint64_t allocated = 0;
+	uint64_t recycled = 0;
+	MemoryClassStatistics classes[MEMORY_CLASS_COUNT];
+};
+
 struct DeviceAllocation
 {
 	friend class ClassAllocator;
@@ -235,6 +262,17 @@ public:
 	bool allocate(uint32_t size, AllocationTiling tiling, DeviceAllocation *alloc, bool hierarchical);
 	void free(DeviceAllocation *alloc);
 
+	void collect_statistics(MemoryClassStatistics &stats);
+	uint32_t get_heap_used_sub_blocks(const DeviceAllocation &alloc);
+
+	// Small allocations are served from per-thread caches of pre-carved sub-blocks,
+	// indexed by Vulkan::get_current_thread_index(), so that they do not contend on the class lock.
+	void init_thread_caches(unsigned num_thread_indices);
+	// Returns all cached allocations to the class allocator. Only safe while no other thread allocates.
+	void drain_thread_caches();
+	// Returns excess cached allocations of the calling thread to the class allocator.
+	void trim_thread_cache();
+
 private:
 	ClassAllocator() = default;
 	struct AllocationTilingHeaps
@@ -268,6 +306,26 @@ private:
 
 	void suballocate(uint32_t num_blocks, uint32_t tiling, uint32_t memory_type, MiniHeap &heap,
 	                 DeviceAllocation *alloc);
+	bool allocate_nolock(uint32_t num_blocks, AllocationTiling tiling, DeviceAllocation *alloc, bool hierarchical);
+	void free_nolock(DeviceAllocation *alloc);
+
+#ifdef GRANITE_VULKAN_MT
+	enum
+	{
+		// Allocations of 1, 2, 4 and 8 sub-blocks are cached.
+		ThreadCacheSizes = 4
+	};
+
+	struct ThreadCache
+	{
+		std::vector<DeviceAllocation> allocations[ALLOCATION_TILING_COUNT][ThreadCacheSizes];
+	};
+	std::vector<std::unique_ptr<ThreadCache>> thread_caches;
+
+	bool allocate_cached(uint32_t num_blocks, uint32_t tiling, DeviceAllocation *alloc);
+	bool free_cached(DeviceAllocation *alloc);
+	void release_cached_nolock(std::vector<DeviceAllocation> &allocations, size_t count);
+#endif
 
 	inline void set_parent(ClassAllocator *allocator)
 	{
@@ -309,6 +367,10 @@ public:
 		global_allocator = allocator;
 	}
 
+	void init_thread_caches(unsigned num_thread_indices);
+	void drain_thread_caches();
+	void trim_thread_cache();
+
 private:
 	ClassAllocator classes[MEMORY_CLASS_COUNT];
 	DeviceAllocator *global_allocator = nullptr;
@@ -341,6 +403,13 @@ public:
 	void free(uint32_t size, uint32_t memory_type, VkDeviceMemory memory, uint8_t *host_memory);
 	void free_no_recycle(uint32_t size, uint32_t memory_type, VkDeviceMemory memory, uint8_t *host_memory);
 
+	void get_heap_statistics(std::vector<MemoryHeapStatistics> &stats);
+
+	// Per-thread caches for the small and medium classes. Without this, every allocation takes the class lock.
+	void init_thread_caches(unsigned num_thread_indices);
+	// Rebalances the cache of the calling thread back to the shared allocators, call periodically.
+	void trim_thread_cache();
+
 private:
 	std::vector<std::unique_ptr<Allocator>> allocators;
 	Device *device = nullptr;
@@ -78,7 +78,7 @@ PipelineLayout::PipelineLayout(Hash hash, Device *device_, const CombinedResourc
 	device->register_pipeline_layout(pipe_layout, get_hash(), info);
 #endif
 
-	if (device->get_device_features().supports_update_template)
+	if (device->uses_descriptor_update_templates())
 		create_update_templates();
 }
 